@@ -1,17 +1,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "src/utils.h"
+#include "src/alloc.h"
+#include "src/memstats.h"
+#include "src/probes.h"
+#include "src/perf_counters.h"
 #include "src/tables.h"
 #include "src/translate_utils.h"
 #include "src/translate.h"
+#include "src/mapped_output.h"
+#include "src/source_map.h"
+#include "src/data.h"
+#include "src/source_cache.h"
+#include "src/macro.h"
+#include "src/peephole.h"
 #include "assembler.h"
+#include "batch.h"
+#include "pipeline.h"
+#include "stream.h"
 
 const int MAX_ARGS = 3;
-const int BUF_SIZE = 1024;
+static const int BUF_SIZE = 1024;
 const char* IGNORE_CHARS = " \f\n\r\t\v,";
 
+const AsmOptions DEFAULT_ASM_OPTIONS = { .verify_stride = 1 };
+
 /*******************************
  * Helper Functions
  *******************************/
@@ -46,49 +63,336 @@ static void raise_inst_error(uint32_t input_line, const char* name, char** args,
     log_inst(name, args, num_args);
 }
 
-/* Truncates the string at the first occurrence of the '#' character. */
-static void skip_comment(char* str) {
-    char* comment_start = strchr(str, '#');
-    if (comment_start) {
-        *comment_start = '\0';
+/* Adds LABEL, the label of a line without its ':', to SYMTBL if it is a
+   valid label.
+
+   INPUT_LINE is which line of the input file we are currently processing. Note
+   that the first line is line 1 and that empty lines are included in this count.
+
+   BYTE_OFFSET is the offset of the NEXT instruction (should it exist), or
+   with DATA set the address of the next byte of .data, which need not be
+   word-aligned.
+
+   Returns 0, or -1 if LABEL is not a valid label (after raising the error)
+   or could not be added to SYMTBL.
+ */
+static int add_label(uint32_t input_line, const char* label, uint32_t byte_offset,
+    SymbolTable* symtbl, int data) {
+
+    if (!is_valid_label(label)) {
+        raise_label_error(input_line, label);
+        return -1;
+    }
+    int res = data ? add_data_symbol(symtbl, label, byte_offset)
+                   : add_to_table(symtbl, label, byte_offset);
+    return res == 0 ? 0 : -1;
+}
+
+/* Handles the directive NAME in pass one: .text and .data switch sections,
+   the others lay down data in STATE->data. OPERANDS is the rest of the line,
+   which may be a cached line of an included file and is left alone. The
+   line is in the file PATH, which the paths it names are relative to.
+   Returns 0, or -1 after logging an error.
+ */
+static int run_directive(uint32_t input_line, const char* name,
+    const char* operands, const char* path, PassState* state) {
+
+    DataSection* data = state->data;
+    if (strcmp(name, ".text") == 0) {
+        if (data) {
+            data->active = 0;
+            data->num_pending = 0;
+        }
+        return 0;
+    }
+    if (!data) {
+        write_to_log("Error - .data is not supported here at line %d: %s\n",
+            input_line, name);
+        return -1;
+    }
+    if (strcmp(name, ".data") == 0) {
+        data->active = 1;
+        return 0;
+    }
+    if (!data->active) {
+        write_to_log("Error - data directive outside .data at line %d: %s\n",
+            input_line, name);
+        return -1;
+    }
+
+    /* add_data_directive() clobbers the operands. */
+    char buf[BUF_SIZE];
+    size_t len = strlen(operands);
+    char* copy = len < sizeof(buf) ? buf : malloc(len + 1);
+    if (!copy) {
+        allocation_failed();
     }
+    memcpy(copy, operands, len + 1);
+    int err = add_data_directive(data, input_line, name, copy, path);
+    if (copy != buf) {
+        free(copy);
+    }
+    return err;
 }
 
-/* Reads STR and determines whether it is a label (ends in ':'), and if so,
-   whether it is a valid label, and then tries to add it to the symbol table.
+/* What pass one carries from line to line, into included files. */
+typedef struct {
+    FILE* output;
+    SymbolTable* symtbl;
+    PassState* state;
+    uint32_t addr;
+    int depth;                                  // of .include
+    const SourceFile* including[MAX_INCLUDE_DEPTH];
+    const char* path;                           // of the file being read
+    uint32_t src_file;                          // in the source map, 0 for the input
+    int macro_depth;                            // of macro expansions
+    int err;
+} PassOne;
+
+static void pass_one_line(PassOne* one, const SourceLine* line,
+    uint32_t src_line, uint32_t src_column);
+
+/* Runs the lines of the file named by the .include on LINE, a path
+   relative to the file being read. Diagnostics give line numbers in that
+   file, after its path, and so do the source map entries of its
+   instructions. Returns 0, or -1 after logging an error.
+ */
+static int run_include(PassOne* one, const SourceLine* line) {
+
+    char name[BUF_SIZE];
+    char path[BUF_SIZE];
+    const char* operands = line->operands + strspn(line->operands, IGNORE_CHARS);
+    if (include_path(operands, name, sizeof(name)) != 0
+        || resolve_source_path(one->path, name, path, sizeof(path)) != 0) {
+        write_to_log("Error - invalid .include at line %d: %.*s\n", line->line_no,
+            (int) strcspn(operands, "\r\n"), operands);
+        return -1;
+    }
+    if (one->depth == MAX_INCLUDE_DEPTH) {
+        write_to_log("Error - .include nested too deeply at line %d: %s\n",
+            line->line_no, path);
+        return -1;
+    }
+    const SourceFile* file = get_source_file(path);
+    if (!file) {
+        return -1;
+    }
+    for (int i = 0; i < one->depth; i++) {
+        if (one->including[i] == file) {
+            write_to_log("Error - recursive .include at line %d: %s\n",
+                line->line_no, path);
+            release_source_file(file);
+            return -1;
+        }
+    }
 
-   INPUT_LINE is which line of the input file we are currently processing. Note
-   that the first line is line 1 and that empty lines are included in this count.
+    one->including[one->depth++] = file;
+    const char* prefix = set_log_prefix(path);
+    uint32_t src_file = one->src_file;
+    const char* including = one->path;
+    one->path = path;
+    if (one->state->srcmap) {
+        one->src_file = source_map_file(one->state->srcmap, path);
+    }
+    for (uint32_t i = 0; i < file->num_lines; i++) {
+        pass_one_line(one, &file->lines[i], file->lines[i].line_no,
+            file->lines[i].column);
+    }
+    one->src_file = src_file;
+    one->path = including;
+    set_log_prefix(prefix);
+    one->depth--;
+    release_source_file(file);
+    return 0;
+}
+
+/* Expands the macro MACRO invoked on LINE, running each line of its body
+   as if it were at LINE, and at SRC_LINE and SRC_COLUMN in the source map.
+   Returns 0, or -1 after logging an error.
+ */
+static int run_macro(PassOne* one, const Macro* macro, const SourceLine* line,
+    uint32_t src_line, uint32_t src_column) {
 
-   BYTE_OFFSET is the offset of the NEXT instruction (should it exist).
+    if (line->extra || line->num_args != macro->num_params) {
+        write_to_log("Error - wrong number of macro arguments at line %d: %s\n",
+            line->line_no, line->name);
+        return -1;
+    }
+    if (one->macro_depth == MAX_MACRO_DEPTH) {
+        write_to_log("Error - macro expanded too deeply at line %d: %s\n",
+            line->line_no, line->name);
+        return -1;
+    }
 
-   Four scenarios can happen:
-    1. STR is not a label (does not end in ':'). Returns 0.
-    2. STR ends in ':', but is not a valid label. Returns -1.
-    3a. STR ends in ':' and is a valid label. Addition to symbol table fails.
-        Returns -1.
-    3b. STR ends in ':' and is a valid label. Addition to symbol table succeeds.
-        Returns 1.
+    MacroTable* macros = one->state->macros;
+    uint32_t expansion = macros->expansions++;
+    one->macro_depth++;
+    for (uint32_t i = 0; i < macro->num_lines; i++) {
+        char buf[BUF_SIZE];
+        SourceLine body;
+        if (expand_macro_line(macro, i, line->args, line->num_args, expansion,
+                line->line_no, &body, buf, sizeof(buf)) != 0) {
+            write_to_log("Error - macro expansion too long at line %d: %s\n",
+                line->line_no, line->name);
+            one->err = -1;
+            continue;
+        }
+        pass_one_line(one, &body, src_line, src_column);
+    }
+    one->macro_depth--;
+    return 0;
+}
+
+/* Starts or ends a macro definition at LINE, a .macro or .endm. Returns 0,
+   or -1 after logging an error.
  */
-static int add_if_label(uint32_t input_line, char* str, uint32_t byte_offset,
-    SymbolTable* symtbl) {
-
-    size_t len = strlen(str);
-    if (str[len - 1] == ':') {
-        str[len - 1] = '\0';
-        if (is_valid_label(str)) {
-            if (add_to_table(symtbl, str, byte_offset) == 0) {
-                return 1;
-            } else {
-                return -1;
-            }
+static int run_macro_directive(PassOne* one, const SourceLine* line) {
+    MacroTable* macros = one->state->macros;
+    if (!macros) {
+        write_to_log("Error - macros are not supported here at line %d: %s\n",
+            line->line_no, line->name);
+        return -1;
+    }
+    if (strcmp(line->name, ".macro") == 0) {
+        return begin_macro(macros, line->line_no, line->operands);
+    }
+    write_to_log("Error - .endm without .macro at line %d\n", line->line_no);
+    return -1;
+}
+
+/* Pass one over the tokenized LINE. SRC_LINE and SRC_COLUMN are where its
+   instructions go in the source map. Errors are logged and set ONE->err.
+ */
+static void pass_one_line(PassOne* one, const SourceLine* line,
+    uint32_t src_line, uint32_t src_column) {
+
+    /* The body of a macro being defined is only kept. */
+    MacroTable* macros = one->state->macros;
+    if (macros && macros->defining) {
+        int err;
+        if (line->name && strcmp(line->name, ".endm") == 0) {
+            SourceLine label = *line;
+            label.name = NULL;
+            err = line->label ? add_macro_line(macros, &label) : 0;
+            err |= end_macro(macros);
         } else {
-            raise_label_error(input_line, str);
-            return -1;
+            err = add_macro_line(macros, line);
+        }
+        if (err != 0) {
+            one->err = -1;
+        }
+        return;
+    }
+
+    DataSection* data = one->state->data;
+    int in_data = data && data->active;
+
+    if (line->label) {
+        // in .data, the label waits for the aligned first value
+        uint32_t label_addr = in_data ? data_address(data) : one->addr;
+        if (add_label(line->line_no, line->label, label_addr, one->symtbl,
+                in_data) != 0) {
+            one->err = -1;
+        } else if (in_data) {
+            add_pending_label(data, one->symtbl->len - 1);
+        } else if (one->state->peephole) {
+            peephole_label(one->state->peephole, one->symtbl->len - 1);
         }
-    } else {
-        return 0;
     }
+    if (!line->name) {
+        return;
+    }
+
+    if (strcmp(line->name, ".include") == 0) {
+        if (run_include(one, line) != 0) {
+            one->err = -1;
+        }
+        return;
+    }
+    if (strcmp(line->name, ".macro") == 0 || strcmp(line->name, ".endm") == 0) {
+        if (run_macro_directive(one, line) != 0) {
+            one->err = -1;
+        }
+        return;
+    }
+    const Macro* macro = macros && macros->num_macros
+        ? find_macro(macros, line->name) : NULL;
+    if (macro) {
+        if (run_macro(one, macro, line, src_line, src_column) != 0) {
+            one->err = -1;
+        }
+        return;
+    }
+    if (line->name[0] == '.') {      // section or data directive, any operands
+        if (in_data && strcmp(line->name, ".data") != 0) {
+            place_pending_labels(data, one->symtbl, line->name);
+        }
+        if (run_directive(line->line_no, line->name, line->operands, one->path,
+                one->state) != 0) {
+            one->err = -1;
+        }
+        return;
+    }
+
+    if (in_data) {
+        write_to_log("Error - instruction in .data at line %d: %s\n",
+            line->line_no, line->name);
+        one->err = -1;
+        return;
+    }
+    if (line->num_args > MAX_ARGS) {
+        raise_extra_arg_error(line->line_no, line->args[MAX_ARGS]);
+        one->err = -1;
+        return;
+    }
+
+    // the encoder does not write to the arguments, cached ones included
+    char** args = (char**) line->args;
+    Peephole* peephole = one->state->peephole;
+    int num_instr = peephole
+        ? peephole_pass_one(peephole, line->name, args, line->num_args,
+            one->src_file, src_line, src_column)
+        : one->output
+        ? write_pass_one(one->output, line->name, args, line->num_args)
+        : size_pass_one(line->name, args, line->num_args);
+
+    one->addr += 4 * num_instr;
+
+    for (int i = 0; !peephole && one->state->srcmap && i < num_instr; i++) {
+        source_map_add_in(one->state->srcmap, one->src_file, src_line, src_column);
+    }
+
+    if (num_instr == 0) {
+        raise_inst_error(line->line_no, line->name, args, line->num_args);
+        one->err = -1;
+    }
+}
+
+/* Completes a whole pass one: checks that its macros were closed, writes
+   out the instructions of the peephole pass, fills in .word labels from
+   SYMTBL and, if there is data and OUTPUT is set, appends it to the
+   intermediate file as a ".data" trailer, where pass two stops reading
+   instructions.
+ */
+static int end_pass_one(PassState* state, FILE* output, SymbolTable* symtbl) {
+    DataSection* data = state->data;
+    int err = check_macros_closed(state->macros);
+    Peephole* peephole = state->peephole;
+    if (peephole) {
+        run_peephole(peephole);
+        state->addr = peephole->base
+            + 4 * flush_peephole(peephole, output, symtbl, state->srcmap);
+    }
+    if (resolve_data_labels(data, symtbl) != 0) {
+        err = -1;
+    }
+    if (output && data->size > 0) {
+        fprintf(output, ".data\n");
+        if (write_data_section(data, output, 1) != 0) {
+            err = -1;
+        }
+    }
+    return err;
 }
 
 /*******************************
@@ -118,92 +422,59 @@ static int add_if_label(uint32_t input_line, char* str, uint32_t byte_offset,
    Just like in pass_two(), if the function encounters an error it should NOT
    exit, but process the entire file and return -1. If no errors were encountered,
    it should return 0.
+
+   If OUTPUT is NULL, instructions are only sized with size_pass_one() and
+   nothing is written; only SYMTBL is filled in.
+
+   Labels in .data take addresses from DATA_BASE on; the data itself goes to
+   the end of OUTPUT (see end_pass_one()).
+
+   A macro invocation runs the lines of the macro's body in its place, with
+   diagnostics at the invocation.
  */
 int pass_one(FILE* input, FILE* output, SymbolTable* symtbl) {
+	PassState state = { 0, 0 };
+	state.data = create_data_section();
+	state.macros = create_macro_table();
+	int err = run_pass_one(input, output, symtbl, &state);
+	if (end_pass_one(&state, output, symtbl) != 0)
+		err = -1;
+	free_data_section(state.data);
+	free_macro_table(state.macros);
+	return err;
+}
+
+/* Body of pass_one(). Counting starts from the line number and byte offset
+   in STATE, which are updated to the values after the last line of INPUT.
+   This lets a file be processed in pieces.
+ */
+int run_pass_one(FILE* input, FILE* output, SymbolTable* symtbl, PassState* state) {
 	/* YOUR CODE HERE */
 
-	int err = 0;
 	char buf[BUF_SIZE];
+	PassOne one = { output, symtbl, state, state->addr };
+	one.path = state->path;
+
+	uint32_t line_no = state->line_no;   // line number
 
-	uint32_t line_no = 0;       // line number
-	uint32_t addr    = 0;       // label addr
+	PROBE2(pass_one_start, line_no, one.addr);
 
 	while(fgets(buf, BUF_SIZE, input) != NULL) {
 
 		line_no++;
-		skip_comment(buf);  // strip comments
-
-		if(strlen(buf) == 0) continue;
-
-		char* args[MAX_ARGS];
-		int num_args = 0;
-		char nbuf[BUF_SIZE];    // buf for line with no label
-		char instr[BUF_SIZE];   // instruction string
-		char label[BUF_SIZE];   // label string
-		instr[0] = '\0';
-		label[0] = '\0';
-
-		strcpy(nbuf, buf);
-		char * pch;
-		pch = strtok (buf, IGNORE_CHARS);   // buf is clobbered
-
-		if(pch == NULL) continue;
-
-		strcpy(label, pch);   // first pch maybe  label
-
-		int res = add_if_label(line_no,  label, addr, symtbl);
-
-		if( res  == 0) {      // not a label
-			label[0] = '\0';
-		}
-		else {
-
-			if(res == -1)  {  // not a valid lable or fails to add to symtle
-				err = -2;
-				raise_label_error(line_no,  label);
-			}
-
-			char* tmp = strstr(nbuf, label);
-			strcpy(nbuf, tmp + strlen(label) + 1);
-		}
-
-
-		pch = strtok (nbuf, IGNORE_CHARS);
-
-		if(pch == NULL)  continue;
 
-		strcpy(instr, pch);   // first is instruction string
-
-		pch = strtok (NULL, IGNORE_CHARS);
-
-		while (pch != NULL) { // following is arguments
-			args[num_args++] = strdup(pch);
-			pch = strtok (NULL, IGNORE_CHARS);
-			if(num_args > MAX_ARGS ) {
-				raise_extra_arg_error(line_no, args[num_args]);
-				err = -3;
-				break;
-			}
-		}
-
-		if(err != -3) {
-
-			int num_instr = write_pass_one(output, instr,  args, num_args);
-
-			addr += 4 * num_instr;
-
-			if( num_instr == 0)  {
-				raise_inst_error(line_no, instr, args, num_args);
-				err = -1;
-			}
-		}
-
-		// free memeory in args
-		for(int i = 0; i < num_args; i++) 	free(args[i]);
+		// strips comments, splits off the label and arguments
+		SourceLine line;
+		if(!tokenize_line(buf, &line)) continue;
 
+		line.line_no = line_no;
+		pass_one_line(&one, &line, line_no, line.column);
 	}
 
-	return  err < 0 ? -1 : 0;
+	state->line_no = line_no;
+	state->addr = one.addr;
+	PROBE3(pass_one_end, line_no, one.addr, one.err);
+	return  one.err < 0 ? -1 : 0;
 
 }
 
@@ -219,18 +490,30 @@ int pass_one(FILE* input, FILE* output, SymbolTable* symtbl) {
    encountered. */
 
 int pass_two(FILE *input, FILE* output, SymbolTable* symtbl, SymbolTable* reltbl) {
+    PassState state = { 0, 0 };
+    return run_pass_two(input, output, symtbl, reltbl, &DEFAULT_ASM_OPTIONS, &state);
+}
+
+/* Body of pass_two(). OPTS selects the encoder: translate_inst_trusted() if
+   OPTS->trusted is set, translate_inst() otherwise. Instructions are written to
+   OUTPUT or, if MAP is set, stored in MAP. With neither, the input is
+   validated without writing anything. STATE works as in run_pass_one().
+ */
+static int encode_pass_two(FILE *input, FILE* output, MappedOutput* map,
+    SymbolTable* symtbl, SymbolTable* reltbl, const AsmOptions* opts,
+    PassState* state) {
     /* YOUR CODE HERE */
 
-    // Since we pass this buffer to strtok(), the chars here will GET CLOBBERED.
+    // Since we pass this buffer to strtok_r(), the chars here will GET CLOBBERED.
     char buf[BUF_SIZE];
     // Store input line number / byte offset below. When should each be incremented?
 
     // First, read the next line into a buffer.
 
-    // Next, use strtok() to scan for next character. If there's nothing,
+    // Next, use strtok_r() to scan for next character. If there's nothing,
     // go to the next line.
 
-    // Parse for instruction arguments. You should use strtok() to tokenize
+    // Parse for instruction arguments. You should use strtok_r() to tokenize
     // the rest of the line. Extra arguments should be filtered out in pass_one(),
     // so you don't need to worry about that here.
 
@@ -241,12 +524,26 @@ int pass_two(FILE *input, FILE* output, SymbolTable* symtbl, SymbolTable* reltbl
 
     // Repeat until no more characters are left, and the return the correct return val
 
-    uint32_t line_no = 0;
-    uint32_t addr = 0;
+    uint32_t line_no = state->line_no;
+    uint32_t addr = state->addr;
+
+    PROBE2(pass_two_start, line_no, addr);
 
-    while(fgets(buf, BUF_SIZE, input) != NULL) {
+    // With a source map, errors are reported at the source line, after the
+    // path of an included file.
+    SourceMapCursor cursor;
+    uint32_t src_line = 0, src_column = 0;
+    const char* src_path = NULL;
+    const char* prefix = set_log_prefix(NULL);
+    source_map_begin(&cursor, state->srcmap);
+
+    while(fgets(buf, BUF_SIZE, input) != NULL && !is_data_trailer(buf)) {
 
 	 line_no++;
+	 if(source_map_next(&cursor, &src_line, &src_column) != 0)
+	      src_line = line_no;
+	 src_path = source_map_path(state->srcmap, cursor.file);
+	 set_log_prefix(src_path ? src_path : prefix);
 
 	 if(strlen(buf) == 0) continue;
 
@@ -255,44 +552,85 @@ int pass_two(FILE *input, FILE* output, SymbolTable* symtbl, SymbolTable* reltbl
 	 char instr[BUF_SIZE];   // instruction string
 	 instr[0] = '\0';
 
+	 char* save;             // strtok_r() state
 	 char * pch;
-	 pch = strtok (buf, IGNORE_CHARS);
+	 pch = strtok_r (buf, IGNORE_CHARS, &save);
 
 	 if(pch != NULL) {
 
 	      strcpy(instr, pch);   // first is instruction string
 
-	      pch = strtok (NULL, IGNORE_CHARS);
+	      pch = strtok_r (NULL, IGNORE_CHARS, &save);
 
-	      while (pch != NULL) { // following is arguments
-		   args[num_args++] = strdup(pch);
-		   pch = strtok (NULL, IGNORE_CHARS);
+	      while (pch != NULL && num_args < MAX_ARGS) { // following is arguments
+		   args[num_args++] = pch;
+		   pch = strtok_r (NULL, IGNORE_CHARS, &save);
+	      }
+	      if (pch != NULL) {         // an intermediate file not from pass one
+		   raise_extra_arg_error(src_line, pch);
+		   err = -1;
+		   continue;
 	      }
 
-	      if(translate_inst(output, instr, args,  num_args, addr,
-				symtbl, reltbl) == -1)  {
-		   raise_inst_error(line_no, instr, args, num_args);
+	      int res;
+	      if (map) {
+		   uint32_t word;
+		   res = opts->trusted
+			? encode_inst_trusted(&word, instr, args, num_args, addr,
+					      symtbl, reltbl)
+			: encode_inst(&word, instr, args, num_args, addr,
+				      symtbl, reltbl);
+		   if (res == 0) {
+			res = write_mapped_word(map, addr / 4, word);
+		   }
+	      }
+	      else {
+		   res = opts->trusted
+			? translate_inst_trusted(output, instr, args, num_args, addr,
+						 symtbl, reltbl)
+			: translate_inst(output, instr, args, num_args, addr,
+					 symtbl, reltbl);
+	      }
+
+	      if(res == -1)  {
+		   raise_inst_error(src_line, instr, args, num_args);
 		   err = -1;
 	      }
 	      else {
 		   addr += 4;
+		   if(state->linemap)
+			source_map_add_in(state->linemap,
+					  src_path ? source_map_file(state->linemap, src_path) : 0,
+					  src_line, src_column);
 	      }
 	 }
 	 else {
-	      raise_inst_error(line_no, instr, args, num_args);
+	      raise_inst_error(src_line, instr, args, num_args);
 	      err = -1;
 	 }
-
-	 // free memeory in args
-
-	 for(int i = 0; i < num_args; i++)
-	      free(args[i]);
-
     }
 
+    set_log_prefix(prefix);
+    state->line_no = line_no;
+    state->addr = addr;
+    PROBE3(pass_two_end, line_no, addr, err);
     return err;
 }
 
+/* Pass two into the stream OUTPUT; see encode_pass_two(). */
+int run_pass_two(FILE *input, FILE* output, SymbolTable* symtbl,
+    SymbolTable* reltbl, const AsmOptions* opts, PassState* state) {
+    return encode_pass_two(input, output, NULL, symtbl, reltbl, opts, state);
+}
+
+/* Same as run_pass_two(), storing each instruction in OUTPUT at the index
+   its byte offset gives it instead of appending it to a stream. */
+int run_pass_two_mapped(FILE *input, struct MappedOutput* output,
+    SymbolTable* symtbl, SymbolTable* reltbl, const AsmOptions* opts,
+    PassState* state) {
+    return encode_pass_two(input, NULL, output, symtbl, reltbl, opts, state);
+}
+
 /*******************************
  * Do Not Modify Code Below
  *******************************/
@@ -323,38 +661,220 @@ static void close_files(FILE* input, FILE* output) {
    and pass_two().
  */
 int assemble(const char* in_name, const char* tmp_name, const char* out_name) {
+    return assemble_opts(in_name, tmp_name, out_name, &DEFAULT_ASM_OPTIONS);
+}
+
+/* Phases of assemble_opts() measured with OPTS->perfcounters. */
+enum { PHASE_PASS_ONE, PHASE_PASS_TWO, PHASE_TABLES, NUM_PHASES };
+
+static const char* PHASE_NAMES[NUM_PHASES] = {
+    "pass one", "pass two", "table output"
+};
+
+/* Pass two of assemble_opts() with OPTS->mmap_output set: OUT_NAME is
+   created at its final size for MAX_WORDS instructions (counted from the
+   intermediate file if 0) and the encoder stores each word at its offset.
+   Returns 0 on success, 1 on assembly errors and -1 if a file cannot be
+   opened. The encoding is counted as pass two in PERF and writing the
+   tables as its own phase.
+ */
+static int mapped_pass_two(const char* tmp_name, const char* out_name,
+    uint32_t max_words, SymbolTable* symtbl, SymbolTable* reltbl,
+    const AsmOptions* opts, PassState* state, PerfCounters* perf) {
+    char buf[BUF_SIZE];
+    MappedOutput out;
+
+    begin_perf_phase(perf, PHASE_PASS_TWO);
+    FILE* src = fopen(tmp_name, "r");
+    if (!src) {
+        write_to_log("Error: unable to open input file: %s\n", tmp_name);
+        end_perf_phase(perf, PHASE_PASS_TWO);
+        return -1;
+    }
+    if (max_words == 0) {
+        while (fgets(buf, BUF_SIZE, src) != NULL && !is_data_trailer(buf)) {
+            max_words++;
+        }
+        rewind(src);
+    }
+    if (open_mapped_output(&out, out_name, max_words, symtbl) != 0) {
+        write_to_log("Error: unable to open output file: %s\n", out_name);
+        fclose(src);
+        end_perf_phase(perf, PHASE_PASS_TWO);
+        return -1;
+    }
+
+    int err = run_pass_two_mapped(src, &out, symtbl, reltbl, opts, state) != 0;
+    fclose(src);
+
+    end_perf_phase(perf, PHASE_PASS_TWO);
+    begin_perf_phase(perf, PHASE_TABLES);
+    if (close_mapped_output(&out, state->addr / 4, symtbl, reltbl) != 0) {
+        write_to_log("Error: unable to write output file: %s\n", out_name);
+        err = -1;
+    }
+    end_perf_phase(perf, PHASE_TABLES);
+    return err;
+}
+
+/* Appends the .line section of LINEMAP to the output file OUT_NAME. */
+static int append_line_section(const char* out_name, SourceMap* linemap) {
+    FILE* dst = fopen(out_name, "a");
+    if (!dst) {
+        write_to_log("Error: unable to open output file: %s\n", out_name);
+        return -1;
+    }
+    fprintf(dst, "\n.line\n");
+    write_source_map(linemap, dst);
+    fclose(dst);
+    return 0;
+}
+
+/* Appends the .data section of DATA to the output file OUT_NAME. */
+static int append_data_section(const char* out_name, const DataSection* data) {
+    FILE* dst = fopen(out_name, "a");
+    if (!dst) {
+        write_to_log("Error: unable to open output file: %s\n", out_name);
+        return -1;
+    }
+    fprintf(dst, "\n.data\n");
+    int err = write_data_section(data, dst, 0);
+    if (fclose(dst) != 0 || err != 0) {
+        write_to_log("Error: unable to write output file: %s\n", out_name);
+        return -1;
+    }
+    return 0;
+}
+
+/* Reads the .data trailer of the intermediate file TMP_NAME into DATA, for
+   a pass two run on its own. */
+static int load_data_trailer(const char* tmp_name, DataSection* data) {
+    char buf[BUF_SIZE];
+    FILE* src = fopen(tmp_name, "r");
+    if (!src) {
+        write_to_log("Error: unable to open input file: %s\n", tmp_name);
+        return -1;
+    }
+    int err = 0;
+    while (fgets(buf, BUF_SIZE, src) != NULL) {
+        if (is_data_trailer(buf)) {
+            if (strcmp(buf, ".data\n") != 0 || read_data_section(data, src) != 0) {
+                write_to_log("Error - malformed .data in %s\n", tmp_name);
+                err = 1;
+            }
+            break;
+        }
+    }
+    fclose(src);
+    return err;
+}
+
+/* Same as assemble(), configured by OPTS. Returns -1 instead of exiting if a
+   file cannot be opened, so one failing job does not end a batch. When both
+   passes run, pass one's source map lets pass two report errors at source
+   lines; with OPTS->debug_lines the map also goes to the output file.
+   Data follows the tables in a .data section.
+   With OPTS->memstats set, the memory each subsystem used is printed at the
+   end, and with OPTS->perfcounters the hardware counters of each phase.
+ */
+int assemble_opts(const char* in_name, const char* tmp_name, const char* out_name,
+    const AsmOptions* opts) {
     FILE *src, *dst;
     int err = 0;
-    SymbolTable* symtbl = create_table(SYMTBL_UNIQUE_NAME);
-    SymbolTable* reltbl = create_table(SYMTBL_NON_UNIQUE);
+    PassState one = { 0, 0, NULL, NULL };
+    PassState two = { 0, 0, NULL, NULL };
+    MemStats stats;
+    if (opts->memstats) {
+        start_mem_stats(&stats);
+    }
+    SymbolTable* symtbl = create_table_in(SYMTBL_UNIQUE_NAME, opts->allocator);
+    SymbolTable* reltbl = create_table_in(SYMTBL_NON_UNIQUE, opts->allocator);
+    PerfCounters* perf = opts->perfcounters ? open_perf_counters() : NULL;
+    DataSection* data = create_data_section();
+    one.data = data;
+    one.macros = create_macro_table();
+    one.path = in_name;
+
+    if (in_name && out_name) {
+        one.srcmap = two.srcmap = create_source_map();
+    }
+    if (in_name && (opts->optimize || opts->delay_slots)) {
+        one.peephole = create_peephole(one.addr,
+            (opts->optimize ? PEEP_OPTIMIZE : 0)
+            | (opts->delay_slots ? PEEP_DELAY_SLOTS : 0));
+    }
+    if (out_name && opts->debug_lines) {
+        two.linemap = create_source_map();
+    }
 
     if (in_name) {
-        printf("Running pass one: %s -> %s\n", in_name, tmp_name);
+        if (!opts->quiet) {
+            printf("Running pass one: %s -> %s\n", in_name, tmp_name);
+        }
+        begin_perf_phase(perf, PHASE_PASS_ONE);
+        prefetch_includes(in_name);     // reads included files in parallel
         if (open_files(&src, &dst, in_name, tmp_name) != 0) {
-            free_table(symtbl);
-            free_table(reltbl);
-            exit(1);
+            end_perf_phase(perf, PHASE_PASS_ONE);
+            err = -1;
+            goto done;
         }
 
-        if (pass_one(src, dst, symtbl) != 0) {
+        if (run_pass_one(src, dst, symtbl, &one) != 0) {
+            err = 1;
+        }
+        if (end_pass_one(&one, dst, symtbl) != 0) {
             err = 1;
         }
         close_files(src, dst);
+        end_perf_phase(perf, PHASE_PASS_ONE);
+        if (opts->optimize && !opts->quiet) {
+            printf("Peephole pass: removed %u instructions, moved %u lui/ori pairs off $at\n",
+                one.peephole->removed, one.peephole->folded);
+        }
+        if (opts->delay_slots && !opts->quiet) {
+            printf("Delay slots: filled %u\n", one.peephole->filled);
+        }
+    } else if (out_name) {
+        int res = load_data_trailer(tmp_name, data);
+        if (res == -1) {
+            err = -1;
+            goto done;
+        }
+        err |= res;
     }
 
-    if (out_name) {
-        printf("Running pass two: %s -> %s\n", tmp_name, out_name);
+    if (out_name && opts->mmap_output) {
+        if (!opts->quiet) {
+            printf("Running pass two: %s -> %s (mapped)\n", tmp_name, out_name);
+        }
+        int res = mapped_pass_two(tmp_name, out_name, in_name ? one.addr / 4 : 0,
+            symtbl, reltbl, opts, &two, perf);
+        if (res == -1) {
+            err = -1;
+            goto done;
+        }
+        err |= res;
+    } else if (out_name) {
+        if (!opts->quiet) {
+            printf("Running pass two: %s -> %s\n", tmp_name, out_name);
+        }
+        begin_perf_phase(perf, PHASE_PASS_TWO);
         if (open_files(&src, &dst, tmp_name, out_name) != 0) {
-            free_table(symtbl);
-            free_table(reltbl);
-            exit(1);
+            end_perf_phase(perf, PHASE_PASS_TWO);
+            err = -1;
+            goto done;
         }
 
         fprintf(dst, ".text\n");
-        if (pass_two(src, dst, symtbl, reltbl) != 0) {
+        int res = opts->pipeline
+            ? run_pass_two_pipelined(src, dst, symtbl, reltbl, opts, &two)
+            : run_pass_two(src, dst, symtbl, reltbl, opts, &two);
+        if (res != 0) {
             err = 1;
         }
+        end_perf_phase(perf, PHASE_PASS_TWO);
 
+        begin_perf_phase(perf, PHASE_TABLES);
         fprintf(dst, "\n.symbol\n");
         write_table(symtbl, dst);
 
@@ -362,61 +882,378 @@ int assemble(const char* in_name, const char* tmp_name, const char* out_name) {
         write_table(reltbl, dst);
 
         close_files(src, dst);
+        end_perf_phase(perf, PHASE_TABLES);
     }
 
+    if (out_name && data->size > 0) {
+        begin_perf_phase(perf, PHASE_TABLES);
+        if (append_data_section(out_name, data) != 0) {
+            err = -1;
+        }
+        end_perf_phase(perf, PHASE_TABLES);
+    }
+
+    if (two.linemap) {
+        begin_perf_phase(perf, PHASE_TABLES);
+        if (append_line_section(out_name, two.linemap) != 0) {
+            err = -1;
+        }
+        end_perf_phase(perf, PHASE_TABLES);
+    }
+
+done:
+    free_source_map(one.srcmap);
+    free_source_map(two.linemap);
+    free_data_section(data);
+    free_macro_table(one.macros);
+    free_peephole(one.peephole);
     free_table(symtbl);
     free_table(reltbl);
+
+    if (opts->memstats) {
+        stop_mem_stats();
+        write_mem_stats(&stats, stdout);
+    }
+    if (perf) {
+        write_perf_report(perf, PHASE_NAMES, NUM_PHASES,
+            (out_name ? two.addr : one.addr) / 4, stdout);
+        close_perf_counters(perf);
+    }
+    return err;
+}
+
+/* Runs pass one in sizing-only mode and writes just the symbol table of
+   IN_NAME to SYM_NAME, as text or, with SNAPSHOT set, as a binary snapshot
+   (see write_table_snapshot()). No intermediate file is produced.
+ */
+int assemble_symbols(const char* in_name, const char* sym_name, int snapshot) {
+    FILE *src, *dst;
+    int err = 0;
+    SymbolTable* symtbl = create_table(SYMTBL_UNIQUE_NAME);
+
+    printf("Running symbols-only pass: %s -> %s\n", in_name, sym_name);
+    if (open_files(&src, &dst, in_name, sym_name) != 0) {
+        free_table(symtbl);
+        return -1;
+    }
+
+    if (pass_one(src, NULL, symtbl) != 0) {
+        err = 1;
+    }
+
+    if (snapshot) {
+        if (write_table_snapshot(symtbl, dst) != 0) {
+            write_to_log("Error: unable to write snapshot: %s\n", sym_name);
+            err = 1;
+        }
+    } else {
+        fprintf(dst, ".symbol\n");
+        write_table(symtbl, dst);
+    }
+
+    close_files(src, dst);
+    free_table(symtbl);
     return err;
 }
 
+/* Prints the address of each of the NUM_NAMES symbols in NAMES as found in
+   the snapshot SNAP_NAME. Returns 0 if all were found, 1 if some were not
+   and -1 if the snapshot cannot be opened.
+ */
+int lookup_symbols(const char* snap_name, char** names, int num_names) {
+    SymbolSnapshot snapshot;
+    int err = 0;
+
+    if (open_table_snapshot(&snapshot, snap_name) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < num_names; i++) {
+        int64_t addr = get_addr_for_snapshot(&snapshot, names[i]);
+        if (addr == -1) {
+            printf("%s\tnot found\n", names[i]);
+            err = 1;
+        } else {
+            printf("%s\t%u\n", names[i], (uint32_t) addr);
+        }
+    }
+    close_table_snapshot(&snapshot);
+    return err;
+}
+
+/* Encodes every STRIDE-th instruction of the intermediate file INPUT with
+   the validating encoder, writing nothing. The others are assumed valid
+   and only advance the byte offset. Returns 0, or -1 after logging the
+   errors, at intermediate line numbers.
+ */
+static int check_sample(FILE* input, SymbolTable* symtbl, SymbolTable* reltbl,
+    unsigned stride) {
+    char buf[BUF_SIZE];
+    uint32_t line_no = 0;
+    uint32_t addr = 0;
+    int err = 0;
+
+    while (fgets(buf, BUF_SIZE, input) != NULL && !is_data_trailer(buf)) {
+        line_no++;
+        if ((line_no - 1) % stride != 0) {
+            addr += 4;
+            continue;
+        }
+
+        char* args[MAX_ARGS];
+        int num_args = 0;
+        char* save;
+        char* name = strtok_r(buf, IGNORE_CHARS, &save);
+        if (!name) {
+            raise_inst_error(line_no, "", args, 0);
+            err = -1;
+            continue;
+        }
+        char* pch = strtok_r(NULL, IGNORE_CHARS, &save);
+        for (; pch != NULL && num_args < MAX_ARGS; pch = strtok_r(NULL, IGNORE_CHARS, &save)) {
+            args[num_args++] = pch;
+        }
+        if (pch != NULL) {
+            raise_extra_arg_error(line_no, pch);
+            err = -1;
+            continue;
+        }
+
+        uint32_t word;
+        if (encode_inst(&word, name, args, num_args, addr, symtbl, reltbl) != 0) {
+            raise_inst_error(line_no, name, args, num_args);
+            err = -1;
+        } else {
+            addr += 4;
+        }
+    }
+    return err;
+}
+
+/* Re-checks IN_NAME offline with the fully validating encoder: pass one is
+   run into a temporary file, and every OPTS->verify_stride-th instruction
+   of it is translated without writing any output. Errors are logged as in
+   a normal run.
+ */
+int verify_file(const char* in_name, const AsmOptions* opts) {
+    int err = 0;
+    SymbolTable* symtbl = create_table(SYMTBL_UNIQUE_NAME);
+    SymbolTable* reltbl = create_table(SYMTBL_NON_UNIQUE);
+    unsigned stride = opts->verify_stride ? opts->verify_stride : 1;
+
+    printf("Running verify pass: %s (every %u instruction(s))\n", in_name,
+        stride);
+
+    FILE* src = fopen(in_name, "r");
+    if (!src) {
+        write_to_log("Error: unable to open input file: %s\n", in_name);
+        free_table(symtbl);
+        free_table(reltbl);
+        return -1;
+    }
+    FILE* tmp = tmpfile();
+    if (!tmp) {
+        write_to_log("Error: unable to create temporary file\n");
+        fclose(src);
+        free_table(symtbl);
+        free_table(reltbl);
+        return -1;
+    }
+
+    if (pass_one(src, tmp, symtbl) != 0) {
+        err = 1;
+    }
+    rewind(tmp);
+    if (check_sample(tmp, symtbl, reltbl, stride) != 0) {
+        err = 1;
+    }
+
+    close_files(src, tmp);
+    free_table(symtbl);
+    free_table(reltbl);
+    return err;
+}
+
+/* The command line; the tests link the rest of this file. */
+#ifndef TESTING
 static void print_usage_and_exit() {
     printf("Usage:\n");
     printf("  Runs both passes: assembler <input file> <intermediate file> <output file>\n");
     printf("  Run pass #1:      assembler -p1 <input file> <intermediate file>\n");
     printf("  Run pass #2:      assembler -p2 <intermediate file> <output file>\n");
+    printf("  Symbols only:     assembler -sym [-snapshot] <input file> <symbol file>\n");
+    printf("  Look up symbols:  assembler -lookup <snapshot file> <name>...\n");
+    printf("  Verify input:     assembler -verify [-sample <n>] <input file>\n");
+    printf("  Stream:           assembler -stream < <input file> > <output file>\n");
+    printf("  Batch:            assembler -batch [-j <threads>] [-manifest <file>] <input file>...\n");
+    printf("                    add -steal [-chunk <lines>] to split large files into stealable tasks\n");
+    printf("                    or -uring to overlap file I/O with assembly (-uring-blocking without io_uring)\n");
+    printf("Prefix -trusted to skip operand validation in pass two (well-formed input only).\n");
+    printf("Prefix -pipeline to overlap reading, lexing, encoding and writing in pass two.\n");
+    printf("Prefix -mmap to write the output file in place through a pre-sized mapping.\n");
+    printf("Prefix -O to remove redundant instructions in pass one (not with -sym,\n");
+    printf("  -stream, -steal or -uring).\n");
+    printf("Prefix -delayslots to move instructions into branch delay slots in place of nops\n");
+    printf("  (not with -sym, -stream, -steal or -uring).\n");
+    printf("Prefix -g to add a .line section mapping each instruction to its source line.\n");
+    printf("Prefix -perfcounters to report cycles, IPC and cache and branch misses per phase.\n");
+    printf("Prefix -memstats to report allocations and peak memory use per subsystem.\n");
+    printf("Prefix -arena to allocate symbol tables from an arena (per worker in batch mode),\n");
+    printf("  or -hugepages to also back it with huge pages.\n");
     printf("Append -log <file name> after any option to save log files to a text file.\n");
     exit(0);
 }
 
+/* Returns ARG, a positive decimal number, or exits with the usage. */
+static unsigned parse_positive(const char* arg) {
+    char* end;
+    errno = 0;
+    unsigned long n = strtoul(arg, &end, 10);
+    if (end == arg || *end != '\0' || errno != 0 || arg[0] == '-'
+        || n == 0 || n > UINT_MAX) {
+        print_usage_and_exit();
+    }
+    return (unsigned) n;
+}
+
 
 
 
 int main(int argc, char **argv) {
-    if (argc != 4 && argc != 6) {
+    AsmOptions opts = DEFAULT_ASM_OPTIONS;
+    BatchOptions batch = { 0, NULL, DEFAULT_ASM_OPTIONS, 0, 0, 0, 0, 0, 0 };
+    const char* log_name = NULL;
+    char *input = NULL, *inter, *output;
+    int mode = 0;
+    int snapshot = 0;
+    int argi = 1;
+
+    for (; argi < argc && argv[argi][0] == '-'; argi++) {
+        if (strcmp(argv[argi], "-p1") == 0) {
+            mode = 1;
+        } else if (strcmp(argv[argi], "-p2") == 0) {
+            mode = 2;
+        } else if (strcmp(argv[argi], "-sym") == 0) {
+            mode = 3;
+        } else if (strcmp(argv[argi], "-verify") == 0) {
+            mode = 4;
+        } else if (strcmp(argv[argi], "-batch") == 0) {
+            mode = 5;
+        } else if (strcmp(argv[argi], "-stream") == 0) {
+            mode = 6;
+        } else if (strcmp(argv[argi], "-lookup") == 0) {
+            mode = 7;
+        } else if (strcmp(argv[argi], "-snapshot") == 0) {
+            snapshot = 1;
+        } else if (strcmp(argv[argi], "-j") == 0 && argi + 1 < argc) {
+            batch.num_threads = (unsigned) strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "-steal") == 0) {
+            batch.steal = 1;
+        } else if (strcmp(argv[argi], "-uring") == 0) {
+            batch.uring = 1;
+        } else if (strcmp(argv[argi], "-uring-blocking") == 0) {
+            batch.uring = batch.uring_blocking = 1;
+        } else if (strcmp(argv[argi], "-arena") == 0) {
+            batch.arena = 1;
+        } else if (strcmp(argv[argi], "-hugepages") == 0) {
+            batch.arena = batch.huge_pages = 1;
+        } else if (strcmp(argv[argi], "-chunk") == 0 && argi + 1 < argc) {
+            batch.chunk_lines = (unsigned) strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "-manifest") == 0 && argi + 1 < argc) {
+            input = argv[++argi];
+        } else if (strcmp(argv[argi], "-perfcounters") == 0) {
+            opts.perfcounters = 1;
+        } else if (strcmp(argv[argi], "-memstats") == 0) {
+            opts.memstats = 1;
+        } else if (strcmp(argv[argi], "-O") == 0) {
+            opts.optimize = 1;
+        } else if (strcmp(argv[argi], "-delayslots") == 0) {
+            opts.delay_slots = 1;
+        } else if (strcmp(argv[argi], "-g") == 0) {
+            opts.debug_lines = 1;
+        } else if (strcmp(argv[argi], "-mmap") == 0) {
+            opts.mmap_output = 1;
+        } else if (strcmp(argv[argi], "-pipeline") == 0) {
+            opts.pipeline = 1;
+        } else if (strcmp(argv[argi], "-trusted") == 0) {
+            opts.trusted = 1;
+        } else if (strcmp(argv[argi], "-sample") == 0 && argi + 1 < argc) {
+            opts.verify_stride = parse_positive(argv[++argi]);
+        } else {
+            print_usage_and_exit();
+        }
+    }
+
+    if (argc - argi >= 2 && strcmp(argv[argc - 2], "-log") == 0) {
+        log_name = argv[argc - 1];
+        argc -= 2;
+    }
+
+    int num_files = argc - argi;
+    if (mode == 5 ? num_files == 0 && !input
+        : mode == 6 ? num_files != 0
+        : mode == 7 ? num_files < 2
+                    : num_files != (mode == 0 ? 3 : mode == 4 ? 1 : 2)) {
         print_usage_and_exit();
     }
 
-    int mode = 0;
-    if (strcmp(argv[1], "-p1") == 0) {
-        mode = 1;
-    } else if (strcmp(argv[1], "-p2") == 0) {
-        mode = 2;
+    if ((opts.optimize || opts.delay_slots) && (mode == 6 || batch.steal || batch.uring)) {
+        print_usage_and_exit();
+    }
+    if ((opts.optimize || opts.delay_slots) && mode == 3) {
+        print_usage_and_exit();          // the symbols would not be the object's
+    }
+    if (opts.verify_stride != 1 && mode != 4) {
+        print_usage_and_exit();          // -sample only thins out -verify
     }
 
-    char *input, *inter, *output;
-    if (mode == 1) {
-        input = argv[2];
-        inter = argv[3];
+    if (mode == 5 || mode == 6) {
+        inter = output = NULL;
+    } else if (mode == 1 || mode == 3 || mode == 4) {
+        input = argv[argi];
+        inter = mode == 4 ? NULL : argv[argi + 1];
         output = NULL;
     } else if (mode == 2) {
         input = NULL;
-        inter = argv[2];
-        output = argv[3];
+        inter = argv[argi];
+        output = argv[argi + 1];
     } else {
-        input = argv[1];
-        inter = argv[2];
-        output = argv[3];
+        input = argv[argi];
+        inter = argv[argi + 1];
+        output = argv[argi + 2];
     }
 
-    if (argc == 6) {
-        if (strcmp(argv[4], "-log") == 0) {
-            set_log_file(argv[5]);
-        } else {
-            print_usage_and_exit();
-        }
+    if (log_name) {
+        set_log_file(log_name);
+    }
+    batch.log_name = log_name;
+    batch.asm_opts = opts;
+    if (batch.arena && mode != 5) {
+        opts.allocator = create_arena(0, batch.huge_pages);
     }
 
-    int err = assemble(input, inter, output);
+    int err;
+    if (mode == 7) {
+        err = lookup_symbols(argv[argi], argv + argi + 1, num_files - 1);
+    } else if (mode == 6) {
+        err = assemble_stream(stdin, stdout, &opts);
+    } else if (mode == 5) {
+        err = assemble_batch(input, argv + argi, num_files, &batch);
+    } else if (mode == 3) {
+        err = assemble_symbols(input, inter, snapshot);
+    } else if (mode == 4) {
+        err = verify_file(input, &opts);
+    } else {
+        err = assemble_opts(input, inter, output, &opts);
+    }
+
+    if (opts.allocator) {
+        free_arena(opts.allocator);
+    }
+    free_source_cache();
+
+    if (err == -1) {
+        exit(1);
+    }
 
     if (err) {
         write_to_log("One or more errors encountered during assembly operation.\n");
@@ -425,9 +1262,10 @@ int main(int argc, char **argv) {
     }
 
     if (is_log_file_set()) {
-        printf("Results saved to %s\n", argv[5]);
+        printf("Results saved to %s\n", log_name);
     }
 
 
     return err;
 }
+#endif
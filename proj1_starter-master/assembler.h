@@ -1,10 +1,73 @@
 #ifndef ASSEMBLER_H
 #define ASSEMBLER_H
 
+/* Options for an assembly run. DEFAULT_ASM_OPTIONS is the fully validating
+   configuration used by assemble().
+ */
+typedef struct {
+    int trusted;             // encode pass two with translate_inst_trusted()
+    unsigned verify_stride;  // check every n-th instruction in verify_file()
+    int quiet;               // do not print progress messages
+    int pipeline;            // run pass two as a pipeline of threads
+    int mmap_output;         // write the output file through a mapping
+    int debug_lines;         // add a .line section mapping code to source
+    struct Allocator* allocator;   // for the symbol tables, NULL for malloc()
+    int memstats;            // report memory use per subsystem at the end
+    int perfcounters;        // report hardware counters per phase at the end
+    int optimize;            // run the peephole pass at the end of pass one
+    int delay_slots;         // then fill branch delay slots in place of nops
+} AsmOptions;
+
+extern const AsmOptions DEFAULT_ASM_OPTIONS;
+
+struct Allocator;
+struct SourceMap;
+struct DataSection;
+struct Peephole;
+
+/* Where a pass starts, and after it returns, where it stopped. With SRCMAP
+   set, pass one records the source position of every instruction it writes
+   and pass two reports errors at those positions; pass two records the
+   position of every instruction it encodes in LINEMAP. Pass one lays down
+   .data directives in DATA; without it they are errors. With PEEPHOLE set,
+   pass one records its instructions there and they are written, optimized,
+   at the end of pass one.
+ */
+typedef struct {
+    uint32_t line_no;        // lines read before the first line of input
+    uint32_t addr;           // byte offset of the first instruction
+    struct SourceMap* srcmap;
+    struct SourceMap* linemap;
+    struct DataSection* data;
+    struct MacroTable* macros;
+    struct Peephole* peephole;
+    const char* path;        // of the input, for the paths it names; NULL for stdin
+} PassState;
+
 int assemble(const char* in_name, const char* tmp_name, const char* out_name);
 
+int assemble_opts(const char* in_name, const char* tmp_name, const char* out_name,
+    const AsmOptions* opts);
+
+int assemble_symbols(const char* in_name, const char* sym_name, int snapshot);
+
+int lookup_symbols(const char* snap_name, char** names, int num_names);
+
+int verify_file(const char* in_name, const AsmOptions* opts);
+
 int pass_one(FILE *input, FILE* output, SymbolTable* symtbl);
 
 int pass_two(FILE *input, FILE* output, SymbolTable* symtbl, SymbolTable* reltbl);
 
+int run_pass_one(FILE* input, FILE* output, SymbolTable* symtbl, PassState* state);
+
+int run_pass_two(FILE *input, FILE* output, SymbolTable* symtbl,
+    SymbolTable* reltbl, const AsmOptions* opts, PassState* state);
+
+struct MappedOutput;
+
+int run_pass_two_mapped(FILE *input, struct MappedOutput* output,
+    SymbolTable* symtbl, SymbolTable* reltbl, const AsmOptions* opts,
+    PassState* state);
+
 #endif
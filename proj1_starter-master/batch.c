@@ -0,0 +1,1171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "src/utils.h"
+#include "src/alloc.h"
+#include "src/tables.h"
+#include "src/sched.h"
+#include "src/io_ring.h"
+#include "src/mapped_output.h"
+#include "src/data.h"
+#include "src/macro.h"
+#include "src/source_map.h"
+#include "assembler.h"
+#include "batch.h"
+
+typedef struct BatchRun BatchRun;
+
+/* One input file of a batch and the files it is assembled to. */
+typedef struct {
+    BatchRun* run;
+    char* input;
+    char* inter;
+    char* output;
+    int err;
+} BatchJob;
+
+/* State shared by the workers of one batch run. In thread pool mode jobs are
+   handed out through NEXT; in work-stealing mode they are tasks of SCHED.
+   LOG_LOCK serializes flushing a finished job's diagnostics so the messages
+   of different files never interleave.
+ */
+struct BatchRun {
+    BatchJob* jobs;
+    size_t num_jobs;
+    size_t cap;
+    size_t next;
+    AsmOptions asm_opts;
+    const char* log_name;
+    pthread_mutex_t log_lock;
+    Scheduler* sched;
+    unsigned chunk_lines;
+    int arena;
+    int huge_pages;
+};
+
+/*******************************
+ * Job List
+ *******************************/
+
+/* Returns a copy of NAME with its extension replaced by EXT. */
+static char* replace_extension(const char* name, const char* ext) {
+    const char* base = strrchr(name, '/');
+    const char* dot = strrchr(base ? base : name, '.');
+    size_t stem = dot ? (size_t) (dot - name) : strlen(name);
+
+    char* res = malloc(stem + strlen(ext) + 1);
+    if (!res) {
+        allocation_failed();
+    }
+    memcpy(res, name, stem);
+    strcpy(res + stem, ext);
+    return res;
+}
+
+/* Adds a job for INPUT. INTER and OUTPUT default to INPUT with its extension
+   replaced by .int and .out. */
+static void add_job(BatchRun* run, const char* input, const char* inter,
+    const char* output) {
+
+    if (run->num_jobs >= run->cap) {
+        run->cap = run->cap ? run->cap * 2 : 16;
+        run->jobs = realloc(run->jobs, run->cap * sizeof(BatchJob));
+        if (!run->jobs) {
+            allocation_failed();
+        }
+    }
+
+    BatchJob* job = &run->jobs[run->num_jobs++];
+    job->run = run;
+    job->input = strdup(input);
+    job->inter = inter ? strdup(inter) : replace_extension(input, ".int");
+    job->output = output ? strdup(output) : replace_extension(input, ".out");
+    job->err = 0;
+}
+
+/* Reads the jobs listed in MANIFEST. Each non-empty line holds either an
+   input file, or an input, intermediate and output file separated by
+   whitespace. Lines starting with '#' are ignored.
+
+   Returns 0 on success and -1 if MANIFEST cannot be read or is malformed.
+ */
+static int read_manifest(BatchRun* run, const char* manifest) {
+    char buf[1024];
+    uint32_t line_no = 0;
+    int err = 0;
+
+    FILE* f = fopen(manifest, "r");
+    if (!f) {
+        write_to_log("Error: unable to open manifest: %s\n", manifest);
+        return -1;
+    }
+
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+        char* fields[4];
+        int num_fields = 0;
+        char* save;
+
+        line_no++;
+        if (buf[0] == '#') continue;
+
+        for (char* tok = strtok_r(buf, " \t\r\n", &save); tok && num_fields < 4;
+            tok = strtok_r(NULL, " \t\r\n", &save)) {
+            fields[num_fields++] = tok;
+        }
+
+        if (num_fields == 1) {
+            add_job(run, fields[0], NULL, NULL);
+        } else if (num_fields == 3) {
+            add_job(run, fields[0], fields[1], fields[2]);
+        } else if (num_fields != 0) {
+            write_to_log("Error - malformed manifest entry at line %d\n", line_no);
+            err = -1;
+        }
+    }
+
+    fclose(f);
+    return err;
+}
+
+static void free_jobs(BatchRun* run) {
+    for (size_t i = 0; i < run->num_jobs; i++) {
+        free(run->jobs[i].input);
+        free(run->jobs[i].inter);
+        free(run->jobs[i].output);
+    }
+    free(run->jobs);
+}
+
+/*******************************
+ * Workers
+ *******************************/
+
+/* Writes the LEN bytes of diagnostics in TEXT to the batch log, under the
+   log lock. */
+static void flush_job_log(BatchRun* run, const BatchJob* job, const char* text,
+    size_t len) {
+
+    pthread_mutex_lock(&run->log_lock);
+    if (len > 0) {
+        FILE* f = run->log_name ? fopen(run->log_name, "a") : stderr;
+        if (f) {
+            fprintf(f, "%s:\n", job->input);
+            fwrite(text, 1, len, f);
+            if (f != stderr) {
+                fclose(f);
+            }
+        }
+    }
+    printf("%s %s -> %s\n", job->err ? "Failed:   " : "Assembled:", job->input,
+        job->output);
+    pthread_mutex_unlock(&run->log_lock);
+}
+
+/* Returns the arena a worker of RUN allocates its jobs' tables from, or
+   NULL to use malloc(). */
+static Allocator* create_worker_arena(BatchRun* run) {
+    return run->arena ? create_arena(0, run->huge_pages) : NULL;
+}
+
+/* Assembles JOB with its own symbol tables, allocated from ALLOCATOR, and
+   files. Its diagnostics are collected in memory and flushed as one block
+   when the job is done. */
+static void run_job(BatchRun* run, BatchJob* job, Allocator* allocator) {
+    char* text = NULL;
+    size_t len = 0;
+    AsmOptions opts = run->asm_opts;
+    opts.allocator = allocator;
+
+    FILE* log = open_memstream(&text, &len);
+    set_log_stream(log);
+
+    job->err = assemble_opts(job->input, job->inter, job->output, &opts);
+
+    set_log_stream(NULL);
+    if (log) {
+        fclose(log);
+    }
+    flush_job_log(run, job, text, len);
+    free(text);
+}
+
+static void* batch_worker(void* arg) {
+    BatchRun* run = arg;
+    Allocator* arena = create_worker_arena(run);
+
+    for (;;) {
+        size_t i = __sync_fetch_and_add(&run->next, 1);
+        if (i >= run->num_jobs) {
+            break;
+        }
+        run_job(run, &run->jobs[i], arena);
+        reset_allocator(arena);
+    }
+    free_arena(arena);
+    return NULL;
+}
+
+/* Runs the jobs of RUN on NUM_THREADS threads, one whole file at a time. */
+static void run_thread_pool(BatchRun* run, size_t num_threads) {
+    pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+    if (!threads) {
+        allocation_failed();
+    }
+    size_t started = 0;
+    for (; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, batch_worker, run) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        batch_worker(run);     // no threads available, run the jobs here
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+/*******************************
+ * Work-Stealing Mode
+ *******************************/
+
+typedef struct SplitFile SplitFile;
+
+/* A piece of a large file: up to CHUNK_LINES source lines and the
+   intermediate text and machine code they turn into. Chunks are lexed
+   (pass one) and encoded (pass two) as independent tasks; positions that
+   depend on earlier chunks are fixed up between the two passes.
+ */
+typedef struct {
+    SplitFile* file;
+    char* src;               // source text, inside the file's buffer
+    size_t src_len;
+    PassState start_one;     // first line of the chunk, byte offset 0
+    PassState start_two;     // first intermediate line and byte offset
+    SymbolTable* symtbl;     // labels, relative to the chunk's start
+    SymbolTable* reltbl;
+    SourceMap* srcmap;       // source lines of the intermediate lines
+    SourceMap* linemap;      // of the encoded instructions, with -g
+    uint32_t size;           // bytes of instructions in the chunk
+    uint32_t words;          // instructions encoded in pass two
+    char* inter;
+    size_t inter_len;
+    char* out;
+    size_t out_len;
+    char* log_one;           // pass one diagnostics
+    size_t log_one_len;
+    char* log_two;           // pass two diagnostics
+    size_t log_two_len;
+    int err;
+} FileChunk;
+
+/* A large file assembled as chunk tasks. PENDING counts the chunks of the
+   current pass that are still running; the task that finishes the last
+   one carries the file on to the next step. */
+struct SplitFile {
+    BatchJob* job;
+    char* text;
+    FileChunk* chunks;
+    size_t num_chunks;
+    long pending;
+    int encoded;             // pass two was started
+    int mapped;              // chunks encode straight into OUT_MAP
+    MappedOutput out_map;
+    ConcurrentSymbolTable* labels;   // of all chunks, relative to their start
+    SymbolTable* symtbl;
+    SymbolTable* reltbl;
+    char* log;               // diagnostics of the merge between passes
+    size_t log_len;
+    int err;
+};
+
+/* Reads the whole file NAME into a null-terminated buffer. Returns NULL if
+   it cannot be read. */
+static char* read_file(const char* name, size_t* len) {
+    FILE* f = fopen(name, "r");
+    if (!f) {
+        return NULL;
+    }
+
+    char* text = NULL;
+    if (fseek(f, 0, SEEK_END) == 0) {
+        long size = ftell(f);
+        rewind(f);
+        if (size >= 0 && (text = malloc(size + 1)) != NULL) {
+            *len = fread(text, 1, size, f);
+            text[*len] = '\0';
+        }
+    }
+    fclose(f);
+    return text;
+}
+
+/* Directives a chunk cannot run: it has no data section and no macro
+   table, and the data or macros of an included file would need the chunks
+   before it. */
+static const char* const WHOLE_FILE_DIRECTIVES[] = { ".data", ".include", ".macro" };
+
+/* Returns 1 if a line of TEXT, before any comment, has a word that is one
+   of WHOLE_FILE_DIRECTIVES. Such files are not split. */
+static int needs_whole_file(const char* text) {
+    size_t num = sizeof(WHOLE_FILE_DIRECTIVES) / sizeof(WHOLE_FILE_DIRECTIVES[0]);
+    const char* line = text;
+    while (*line) {
+        size_t line_len = strcspn(line, "\n");
+        size_t code_len = strcspn(line, "#\n");
+        for (const char* p = line; p < line + code_len; p++) {
+            if (*p != '.' || (p > line && !isspace((unsigned char) p[-1])
+                    && p[-1] != ':' && p[-1] != ',')) {
+                continue;
+            }
+            size_t word = strcspn(p, " \f\r\t\v,#\n");
+            for (size_t i = 0; i < num; i++) {
+                if (strlen(WHOLE_FILE_DIRECTIVES[i]) == word
+                    && strncmp(p, WHOLE_FILE_DIRECTIVES[i], word) == 0) {
+                    return 1;
+                }
+            }
+        }
+        line += line_len + (line[line_len] == '\n');
+    }
+    return 0;
+}
+
+static uint32_t count_lines(const char* text, size_t len) {
+    uint32_t lines = 0;
+    for (const char* p = text; (p = memchr(p, '\n', text + len - p)) != NULL; p++) {
+        lines++;
+    }
+    return lines;
+}
+
+static void finish_split_file(SplitFile* file);
+static void encode_chunk_task(void* arg);
+
+/* Places the chunks once all of them went through pass one, moves the
+   labels they published to the file's table in source order, reporting
+   those defined in an earlier chunk too, writes the intermediate file and
+   starts pass two. */
+static void merge_pass_one(SplitFile* file) {
+    FILE* log = open_memstream(&file->log, &file->log_len);
+    if (!log) {
+        allocation_failed();
+    }
+    set_log_stream(log);
+
+    uint32_t addr = 0, line_no = 0;
+    for (size_t i = 0; i < file->num_chunks; i++) {
+        FileChunk* c = &file->chunks[i];
+        c->start_two.addr = addr;
+        c->start_two.line_no = line_no;
+        addr += c->size;
+        line_no += count_lines(c->inter, c->inter_len);
+    }
+
+    uint32_t num_labels;
+    ConcurrentSymbol** labels = sort_ctable(file->labels, &num_labels);
+    for (uint32_t i = 0; i < num_labels; i++) {
+        ConcurrentSymbol* sym = labels[i];
+        FileChunk* c = &file->chunks[sym->pos >> 32];
+        if (sym->dropped) {
+            name_already_exists(sym->name);
+            file->err = 1;
+        } else if (add_to_table(file->symtbl, sym->name,
+                sym->addr + c->start_two.addr) != 0) {
+            file->err = 1;
+        }
+    }
+    free(labels);
+
+    FILE* inter = fopen(file->job->inter, "w");
+    if (inter) {
+        for (size_t i = 0; i < file->num_chunks; i++) {
+            fwrite(file->chunks[i].inter, 1, file->chunks[i].inter_len, inter);
+        }
+        fclose(inter);
+    } else {
+        write_to_log("Error: unable to open output file: %s\n", file->job->inter);
+        file->err = 1;
+    }
+
+    /* The output file can be created at its final size now that the
+       instructions are counted; the chunks then encode straight into it. */
+    int mmap_output = file->job->run->asm_opts.mmap_output;
+    if (inter && mmap_output) {
+        if (open_mapped_output(&file->out_map, file->job->output, addr / 4,
+                file->symtbl) == 0) {
+            file->mapped = 1;
+        } else {
+            write_to_log("Error: unable to open output file: %s\n", file->job->output);
+            file->err = 1;
+        }
+    }
+
+    set_log_stream(NULL);
+    fclose(log);
+
+    if (!inter || (mmap_output && !file->mapped)) {
+        finish_split_file(file);
+        return;
+    }
+
+    file->encoded = 1;
+    file->pending = file->num_chunks;
+    for (size_t i = 0; i < file->num_chunks; i++) {
+        sched_spawn(file->job->run->sched, encode_chunk_task, &file->chunks[i]);
+    }
+}
+
+/* Pass one over a chunk, into its own intermediate text and symbol table.
+   Its labels are then published to the file's table, by source position,
+   as soon as the chunk is done. */
+static void lex_chunk_task(void* arg) {
+    FileChunk* chunk = arg;
+    PassState state = chunk->start_one;
+    state.srcmap = chunk->srcmap;
+
+    FILE* log = open_memstream(&chunk->log_one, &chunk->log_one_len);
+    FILE* src = fmemopen(chunk->src, chunk->src_len, "r");
+    FILE* dst = open_memstream(&chunk->inter, &chunk->inter_len);
+    if (!log || !src || !dst) {
+        allocation_failed();
+    }
+
+    set_log_stream(log);
+    chunk->err = run_pass_one(src, dst, chunk->symtbl, &state) != 0;
+    chunk->size = state.addr;
+    uint64_t index = chunk - chunk->file->chunks;
+    for (uint32_t j = 0; j < chunk->symtbl->len; j++) {
+        Symbol* sym = &chunk->symtbl->tbl[j];
+        if (add_to_ctable(chunk->file->labels, sym->name, sym->addr,
+                index << 32 | j) != 0) {
+            chunk->err = 1;
+        }
+    }
+    set_log_stream(NULL);
+
+    fclose(src);
+    fclose(dst);
+    fclose(log);
+
+    if (__atomic_sub_fetch(&chunk->file->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        merge_pass_one(chunk->file);
+    }
+}
+
+/* Pass two over a chunk's intermediate text, into its own machine code and
+   relocation table. */
+static void encode_chunk_task(void* arg) {
+    FileChunk* chunk = arg;
+    SplitFile* file = chunk->file;
+    PassState state = chunk->start_two;
+    state.srcmap = chunk->srcmap;
+    state.linemap = chunk->linemap;
+
+    FILE* log = open_memstream(&chunk->log_two, &chunk->log_two_len);
+    FILE* dst = open_memstream(&chunk->out, &chunk->out_len);
+    if (!log || !dst) {
+        allocation_failed();
+    }
+
+    set_log_stream(log);
+    if (chunk->inter_len > 0) {
+        FILE* src = fmemopen(chunk->inter, chunk->inter_len, "r");
+        if (!src) {
+            allocation_failed();
+        }
+        int res = file->mapped
+            ? run_pass_two_mapped(src, &file->out_map, file->symtbl,
+                chunk->reltbl, &file->job->run->asm_opts, &state)
+            : run_pass_two(src, dst, file->symtbl, chunk->reltbl,
+                &file->job->run->asm_opts, &state);
+        if (res != 0) {
+            chunk->err = 1;
+        }
+        chunk->words = (state.addr - chunk->start_two.addr) / 4;
+        fclose(src);
+    }
+    set_log_stream(NULL);
+
+    fclose(dst);
+    fclose(log);
+
+    if (__atomic_sub_fetch(&file->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        finish_split_file(file);
+    }
+}
+
+/* Writes the .line section of the chunks of FILE, assembled with -g, to
+   DST. */
+static void write_chunk_lines(const SplitFile* file, FILE* dst) {
+    SourceMap* linemap = create_source_map();
+    for (size_t i = 0; i < file->num_chunks; i++) {
+        source_map_append(linemap, file->chunks[i].linemap);
+    }
+    fprintf(dst, "\n.line\n");
+    write_source_map(linemap, dst);
+    free_source_map(linemap);
+}
+
+/* Writes the output file of a split file, flushes its diagnostics and
+   frees it. Diagnostics come pass by pass and chunk by chunk, as in a
+   single-threaded run, except for labels defined in two chunks: those are
+   only found by merge_pass_one(), so they follow the rest of pass one's. */
+static void finish_split_file(SplitFile* file) {
+    BatchJob* job = file->job;
+    char* text = NULL;
+    size_t len = 0;
+
+    FILE* log = open_memstream(&text, &len);
+    if (!log) {
+        allocation_failed();
+    }
+
+    for (size_t i = 0; i < file->num_chunks; i++) {
+        fwrite(file->chunks[i].log_one, 1, file->chunks[i].log_one_len, log);
+        file->err |= file->chunks[i].err;
+    }
+    fwrite(file->log, 1, file->log_len, log);
+
+    if (file->encoded) {
+        /* Relocations are only recorded for the first use of a label. */
+        for (size_t i = 0; i < file->num_chunks; i++) {
+            FileChunk* c = &file->chunks[i];
+            fwrite(c->log_two, 1, c->log_two_len, log);
+            for (uint32_t j = 0; j < c->reltbl->len; j++) {
+                Symbol* sym = &c->reltbl->tbl[j];
+                if (get_addr_for_symbol(file->reltbl, sym->name) == -1) {
+                    add_to_table(file->reltbl, sym->name, sym->addr);
+                }
+            }
+        }
+
+        FILE* dst = file->mapped ? NULL : fopen(job->output, "w");
+        if (file->mapped) {
+            /* Instructions that failed to encode left gaps behind their
+               chunk; only then do later chunks have to move down. */
+            uint32_t words = 0;
+            for (size_t i = 0; i < file->num_chunks; i++) {
+                FileChunk* c = &file->chunks[i];
+                if (words != c->start_two.addr / 4) {
+                    move_mapped_words(&file->out_map, words, c->start_two.addr / 4,
+                        c->words);
+                }
+                words += c->words;
+            }
+            FILE* lines = NULL;
+            if (close_mapped_output(&file->out_map, words, file->symtbl,
+                    file->reltbl) != 0 || (job->run->asm_opts.debug_lines
+                    && (lines = fopen(job->output, "a")) == NULL)) {
+                fprintf(log, "Error: unable to write output file: %s\n", job->output);
+                file->err = 1;
+            } else if (lines) {
+                write_chunk_lines(file, lines);
+                fclose(lines);
+            }
+        } else if (dst) {
+            fprintf(dst, ".text\n");
+            for (size_t i = 0; i < file->num_chunks; i++) {
+                fwrite(file->chunks[i].out, 1, file->chunks[i].out_len, dst);
+            }
+            fprintf(dst, "\n.symbol\n");
+            write_table(file->symtbl, dst);
+            fprintf(dst, "\n.relocation\n");
+            write_table(file->reltbl, dst);
+            if (job->run->asm_opts.debug_lines) {
+                write_chunk_lines(file, dst);
+            }
+            fclose(dst);
+        } else {
+            fprintf(log, "Error: unable to open output file: %s\n", job->output);
+            file->err = 1;
+        }
+    }
+
+    fclose(log);
+    job->err = file->err;
+    flush_job_log(job->run, job, text, len);
+    free(text);
+
+    for (size_t i = 0; i < file->num_chunks; i++) {
+        FileChunk* c = &file->chunks[i];
+        free_table(c->symtbl);
+        free_table(c->reltbl);
+        free_source_map(c->srcmap);
+        free_source_map(c->linemap);
+        free(c->inter);
+        free(c->out);
+        free(c->log_one);
+        free(c->log_two);
+    }
+    free(file->chunks);
+    free_ctable(file->labels);
+    free_table(file->symtbl);
+    free_table(file->reltbl);
+    free(file->log);
+    free(file->text);
+    free(file);
+}
+
+/* Task for one input file. Files of up to CHUNK_LINES lines, and files
+   with data or macros (see needs_whole_file()), are assembled by this task; larger
+   ones are split into chunks that are lexed and encoded as separate tasks,
+   which idle workers can steal. */
+static void file_task(void* arg) {
+    BatchJob* job = arg;
+    BatchRun* run = job->run;
+    size_t len = 0;
+
+    char* text = read_file(job->input, &len);
+    uint32_t total_lines = text ? count_lines(text, len) : 0;
+    if (!text || total_lines <= run->chunk_lines || needs_whole_file(text)) {
+        free(text);
+        run_job(run, job, NULL);
+        return;
+    }
+
+    SplitFile* file = calloc(1, sizeof(SplitFile));
+    if (!file) {
+        allocation_failed();
+    }
+    file->job = job;
+    file->text = text;
+    file->labels = create_ctable(SYMTBL_UNIQUE_NAME, total_lines / 4);
+    file->symtbl = create_table(SYMTBL_UNIQUE_NAME);
+    file->reltbl = create_table(SYMTBL_NON_UNIQUE);
+    file->chunks = calloc(total_lines / run->chunk_lines + 1, sizeof(FileChunk));
+    if (!file->chunks) {
+        allocation_failed();
+    }
+
+    char* pos = text;
+    char* end = text + len;
+    uint32_t line_no = 0;
+    while (pos < end) {
+        FileChunk* chunk = &file->chunks[file->num_chunks++];
+        char* stop = pos;
+        uint32_t lines = 0;
+        while (stop < end && lines < run->chunk_lines) {
+            char* nl = memchr(stop, '\n', end - stop);
+            stop = nl ? nl + 1 : end;
+            lines++;
+        }
+
+        chunk->file = file;
+        chunk->src = pos;
+        chunk->src_len = stop - pos;
+        chunk->start_one.line_no = line_no;
+        chunk->symtbl = create_table(SYMTBL_UNIQUE_NAME);
+        chunk->reltbl = create_table(SYMTBL_NON_UNIQUE);
+        chunk->srcmap = create_source_map();
+        if (run->asm_opts.debug_lines) {
+            chunk->linemap = create_source_map();
+        }
+
+        line_no += lines;
+        pos = stop;
+    }
+
+    file->pending = file->num_chunks;
+    for (size_t i = 0; i < file->num_chunks; i++) {
+        sched_spawn(run->sched, lex_chunk_task, &file->chunks[i]);
+    }
+}
+
+/*******************************
+ * io_uring Mode
+ *******************************/
+
+#define IO_DEPTH 64              // reads and writes in flight
+
+typedef struct UringFile UringFile;
+
+/* A whole-file read or write; the tag of its ring requests, which are
+   reissued for the rest of the file after a short transfer. */
+typedef struct {
+    UringFile* file;
+    const char* name;
+    int fd;
+    int write;
+    char* buf;
+    size_t len;
+    size_t done;
+} IoTransfer;
+
+/* A job assembled from memory: its input is read through the ring, a
+   worker runs both passes into memory buffers, and the intermediate and
+   output file are written through the ring. */
+struct UringFile {
+    BatchJob* job;
+    IoTransfer read;
+    IoTransfer writes[2];        // intermediate and output file
+    int pending;                 // writes not yet complete
+    char* inter;
+    size_t inter_len;
+    char* out;
+    size_t out_len;
+    FILE* log;
+    char* log_text;
+    size_t log_len;
+    int err;
+    UringFile* next;             // in the ready or done list
+};
+
+/* State shared by the I/O thread and the workers. The I/O thread hands
+   files whose input was read to the workers through READY; workers return
+   assembled files through DONE and ring DOORBELL, an eventfd the I/O thread
+   keeps a read queued on, so it wakes up for them as for any completion.
+ */
+typedef struct {
+    BatchRun* run;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    UringFile* ready;
+    UringFile** ready_tail;
+    UringFile* done;
+    size_t num_done;
+    int closing;
+    int doorbell;
+} UringRun;
+
+/* Both passes over the input in F->read, into F->inter and F->out, with
+   the symbol tables allocated from ALLOCATOR. */
+static void assemble_from_memory(BatchRun* run, UringFile* f,
+    Allocator* allocator) {
+    SymbolTable* symtbl = create_table_in(SYMTBL_UNIQUE_NAME, allocator);
+    SymbolTable* reltbl = create_table_in(SYMTBL_NON_UNIQUE, allocator);
+    PassState one = { 0, 0 }, two = { 0, 0 };
+    one.data = create_data_section();
+    one.macros = create_macro_table();
+    one.srcmap = two.srcmap = create_source_map();
+    one.path = f->job->input;
+    if (run->asm_opts.debug_lines) {
+        two.linemap = create_source_map();
+    }
+
+    FILE* inter = open_memstream(&f->inter, &f->inter_len);
+    FILE* out = open_memstream(&f->out, &f->out_len);
+    if (!inter || !out) {
+        allocation_failed();
+    }
+
+    set_log_stream(f->log);
+    if (f->read.done > 0) {
+        FILE* src = fmemopen(f->read.buf, f->read.done, "r");
+        if (!src) {
+            allocation_failed();
+        }
+        if (run_pass_one(src, inter, symtbl, &one) != 0) {
+            f->err = 1;
+        }
+        fclose(src);
+    }
+    if (check_macros_closed(one.macros) != 0) {
+        f->err = 1;
+    }
+    if (resolve_data_labels(one.data, symtbl) != 0) {
+        f->err = 1;
+    }
+    fclose(inter);
+
+    fprintf(out, ".text\n");
+    if (f->inter_len > 0) {
+        FILE* src = fmemopen(f->inter, f->inter_len, "r");
+        if (!src) {
+            allocation_failed();
+        }
+        if (run_pass_two(src, out, symtbl, reltbl, &run->asm_opts, &two) != 0) {
+            f->err = 1;
+        }
+        fclose(src);
+    }
+    fprintf(out, "\n.symbol\n");
+    write_table(symtbl, out);
+    fprintf(out, "\n.relocation\n");
+    write_table(reltbl, out);
+    if (one.data->size > 0) {
+        fprintf(out, "\n.data\n");
+        write_data_section(one.data, out, 0);
+    }
+    if (two.linemap) {
+        fprintf(out, "\n.line\n");
+        write_source_map(two.linemap, out);
+    }
+    fclose(out);
+    set_log_stream(NULL);
+
+    free_data_section(one.data);
+    free_macro_table(one.macros);
+    free_source_map(one.srcmap);
+    free_source_map(two.linemap);
+    free_table(symtbl);
+    free_table(reltbl);
+}
+
+static void* uring_worker(void* arg) {
+    UringRun* ur = arg;
+    uint64_t one = 1;
+    Allocator* arena = create_worker_arena(ur->run);
+
+    for (;;) {
+        pthread_mutex_lock(&ur->lock);
+        while (!ur->ready && !ur->closing) {
+            pthread_cond_wait(&ur->cond, &ur->lock);
+        }
+        UringFile* f = ur->ready;
+        if (!f) {
+            pthread_mutex_unlock(&ur->lock);
+            break;
+        }
+        ur->ready = f->next;
+        if (!ur->ready) {
+            ur->ready_tail = &ur->ready;
+        }
+        pthread_mutex_unlock(&ur->lock);
+
+        assemble_from_memory(ur->run, f, arena);
+        reset_allocator(arena);
+
+        pthread_mutex_lock(&ur->lock);
+        f->next = ur->done;
+        ur->done = f;
+        ur->num_done++;
+        pthread_mutex_unlock(&ur->lock);
+        if (write(ur->doorbell, &one, sizeof(one)) != sizeof(one)) {
+            perror("doorbell");
+        }
+    }
+    free_arena(arena);
+    return NULL;
+}
+
+static void make_ready(UringRun* ur, UringFile* f) {
+    pthread_mutex_lock(&ur->lock);
+    f->next = NULL;
+    *ur->ready_tail = f;
+    ur->ready_tail = &f->next;
+    pthread_cond_signal(&ur->cond);
+    pthread_mutex_unlock(&ur->lock);
+}
+
+/* Flushes the diagnostics of F and frees it. */
+static void finish_uring_file(BatchRun* run, UringFile* f) {
+    fclose(f->log);
+    f->job->err = f->err;
+    flush_job_log(run, f->job, f->log_text, f->log_len);
+
+    free(f->log_text);
+    free(f->read.buf);
+    free(f->inter);
+    free(f->out);
+    free(f);
+}
+
+/* Opens the input of JOB and queues its read; an empty input is handed to
+   the workers right away. Returns the file, or NULL if the job already
+   finished because its input cannot be read. */
+static UringFile* start_read(UringRun* ur, IoRing* ring, BatchJob* job) {
+    UringFile* f = calloc(1, sizeof(UringFile));
+    if (!f) {
+        allocation_failed();
+    }
+    f->job = job;
+    f->log = open_memstream(&f->log_text, &f->log_len);
+    if (!f->log) {
+        allocation_failed();
+    }
+
+    struct stat st;
+    int fd = open(job->input, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(f->log, "Error: unable to open input file: %s\n", job->input);
+        if (fd >= 0) {
+            close(fd);
+        }
+        f->err = 1;
+        finish_uring_file(ur->run, f);
+        return NULL;
+    }
+
+    f->read.file = f;
+    f->read.name = job->input;
+    f->read.fd = fd;
+    f->read.len = st.st_size;
+    f->read.buf = malloc(f->read.len + 1);
+    if (!f->read.buf) {
+        allocation_failed();
+    }
+
+    if (f->read.len == 0) {
+        close(fd);
+        make_ready(ur, f);
+    } else {
+        io_ring_read(ring, fd, f->read.buf, f->read.len, 0, &f->read);
+    }
+    return f;
+}
+
+/* Opens the intermediate and output file of F and queues their writes.
+   Returns the number of writes queued. */
+static int start_writes(IoRing* ring, UringFile* f) {
+    const char* names[2] = { f->job->inter, f->job->output };
+    char* bufs[2] = { f->inter, f->out };
+    size_t lens[2] = { f->inter_len, f->out_len };
+
+    for (int i = 0; i < 2; i++) {
+        int fd = open(names[i], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            fprintf(f->log, "Error: unable to open output file: %s\n", names[i]);
+            f->err = 1;
+            continue;
+        }
+        if (lens[i] == 0) {
+            close(fd);
+            continue;
+        }
+
+        IoTransfer* t = &f->writes[f->pending++];
+        t->file = f;
+        t->name = names[i];
+        t->fd = fd;
+        t->write = 1;
+        t->buf = bufs[i];
+        t->len = lens[i];
+        io_ring_write(ring, fd, t->buf, t->len, 0, t);
+    }
+    return f->pending;
+}
+
+/* Runs the jobs of RUN with their files read and written through an IoRing
+   on the calling thread, which overlaps the I/O of many files with the
+   assembly of others on NUM_THREADS worker threads. Falls back to
+   run_thread_pool() if the workers cannot be started. */
+static void run_uring(BatchRun* run, size_t num_threads, int blocking) {
+    UringRun ur;
+    memset(&ur, 0, sizeof(ur));
+    ur.run = run;
+    ur.ready_tail = &ur.ready;
+    ur.doorbell = eventfd(0, EFD_CLOEXEC);
+    if (ur.doorbell < 0) {
+        run_thread_pool(run, num_threads);
+        return;
+    }
+    pthread_mutex_init(&ur.lock, NULL);
+    pthread_cond_init(&ur.cond, NULL);
+
+    pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+    if (!threads) {
+        allocation_failed();
+    }
+    size_t started = 0;
+    for (; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, uring_worker, &ur) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        free(threads);
+        close(ur.doorbell);
+        run_thread_pool(run, num_threads);
+        return;
+    }
+
+    IoRing* ring = create_io_ring(IO_DEPTH, blocking);
+    printf("I/O: %s\n", io_ring_is_async(ring) ? "io_uring" : "blocking");
+
+    IoTransfer doorbell_read = { NULL, "doorbell", ur.doorbell, 0, NULL, 0, 0 };
+    uint64_t doorbell_value;
+    int doorbell_armed = 0;
+    size_t next = 0, finished = 0, assembling = 0;
+
+    /* A job the loop does not get to finish counts as failed. */
+    for (size_t i = 0; i < run->num_jobs; i++) {
+        run->jobs[i].err = 1;
+    }
+
+    while (finished < run->num_jobs) {
+        /* One slot stays free for the doorbell, two are needed per file
+           that is written. */
+        while (next < run->num_jobs && io_ring_in_flight(ring) + 3 < IO_DEPTH) {
+            UringFile* f = start_read(&ur, ring, &run->jobs[next++]);
+            if (!f) {
+                finished++;
+            } else if (f->read.len == 0) {
+                assembling++;
+            }
+        }
+
+        pthread_mutex_lock(&ur.lock);
+        while (ur.done && io_ring_in_flight(ring) + 3 <= IO_DEPTH) {
+            UringFile* f = ur.done;
+            ur.done = f->next;
+            ur.num_done--;
+            assembling--;
+            if (start_writes(ring, f) == 0) {
+                finish_uring_file(run, f);
+                finished++;
+            }
+        }
+        /* One doorbell read can consume the signals of several files, so
+           it is only queued while a worker still holds a file that will
+           ring it; otherwise the blocking backend would wait forever. */
+        int with_workers = assembling > ur.num_done;
+        pthread_mutex_unlock(&ur.lock);
+        if (finished == run->num_jobs) {
+            break;
+        }
+
+        if (!doorbell_armed && with_workers) {
+            io_ring_read(ring, ur.doorbell, &doorbell_value, sizeof(doorbell_value),
+                IO_RING_NO_OFFSET, &doorbell_read);
+            doorbell_armed = 1;
+        }
+
+        void* tag;
+        long res;
+        if (io_ring_wait(ring, &tag, &res) != 0) {
+            perror("io_ring_wait");
+            break;
+        }
+
+        if (tag == &doorbell_read) {
+            doorbell_armed = 0;
+            continue;
+        }
+
+        IoTransfer* t = tag;
+        UringFile* f = t->file;
+        if (res < 0) {
+            fprintf(f->log, "Error: unable to %s file: %s (%s)\n",
+                t->write ? "write output" : "read input", t->name, strerror(-res));
+            f->err = 1;
+            t->len = t->done;
+        } else if (res == 0 && !t->write) {
+            t->len = t->done;        // the file shrank since fstat()
+        } else {
+            t->done += res;
+        }
+
+        if (t->done < t->len) {
+            if (t->write) {
+                io_ring_write(ring, t->fd, t->buf + t->done, t->len - t->done,
+                    t->done, t);
+            } else {
+                io_ring_read(ring, t->fd, t->buf + t->done, t->len - t->done,
+                    t->done, t);
+            }
+            continue;
+        }
+
+        close(t->fd);
+        if (!t->write) {
+            assembling++;
+            make_ready(&ur, f);
+        } else if (--f->pending == 0) {
+            finish_uring_file(run, f);
+            finished++;
+        }
+    }
+
+    pthread_mutex_lock(&ur.lock);
+    ur.closing = 1;
+    pthread_cond_broadcast(&ur.cond);
+    pthread_mutex_unlock(&ur.lock);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    free_io_ring(ring);
+    close(ur.doorbell);
+    pthread_cond_destroy(&ur.cond);
+    pthread_mutex_destroy(&ur.lock);
+}
+
+/*******************************
+ * Batch Assembly
+ *******************************/
+
+/* Assembles every file in INPUTS and in MANIFEST (if not NULL) concurrently
+   on OPTS->num_threads worker threads. Every job has its own symbol tables
+   and files; see assemble_opts(). With OPTS->steal set, the jobs run on the
+   work-stealing scheduler and files larger than OPTS->chunk_lines lines are
+   split into chunk tasks; per-worker statistics are printed at the end.
+   With OPTS->uring set instead, file I/O goes through an IoRing so reads
+   and writes of many files overlap with assembly. With OPTS->arena set, the
+   workers of the thread pool and uring modes allocate the symbol tables of
+   their jobs from an arena each that is reset after every job; the tables
+   of split files are shared between tasks and always use malloc().
+
+   Returns 0 if every job succeeded, 1 if any job failed and -1 if the
+   manifest could not be read.
+ */
+int assemble_batch(const char* manifest, char** inputs, int num_inputs,
+    const BatchOptions* opts) {
+
+    BatchRun run;
+    memset(&run, 0, sizeof(run));
+    run.asm_opts = opts->asm_opts;
+    run.asm_opts.quiet = 1;
+    run.asm_opts.memstats = 0;          // counts are process-wide
+    run.asm_opts.perfcounters = 0;
+    run.log_name = opts->log_name;
+    run.chunk_lines = opts->chunk_lines ? opts->chunk_lines : 65536;
+    run.arena = opts->arena;
+    run.huge_pages = opts->huge_pages;
+    pthread_mutex_init(&run.log_lock, NULL);
+
+    for (int i = 0; i < num_inputs; i++) {
+        add_job(&run, inputs[i], NULL, NULL);
+    }
+    if (manifest && read_manifest(&run, manifest) != 0) {
+        free_jobs(&run);
+        pthread_mutex_destroy(&run.log_lock);
+        return -1;
+    }
+
+    size_t num_threads = opts->num_threads;
+    if (num_threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cpus > 0 ? (size_t) cpus : 1;
+    }
+    if (num_threads > run.num_jobs) {
+        num_threads = run.num_jobs ? run.num_jobs : 1;
+    }
+
+    printf("Running batch: %zu file(s) on %zu thread(s)\n", run.num_jobs,
+        num_threads);
+
+    if (opts->uring) {
+        run_uring(&run, num_threads, opts->uring_blocking);
+    } else if (opts->steal) {
+        run.sched = create_scheduler(num_threads);
+        for (size_t i = 0; i < run.num_jobs; i++) {
+            sched_spawn(run.sched, file_task, &run.jobs[i]);
+        }
+        sched_run(run.sched);
+        write_sched_stats(run.sched, stdout);
+        free_scheduler(run.sched);
+    } else {
+        run_thread_pool(&run, num_threads);
+    }
+
+    int err = 0;
+    for (size_t i = 0; i < run.num_jobs; i++) {
+        if (run.jobs[i].err) {
+            err = 1;
+        }
+    }
+
+    free_jobs(&run);
+    pthread_mutex_destroy(&run.log_lock);
+    return err;
+}
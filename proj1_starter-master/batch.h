@@ -0,0 +1,20 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+/* Options for a batch run. */
+typedef struct {
+    unsigned num_threads;    // worker threads, 0 for one per online CPU
+    const char* log_name;    // file diagnostics are flushed to, NULL for stderr
+    AsmOptions asm_opts;     // options for each job; quiet is always set
+    int steal;               // use the work-stealing scheduler
+    unsigned chunk_lines;    // lines per task for split files, 0 for default
+    int uring;               // read and write files through an IoRing
+    int uring_blocking;      // ... using its blocking backend
+    int arena;               // give each worker an arena, reset after every job
+    int huge_pages;          // ... backed by huge pages
+} BatchOptions;
+
+int assemble_batch(const char* manifest, char** inputs, int num_inputs,
+    const BatchOptions* opts);
+
+#endif
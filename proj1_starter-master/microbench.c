@@ -0,0 +1,448 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "src/utils.h"
+#include "src/tables.h"
+#include "src/translate_utils.h"
+#include "src/translate.h"
+
+/* Microbenchmarks of the encoder and table primitives.
+
+   Every benchmark is timed in SAMPLES samples, each a run of as many
+   iterations as take about SAMPLE_NS. The median, the 99th percentile of the
+   per-operation times of the samples and the throughput at the median are
+   reported. Each median is also taken relative to that of a fixed
+   arithmetic loop timed just before it, which cancels most of the drift in
+   clock speed between runs (frequency scaling, noisy neighbours in a VM).
+   The relative medians are kept in a JSON baseline; a later run fails if one
+   is more than the threshold above its baseline.
+
+     microbench [-baseline <file>] [-threshold <percent>] [-update] [<filter>]
+
+   Without -update the baseline is only written if it does not exist yet.
+   A filter runs the benchmarks whose name contains it.
+ */
+
+#define SAMPLES 101
+#define SAMPLE_NS 200000
+#define MAX_BENCHES 64
+#define DEFAULT_BASELINE "microbench-baseline.json"
+#define DEFAULT_THRESHOLD 25.0
+
+typedef struct {
+    char name[64];
+    double median_ns;            // per operation
+    double p99_ns;
+    double ops_per_sec;
+    double relative;             // median over that of the reference loop
+} BenchResult;
+
+/* Runs the operation ITERS times and returns the number of operations
+   performed (a table fill does many per iteration). */
+typedef uint64_t (*BenchFn)(void* ctx, uint64_t iters);
+
+static volatile uint64_t sink;   // keeps results alive
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Times FN on CTX and stores the statistics under NAME in RESULT. */
+static void run_bench(const char* name, BenchFn fn, void* ctx, BenchResult* result) {
+    double per_op[SAMPLES];
+    uint64_t iters = 1;
+
+    /* Calibrate: double the iterations until one sample is long enough. */
+    for (;;) {
+        uint64_t start = now_ns();
+        fn(ctx, iters);
+        if (now_ns() - start >= SAMPLE_NS || iters >= (1u << 30)) {
+            break;
+        }
+        iters *= 2;
+    }
+
+    for (int i = 0; i < SAMPLES; i++) {
+        uint64_t start = now_ns();
+        uint64_t ops = fn(ctx, iters);
+        per_op[i] = (double) (now_ns() - start) / ops;
+    }
+    qsort(per_op, SAMPLES, sizeof(double), compare_doubles);
+
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->median_ns = per_op[SAMPLES / 2];
+    result->p99_ns = per_op[(SAMPLES * 99 + 99) / 100 - 1];
+    result->ops_per_sec = result->median_ns > 0 ? 1e9 / result->median_ns : 0;
+}
+
+/*******************************
+ * Benchmarks
+ *******************************/
+
+static char* REGS[8] = { "$zero", "$at", "$v0", "$a3", "$t0", "$t9", "$s7", "$ra" };
+
+static uint64_t bench_translate_reg(void* ctx, uint64_t iters) {
+    uint64_t acc = 0;
+    for (uint64_t i = 0; i < iters; i++) {
+        acc += translate_reg(REGS[i & 7]);
+    }
+    sink = acc;
+    return iters;
+}
+
+static char* NUMS[4] = { "0", "-32768", "0x7fff", "2147483647" };
+
+static uint64_t bench_translate_num(void* ctx, uint64_t iters) {
+    long int n, acc = 0;
+    for (uint64_t i = 0; i < iters; i++) {
+        translate_num(&n, NUMS[i & 3], -2147483648L, 2147483647L);
+        acc += n;
+    }
+    sink = acc;
+    return iters;
+}
+
+static char* LABELS[4] = { "loop", "_start", "label_with_digits_123", "9bad" };
+
+static uint64_t bench_is_valid_label(void* ctx, uint64_t iters) {
+    uint64_t acc = 0;
+    for (uint64_t i = 0; i < iters; i++) {
+        acc += is_valid_label(LABELS[i & 3]);
+    }
+    sink = acc;
+    return iters;
+}
+
+/* The reference: a dependent chain of multiplies and adds, independent of
+   memory and of the code under test. */
+static uint64_t bench_reference(void* ctx, uint64_t iters) {
+    uint64_t x = 1;
+    for (uint64_t i = 0; i < iters; i++) {
+        x = x * 6364136223846793005u + 1442695040888963407u;
+    }
+    sink = x;
+    return iters;
+}
+
+/* One encoder call: the instruction encode_inst() dispatches to. */
+typedef struct {
+    const char* name;
+    char* args[3];
+    int num_args;
+} EncoderCase;
+
+static const EncoderCase ENCODER_CASES[] = {
+    { "encode_rtype (addu)", { "$t0", "$t1", "$t2" }, 3 },
+    { "encode_shift (sll)", { "$t0", "$t1", "31" }, 3 },
+    { "encode_jr (jr)", { "$ra" }, 1 },
+    { "encode_addiu (addiu)", { "$t0", "$t1", "-100" }, 3 },
+    { "encode_ori (ori)", { "$t0", "$t1", "0xffff" }, 3 },
+    { "encode_lui (lui)", { "$t0", "0x1234" }, 2 },
+    { "encode_mem (lw)", { "$t0", "16($sp)" }, 2 },
+    { "encode_branch (beq)", { "$t0", "$t1", "target" }, 3 },
+    { "encode_jump (jal)", { "target" }, 1 },
+};
+
+typedef struct {
+    const EncoderCase* c;
+    SymbolTable* symtbl;
+    SymbolTable* reltbl;
+} EncoderBench;
+
+/* Encodes the case of B into WORD; returns what the encoder returns. */
+static inline int encode_case(EncoderBench* b, uint32_t* word) {
+    const EncoderCase* c = b->c;
+    char** args = (char**) c->args;
+
+    switch (c->name[7]) {       // the letter after "encode_"
+    case 'r': return encode_rtype(0x21, word, args, c->num_args);
+    case 's': return encode_shift(0x00, word, args, c->num_args);
+    case 'j':
+        if (c->name[8] == 'r') {
+            return encode_jr(0x08, word, args, c->num_args);
+        }
+        return encode_jump(0x03, word, args, c->num_args, 0x400, b->reltbl);
+    case 'a': return encode_addiu(0x09, word, args, c->num_args);
+    case 'o': return encode_ori(0x0d, word, args, c->num_args);
+    case 'l': return encode_lui(0x0f, word, args, c->num_args);
+    case 'm': return encode_mem(0x23, word, args, c->num_args);
+    default:  return encode_branch(0x04, word, args, c->num_args, 0x400, b->symtbl);
+    }
+}
+
+static uint64_t bench_encoder(void* ctx, uint64_t iters) {
+    uint32_t word = 0, acc = 0;
+    for (uint64_t i = 0; i < iters; i++) {
+        encode_case(ctx, &word);
+        acc += word;
+    }
+    sink = acc;
+    return iters;
+}
+
+typedef struct {
+    char** names;
+    uint32_t size;
+    SymbolTable* table;          // filled with the first SIZE names
+} TableBench;
+
+static uint64_t bench_add_to_table(void* ctx, uint64_t iters) {
+    TableBench* b = ctx;
+    for (uint64_t i = 0; i < iters; i++) {
+        SymbolTable* table = create_table(SYMTBL_UNIQUE_NAME);
+        for (uint32_t j = 0; j < b->size; j++) {
+            add_to_table(table, b->names[j], 4 * j);
+        }
+        free_table(table);
+    }
+    return iters * b->size;
+}
+
+static uint64_t bench_get_addr_for_symbol(void* ctx, uint64_t iters) {
+    TableBench* b = ctx;
+    uint64_t acc = 0;
+    for (uint64_t i = 0; i < iters; i++) {
+        // spread over the table: step by a prime
+        acc += get_addr_for_symbol(b->table, b->names[(i * 7919) % b->size]);
+    }
+    sink = acc;
+    return iters;
+}
+
+typedef struct {
+    const char* name;
+    char* args[3];
+    int num_args;
+    FILE* output;
+} PassOneBench;
+
+static uint64_t bench_write_pass_one(void* ctx, uint64_t iters) {
+    PassOneBench* b = ctx;
+    uint64_t acc = 0;
+    for (uint64_t i = 0; i < iters; i++) {
+        acc += write_pass_one(b->output, b->name, b->args, b->num_args);
+    }
+    sink = acc;
+    return iters;
+}
+
+static uint64_t bench_write_inst_hex(void* ctx, uint64_t iters) {
+    FILE* output = ctx;
+    for (uint64_t i = 0; i < iters; i++) {
+        write_inst_hex(output, (uint32_t) i * 0x9e3779b9u);
+    }
+    return iters;
+}
+
+/*******************************
+ * Baseline
+ *******************************/
+
+static int write_baseline(const char* filename, const BenchResult* results, int n) {
+    FILE* f = fopen(filename, "w");
+    if (!f) {
+        return -1;
+    }
+    fprintf(f, "{\n");
+    for (int i = 0; i < n; i++) {
+        fprintf(f, "  \"%s\": {\"median_ns\": %.3f, \"p99_ns\": %.3f, "
+            "\"ops_per_sec\": %.0f, \"relative\": %.4f}%s\n", results[i].name,
+            results[i].median_ns, results[i].p99_ns, results[i].ops_per_sec,
+            results[i].relative, i + 1 < n ? "," : "");
+    }
+    fprintf(f, "}\n");
+    return fclose(f);
+}
+
+/* Reads the relative medians of a baseline written by write_baseline().
+   Returns the number of entries, or -1 if the file cannot be opened. */
+static int read_baseline(const char* filename, BenchResult* results, int max) {
+    char line[256];
+    int n = 0;
+
+    FILE* f = fopen(filename, "r");
+    if (!f) {
+        return -1;
+    }
+    while (n < max && fgets(line, sizeof(line), f)) {
+        char* relative = strstr(line, "\"relative\": ");
+        if (relative && sscanf(line, " \"%63[^\"]\"", results[n].name) == 1
+            && sscanf(relative, "\"relative\": %lf", &results[n].relative) == 1) {
+            n++;
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+static const BenchResult* find_result(const BenchResult* results, int n,
+    const char* name) {
+    for (int i = 0; i < n; i++) {
+        if (strcmp(results[i].name, name) == 0) {
+            return &results[i];
+        }
+    }
+    return NULL;
+}
+
+/*******************************
+ * Driver
+ *******************************/
+
+int main(int argc, char** argv) {
+    const char* baseline = DEFAULT_BASELINE;
+    const char* filter = NULL;
+    double threshold = DEFAULT_THRESHOLD;
+    int update = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-baseline") == 0 && i + 1 < argc) {
+            baseline = argv[++i];
+        } else if (strcmp(argv[i], "-threshold") == 0 && i + 1 < argc) {
+            threshold = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "-update") == 0) {
+            update = 1;
+        } else if (argv[i][0] != '-') {
+            filter = argv[i];
+        } else {
+            printf("Usage: microbench [-baseline <file>] [-threshold <percent>] "
+                "[-update] [<filter>]\n");
+            return 2;
+        }
+    }
+
+    BenchResult results[MAX_BENCHES];
+    int n = 0;
+    FILE* devnull = fopen("/dev/null", "w");
+    if (!devnull) {
+        perror("/dev/null");
+        return 2;
+    }
+    set_log_stream(devnull);     // keep diagnostics out of the report
+
+    BenchResult reference;
+#define BENCH(name, fn, ctx) \
+    if (!filter || strstr(name, filter)) { \
+        run_bench("reference", bench_reference, NULL, &reference); \
+        run_bench(name, fn, ctx, &results[n]); \
+        results[n].relative = results[n].median_ns / reference.median_ns; \
+        n++; \
+    }
+
+    BENCH("translate_reg", bench_translate_reg, NULL);
+    BENCH("translate_num", bench_translate_num, NULL);
+    BENCH("is_valid_label", bench_is_valid_label, NULL);
+
+    EncoderBench enc;
+    enc.symtbl = create_table(SYMTBL_UNIQUE_NAME);
+    enc.reltbl = create_table(SYMTBL_NON_UNIQUE);
+    add_to_table(enc.symtbl, "target", 0x200);
+    for (size_t i = 0; i < sizeof(ENCODER_CASES) / sizeof(ENCODER_CASES[0]); i++) {
+        uint32_t word;
+        enc.c = &ENCODER_CASES[i];
+        if (encode_case(&enc, &word) != 0) {   // time the success path only
+            printf("%s fails\n", enc.c->name);
+            return 2;
+        }
+        BENCH(enc.c->name, bench_encoder, &enc);
+    }
+    free_table(enc.symtbl);
+    free_table(enc.reltbl);
+
+    static const uint32_t SIZES[] = { 16, 256, 4096 };
+    char** names = malloc(4096 * sizeof(char*));
+    for (int i = 0; i < 4096; i++) {
+        char buf[32];
+        sprintf(buf, "label_%d", i);
+        names[i] = strdup(buf);
+    }
+    for (size_t s = 0; s < sizeof(SIZES) / sizeof(SIZES[0]); s++) {
+        TableBench tb = { names, SIZES[s], create_table(SYMTBL_UNIQUE_NAME) };
+        for (uint32_t i = 0; i < tb.size; i++) {
+            add_to_table(tb.table, names[i], 4 * i);
+        }
+        char name[64];
+        sprintf(name, "add_to_table/%u", tb.size);
+        BENCH(name, bench_add_to_table, &tb);
+        sprintf(name, "get_addr_for_symbol/%u", tb.size);
+        BENCH(name, bench_get_addr_for_symbol, &tb);
+        free_table(tb.table);
+    }
+    for (int i = 0; i < 4096; i++) {
+        free(names[i]);
+    }
+    free(names);
+
+    PassOneBench p1[] = {
+        { "li", { "$t0", "100" }, 2, devnull },
+        { "li", { "$t0", "0x12345678" }, 2, devnull },
+        { "blt", { "$t0", "$t1", "target" }, 3, devnull },
+        { "addu", { "$t0", "$t1", "$t2" }, 3, devnull },
+    };
+    const char* p1_names[] = {
+        "write_pass_one (li, 1 word)", "write_pass_one (li, 2 words)",
+        "write_pass_one (blt)", "write_pass_one (addu)"
+    };
+    for (int i = 0; i < 4; i++) {
+        if (write_pass_one(devnull, p1[i].name, p1[i].args, p1[i].num_args) == 0) {
+            printf("%s fails\n", p1_names[i]);
+            return 2;
+        }
+        BENCH(p1_names[i], bench_write_pass_one, &p1[i]);
+    }
+
+    BENCH("write_inst_hex", bench_write_inst_hex, devnull);
+#undef BENCH
+
+    set_log_stream(NULL);
+    fclose(devnull);
+
+    /* Report and compare. */
+    BenchResult base[MAX_BENCHES];
+    int num_base = update ? -1 : read_baseline(baseline, base, MAX_BENCHES);
+    int regressions = 0;
+
+    printf("%-32s %12s %12s %14s %10s\n", "benchmark", "median ns", "p99 ns",
+        "ops/s", "vs base");
+    for (int i = 0; i < n; i++) {
+        const BenchResult* r = &results[i];
+        const BenchResult* b = num_base > 0 ? find_result(base, num_base, r->name) : NULL;
+        char change[32] = "";
+        if (b && b->relative > 0) {
+            double pct = (r->relative / b->relative - 1) * 100;
+            int regressed = pct > threshold;
+            regressions += regressed;
+            snprintf(change, sizeof(change), "%+.1f%%%s", pct, regressed ? " !" : "");
+        }
+        printf("%-32s %12.2f %12.2f %14.0f %10s\n", r->name, r->median_ns,
+            r->p99_ns, r->ops_per_sec, change);
+    }
+
+    if (num_base < 0) {
+        if (filter) {
+            printf("Not writing a partial baseline; run without a filter.\n");
+        } else if (write_baseline(baseline, results, n) != 0) {
+            perror(baseline);
+            return 2;
+        } else {
+            printf("Baseline written to %s\n", baseline);
+        }
+        return 0;
+    }
+    if (regressions) {
+        printf("%d benchmark(s) regressed more than %.0f%% against %s\n",
+            regressions, threshold, baseline);
+        return 1;
+    }
+    printf("No regressions beyond %.0f%% against %s\n", threshold, baseline);
+    return 0;
+}
@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "src/utils.h"
+#include "src/tables.h"
+#include "src/memstats.h"
+#include "src/probes.h"
+#include "src/translate_utils.h"
+#include "src/translate.h"
+#include "src/source_map.h"
+#include "src/data.h"
+#include "assembler.h"
+#include "pipeline.h"
+
+/* Pass two as a pipeline of four stages, each on its own thread:
+
+     reader  -- fgets() lines of the intermediate file into a batch
+     lexer   -- tokenizes the batch's lines in place
+     encoder -- encodes the tokens into instruction words
+     writer  -- writes the words to the output file
+
+   A batch moves from stage to stage through bounded single-producer/
+   single-consumer rings, so reading and writing overlap with encoding.
+   The encoder runs on the calling thread, so diagnostics go to the
+   caller's log.
+ */
+
+#define RING_SIZE 8              // batches in flight between two stages
+#define BATCH_LINES 512
+#define BATCH_BYTES (64 * 1024)
+#define LINE_SIZE 1024           // BUF_SIZE of assembler.c
+#define LINE_ARGS 3              // MAX_ARGS of assembler.c
+
+static const char* IGNORE = " \f\n\r\t\v,";
+
+typedef struct {
+    char* name;                  // NULL for a line without tokens
+    char* args[LINE_ARGS];
+    int num_args;
+    char* extra;                 // first argument past LINE_ARGS, or NULL
+} TokenLine;
+
+/* The unit passed between stages. Each stage fills in its part. */
+typedef struct {
+    char text[BATCH_BYTES];                  // reader: the lines
+    uint32_t offsets[BATCH_LINES];
+    int num_lines;
+    TokenLine tokens[BATCH_LINES];           // lexer: tokens into TEXT
+    uint32_t words[BATCH_LINES];             // encoder: instructions
+    int num_words;
+} Batch;
+
+/* Bounded single-producer/single-consumer ring. TAIL is only written by
+   the producer and HEAD only by the consumer. A stage that has to wait
+   spins with sched_yield() and adds the wait to the ring's stall time. */
+typedef struct {
+    Batch* slots[RING_SIZE];
+    size_t head;
+    size_t tail;
+    uint64_t full_ns;            // producer waited for space
+    uint64_t empty_ns;           // consumer waited for a batch
+} Ring;
+
+typedef struct {
+    FILE* input;
+    FILE* output;
+    Ring read_ring;              // reader -> lexer
+    Ring lex_ring;               // lexer -> encoder
+    Ring write_ring;             // encoder -> writer
+} Pipeline;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Pushes BATCH (NULL marks the end of the stream). */
+static void ring_push(Ring* ring, Batch* batch) {
+    size_t tail = ring->tail;
+
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == RING_SIZE) {
+        uint64_t start = now_ns();
+        while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == RING_SIZE) {
+            sched_yield();
+        }
+        ring->full_ns += now_ns() - start;
+    }
+    ring->slots[tail % RING_SIZE] = batch;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static Batch* ring_pop(Ring* ring) {
+    size_t head = ring->head;
+
+    if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head) {
+        uint64_t start = now_ns();
+        while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head) {
+            sched_yield();
+        }
+        ring->empty_ns += now_ns() - start;
+    }
+    Batch* batch = ring->slots[head % RING_SIZE];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return batch;
+}
+
+/*******************************
+ * Stages
+ *******************************/
+
+static void* reader_stage(void* arg) {
+    Pipeline* p = arg;
+    Batch* batch = NULL;
+
+    for (;;) {
+        if (!batch) {
+            batch = malloc(sizeof(Batch));
+            if (!batch) {
+                allocation_failed();
+            }
+            MEM_ALLOC(MEM_LINES, sizeof(Batch));
+            batch->num_lines = 0;
+        }
+
+        size_t used = batch->num_lines
+            ? batch->offsets[batch->num_lines - 1]
+              + strlen(batch->text + batch->offsets[batch->num_lines - 1]) + 1
+            : 0;
+        if (batch->num_lines == BATCH_LINES || used + LINE_SIZE > BATCH_BYTES) {
+            ring_push(&p->read_ring, batch);
+            batch = NULL;
+            continue;
+        }
+
+        if (!fgets(batch->text + used, LINE_SIZE, p->input)
+            || is_data_trailer(batch->text + used)) {
+            break;
+        }
+        batch->offsets[batch->num_lines++] = used;
+    }
+
+    if (batch && batch->num_lines > 0) {
+        ring_push(&p->read_ring, batch);
+    } else if (batch) {
+        MEM_FREE(MEM_LINES, sizeof(Batch));
+        free(batch);
+    }
+    ring_push(&p->read_ring, NULL);
+    return NULL;
+}
+
+static void* lexer_stage(void* arg) {
+    Pipeline* p = arg;
+    Batch* batch;
+
+    while ((batch = ring_pop(&p->read_ring)) != NULL) {
+        for (int i = 0; i < batch->num_lines; i++) {
+            TokenLine* line = &batch->tokens[i];
+            char* save;
+
+            line->name = strtok_r(batch->text + batch->offsets[i], IGNORE, &save);
+            line->num_args = 0;
+            line->extra = NULL;
+            if (!line->name) continue;
+
+            char* pch = strtok_r(NULL, IGNORE, &save);
+            while (pch != NULL && line->num_args < LINE_ARGS) {
+                line->args[line->num_args++] = pch;
+                pch = strtok_r(NULL, IGNORE, &save);
+            }
+            line->extra = pch;
+        }
+        ring_push(&p->lex_ring, batch);
+    }
+    ring_push(&p->lex_ring, NULL);
+    return NULL;
+}
+
+static void* writer_stage(void* arg) {
+    Pipeline* p = arg;
+    Batch* batch;
+
+    while ((batch = ring_pop(&p->write_ring)) != NULL) {
+        for (int i = 0; i < batch->num_words; i++) {
+            write_inst_hex(p->output, batch->words[i]);
+        }
+        MEM_FREE(MEM_LINES, sizeof(Batch));
+        free(batch);
+    }
+    return NULL;
+}
+
+/* Encoder stage, run on the calling thread. Mirrors the loop of
+   run_pass_two(). */
+static int encoder_stage(Pipeline* p, SymbolTable* symtbl, SymbolTable* reltbl,
+    const AsmOptions* opts, PassState* state) {
+
+    int err = 0;
+    uint32_t line_no = state->line_no;
+    uint32_t addr = state->addr;
+    SourceMapCursor cursor;
+    uint32_t src_line = 0, src_column = 0;
+    const char* src_path = NULL;
+    const char* prefix = set_log_prefix(NULL);
+    Batch* batch;
+
+    PROBE2(pass_two_start, line_no, addr);
+    source_map_begin(&cursor, state->srcmap);
+
+    while ((batch = ring_pop(&p->lex_ring)) != NULL) {
+        batch->num_words = 0;
+
+        for (int i = 0; i < batch->num_lines; i++) {
+            TokenLine* line = &batch->tokens[i];
+            uint32_t* word = &batch->words[batch->num_words];
+
+            line_no++;
+            if (source_map_next(&cursor, &src_line, &src_column) != 0) {
+                src_line = line_no;
+            }
+            src_path = source_map_path(state->srcmap, cursor.file);
+            set_log_prefix(src_path ? src_path : prefix);
+
+            if (line->extra) {
+                write_to_log("Error - extra argument at line %d: %s\n", src_line,
+                    line->extra);
+                err = -1;
+                continue;
+            }
+
+            int res = -1;
+            if (line->name) {
+                res = opts->trusted
+                    ? encode_inst_trusted(word, line->name, line->args,
+                        line->num_args, addr, symtbl, reltbl)
+                    : encode_inst(word, line->name, line->args,
+                        line->num_args, addr, symtbl, reltbl);
+            }
+
+            if (res == -1) {
+                write_to_log("Error - invalid instruction at line %d: ", src_line);
+                log_inst(line->name ? line->name : "", line->args, line->num_args);
+                err = -1;
+            } else {
+                batch->num_words++;
+                addr += 4;
+                if (state->linemap) {
+                    source_map_add_in(state->linemap,
+                        src_path ? source_map_file(state->linemap, src_path) : 0,
+                        src_line, src_column);
+                }
+            }
+        }
+        ring_push(&p->write_ring, batch);
+    }
+    ring_push(&p->write_ring, NULL);
+
+    set_log_prefix(prefix);
+    state->line_no = line_no;
+    state->addr = addr;
+    PROBE3(pass_two_end, line_no, addr, err);
+    return err;
+}
+
+static void write_stall_report(Pipeline* p) {
+    printf("Pipeline stalls (ms waiting for input / for space in output):\n");
+    printf("  reader    -      / %.1f\n", p->read_ring.full_ns / 1e6);
+    printf("  lexer   %6.1f / %.1f\n", p->read_ring.empty_ns / 1e6,
+        p->lex_ring.full_ns / 1e6);
+    printf("  encoder %6.1f / %.1f\n", p->lex_ring.empty_ns / 1e6,
+        p->write_ring.full_ns / 1e6);
+    printf("  writer  %6.1f / -\n", p->write_ring.empty_ns / 1e6);
+}
+
+/*******************************
+ * Pipelined Pass Two
+ *******************************/
+
+/* Same as run_pass_two(), with reading, tokenizing, encoding and writing
+   overlapped on separate threads. Unless OPTS->quiet is set, the time each
+   stage stalled on its neighbours is printed afterwards. Falls back to
+   run_pass_two() if the threads cannot be started.
+ */
+int run_pass_two_pipelined(FILE* input, FILE* output, SymbolTable* symtbl,
+    SymbolTable* reltbl, const AsmOptions* opts, PassState* state) {
+
+    Pipeline* p = calloc(1, sizeof(Pipeline));
+    if (!p) {
+        allocation_failed();
+    }
+    p->input = input;
+    p->output = output;
+
+    pthread_t reader, lexer, writer;
+    if (pthread_create(&writer, NULL, writer_stage, p) != 0) {
+        free(p);
+        return run_pass_two(input, output, symtbl, reltbl, opts, state);
+    }
+    if (pthread_create(&lexer, NULL, lexer_stage, p) != 0) {
+        ring_push(&p->write_ring, NULL);
+        pthread_join(writer, NULL);
+        free(p);
+        return run_pass_two(input, output, symtbl, reltbl, opts, state);
+    }
+    if (pthread_create(&reader, NULL, reader_stage, p) != 0) {
+        ring_push(&p->read_ring, NULL);
+        pthread_join(lexer, NULL);
+        ring_pop(&p->lex_ring);
+        ring_push(&p->write_ring, NULL);
+        pthread_join(writer, NULL);
+        free(p);
+        return run_pass_two(input, output, symtbl, reltbl, opts, state);
+    }
+
+    int err = encoder_stage(p, symtbl, reltbl, opts, state);
+
+    pthread_join(reader, NULL);
+    pthread_join(lexer, NULL);
+    pthread_join(writer, NULL);
+
+    if (!opts->quiet) {
+        write_stall_report(p);
+    }
+    free(p);
+    return err;
+}
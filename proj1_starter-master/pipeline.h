@@ -0,0 +1,7 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+int run_pass_two_pipelined(FILE* input, FILE* output, SymbolTable* symtbl,
+    SymbolTable* reltbl, const AsmOptions* opts, PassState* state);
+
+#endif
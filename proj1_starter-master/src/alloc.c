@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "alloc.h"
+
+/*******************************
+ * System Allocator
+ *******************************/
+
+static void* system_alloc(Allocator* a, size_t size) {
+    return malloc(size);
+}
+
+static void* system_resize(Allocator* a, void* ptr, size_t old_size, size_t size) {
+    return realloc(ptr, size);
+}
+
+static void system_release(Allocator* a, void* ptr) {
+    free(ptr);
+}
+
+static void system_reset(Allocator* a) {
+}
+
+Allocator system_allocator = {
+    system_alloc, system_resize, system_release, system_reset
+};
+
+/*******************************
+ * Arena Allocator
+ *******************************/
+
+#define ARENA_ALIGN 16
+
+/* A mapping the arena carves allocations from; the header sits at its
+   start and DATA follows it. */
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t mapped;           // bytes mapped, header included
+    size_t size;             // bytes of data
+    size_t used;
+    char* data;
+} ArenaChunk;
+
+/* CHUNKS are used in list order; after a reset allocation starts over at
+   the first. LAST is the most recent allocation, which can be resized in
+   place. */
+typedef struct {
+    Allocator base;
+    size_t chunk_size;
+    int huge_pages;
+    ArenaChunk* chunks;
+    ArenaChunk* current;
+    char* last;
+    size_t reserved;
+    size_t used;
+} Arena;
+
+static size_t round_up(size_t n, size_t to) {
+    return (n + to - 1) / to * to;
+}
+
+/* Maps a chunk with room for at least SIZE bytes of data. Huge pages are
+   requested outright if the system has them reserved, or else suggested
+   for the regular mapping. */
+static ArenaChunk* map_chunk(Arena* arena, size_t size) {
+    size_t header = round_up(sizeof(ArenaChunk), ARENA_ALIGN);
+    size_t len = header + size;
+    if (len < arena->chunk_size) {
+        len = arena->chunk_size;
+    }
+    void* map = MAP_FAILED;
+
+    if (arena->huge_pages) {
+        len = round_up(len, HUGE_PAGE_SIZE);
+#ifdef MAP_HUGETLB
+        map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    } else {
+        len = round_up(len, (size_t) sysconf(_SC_PAGESIZE));
+    }
+    if (map == MAP_FAILED) {
+        map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        if (arena->huge_pages) {
+            madvise(map, len, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    ArenaChunk* chunk = map;
+    chunk->next = NULL;
+    chunk->mapped = len;
+    chunk->size = len - header;
+    chunk->used = 0;
+    chunk->data = (char*) map + header;
+    arena->reserved += len;
+    return chunk;
+}
+
+static void* arena_alloc(Allocator* a, size_t size) {
+    Arena* arena = (Arena*) a;
+    ArenaChunk* chunk = arena->current;
+    size = round_up(size ? size : 1, ARENA_ALIGN);
+
+    if (!chunk || chunk->used + size > chunk->size) {
+        ArenaChunk* next = chunk ? chunk->next : arena->chunks;
+        if (next && next->used + size <= next->size) {
+            chunk = next;
+        } else {
+            /* Too big for the chunk kept from an earlier run, if any: map
+               a new one and reuse the kept one after it. */
+            ArenaChunk* fresh = map_chunk(arena, size);
+            if (!fresh) {
+                return NULL;
+            }
+            fresh->next = next;
+            if (chunk) {
+                chunk->next = fresh;
+            } else {
+                arena->chunks = fresh;
+            }
+            chunk = fresh;
+        }
+        arena->current = chunk;
+    }
+
+    char* p = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->used += size;
+    arena->last = p;
+    return p;
+}
+
+static void* arena_resize(Allocator* a, void* ptr, size_t old_size, size_t size) {
+    Arena* arena = (Arena*) a;
+    if (!ptr) {
+        return arena_alloc(a, size);
+    }
+
+    ArenaChunk* chunk = arena->current;
+    if (ptr == arena->last) {
+        size_t start = (char*) ptr - chunk->data;
+        size_t end = start + round_up(size ? size : 1, ARENA_ALIGN);
+        if (end <= chunk->size) {
+            arena->used += end - chunk->used;
+            chunk->used = end;
+            return ptr;
+        }
+    }
+    if (size <= old_size) {
+        return ptr;
+    }
+
+    void* p = arena_alloc(a, size);
+    if (p) {
+        memcpy(p, ptr, old_size);
+    }
+    return p;
+}
+
+static void arena_release(Allocator* a, void* ptr) {
+}
+
+static void arena_reset(Allocator* a) {
+    Arena* arena = (Arena*) a;
+    for (ArenaChunk* chunk = arena->chunks; chunk; chunk = chunk->next) {
+        chunk->used = 0;
+    }
+    arena->current = arena->chunks;
+    arena->last = NULL;
+    arena->used = 0;
+}
+
+Allocator* create_arena(size_t chunk_size, int huge_pages) {
+    Arena* arena = calloc(1, sizeof(Arena));
+    if (!arena) {
+        return NULL;
+    }
+    arena->base.alloc = arena_alloc;
+    arena->base.resize = arena_resize;
+    arena->base.release = arena_release;
+    arena->base.reset = arena_reset;
+    arena->chunk_size = chunk_size ? chunk_size : ARENA_CHUNK_SIZE;
+    arena->huge_pages = huge_pages;
+    return &arena->base;
+}
+
+void free_arena(Allocator* a) {
+    Arena* arena = (Arena*) a;
+    if (!arena) {
+        return;
+    }
+    ArenaChunk* chunk = arena->chunks;
+    while (chunk) {
+        ArenaChunk* next = chunk->next;
+        munmap(chunk, chunk->mapped);
+        chunk = next;
+    }
+    free(arena);
+}
+
+size_t arena_reserved(const Allocator* a) {
+    return ((const Arena*) a)->reserved;
+}
+
+size_t arena_used(const Allocator* a) {
+    return ((const Arena*) a)->used;
+}
+
+/*******************************
+ * Allocation Helpers
+ *******************************/
+
+void* alloc_mem(Allocator* a, size_t size) {
+    return a ? a->alloc(a, size) : malloc(size);
+}
+
+void* resize_mem(Allocator* a, void* ptr, size_t old_size, size_t size) {
+    return a ? a->resize(a, ptr, old_size, size) : realloc(ptr, size);
+}
+
+void free_mem(Allocator* a, void* ptr) {
+    if (a) {
+        a->release(a, ptr);
+    } else {
+        free(ptr);
+    }
+}
+
+char* alloc_strdup(Allocator* a, const char* s) {
+    size_t len = strlen(s) + 1;
+    char* d = alloc_mem(a, len);
+    if (d) {
+        memcpy(d, s, len);
+    }
+    return d;
+}
+
+void reset_allocator(Allocator* a) {
+    if (a) {
+        a->reset(a);
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+
+/* Where the tables and operand strings of an assembly run get their memory.
+   The system allocator forwards to malloc() and friends. An arena hands out
+   pieces of large chunks and frees nothing until it is reset, which returns
+   everything allocated since in one step; the chunks are kept for the next
+   run. An arena is not thread-safe: give every thread its own.
+
+   Functions taking an Allocator* accept NULL for the system allocator.
+ */
+
+typedef struct Allocator {
+    void* (*alloc)(struct Allocator* a, size_t size);
+    /* Grows or shrinks PTR, which has OLD_SIZE bytes, to SIZE bytes. */
+    void* (*resize)(struct Allocator* a, void* ptr, size_t old_size, size_t size);
+    void (*release)(struct Allocator* a, void* ptr);
+    void (*reset)(struct Allocator* a);
+} Allocator;
+
+extern Allocator system_allocator;
+
+#define ARENA_CHUNK_SIZE (1 << 20)
+#define HUGE_PAGE_SIZE (2 << 20)
+
+/* Creates an arena that maps chunks of CHUNK_SIZE bytes (ARENA_CHUNK_SIZE if
+   0). With HUGE_PAGES set, chunks are rounded up to whole huge pages and
+   backed by them where the system allows it. */
+Allocator* create_arena(size_t chunk_size, int huge_pages);
+
+void free_arena(Allocator* arena);
+
+/* Bytes of chunks the arena holds and bytes handed out since its last reset. */
+size_t arena_reserved(const Allocator* arena);
+
+size_t arena_used(const Allocator* arena);
+
+/* Allocation returns NULL on failure, like malloc(). */
+void* alloc_mem(Allocator* a, size_t size);
+
+void* resize_mem(Allocator* a, void* ptr, size_t old_size, size_t size);
+
+void free_mem(Allocator* a, void* ptr);
+
+char* alloc_strdup(Allocator* a, const char* s);
+
+void reset_allocator(Allocator* a);
+
+#endif
@@ -0,0 +1,626 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "utils.h"
+#include "tables.h"
+#include "translate_utils.h"
+#include "memstats.h"
+#include "source_cache.h"
+#include "data.h"
+
+static const char* DELIMS = " \f\n\r\t\v,";
+
+/* Lines written per fwrite() of a section body. */
+#define WRITE_LINES 1024
+
+/* Longest line of a section body, an .incbin with its path, and the
+   longest path. */
+#define PATH_LINE_SIZE 4200
+#define INCBIN_PATH_SIZE 4096
+
+DataSection* create_data_section() {
+    DataSection* data = calloc(1, sizeof(DataSection));
+    if (!data) {
+        allocation_failed();
+    }
+    MEM_ALLOC(MEM_DATA, sizeof(DataSection));
+    return data;
+}
+
+void free_data_section(DataSection* data) {
+    if (!data) {
+        return;
+    }
+    size_t bytes = sizeof(DataSection) + data->segment_cap * sizeof(DataSegment)
+        + data->label_cap * sizeof(DataLabel);
+    for (uint32_t i = 0; i < data->num_segments; i++) {
+        bytes += data->segments[i].cap;
+        if (data->segments[i].kind == DATA_BYTES) {
+            free(data->segments[i].bytes);
+        }
+    }
+    for (uint32_t i = 0; i < data->num_labels; i++) {
+        MEM_FREE(MEM_STRINGS, strlen(data->labels[i].name) + 1);
+        free(data->labels[i].name);
+    }
+    for (uint32_t i = 0; i < data->num_files; i++) {
+        MEM_FREE(MEM_STRINGS, strlen(data->files[i].path) + 1);
+        free(data->files[i].path);
+        if (data->files[i].map) {
+            munmap(data->files[i].map, data->files[i].len);
+        }
+    }
+    bytes += data->file_cap * sizeof(DataFile);
+    MEM_FREE(MEM_DATA, bytes);
+    free(data->segments);
+    free(data->labels);
+    free(data->files);
+    free(data);
+}
+
+uint32_t data_address(const DataSection* data) {
+    return DATA_BASE + data->size;
+}
+
+static DataSegment* add_segment(DataSection* data, DataKind kind) {
+    if (data->num_segments == data->segment_cap) {
+        uint32_t old_cap = data->segment_cap;
+        data->segment_cap = data->segment_cap ? data->segment_cap * 2 : 16;
+        data->segments = realloc(data->segments,
+            data->segment_cap * sizeof(DataSegment));
+        if (!data->segments) {
+            allocation_failed();
+        }
+        MEM_RESIZE(MEM_DATA, old_cap * sizeof(DataSegment),
+            data->segment_cap * sizeof(DataSegment));
+    }
+    DataSegment* seg = &data->segments[data->num_segments++];
+    memset(seg, 0, sizeof(DataSegment));
+    seg->kind = kind;
+    seg->offset = data->size;
+    return seg;
+}
+
+static DataSegment* last_segment(DataSection* data) {
+    return data->num_segments ? &data->segments[data->num_segments - 1] : NULL;
+}
+
+int add_data_bytes(DataSection* data, const uint8_t* bytes, uint32_t n) {
+    if (n == 0) {
+        return 0;
+    }
+    if (n > DATA_MAX_SIZE - data->size) {
+        write_to_log("Error - .data larger than %u bytes\n", DATA_MAX_SIZE);
+        return -1;
+    }
+    DataSegment* seg = last_segment(data);
+    if (!seg || seg->kind != DATA_BYTES) {
+        seg = add_segment(data, DATA_BYTES);
+    }
+    if (seg->size + n > seg->cap) {
+        uint32_t old_cap = seg->cap;
+        while (seg->size + n > seg->cap) {
+            seg->cap = seg->cap ? seg->cap * 2 : 256;
+        }
+        seg->bytes = realloc(seg->bytes, seg->cap);
+        if (!seg->bytes) {
+            allocation_failed();
+        }
+        MEM_RESIZE(MEM_DATA, old_cap, seg->cap);
+    }
+    if (bytes) {
+        memcpy(seg->bytes + seg->size, bytes, n);
+    } else {
+        memset(seg->bytes + seg->size, 0, n);
+    }
+    seg->size += n;
+    data->size += n;
+    return 0;
+}
+
+int add_data_space(DataSection* data, uint32_t n) {
+    if (n < SPARSE_SPACE_MIN) {
+        return add_data_bytes(data, NULL, n);
+    }
+    if (n > DATA_MAX_SIZE - data->size) {
+        write_to_log("Error - .data larger than %u bytes\n", DATA_MAX_SIZE);
+        return -1;
+    }
+    /* Zero runs are whole words, so the bytes around them stay aligned. */
+    uint32_t pad = (4 - data->size % 4) % 4;
+    add_data_bytes(data, NULL, pad);
+    n -= pad;
+
+    DataSegment* seg = last_segment(data);
+    if (!seg || seg->kind != DATA_ZEROS) {
+        seg = add_segment(data, DATA_ZEROS);
+    }
+    seg->size += n & ~3u;
+    data->size += n & ~3u;
+    return add_data_bytes(data, NULL, n & 3);
+}
+
+static void align_data(DataSection* data, uint32_t alignment) {
+    uint32_t pad = (alignment - data->size % alignment) % alignment;
+    if (pad) {
+        add_data_space(data, pad);
+    }
+}
+
+void align_for_directive(DataSection* data, const char* directive) {
+    if (strcmp(directive, ".word") == 0) {
+        align_data(data, 4);
+    } else if (strcmp(directive, ".half") == 0) {
+        align_data(data, 2);
+    }
+}
+
+void add_pending_label(DataSection* data, uint32_t symbol) {
+    if (data->num_pending == 0 || symbol != data->first_pending + data->num_pending) {
+        data->first_pending = symbol;
+        data->num_pending = 0;
+    }
+    data->num_pending++;
+}
+
+void place_pending_labels(DataSection* data, SymbolTable* symtbl,
+    const char* directive) {
+    align_for_directive(data, directive);
+    for (uint32_t i = 0; i < data->num_pending; i++) {
+        symtbl->tbl[data->first_pending + i].addr = data_address(data);
+    }
+    data->num_pending = 0;
+}
+
+/* Maps PATH, or finds it mapped by an earlier .incbin. Returns its index in
+   DATA->files, or -1 after logging an error. */
+static int map_file(DataSection* data, const char* path) {
+    for (uint32_t i = 0; i < data->num_files; i++) {
+        if (strcmp(data->files[i].path, path) == 0) {
+            return i;
+        }
+    }
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        write_to_log("Error: unable to open included file: %s\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    uint8_t* map = NULL;
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            write_to_log("Error: unable to map included file: %s\n", path);
+            close(fd);
+            return -1;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    if (data->num_files == data->file_cap) {
+        uint32_t old_cap = data->file_cap;
+        data->file_cap = data->file_cap ? data->file_cap * 2 : 4;
+        data->files = realloc(data->files, data->file_cap * sizeof(DataFile));
+        if (!data->files) {
+            allocation_failed();
+        }
+        MEM_RESIZE(MEM_DATA, old_cap * sizeof(DataFile),
+            data->file_cap * sizeof(DataFile));
+    }
+    DataFile* file = &data->files[data->num_files];
+    file->path = strdup(path);
+    file->map = map;
+    file->len = st.st_size;
+    return data->num_files++;
+}
+
+int add_data_file(DataSection* data, const char* path, uint64_t offset,
+    int64_t length) {
+    int index = map_file(data, path);
+    if (index < 0) {
+        return -1;
+    }
+    const DataFile* file = &data->files[index];
+    if (offset > file->len || length > (int64_t) (file->len - offset)) {
+        write_to_log("Error - .incbin past the end of %s (%lu bytes)\n", path,
+            (unsigned long) file->len);
+        return -1;
+    }
+    uint64_t len = length < 0 ? file->len - offset : (uint64_t) length;
+    if (len > DATA_MAX_SIZE - data->size) {
+        write_to_log("Error - .data larger than %u bytes\n", DATA_MAX_SIZE);
+        return -1;
+    }
+    uint32_t n = (uint32_t) len;
+    const uint8_t* bytes = file->map + offset;
+    if (n < SPARSE_SPACE_MIN) {
+        return add_data_bytes(data, bytes, n);
+    }
+
+    /* Copy up to the first word boundary, map the whole words after it and
+       copy the rest, so the segments around the mapping stay aligned. */
+    uint32_t head = (4 - data->size % 4) % 4;
+    if (head > n) {
+        head = n;
+    }
+    add_data_bytes(data, bytes, head);
+    uint32_t words = (n - head) & ~3u;
+    if (words > 0) {
+        DataSegment* seg = add_segment(data, DATA_FILE);
+        seg->bytes = (uint8_t*) bytes + head;
+        seg->size = words;
+        seg->file = index;
+        data->size += words;
+    }
+    return add_data_bytes(data, bytes + head + words, n - head - words);
+}
+
+static void add_label(DataSection* data, uint32_t line_no, const char* name) {
+    if (data->num_labels == data->label_cap) {
+        uint32_t old_cap = data->label_cap;
+        data->label_cap = data->label_cap ? data->label_cap * 2 : 16;
+        data->labels = realloc(data->labels, data->label_cap * sizeof(DataLabel));
+        if (!data->labels) {
+            allocation_failed();
+        }
+        MEM_RESIZE(MEM_DATA, old_cap * sizeof(DataLabel),
+            data->label_cap * sizeof(DataLabel));
+    }
+    DataLabel* label = &data->labels[data->num_labels++];
+    label->offset = data->size;
+    label->line_no = line_no;
+    label->name = strdup(name);
+}
+
+static void raise_operand_error(uint32_t line_no, const char* name,
+    const char* operand) {
+    write_to_log("Error - invalid %s operand at line %d: %s\n", name, line_no,
+        operand);
+}
+
+/* Skips leading delimiters of OPERANDS and cuts off trailing ones (the line
+   break, which should not show in diagnostics). */
+static char* trim_operands(char* operands) {
+    char* p = operands + strspn(operands, DELIMS);
+    char* end = p + strlen(p);
+    while (end > p && strchr(DELIMS, end[-1])) {
+        *--end = '\0';
+    }
+    return p;
+}
+
+/* Unescapes the string literal at *POS in place (the text shrinks, never
+   grows) and moves *POS past it. Returns the text, NUL-terminated and LEN
+   bytes long, or NULL after logging an error. */
+static char* parse_string(char** pos, size_t* len, uint32_t line_no,
+    const char* name) {
+    char* p = *pos;
+    if (*p != '"') {
+        raise_operand_error(line_no, name, p);
+        return NULL;
+    }
+    char* start = ++p;
+    char* out = start;
+    for (; *p && *p != '"'; p++) {
+        if (*p != '\\') {
+            *out++ = *p;
+            continue;
+        }
+        switch (*++p) {
+        case 'n': *out++ = '\n'; break;
+        case 't': *out++ = '\t'; break;
+        case 'r': *out++ = '\r'; break;
+        case '0': *out++ = '\0'; break;
+        case '\\': *out++ = '\\'; break;
+        case '"': *out++ = '"'; break;
+        default:
+            raise_operand_error(line_no, name, p - 1);
+            return NULL;
+        }
+    }
+    if (*p != '"') {
+        raise_operand_error(line_no, name, start - 1);
+        return NULL;
+    }
+    *out = '\0';
+    *len = out - start;
+    *pos = p + 1;
+    return start;
+}
+
+/* Parses the string literals of .ascii and .asciiz in OPERANDS. */
+static int add_strings(DataSection* data, uint32_t line_no, const char* name,
+    char* operands, int terminate) {
+    char* p = trim_operands(operands);
+    if (*p == '\0') {
+        raise_operand_error(line_no, name, "");
+        return -1;
+    }
+    while (*p) {
+        size_t len;
+        char* text = parse_string(&p, &len, line_no, name);
+        if (!text || add_data_bytes(data, (uint8_t*) text, len + terminate) != 0) {
+            return -1;
+        }
+        p += strspn(p, DELIMS);
+    }
+    return 0;
+}
+
+/* Parses the operands of .incbin: "path"[, offset, length]. The path is
+   taken from the directory of SOURCE. */
+static int add_incbin(DataSection* data, uint32_t line_no, const char* name,
+    char* operands, const char* source) {
+    char* p = trim_operands(operands);
+    size_t len;
+    char path[INCBIN_PATH_SIZE];
+    char* file = parse_string(&p, &len, line_no, name);
+    if (!file) {
+        return -1;
+    }
+    if (resolve_source_path(source, file, path, sizeof(path)) != 0) {
+        write_to_log("Error - invalid .incbin at line %d: %s\n", line_no, file);
+        return -1;
+    }
+    long int offset = 0, length = -1;
+    char* save;
+    char* arg = strtok_r(p, DELIMS, &save);
+    if (arg && translate_num(&offset, arg, 0, 0xffffffffL) != 0) {
+        raise_operand_error(line_no, name, arg);
+        return -1;
+    }
+    arg = arg ? strtok_r(NULL, DELIMS, &save) : NULL;
+    if (arg && translate_num(&length, arg, 0, DATA_MAX_SIZE) != 0) {
+        raise_operand_error(line_no, name, arg);
+        return -1;
+    }
+    arg = arg ? strtok_r(NULL, DELIMS, &save) : NULL;
+    if (arg) {
+        write_to_log("Error - extra argument at line %d: %s\n", line_no, arg);
+        return -1;
+    }
+    if (add_data_file(data, path, (uint64_t) offset, length) != 0) {
+        write_to_log("Error - invalid .incbin at line %d: %s\n", line_no, path);
+        return -1;
+    }
+    return 0;
+}
+
+int add_data_directive(DataSection* data, uint32_t line_no, const char* name,
+    char* operands, const char* source) {
+    long int lower, upper;
+    uint32_t width;
+
+    if (strcmp(name, ".ascii") == 0 || strcmp(name, ".asciiz") == 0) {
+        return add_strings(data, line_no, name, operands, name[6] == 'z');
+    } else if (strcmp(name, ".incbin") == 0) {
+        return add_incbin(data, line_no, name, operands, source);
+    } else if (strcmp(name, ".word") == 0) {
+        lower = -2147483648L, upper = 4294967295L, width = 4;
+    } else if (strcmp(name, ".half") == 0) {
+        lower = -32768, upper = 65535, width = 2;
+    } else if (strcmp(name, ".byte") == 0) {
+        lower = -128, upper = 255, width = 1;
+    } else if (strcmp(name, ".space") == 0 || strcmp(name, ".align") == 0) {
+        char* save;
+        char* arg = strtok_r(operands, DELIMS, &save);
+        long int n;
+        int space = name[1] == 's';
+        if (!arg || translate_num(&n, arg, 0, space ? DATA_MAX_SIZE : 16) != 0) {
+            raise_operand_error(line_no, name, arg ? arg : "");
+            return -1;
+        }
+        char* extra = strtok_r(NULL, DELIMS, &save);
+        if (extra) {
+            write_to_log("Error - extra argument at line %d: %s\n", line_no, extra);
+            return -1;
+        }
+        if (space) {
+            return add_data_space(data, (uint32_t) n);
+        }
+        align_data(data, 1u << n);
+        return 0;
+    } else {
+        write_to_log("Error - unknown directive at line %d: %s\n", line_no, name);
+        return -1;
+    }
+
+    /* .word, .half and .byte: a list of values, stored least significant
+       byte first. */
+    align_data(data, width);
+    int count = 0;
+    char* save;
+    for (char* arg = strtok_r(operands, DELIMS, &save); arg != NULL;
+        arg = strtok_r(NULL, DELIMS, &save), count++) {
+        long int value = 0;
+        if (translate_num(&value, arg, lower, upper) != 0) {
+            if (width != 4 || !is_valid_label(arg)) {
+                raise_operand_error(line_no, name, arg);
+                return -1;
+            }
+            add_label(data, line_no, arg);
+        }
+        uint8_t bytes[4] = { value, value >> 8, value >> 16, value >> 24 };
+        if (add_data_bytes(data, bytes, width) != 0) {
+            return -1;
+        }
+    }
+    if (count == 0) {
+        raise_operand_error(line_no, name, "");
+        return -1;
+    }
+    return 0;
+}
+
+/* Finds the byte segment holding OFFSET. */
+static DataSegment* find_segment(DataSection* data, uint32_t offset) {
+    uint32_t lo = 0, hi = data->num_segments;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (data->segments[mid].offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return &data->segments[lo];
+}
+
+int resolve_data_labels(DataSection* data, const SymbolTable* symtbl) {
+    int err = 0;
+    for (uint32_t i = 0; i < data->num_labels; i++) {
+        const DataLabel* label = &data->labels[i];
+        int64_t addr = get_addr_for_symbol((SymbolTable*) symtbl, label->name);
+        if (addr == -1) {
+            write_to_log("Error - undefined label at line %d: %s\n",
+                label->line_no, label->name);
+            err = -1;
+            continue;
+        }
+        /* A .word is never split: zero runs only start at a .space. */
+        DataSegment* seg = find_segment(data, label->offset);
+        uint8_t* p = seg->bytes + (label->offset - seg->offset);
+        p[0] = addr, p[1] = addr >> 8, p[2] = addr >> 16, p[3] = addr >> 24;
+    }
+    return err;
+}
+
+/* The two hex digits of each byte value. */
+static const char HEX_PAIRS[513] =
+    "000102030405060708090a0b0c0d0e0f"
+    "101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f"
+    "303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f"
+    "505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f"
+    "707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f"
+    "909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeaf"
+    "b0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecf"
+    "d0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+    "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+/* Formats WORD as write_inst_hex() does into the 9 bytes at P. */
+static void format_word(char* p, uint32_t word) {
+    memcpy(p, HEX_PAIRS + 2 * (word >> 24), 2);
+    memcpy(p + 2, HEX_PAIRS + 2 * ((word >> 16) & 0xff), 2);
+    memcpy(p + 4, HEX_PAIRS + 2 * ((word >> 8) & 0xff), 2);
+    memcpy(p + 6, HEX_PAIRS + 2 * (word & 0xff), 2);
+    p[8] = '\n';
+}
+
+/* Writes the N bytes at BYTES as lines of hex words, the last one padded
+   with zeros. */
+static int write_words(const uint8_t* bytes, uint32_t n, FILE* output) {
+    char buf[WRITE_LINES * 9];
+    size_t used = 0;
+
+    for (uint32_t i = 0; i < n; i += 4) {
+        uint32_t word = 0;
+        for (uint32_t j = 0; j < 4 && i + j < n; j++) {
+            word |= (uint32_t) bytes[i + j] << (8 * j);
+        }
+        format_word(buf + used, word);
+        used += 9;
+        if (used == sizeof(buf)) {
+            if (fwrite(buf, 1, used, output) != used) {
+                return -1;
+            }
+            used = 0;
+        }
+    }
+    return fwrite(buf, 1, used, output) == used ? 0 : -1;
+}
+
+/* Writes N / 4 zero words, copied from a block of zero lines. */
+static int write_zero_words(uint32_t n, FILE* output) {
+    char buf[WRITE_LINES * 9];
+    uint32_t words = n / 4;
+
+    for (uint32_t i = 0; i < WRITE_LINES && i < words; i++) {
+        memcpy(buf + 9 * i, "00000000\n", 9);
+    }
+    while (words > 0) {
+        uint32_t lines = words < WRITE_LINES ? words : WRITE_LINES;
+        if (fwrite(buf, 9, lines, output) != lines) {
+            return -1;
+        }
+        words -= lines;
+    }
+    return 0;
+}
+
+int write_data_section(const DataSection* data, FILE* output, int sparse) {
+    for (uint32_t i = 0; i < data->num_segments; i++) {
+        const DataSegment* seg = &data->segments[i];
+        int res;
+        if (seg->kind == DATA_BYTES || (seg->kind == DATA_FILE && !sparse)) {
+            res = write_words(seg->bytes, seg->size, output);
+        } else if (seg->kind == DATA_FILE) {
+            const DataFile* file = &data->files[seg->file];
+            res = fprintf(output, ".incbin \"%s\" %lu %u\n", file->path,
+                (unsigned long) (seg->bytes - file->map), seg->size) < 0 ? -1 : 0;
+        } else if (sparse) {
+            res = fprintf(output, ".space %u\n", seg->size) < 0 ? -1 : 0;
+        } else {
+            res = write_zero_words(seg->size, output);
+        }
+        if (res != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int read_data_section(DataSection* data, FILE* input) {
+    char line[PATH_LINE_SIZE];
+    while (fgets(line, sizeof(line), input) != NULL) {
+        char* end;
+        unsigned long value;
+        if (strncmp(line, ".incbin \"", 9) == 0) {
+            char* path = line + 9;
+            char* quote = strrchr(path, '"');
+            unsigned long length;
+            if (quote == path - 1
+                || sscanf(quote + 1, "%lu %lu", &value, &length) != 2) {
+                return -1;
+            }
+            *quote = '\0';
+            if (length > DATA_MAX_SIZE
+                || add_data_file(data, path, (uint64_t) value, length) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (strncmp(line, ".space ", 7) == 0) {
+            value = strtoul(line + 7, &end, 10);
+            if (*end != '\n' || add_data_space(data, (uint32_t) value) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        value = strtoul(line, &end, 16);
+        if (end != line + 8 || *end != '\n') {
+            return -1;
+        }
+        uint8_t bytes[4] = { value, value >> 8, value >> 16, value >> 24 };
+        if (add_data_bytes(data, bytes, 4) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
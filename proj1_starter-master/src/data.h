@@ -0,0 +1,133 @@
+#ifndef DATA_H
+#define DATA_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "tables.h"
+
+/* The .data section: bytes laid down by .word, .half, .byte, .ascii,
+   .asciiz, .space, .align and .incbin, in order. Contents are kept as a
+   list of segments: literal bytes, a run of zero words, or words of a file
+   mapped by .incbin, so a large .space or binary costs a segment and not
+   its size in memory. The first byte of the section is at address
+   DATA_BASE.
+
+   The section is written out as hex words, least significant byte first,
+   like .text. In the intermediate file zero runs stay ".space n" lines and
+   included files ".incbin "path" offset length" lines, with the path as
+   resolved in pass one, so pass two run on its own finds the file.
+ */
+
+#define DATA_BASE 0x10000000
+#define DATA_MAX_SIZE 0x10000000     // bytes
+#define SPARSE_SPACE_MIN 256         // smaller .space is stored as bytes
+
+typedef enum {
+    DATA_BYTES,
+    DATA_ZEROS,
+    DATA_FILE
+} DataKind;
+
+/* Zero runs and file segments are whole words at a word boundary. */
+typedef struct {
+    DataKind kind;
+    uint32_t offset;         // of the first byte in the section
+    uint32_t size;
+    uint32_t cap;            // bytes allocated for DATA_BYTES
+    uint8_t* bytes;          // NULL for a zero run, in the mapping for a file
+    uint32_t file;           // index in files for DATA_FILE
+} DataSegment;
+
+/* A file mapped by .incbin. */
+typedef struct {
+    char* path;
+    uint8_t* map;
+    size_t len;
+} DataFile;
+
+/* A .word whose value is a label, filled in by resolve_data_labels(). */
+typedef struct {
+    uint32_t offset;
+    uint32_t line_no;
+    char* name;
+} DataLabel;
+
+typedef struct DataSection {
+    DataSegment* segments;
+    uint32_t num_segments;
+    uint32_t segment_cap;
+    DataLabel* labels;
+    uint32_t num_labels;
+    uint32_t label_cap;
+    DataFile* files;
+    uint32_t num_files;
+    uint32_t file_cap;
+    uint32_t size;           // bytes so far
+    int active;              // .data is the current section
+    uint32_t first_pending;  // symbols of labels waiting for the next value
+    uint32_t num_pending;
+} DataSection;
+
+DataSection* create_data_section();
+
+void free_data_section(DataSection* data);
+
+/* Address of the next byte. */
+uint32_t data_address(const DataSection* data);
+
+/* Pads with zeros to the alignment of the values of DIRECTIVE, so a label
+   before a .word or .half gets the address of its first value. */
+void align_for_directive(DataSection* data, const char* directive);
+
+/* Records that entry SYMBOL of the symbol table, a label in .data with no
+   directive after it on its line, labels the next value, whose alignment
+   is not known yet. */
+void add_pending_label(DataSection* data, uint32_t symbol);
+
+/* Aligns for DIRECTIVE, which is about to be laid down, and moves the
+   pending labels in SYMTBL to the address of its first value. */
+void place_pending_labels(DataSection* data, SymbolTable* symtbl,
+    const char* directive);
+
+/* Appends N bytes, or N zero bytes if BYTES is NULL. Returns 0, or -1 if
+   the section would grow past DATA_MAX_SIZE. */
+int add_data_bytes(DataSection* data, const uint8_t* bytes, uint32_t n);
+
+/* Appends N zero bytes, as a zero run if there are SPARSE_SPACE_MIN or more. */
+int add_data_space(DataSection* data, uint32_t n);
+
+/* Appends LENGTH bytes of the file PATH from byte OFFSET on, or the rest
+   of the file if LENGTH is -1, without copying them: the file is mapped and
+   only the bytes up to the next word boundary at either end are copied.
+   Returns 0, or -1 after logging an error. */
+int add_data_file(DataSection* data, const char* path, uint64_t offset,
+    int64_t length);
+
+/* Lays down the data directive NAME with the operands in the rest of the
+   line, OPERANDS, which is clobbered. The path of an .incbin is taken from
+   the directory of the file SOURCE, or the working directory if it is NULL
+   (see resolve_source_path()). Returns 0, or -1 after logging the error at
+   LINE_NO. */
+int add_data_directive(DataSection* data, uint32_t line_no, const char* name,
+    char* operands, const char* source);
+
+/* Fills in the .word operands that were labels from SYMTBL. Returns 0, or -1
+   if some were not defined. */
+int resolve_data_labels(DataSection* data, const SymbolTable* symtbl);
+
+/* Writes the section body, padded to a whole word. With SPARSE set, zero
+   runs are written as ".space n" lines. Returns 0, or -1 on a write error. */
+int write_data_section(const DataSection* data, FILE* output, int sparse);
+
+/* Appends a section body written by write_data_section(), read from INPUT
+   to its end. Returns 0, or -1 on a malformed line. */
+int read_data_section(DataSection* data, FILE* input);
+
+/* Lines starting with '.' in an intermediate file begin the data trailer
+   and end its instructions. */
+static inline int is_data_trailer(const char* line) {
+    return line[0] == '.';
+}
+
+#endif
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "tables.h"
+#include "translate_utils.h"
+#include "translate.h"
+#include "peephole.h"
+#include "delay_slots.h"
+
+#define REG_RA 31
+
+/* Adds register operand ARG to *SET. Returns -1 if it is not a register. */
+static int add_reg(uint32_t* set, const char* arg) {
+    int reg = translate_reg(arg);
+    if (reg == -1) {
+        return -1;
+    }
+    *set |= 1u << reg;
+    return 0;
+}
+
+/* Adds the base register of the memory operand ARG to *SET. */
+static int add_base(uint32_t* set, const char* arg) {
+    long int offset;
+    int reg;
+    if (translate_mem_operand(&offset, &reg, arg, -32769, 32768) != 0) {
+        return -1;
+    }
+    *set |= 1u << reg;
+    return 0;
+}
+
+/* The operand counts of the formats; jalr takes one or two. */
+static const int FORMAT_ARGS[] = {
+    [FMT_R3] = 3,      [FMT_SHIFT] = 3,   [FMT_SHIFTV] = 3,  [FMT_MULDIV] = 2,
+    [FMT_COUNT] = 2,   [FMT_TRAP] = 2,    [FMT_MFROM] = 1,   [FMT_MTO] = 1,
+    [FMT_JR] = 1,      [FMT_JALR] = -1,   [FMT_NONE] = 0,    [FMT_IMM] = 3,
+    [FMT_LUI] = 2,     [FMT_MEM] = 2,     [FMT_BRANCH] = 3,  [FMT_BRANCHZ] = 2,
+    [FMT_JUMP] = 1,
+};
+
+int inst_registers(RegisterSets* regs, const char* name, char* const* args,
+    int num_args) {
+    const InstDesc* inst = find_inst(name);
+    if (!inst || (inst->format == FMT_JALR ? num_args != 1 && num_args != 2
+                                           : num_args != FORMAT_ARGS[inst->format])) {
+        return -1;
+    }
+
+    uint32_t uses = 0, defs = 0;
+    int err = 0;
+    switch (inst->format) {
+    case FMT_R3:
+    case FMT_SHIFTV:
+        err |= add_reg(&defs, args[0]) | add_reg(&uses, args[1])
+            | add_reg(&uses, args[2]);
+        if (inst->funct == 0x0a || inst->funct == 0x0b) {   // movz, movn keep rd
+            uses |= defs;
+        }
+        break;
+    case FMT_SHIFT:
+    case FMT_IMM:
+        err |= add_reg(&defs, args[0]) | add_reg(&uses, args[1]);
+        break;
+    case FMT_MULDIV:
+    case FMT_TRAP:
+    case FMT_BRANCH:
+        err |= add_reg(&uses, args[0]) | add_reg(&uses, args[1]);
+        break;
+    case FMT_COUNT:
+        err |= add_reg(&defs, args[0]) | add_reg(&uses, args[1]);
+        break;
+    case FMT_MFROM:
+    case FMT_LUI:
+        err |= add_reg(&defs, args[0]);
+        break;
+    case FMT_MTO:
+    case FMT_JR:
+        err |= add_reg(&uses, args[0]);
+        break;
+    case FMT_JALR:
+        err |= add_reg(&uses, args[num_args - 1]);
+        if (num_args == 2) {
+            err |= add_reg(&defs, args[0]);
+        } else {
+            defs |= 1u << REG_RA;
+        }
+        break;
+    case FMT_MEM:
+        err |= add_base(&uses, args[1]);
+        if (inst->opcode & 0x08) {           // stores, and sc, read rt
+            err |= add_reg(&uses, args[0]);
+        }
+        if (!(inst->opcode & 0x08) || inst->opcode == 0x38) {
+            err |= add_reg(&defs, args[0]);  // loads, and sc, write it
+        }
+        if (inst->opcode == 0x22 || inst->opcode == 0x26) {
+            uses |= defs;                    // lwl, lwr keep part of rt
+        }
+        break;
+    case FMT_BRANCHZ:
+        err |= add_reg(&uses, args[0]);
+        if (inst->funct & 0x10) {            // bltzal, bgezal
+            defs |= 1u << REG_RA;
+        }
+        break;
+    case FMT_JUMP:
+        if (inst->opcode == 0x03) {          // jal
+            defs |= 1u << REG_RA;
+        }
+        break;
+    case FMT_NONE:
+        break;
+    }
+    if (err) {
+        return -1;
+    }
+    regs->uses = uses & ~1u;
+    regs->defs = defs & ~1u;
+    return 0;
+}
+
+static int is_nop(const PeepInst* inst) {
+    long int shamt;
+    return strcmp(inst->name, "sll") == 0 && inst->num_args == 3
+        && translate_reg(inst->args[0]) == 0 && translate_reg(inst->args[1]) == 0
+        && translate_num(&shamt, inst->args[2], 0, 0) == 0;
+}
+
+/* Returns 1 if INST, before the branch or jump TRANSFER, may run in its
+   delay slot instead. */
+static int can_fill(const PeepInst* inst, const PeepInst* transfer) {
+    const InstDesc* desc = find_inst(inst->name);
+    RegisterSets regs, transfer_regs;
+    if (!desc || desc->format == FMT_NONE || desc->format == FMT_TRAP
+        || inst_registers(&regs, inst->name, inst->args, inst->num_args) != 0
+        || inst_registers(&transfer_regs, transfer->name, transfer->args,
+            transfer->num_args) != 0) {
+        return 0;
+    }
+    return !(regs.defs & (transfer_regs.uses | transfer_regs.defs))
+        && !(regs.uses & transfer_regs.defs);
+}
+
+/* As in optimize_peephole(), the instructions kept so far are below K. */
+uint32_t fill_delay_slots(Peephole* peep) {
+    PeepInst* insts = peep->insts;
+    uint32_t n = peep->num_insts;
+    uint32_t k = 0;
+    uint32_t filled = 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+        PeepInst inst = insts[i];
+        PeepInst* prev = k >= 1 ? &insts[k - 1] : NULL;
+        if (inst.transfer && !inst.labeled && prev && !prev->transfer
+            && (k < 2 || !insts[k - 2].transfer)
+            && i + 1 < n && is_nop(&insts[i + 1]) && !insts[i + 1].labeled
+            && can_fill(prev, &inst)) {
+            PeepInst moved = *prev;
+            inst.labeled = moved.labeled;
+            moved.labeled = 0;
+            insts[k - 1] = inst;
+            insts[k++] = moved;
+            i++;                 // the nop
+            filled++;
+            continue;
+        }
+        insts[k++] = inst;
+    }
+
+    peep->num_insts = k;
+    peep->filled += filled;
+    return filled;
+}
@@ -0,0 +1,42 @@
+#ifndef DELAY_SLOTS_H
+#define DELAY_SLOTS_H
+
+#include <stdint.h>
+
+#include "peephole.h"
+
+/* The delay slot filler (-delayslots). On MIPS the instruction after a
+   branch or jump runs before control moves, so code that does not use the
+   slot pads it with a nop. This pass moves the instruction before the
+   branch or jump into the slot, in place of the nop, where that does not
+   change what the program does.
+
+   The recorded instructions fall into basic blocks, which start at a label
+   and after the delay slot of a branch or jump. An instruction is moved
+   only within its block: the branch or jump must not be labeled, and the
+   instruction must not itself sit in an earlier delay slot. It must also
+   be independent of the branch or jump. It may not write a register that
+   the branch or jump reads or writes, nor read one that it writes, as $ra
+   is written by jal before the slot runs. syscall, break and the traps are
+   not moved.
+   A label at the moved instruction goes to the branch or jump, which takes
+   its place in the block.
+ */
+
+/* Registers read and written by an instruction, one bit per register
+   number. $zero is in neither. */
+typedef struct {
+    uint32_t uses;
+    uint32_t defs;
+} RegisterSets;
+
+/* Fills in *REGS for the instruction NAME with the NUM_ARGS operands ARGS.
+   Returns 0, or -1 if it is not a valid instruction of isa.h. */
+int inst_registers(RegisterSets* regs, const char* name, char* const* args,
+    int num_args);
+
+/* Fills the delay slots of PEEP's instructions and removes their nops.
+   Returns the number filled, which is also added to PEEP->filled. */
+uint32_t fill_delay_slots(Peephole* peep);
+
+#endif
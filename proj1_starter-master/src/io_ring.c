@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#else
+#define HAVE_IO_URING 0
+#endif
+
+#include "tables.h"
+#include "io_ring.h"
+
+/* A request of the blocking backend, performed when it is waited for. */
+typedef struct {
+    int write;
+    int fd;
+    void* buf;
+    size_t len;
+    uint64_t offset;
+    void* tag;
+} IoRequest;
+
+struct IoRing {
+    unsigned depth;
+    unsigned in_flight;
+
+    /* io_uring backend; FD is -1 when the blocking backend is used. */
+    int fd;
+    unsigned to_submit;
+    void* sq_ptr;
+    size_t sq_len;
+    void* cq_ptr;
+    size_t cq_len;
+    void* sqes;
+    size_t sqes_len;
+    void* cqes;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+
+    /* Blocking backend: a FIFO of up to DEPTH requests. */
+    IoRequest* queue;
+    unsigned queue_head;
+};
+
+/*******************************
+ * io_uring Backend
+ *******************************/
+
+#if HAVE_IO_URING
+
+/* Maps the rings of a new io_uring instance. Returns 0, or -1 if the kernel
+   does not provide io_uring or a sandbox forbids it. */
+static int setup_uring(IoRing* ring) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int fd = syscall(__NR_io_uring_setup, ring->depth, &p);
+    if (fd < 0) {
+        return -1;
+    }
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED
+        || ring->sqes == MAP_FAILED) {
+        if (ring->sq_ptr != MAP_FAILED) munmap(ring->sq_ptr, ring->sq_len);
+        if (ring->cq_ptr != MAP_FAILED) munmap(ring->cq_ptr, ring->cq_len);
+        if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_len);
+        close(fd);
+        return -1;
+    }
+
+    char* sq = ring->sq_ptr;
+    char* cq = ring->cq_ptr;
+    ring->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (sq + p.sq_off.array);
+    ring->cq_head = (unsigned*) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    ring->cqes = cq + p.cq_off.cqes;
+    ring->fd = fd;
+    return 0;
+}
+
+static void teardown_uring(IoRing* ring) {
+    munmap(ring->sq_ptr, ring->sq_len);
+    munmap(ring->cq_ptr, ring->cq_len);
+    munmap(ring->sqes, ring->sqes_len);
+    close(ring->fd);
+}
+
+static void queue_sqe(IoRing* ring, int write, int fd, void* buf, size_t len,
+    uint64_t offset, void* tag) {
+
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = (struct io_uring_sqe*) ring->sqes + index;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = (uint64_t) (uintptr_t) tag;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+/* Submits the queued SQEs with the same system call that waits for a
+   completion. */
+static int wait_cqe(IoRing* ring, void** tag, long* res) {
+    for (;;) {
+        unsigned head = *ring->cq_head;
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = (struct io_uring_cqe*) ring->cqes
+                + (head & *ring->cq_mask);
+            *tag = (void*) (uintptr_t) cqe->user_data;
+            *res = cqe->res;
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+
+        int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+            IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        ring->to_submit -= ret;
+    }
+}
+
+#else
+
+static int setup_uring(IoRing* ring) {
+    return -1;
+}
+
+static void teardown_uring(IoRing* ring) {
+}
+
+static void queue_sqe(IoRing* ring, int write, int fd, void* buf, size_t len,
+    uint64_t offset, void* tag) {
+}
+
+static int wait_cqe(IoRing* ring, void** tag, long* res) {
+    return -1;
+}
+
+#endif
+
+/*******************************
+ * Blocking Backend
+ *******************************/
+
+static void queue_request(IoRing* ring, int write, int fd, void* buf, size_t len,
+    uint64_t offset, void* tag) {
+
+    IoRequest* req = &ring->queue[(ring->queue_head + ring->in_flight) % ring->depth];
+    req->write = write;
+    req->fd = fd;
+    req->buf = buf;
+    req->len = len;
+    req->offset = offset;
+    req->tag = tag;
+}
+
+static void run_request(IoRing* ring, void** tag, long* res) {
+    IoRequest* req = &ring->queue[ring->queue_head];
+    ring->queue_head = (ring->queue_head + 1) % ring->depth;
+
+    ssize_t n;
+    do {
+        if (req->offset == IO_RING_NO_OFFSET) {
+            n = req->write ? write(req->fd, req->buf, req->len)
+                           : read(req->fd, req->buf, req->len);
+        } else {
+            n = req->write ? pwrite(req->fd, req->buf, req->len, req->offset)
+                           : pread(req->fd, req->buf, req->len, req->offset);
+        }
+    } while (n < 0 && errno == EINTR);
+
+    *tag = req->tag;
+    *res = n < 0 ? -errno : n;
+}
+
+/*******************************
+ * I/O Rings
+ *******************************/
+
+IoRing* create_io_ring(unsigned depth, int blocking) {
+    IoRing* ring = calloc(1, sizeof(IoRing));
+    if (!ring) {
+        allocation_failed();
+    }
+    ring->depth = depth ? depth : 1;
+    ring->fd = -1;
+
+    if (blocking || setup_uring(ring) != 0) {
+        ring->fd = -1;
+        ring->queue = malloc(ring->depth * sizeof(IoRequest));
+        if (!ring->queue) {
+            allocation_failed();
+        }
+    }
+    return ring;
+}
+
+void free_io_ring(IoRing* ring) {
+    if (!ring) {
+        return;
+    }
+    if (ring->fd >= 0) {
+        teardown_uring(ring);
+    }
+    free(ring->queue);
+    free(ring);
+}
+
+int io_ring_is_async(const IoRing* ring) {
+    return ring->fd >= 0;
+}
+
+unsigned io_ring_in_flight(const IoRing* ring) {
+    return ring->in_flight;
+}
+
+static int queue_io(IoRing* ring, int write, int fd, void* buf, size_t len,
+    uint64_t offset, void* tag) {
+
+    if (ring->in_flight >= ring->depth) {
+        return -1;
+    }
+    if (ring->fd >= 0) {
+        queue_sqe(ring, write, fd, buf, len, offset, tag);
+    } else {
+        queue_request(ring, write, fd, buf, len, offset, tag);
+    }
+    ring->in_flight++;
+    return 0;
+}
+
+int io_ring_read(IoRing* ring, int fd, void* buf, size_t len, uint64_t offset,
+    void* tag) {
+    return queue_io(ring, 0, fd, buf, len, offset, tag);
+}
+
+int io_ring_write(IoRing* ring, int fd, const void* buf, size_t len,
+    uint64_t offset, void* tag) {
+    return queue_io(ring, 1, fd, (void*) buf, len, offset, tag);
+}
+
+int io_ring_wait(IoRing* ring, void** tag, long* res) {
+    if (ring->in_flight == 0) {
+        return -1;
+    }
+    if (ring->fd >= 0) {
+        if (wait_cqe(ring, tag, res) != 0) {
+            return -1;
+        }
+    } else {
+        run_request(ring, tag, res);
+    }
+    ring->in_flight--;
+    return 0;
+}
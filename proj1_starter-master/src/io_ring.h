@@ -0,0 +1,47 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* A queue of asynchronous file reads and writes. On Linux it is backed by
+   io_uring, so many requests are handed to the kernel with one system call
+   and complete while the caller does other work. Where io_uring is not
+   available the same interface performs each request with blocking
+   pread()/pwrite() when its completion is waited for.
+ */
+
+typedef struct IoRing IoRing;
+
+/* Offset for files without one (pipes, eventfds): read or write at the
+   current position. */
+#define IO_RING_NO_OFFSET ((uint64_t) -1)
+
+/* Creates a ring that holds up to DEPTH requests in flight. With BLOCKING
+   set, or if io_uring cannot be set up, blocking I/O is used. */
+IoRing* create_io_ring(unsigned depth, int blocking);
+
+void free_io_ring(IoRing* ring);
+
+/* Returns 1 if RING is backed by io_uring, 0 if it uses blocking I/O. */
+int io_ring_is_async(const IoRing* ring);
+
+/* Number of requests queued or submitted whose completion was not yet
+   returned by io_ring_wait(). */
+unsigned io_ring_in_flight(const IoRing* ring);
+
+/* Queues a read of LEN bytes at OFFSET of FD into BUF. TAG is returned with
+   the completion. Returns 0, or -1 if DEPTH requests are in flight. */
+int io_ring_read(IoRing* ring, int fd, void* buf, size_t len, uint64_t offset,
+    void* tag);
+
+/* Same as io_ring_read(), writing LEN bytes of BUF. */
+int io_ring_write(IoRing* ring, int fd, const void* buf, size_t len,
+    uint64_t offset, void* tag);
+
+/* Submits the queued requests and waits for one to complete. Its TAG and
+   result (bytes transferred, or -errno) are stored. Returns 0, or -1 if no
+   request is in flight. */
+int io_ring_wait(IoRing* ring, void** tag, long* res);
+
+#endif
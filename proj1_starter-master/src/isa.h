@@ -0,0 +1,141 @@
+#ifndef ISA_H
+#define ISA_H
+
+/* The instructions the assembler encodes, the MIPS32 integer instructions
+   but for the branch-likely ones, the trap-immediate ones (teqi and the
+   like), sync, pref and those of the privileged architecture, one per
+   line:
+
+     X(mnemonic, format, opcode, function, lowest immediate, highest immediate)
+
+   FUNCTION is the funct field, or the rt field of the opcode 1 (REGIMM)
+   branches. The immediate bounds are those of the shift amount, the
+   immediate or the memory offset; a negative lower bound makes the
+   immediate signed. addiu and the loads and stores the assembler started
+   with keep the bounds they have always accepted, one wider than 16 bits
+   at either end.
+
+   The format gives the operands, in order:
+
+     R3        rd, rs, rt
+     SHIFT     rd, rt, shamt
+     SHIFTV    rd, rt, rs
+     MULDIV    rs, rt
+     COUNT     rd, rs
+     TRAP      rs, rt
+     MFROM     rd
+     MTO       rs
+     JR        rs
+     JALR      rs, or rd, rs
+     NONE      no operands
+     IMM       rt, rs, immediate
+     LUI       rt, immediate
+     MEM       rt, offset(rs)
+     BRANCH    rs, rt, label
+     BRANCHZ   rs, label
+     JUMP      label
+ */
+
+#define MIPS_INSTRUCTIONS(X) \
+    X(add,     R3,      0x00, 0x20,      0,     0) \
+    X(addu,    R3,      0x00, 0x21,      0,     0) \
+    X(sub,     R3,      0x00, 0x22,      0,     0) \
+    X(subu,    R3,      0x00, 0x23,      0,     0) \
+    X(and,     R3,      0x00, 0x24,      0,     0) \
+    X(or,      R3,      0x00, 0x25,      0,     0) \
+    X(xor,     R3,      0x00, 0x26,      0,     0) \
+    X(nor,     R3,      0x00, 0x27,      0,     0) \
+    X(slt,     R3,      0x00, 0x2a,      0,     0) \
+    X(sltu,    R3,      0x00, 0x2b,      0,     0) \
+    X(movz,    R3,      0x00, 0x0a,      0,     0) \
+    X(movn,    R3,      0x00, 0x0b,      0,     0) \
+    X(mul,     R3,      0x1c, 0x02,      0,     0) \
+    X(sll,     SHIFT,   0x00, 0x00,      0,    31) \
+    X(srl,     SHIFT,   0x00, 0x02,      0,    31) \
+    X(sra,     SHIFT,   0x00, 0x03,      0,    31) \
+    X(sllv,    SHIFTV,  0x00, 0x04,      0,     0) \
+    X(srlv,    SHIFTV,  0x00, 0x06,      0,     0) \
+    X(srav,    SHIFTV,  0x00, 0x07,      0,     0) \
+    X(mult,    MULDIV,  0x00, 0x18,      0,     0) \
+    X(multu,   MULDIV,  0x00, 0x19,      0,     0) \
+    X(div,     MULDIV,  0x00, 0x1a,      0,     0) \
+    X(divu,    MULDIV,  0x00, 0x1b,      0,     0) \
+    X(madd,    MULDIV,  0x1c, 0x00,      0,     0) \
+    X(maddu,   MULDIV,  0x1c, 0x01,      0,     0) \
+    X(msub,    MULDIV,  0x1c, 0x04,      0,     0) \
+    X(msubu,   MULDIV,  0x1c, 0x05,      0,     0) \
+    X(clz,     COUNT,   0x1c, 0x20,      0,     0) \
+    X(clo,     COUNT,   0x1c, 0x21,      0,     0) \
+    X(tge,     TRAP,    0x00, 0x30,      0,     0) \
+    X(tgeu,    TRAP,    0x00, 0x31,      0,     0) \
+    X(tlt,     TRAP,    0x00, 0x32,      0,     0) \
+    X(tltu,    TRAP,    0x00, 0x33,      0,     0) \
+    X(teq,     TRAP,    0x00, 0x34,      0,     0) \
+    X(tne,     TRAP,    0x00, 0x36,      0,     0) \
+    X(mfhi,    MFROM,   0x00, 0x10,      0,     0) \
+    X(mflo,    MFROM,   0x00, 0x12,      0,     0) \
+    X(mthi,    MTO,     0x00, 0x11,      0,     0) \
+    X(mtlo,    MTO,     0x00, 0x13,      0,     0) \
+    X(jr,      JR,      0x00, 0x08,      0,     0) \
+    X(jalr,    JALR,    0x00, 0x09,      0,     0) \
+    X(syscall, NONE,    0x00, 0x0c,      0,     0) \
+    X(break,   NONE,    0x00, 0x0d,      0,     0) \
+    X(addi,    IMM,     0x08, 0x00, -32768, 32767) \
+    X(addiu,   IMM,     0x09, 0x00, -32769, 32768) \
+    X(slti,    IMM,     0x0a, 0x00, -32768, 32767) \
+    X(sltiu,   IMM,     0x0b, 0x00, -32768, 32767) \
+    X(andi,    IMM,     0x0c, 0x00,      0, 65535) \
+    X(ori,     IMM,     0x0d, 0x00,      0, 65535) \
+    X(xori,    IMM,     0x0e, 0x00,      0, 65535) \
+    X(lui,     LUI,     0x0f, 0x00,      0, 65535) \
+    X(lb,      MEM,     0x20, 0x00, -32769, 32768) \
+    X(lh,      MEM,     0x21, 0x00, -32768, 32767) \
+    X(lwl,     MEM,     0x22, 0x00, -32768, 32767) \
+    X(lw,      MEM,     0x23, 0x00, -32769, 32768) \
+    X(lbu,     MEM,     0x24, 0x00, -32769, 32768) \
+    X(lhu,     MEM,     0x25, 0x00, -32768, 32767) \
+    X(lwr,     MEM,     0x26, 0x00, -32768, 32767) \
+    X(sb,      MEM,     0x28, 0x00, -32769, 32768) \
+    X(sh,      MEM,     0x29, 0x00, -32768, 32767) \
+    X(swl,     MEM,     0x2a, 0x00, -32768, 32767) \
+    X(sw,      MEM,     0x2b, 0x00, -32769, 32768) \
+    X(swr,     MEM,     0x2e, 0x00, -32768, 32767) \
+    X(ll,      MEM,     0x30, 0x00, -32768, 32767) \
+    X(sc,      MEM,     0x38, 0x00, -32768, 32767) \
+    X(beq,     BRANCH,  0x04, 0x00,      0,     0) \
+    X(bne,     BRANCH,  0x05, 0x00,      0,     0) \
+    X(blez,    BRANCHZ, 0x06, 0x00,      0,     0) \
+    X(bgtz,    BRANCHZ, 0x07, 0x00,      0,     0) \
+    X(bltz,    BRANCHZ, 0x01, 0x00,      0,     0) \
+    X(bgez,    BRANCHZ, 0x01, 0x01,      0,     0) \
+    X(bltzal,  BRANCHZ, 0x01, 0x10,      0,     0) \
+    X(bgezal,  BRANCHZ, 0x01, 0x11,      0,     0) \
+    X(j,       JUMP,    0x02, 0x00,      0,     0) \
+    X(jal,     JUMP,    0x03, 0x00,      0,     0)
+
+typedef enum {
+    FMT_R3,
+    FMT_SHIFT,
+    FMT_SHIFTV,
+    FMT_MULDIV,
+    FMT_COUNT,
+    FMT_TRAP,
+    FMT_MFROM,
+    FMT_MTO,
+    FMT_JR,
+    FMT_JALR,
+    FMT_NONE,
+    FMT_IMM,
+    FMT_LUI,
+    FMT_MEM,
+    FMT_BRANCH,
+    FMT_BRANCHZ,
+    FMT_JUMP
+} InstFormat;
+
+/* Branches take a label as their last operand and are PC-relative. */
+static inline int is_branch_format(InstFormat format) {
+    return format == FMT_BRANCH || format == FMT_BRANCHZ;
+}
+
+#endif
@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "tables.h"
+#include "translate_utils.h"
+#include "memstats.h"
+#include "macro.h"
+
+static const char* DELIMS = " \f\n\r\t\v,";
+static const char* NAME_CHARS =
+    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+
+static uint32_t hash_name(const char* name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash = (hash ^ (uint8_t) *name) * 16777619u;
+    }
+    return hash % MACRO_BUCKETS;
+}
+
+MacroTable* create_macro_table() {
+    MacroTable* table = calloc(1, sizeof(MacroTable));
+    if (!table) {
+        allocation_failed();
+    }
+    MEM_ALLOC(MEM_LINES, sizeof(MacroTable));
+    return table;
+}
+
+static void free_macro(Macro* macro) {
+    for (uint32_t i = 0; i < macro->num_lines; i++) {
+        MEM_FREE(MEM_LINES, macro->lines[i].text_len);
+        free(macro->lines[i].text);
+    }
+    for (int i = 0; i < macro->num_params; i++) {
+        MEM_FREE(MEM_STRINGS, strlen(macro->params[i]) + 1);
+        free(macro->params[i]);
+    }
+    if (macro->name) {
+        MEM_FREE(MEM_STRINGS, strlen(macro->name) + 1);
+        free(macro->name);
+    }
+    MEM_FREE(MEM_LINES, sizeof(Macro) + macro->line_cap * sizeof(MacroLine));
+    free(macro->lines);
+    free(macro);
+}
+
+void free_macro_table(MacroTable* table) {
+    if (!table) {
+        return;
+    }
+    for (int i = 0; i < MACRO_BUCKETS; i++) {
+        while (table->buckets[i]) {
+            Macro* next = table->buckets[i]->next;
+            free_macro(table->buckets[i]);
+            table->buckets[i] = next;
+        }
+    }
+    if (table->defining) {
+        free_macro(table->defining);
+    }
+    MEM_FREE(MEM_LINES, sizeof(MacroTable));
+    free(table);
+}
+
+int begin_macro(MacroTable* table, uint32_t line_no, const char* operands) {
+    if (table->defining) {
+        write_to_log("Error - nested .macro at line %d\n", line_no);
+        return -1;
+    }
+    Macro* macro = calloc(1, sizeof(Macro));
+    if (!macro) {
+        allocation_failed();
+    }
+    MEM_ALLOC(MEM_LINES, sizeof(Macro));
+    macro->line_no = line_no;
+    table->defining = macro;     // even if invalid, so the body is skipped
+
+    char buf[1024];
+    if (strlen(operands) >= sizeof(buf)) {
+        write_to_log("Error - invalid .macro at line %d\n", line_no);
+        return -1;
+    }
+    strcpy(buf, operands);
+    char* save;
+    char* name = strtok_r(buf, DELIMS, &save);
+    if (!name) {
+        write_to_log("Error - invalid .macro at line %d\n", line_no);
+        return -1;
+    }
+    if (!is_valid_label(name)) {
+        write_to_log("Error - invalid .macro at line %d: %s\n", line_no, name);
+        return -1;
+    }
+
+    for (char* pch = strtok_r(NULL, DELIMS, &save); pch != NULL;
+        pch = strtok_r(NULL, DELIMS, &save)) {
+        if (pch[strspn(pch, NAME_CHARS)] != '\0') {
+            write_to_log("Error - invalid macro parameter at line %d: %s\n",
+                line_no, pch);
+            return -1;
+        }
+        if (macro->num_params == MAX_MACRO_PARAMS) {
+            write_to_log("Error - too many macro parameters at line %d: %s\n",
+                line_no, pch);
+            return -1;
+        }
+        macro->params[macro->num_params++] = strdup(pch);
+    }
+    macro->name = strdup(name);
+    return 0;
+}
+
+/* Number of the parameter of MACRO named by the LEN chars at NAME, or -1. */
+static int find_param(const Macro* macro, const char* name, size_t len) {
+    for (int i = 0; i < macro->num_params; i++) {
+        if (strncmp(macro->params[i], name, len) == 0
+            && macro->params[i][len] == '\0') {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Turns the references to parameters in S into template references, in
+   place. Returns 1 if there were any. */
+static int compile_template(const Macro* macro, char* s) {
+    int refs = 0;
+    char* out = s;
+    const char* p = s;
+    while (*p) {
+        if (*p == '\\' && p[1] == '@') {
+            *out++ = MACRO_REF;
+            *out++ = MACRO_REF_COUNT;
+            p += 2;
+            refs = 1;
+            continue;
+        }
+        if (*p == '\\') {
+            size_t len = strspn(p + 1, NAME_CHARS);
+            int param = len ? find_param(macro, p + 1, len) : -1;
+            if (param >= 0) {
+                *out++ = MACRO_REF;
+                *out++ = (char) (param + 1);
+                p += 1 + len;
+                refs = 1;
+                continue;
+            }
+        }
+        *out++ = *p++;
+    }
+    *out = '\0';
+    return refs;
+}
+
+/* Copies the string S to the text at *END, as a template if it refers to
+   parameters, setting BIT in *SUBST then. Returns the copy. */
+static char* copy_field(const Macro* macro, const char* s, char** end,
+    uint32_t* subst, uint32_t bit) {
+    if (!s) {
+        return NULL;
+    }
+    char* copy = *end;
+    size_t len = strlen(s);
+    memcpy(copy, s, len + 1);
+    *end += len + 1;
+    if (strchr(copy, '\\') && compile_template(macro, copy)) {
+        *subst |= bit;
+    }
+    return copy;
+}
+
+int add_macro_line(MacroTable* table, const SourceLine* line) {
+    Macro* macro = table->defining;
+    if (line->name && strcmp(line->name, ".macro") == 0) {
+        write_to_log("Error - nested .macro at line %d\n", line->line_no);
+        return -1;
+    }
+    if (!macro->name) {
+        return 0;                // invalid definition, body skipped
+    }
+
+    if (macro->num_lines == macro->line_cap) {
+        uint32_t old_cap = macro->line_cap;
+        macro->line_cap = old_cap ? old_cap * 2 : 8;
+        macro->lines = realloc(macro->lines, macro->line_cap * sizeof(MacroLine));
+        if (!macro->lines) {
+            allocation_failed();
+        }
+        MEM_RESIZE(MEM_LINES, old_cap * sizeof(MacroLine),
+            macro->line_cap * sizeof(MacroLine));
+    }
+
+    /* All strings of the line go in one block. */
+    size_t len = 0;
+    const char* fields[SOURCE_MAX_ARGS + 4] = { line->label, line->name,
+        line->operands, line->extra };
+    for (int i = 0; i < line->num_args; i++) {
+        fields[4 + i] = line->args[i];
+    }
+    for (int i = 0; i < 4 + line->num_args; i++) {
+        len += fields[i] ? strlen(fields[i]) + 1 : 0;
+    }
+
+    MacroLine* m = &macro->lines[macro->num_lines++];
+    m->line = *line;
+    m->subst = 0;
+    m->text_len = len ? len : 1;
+    m->text = malloc(m->text_len);
+    if (!m->text) {
+        allocation_failed();
+    }
+    MEM_ALLOC(MEM_LINES, m->text_len);
+
+    char* end = m->text;
+    m->line.label = copy_field(macro, line->label, &end, &m->subst, SUBST_LABEL);
+    m->line.name = copy_field(macro, line->name, &end, &m->subst, SUBST_NAME);
+    m->line.operands = copy_field(macro, line->operands, &end, &m->subst,
+        SUBST_OPERANDS);
+    m->line.extra = copy_field(macro, line->extra, &end, &m->subst, 0);
+    for (int i = 0; i < line->num_args; i++) {
+        m->line.args[i] = copy_field(macro, line->args[i], &end, &m->subst,
+            SUBST_ARG(i));
+    }
+    return 0;
+}
+
+int end_macro(MacroTable* table) {
+    Macro* macro = table->defining;
+    table->defining = NULL;
+    if (!macro->name) {
+        free_macro(macro);
+        return 0;                // reported by begin_macro()
+    }
+    if (find_macro(table, macro->name)) {
+        write_to_log("Error - macro already defined at line %d: %s\n",
+            macro->line_no, macro->name);
+        free_macro(macro);
+        return -1;
+    }
+    uint32_t bucket = hash_name(macro->name);
+    macro->next = table->buckets[bucket];
+    table->buckets[bucket] = macro;
+    table->num_macros++;
+    return 0;
+}
+
+const Macro* find_macro(const MacroTable* table, const char* name) {
+    for (const Macro* m = table->buckets[hash_name(name)]; m != NULL; m = m->next) {
+        if (strcmp(m->name, name) == 0) {
+            return m;
+        }
+    }
+    return NULL;
+}
+
+/* Builds the template S with ARGS substituted at *BUF, which has *LEFT
+   bytes, and advances both. Returns the result, or NULL if it does not fit. */
+static char* expand_template(const char* s, char* const* args, int num_args,
+    uint32_t expansion, char** buf, size_t* left) {
+    char* start = *buf;
+    char* out = start;
+    char* end = start + *left;
+    char count[16];
+
+    for (; *s; s++) {
+        const char* piece = s;
+        size_t len = 1;
+        if (*s == MACRO_REF) {
+            s++;
+            if (*s == MACRO_REF_COUNT) {
+                len = sprintf(count, "%u", expansion);
+                piece = count;
+            } else {
+                int param = *s - 1;
+                piece = param < num_args ? args[param] : "";
+                len = strlen(piece);
+            }
+        }
+        if (len >= (size_t) (end - out)) {
+            return NULL;
+        }
+        memcpy(out, piece, len);
+        out += len;
+    }
+    *out++ = '\0';
+    *left -= out - start;
+    *buf = out;
+    return start;
+}
+
+/* Sets *FIELD to the expansion of its template if BIT is in SUBST. */
+static int expand_field(char** field, uint32_t subst, uint32_t bit,
+    char* const* args, int num_args, uint32_t expansion, char** buf,
+    size_t* left) {
+    if (!(subst & bit)) {
+        return 0;
+    }
+    *field = expand_template(*field, args, num_args, expansion, buf, left);
+    return *field ? 0 : -1;
+}
+
+int expand_macro_line(const Macro* macro, uint32_t i, char* const* args,
+    int num_args, uint32_t expansion, uint32_t line_no, SourceLine* out,
+    char* buf, size_t size) {
+    const MacroLine* m = &macro->lines[i];
+    *out = m->line;
+    out->line_no = line_no;
+    if (m->subst == 0) {
+        return 0;
+    }
+
+    int err = 0;
+    err |= expand_field(&out->label, m->subst, SUBST_LABEL, args, num_args,
+        expansion, &buf, &size);
+    err |= expand_field(&out->name, m->subst, SUBST_NAME, args, num_args,
+        expansion, &buf, &size);
+    err |= expand_field(&out->operands, m->subst, SUBST_OPERANDS, args,
+        num_args, expansion, &buf, &size);
+    for (int a = 0; a < out->num_args; a++) {
+        err |= expand_field(&out->args[a], m->subst, SUBST_ARG(a), args,
+            num_args, expansion, &buf, &size);
+    }
+    return err ? -1 : 0;
+}
+
+int check_macros_closed(const MacroTable* table) {
+    const Macro* macro = table->defining;
+    if (macro && macro->name) {
+        write_to_log("Error - .macro without .endm at line %d: %s\n",
+            macro->line_no, macro->name);
+        return -1;
+    } else if (macro) {
+        write_to_log("Error - .macro without .endm at line %d\n", macro->line_no);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef MACRO_H
+#define MACRO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "source_cache.h"
+
+/* Macros defined with .macro name param... and .endm.
+
+   The body is kept as the tokenized lines of its definition, so an
+   expansion does not read or split text again. Where a field of a line
+   names a parameter (\param) or the expansion number (\@), it is kept as a
+   template in which the reference is a MACRO_REF byte followed by the
+   parameter's number from 1, or MACRO_REF_COUNT for \@. Only those fields
+   are built anew for each expansion; the others are shared.
+
+   A backslash followed by anything but a parameter name or @ is left as
+   it is, so escapes in .ascii strings are unchanged.
+ */
+
+#define MAX_MACRO_PARAMS SOURCE_MAX_ARGS
+#define MAX_MACRO_DEPTH 16       // of macros expanded within macros
+
+#define MACRO_REF '\x01'
+#define MACRO_REF_COUNT '\x7f'
+
+/* Fields of a body line that hold templates. */
+#define SUBST_ARG(i) (1u << (i))
+#define SUBST_LABEL (1u << SOURCE_MAX_ARGS)
+#define SUBST_NAME (1u << (SOURCE_MAX_ARGS + 1))
+#define SUBST_OPERANDS (1u << (SOURCE_MAX_ARGS + 2))
+
+typedef struct {
+    SourceLine line;         // strings in text
+    char* text;
+    size_t text_len;
+    uint32_t subst;          // SUBST_ bits of the fields with templates
+} MacroLine;
+
+typedef struct Macro {
+    char* name;
+    char* params[MAX_MACRO_PARAMS];
+    int num_params;
+    uint32_t line_no;        // of the .macro
+    MacroLine* lines;
+    uint32_t num_lines;
+    uint32_t line_cap;
+    struct Macro* next;      // in the same bucket
+} Macro;
+
+#define MACRO_BUCKETS 64
+
+typedef struct MacroTable {
+    Macro* buckets[MACRO_BUCKETS];
+    uint32_t num_macros;
+    Macro* defining;         // between .macro and .endm, not yet in buckets
+    uint32_t expansions;     // so far, the value of \@
+} MacroTable;
+
+MacroTable* create_macro_table();
+
+void free_macro_table(MacroTable* table);
+
+/* Starts the definition of the macro named in OPERANDS, the rest of the
+   .macro line LINE_NO, followed by the names of its parameters. Returns 0,
+   or -1 after logging an error. */
+int begin_macro(MacroTable* table, uint32_t line_no, const char* operands);
+
+/* Appends LINE to the body of the macro being defined. Returns 0, or -1
+   after logging an error. */
+int add_macro_line(MacroTable* table, const SourceLine* line);
+
+/* Ends the definition at .endm. Returns 0, or -1 after logging an error if
+   a macro of that name exists already. */
+int end_macro(MacroTable* table);
+
+/* Returns the macro NAME, or NULL. */
+const Macro* find_macro(const MacroTable* table, const char* name);
+
+/* Instantiates line I of MACRO into OUT with the NUM_ARGS arguments ARGS,
+   expansion number EXPANSION and line number LINE_NO. Substituted fields
+   are built in BUF, of SIZE bytes; the others point into the macro.
+   Returns 0, or -1 if they do not fit in BUF. */
+int expand_macro_line(const Macro* macro, uint32_t i, char* const* args,
+    int num_args, uint32_t expansion, uint32_t line_no, SourceLine* out,
+    char* buf, size_t size);
+
+/* Logs an error and returns -1 if a macro has no .endm. */
+int check_macros_closed(const MacroTable* table);
+
+#endif
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "tables.h"
+#include "memstats.h"
+#include "mapped_output.h"
+
+static const char* SYMBOL_HEADER = "\n.symbol\n";
+static const char* RELOCATION_HEADER = "\n.relocation\n";
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+static size_t decimal_len(uint32_t n) {
+    size_t len = 1;
+    while (n >= 10) {
+        n /= 10;
+        len++;
+    }
+    return len;
+}
+
+/* Size of TABLE in the format of write_table(). */
+static size_t table_len(SymbolTable* table) {
+    size_t len = 0;
+    if (table == NULL || table->tbl == NULL) return 0;
+    for (uint32_t i = 0; i < table->len; i++) {
+        len += decimal_len(table->tbl[i].addr) + strlen(table->tbl[i].name) + 2;
+    }
+    return len;
+}
+
+/* Formats TABLE as write_table() would into DST. Returns the bytes written. */
+static size_t format_table(char* dst, SymbolTable* table) {
+    char* p = dst;
+    if (table == NULL || table->tbl == NULL) return 0;
+    for (uint32_t i = 0; i < table->len; i++) {
+        uint32_t addr = table->tbl[i].addr;
+        size_t digits = decimal_len(addr);
+        for (size_t j = digits; j > 0; j--) {
+            p[j - 1] = '0' + addr % 10;
+            addr /= 10;
+        }
+        p += digits;
+        *p++ = '\t';
+        size_t name_len = strlen(table->tbl[i].name);
+        memcpy(p, table->tbl[i].name, name_len);
+        p += name_len;
+        *p++ = '\n';
+    }
+    return p - dst;
+}
+
+int open_mapped_output(MappedOutput* out, const char* name, uint32_t max_words,
+    SymbolTable* symtbl) {
+
+    out->fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out->fd < 0) {
+        return -1;
+    }
+    out->max_words = max_words;
+    out->map_len = TEXT_OFFSET + (size_t) HEX_WORD_LEN * max_words
+        + strlen(SYMBOL_HEADER) + table_len(symtbl) + strlen(RELOCATION_HEADER);
+
+    if (ftruncate(out->fd, out->map_len) != 0) {
+        close(out->fd);
+        return -1;
+    }
+    out->map = mmap(NULL, out->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+        out->fd, 0);
+    if (out->map == MAP_FAILED) {
+        close(out->fd);
+        return -1;
+    }
+    MEM_ALLOC(MEM_OUTPUT, out->map_len);
+    memcpy(out->map, ".text\n", TEXT_OFFSET);
+    return 0;
+}
+
+int write_mapped_word(MappedOutput* out, uint32_t index, uint32_t instruction) {
+    if (index >= out->max_words) {
+        return -1;
+    }
+    char* p = out->map + TEXT_OFFSET + (size_t) HEX_WORD_LEN * index;
+    for (int i = 7; i >= 0; i--) {
+        p[i] = HEX_DIGITS[instruction & 0xf];
+        instruction >>= 4;
+    }
+    p[8] = '\n';
+    return 0;
+}
+
+void move_mapped_words(MappedOutput* out, uint32_t to, uint32_t from, uint32_t count) {
+    char* base = out->map + TEXT_OFFSET;
+    memmove(base + (size_t) HEX_WORD_LEN * to, base + (size_t) HEX_WORD_LEN * from,
+        (size_t) HEX_WORD_LEN * count);
+}
+
+int close_mapped_output(MappedOutput* out, uint32_t num_words, SymbolTable* symtbl,
+    SymbolTable* reltbl) {
+
+    size_t text_end = TEXT_OFFSET + (size_t) HEX_WORD_LEN * num_words;
+    size_t sym_len = table_len(symtbl);
+    size_t final_len = text_end + strlen(SYMBOL_HEADER) + sym_len
+        + strlen(RELOCATION_HEADER) + table_len(reltbl);
+    int err = 0;
+
+    if (final_len > out->map_len) {
+        munmap(out->map, out->map_len);
+        MEM_FREE(MEM_OUTPUT, out->map_len);
+        out->map = MAP_FAILED;
+        if (ftruncate(out->fd, final_len) == 0) {
+            out->map = mmap(NULL, final_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                out->fd, 0);
+        }
+        if (out->map == MAP_FAILED) {
+            close(out->fd);
+            return -1;
+        }
+        out->map_len = final_len;
+        MEM_ALLOC(MEM_OUTPUT, out->map_len);
+    }
+
+    char* p = out->map + text_end;
+    memcpy(p, SYMBOL_HEADER, strlen(SYMBOL_HEADER));
+    p += strlen(SYMBOL_HEADER);
+    p += format_table(p, symtbl);
+    memcpy(p, RELOCATION_HEADER, strlen(RELOCATION_HEADER));
+    p += strlen(RELOCATION_HEADER);
+    p += format_table(p, reltbl);
+
+    if (munmap(out->map, out->map_len) != 0) {
+        err = -1;
+    }
+    MEM_FREE(MEM_OUTPUT, out->map_len);
+    if (final_len < out->map_len && ftruncate(out->fd, final_len) != 0) {
+        err = -1;
+    }
+    if (close(out->fd) != 0) {
+        err = -1;
+    }
+    return err;
+}
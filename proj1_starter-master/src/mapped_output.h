@@ -0,0 +1,45 @@
+#ifndef MAPPED_OUTPUT_H
+#define MAPPED_OUTPUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* An output file written in place through a shared mapping. Every
+   instruction of the .text section takes HEX_WORD_LEN bytes ("%08x\n"), so
+   word i always lives at TEXT_OFFSET + HEX_WORD_LEN * i: once pass one has
+   counted the instructions, the file is sized up front and encoders,
+   including parallel ones, store their words straight into it.
+ */
+
+#define TEXT_OFFSET 6            // strlen(".text\n")
+#define HEX_WORD_LEN 9
+
+typedef struct MappedOutput {
+    int fd;
+    char* map;
+    size_t map_len;
+    uint32_t max_words;
+} MappedOutput;
+
+/* Creates NAME sized for MAX_WORDS instructions followed by the sections of
+   SYMTBL and an empty relocation table, and maps it. Returns 0, or -1 if
+   the file cannot be created or mapped. */
+int open_mapped_output(MappedOutput* out, const char* name, uint32_t max_words,
+    SymbolTable* symtbl);
+
+/* Stores INSTRUCTION as word INDEX of the .text section. Safe to call from
+   several threads for different indices. Returns 0, or -1 if INDEX is past
+   the size the file was created for. */
+int write_mapped_word(MappedOutput* out, uint32_t index, uint32_t instruction);
+
+/* Moves COUNT words from index FROM down to index TO, closing the gap left
+   by instructions that failed to encode. */
+void move_mapped_words(MappedOutput* out, uint32_t to, uint32_t from, uint32_t count);
+
+/* Ends the .text section after NUM_WORDS words, writes the symbol and
+   relocation sections, sizes the file to fit and unmaps it. The file only
+   grows here if RELTBL has entries. Returns 0, or -1 on failure. */
+int close_mapped_output(MappedOutput* out, uint32_t num_words, SymbolTable* symtbl,
+    SymbolTable* reltbl);
+
+#endif
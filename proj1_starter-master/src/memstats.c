@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "memstats.h"
+
+MemStats* mem_stats = NULL;
+
+static const char* SUBSYSTEM_NAMES[MEM_SUBSYSTEMS] = {
+    "symbol table", "relocation table", "operand strings", "line buffers",
+    "output buffers", "source map", "data section"
+};
+
+void start_mem_stats(MemStats* stats) {
+    memset(stats, 0, sizeof(MemStats));
+    __atomic_store_n(&mem_stats, stats, __ATOMIC_RELEASE);
+}
+
+void stop_mem_stats() {
+    __atomic_store_n(&mem_stats, NULL, __ATOMIC_RELEASE);
+}
+
+/* Raises *PEAK to LIVE if that is higher. */
+static void update_peak(int64_t* peak, int64_t live) {
+    int64_t old = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (live > old
+           && !__atomic_compare_exchange_n(peak, &old, live, 1,
+                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void count_alloc(MemSubsystem subsystem, size_t bytes) {
+    MemStats* stats = __atomic_load_n(&mem_stats, __ATOMIC_ACQUIRE);
+    if (!stats) {
+        return;
+    }
+    MemCounter* c = &stats->subsystems[subsystem];
+    __atomic_add_fetch(&c->allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->bytes, bytes, __ATOMIC_RELAXED);
+    update_peak(&c->peak,
+        __atomic_add_fetch(&c->live, (int64_t) bytes, __ATOMIC_RELAXED));
+    update_peak(&stats->peak,
+        __atomic_add_fetch(&stats->live, (int64_t) bytes, __ATOMIC_RELAXED));
+}
+
+void count_free(MemSubsystem subsystem, size_t bytes) {
+    MemStats* stats = __atomic_load_n(&mem_stats, __ATOMIC_ACQUIRE);
+    if (!stats) {
+        return;
+    }
+    __atomic_sub_fetch(&stats->subsystems[subsystem].live, (int64_t) bytes,
+        __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&stats->live, (int64_t) bytes, __ATOMIC_RELAXED);
+}
+
+void write_mem_stats(const MemStats* stats, FILE* output) {
+    uint64_t allocs = 0, bytes = 0;
+
+    fprintf(output, "%-18s %10s %12s %12s\n", "memory", "allocs", "bytes", "peak");
+    for (int i = 0; i < MEM_SUBSYSTEMS; i++) {
+        const MemCounter* c = &stats->subsystems[i];
+        fprintf(output, "%-18s %10llu %12llu %12lld\n", SUBSYSTEM_NAMES[i],
+            (unsigned long long) c->allocs, (unsigned long long) c->bytes,
+            (long long) c->peak);
+        allocs += c->allocs;
+        bytes += c->bytes;
+    }
+    fprintf(output, "%-18s %10llu %12llu %12lld\n", "total",
+        (unsigned long long) allocs, (unsigned long long) bytes,
+        (long long) stats->peak);
+}
@@ -0,0 +1,70 @@
+#ifndef MEMSTATS_H
+#define MEMSTATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* Allocation accounting. While a MemStats is active, the allocation paths
+   of the subsystems below count their allocations, the bytes they ask for
+   and the bytes they hold, and keep the peak of the latter. Sizes are the
+   requested ones, without allocator overhead. With no MemStats active the
+   hooks are a single test of MEM_STATS.
+
+   Counting is process-wide and safe from several threads (the pipeline
+   stages), but only one MemStats can be active at a time.
+ */
+
+typedef enum {
+    MEM_SYMBOLS,             // symbol table entries
+    MEM_RELOCATIONS,         // relocation table entries
+    MEM_STRINGS,             // names and operands copied out of lines
+    MEM_LINES,               // buffered input lines
+    MEM_OUTPUT,              // buffered or mapped output
+    MEM_SOURCE_MAP,          // source and line maps
+    MEM_DATA,                // .data contents
+    MEM_SUBSYSTEMS
+} MemSubsystem;
+
+typedef struct {
+    uint64_t allocs;         // allocations and resizes
+    uint64_t bytes;          // bytes requested by them
+    int64_t live;            // bytes held
+    int64_t peak;
+} MemCounter;
+
+typedef struct {
+    MemCounter subsystems[MEM_SUBSYSTEMS];
+    int64_t live;            // bytes held by all subsystems
+    int64_t peak;
+} MemStats;
+
+extern MemStats* mem_stats;
+
+/* Clears STATS and starts counting into it. */
+void start_mem_stats(MemStats* stats);
+
+void stop_mem_stats();
+
+void count_alloc(MemSubsystem subsystem, size_t bytes);
+
+void count_free(MemSubsystem subsystem, size_t bytes);
+
+#define MEM_ALLOC(subsystem, bytes) \
+    do { if (mem_stats) count_alloc(subsystem, bytes); } while (0)
+
+#define MEM_FREE(subsystem, bytes) \
+    do { if (mem_stats) count_free(subsystem, bytes); } while (0)
+
+#define MEM_RESIZE(subsystem, old_bytes, bytes) \
+    do { \
+        if (mem_stats) { \
+            count_free(subsystem, old_bytes); \
+            count_alloc(subsystem, bytes); \
+        } \
+    } while (0)
+
+/* Writes a table of STATS, one row per subsystem. */
+void write_mem_stats(const MemStats* stats, FILE* output);
+
+#endif
@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "alloc.h"
+#include "tables.h"
+#include "translate_utils.h"
+#include "translate.h"
+#include "pseudo.h"
+#include "source_map.h"
+#include "memstats.h"
+#include "peephole.h"
+#include "delay_slots.h"
+
+#define REG_AT 1
+
+Peephole* create_peephole(uint32_t base, unsigned passes) {
+    Peephole* peep = calloc(1, sizeof(Peephole));
+    if (!peep) {
+        allocation_failed();
+    }
+    peep->strings = create_arena(0, 0);
+    if (!peep->strings) {
+        allocation_failed();
+    }
+    peep->base = base;
+    peep->passes = passes;
+    MEM_ALLOC(MEM_LINES, sizeof(Peephole));
+    return peep;
+}
+
+void free_peephole(Peephole* peep) {
+    if (!peep) {
+        return;
+    }
+    MEM_FREE(MEM_STRINGS, arena_used(peep->strings));
+    MEM_FREE(MEM_LINES, sizeof(Peephole) + peep->inst_cap * sizeof(PeepInst)
+        + peep->label_cap * sizeof(PeepLabel));
+    free_arena(peep->strings);
+    free(peep->insts);
+    free(peep->labels);
+    free(peep);
+}
+
+static char* copy_string(Peephole* peep, const char* s) {
+    char* copy = alloc_strdup(peep->strings, s);
+    if (!copy) {
+        allocation_failed();
+    }
+    MEM_ALLOC(MEM_STRINGS, strlen(s) + 1);
+    return copy;
+}
+
+static int is_transfer(const char* name) {
+    const InstDesc* inst = find_inst(name);
+    if (!inst) {
+        return 0;
+    }
+    switch (inst->format) {
+    case FMT_BRANCH: case FMT_BRANCHZ: case FMT_JUMP: case FMT_JR: case FMT_JALR:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static void add_inst(Peephole* peep, const char* name, char** args, int num_args,
+    uint8_t expansion, uint32_t src_file, uint32_t src_line, uint32_t src_column) {
+    if (peep->num_insts == peep->inst_cap) {
+        uint32_t old_cap = peep->inst_cap;
+        peep->inst_cap = old_cap ? old_cap * 2 : 256;
+        peep->insts = realloc(peep->insts, peep->inst_cap * sizeof(PeepInst));
+        if (!peep->insts) {
+            allocation_failed();
+        }
+        MEM_RESIZE(MEM_LINES, old_cap * sizeof(PeepInst),
+            peep->inst_cap * sizeof(PeepInst));
+    }
+    PeepInst* inst = &peep->insts[peep->num_insts];
+    inst->name = copy_string(peep, name);
+    inst->num_args = num_args;
+    for (int i = 0; i < num_args; i++) {
+        inst->args[i] = copy_string(peep, args[i]);
+    }
+    inst->orig = peep->num_insts;
+    inst->src_file = src_file;
+    inst->src_line = src_line;
+    inst->src_column = src_column;
+    inst->labeled = peep->num_labels > 0
+        && peep->labels[peep->num_labels - 1].inst == peep->num_insts;
+    inst->transfer = is_transfer(name);
+    inst->expansion = expansion;
+    peep->num_insts++;
+}
+
+unsigned peephole_pass_one(Peephole* peep, const char* name, char** args,
+    int num_args, uint32_t src_file, uint32_t src_line, uint32_t src_column) {
+    if (num_args > PEEP_ARGS) {
+        return 0;
+    }
+
+    InstRecord insts[MAX_EXPANSION];
+    char buf[PSEUDO_BUF_SIZE];
+    int num_insts = expand_pseudo(name, args, num_args, insts, buf, sizeof(buf));
+
+    if (num_insts < 0) {
+        add_inst(peep, name, args, num_args, 0, src_file, src_line, src_column);
+        return 1;
+    }
+    for (int i = 0; i < num_insts; i++) {
+        add_inst(peep, insts[i].name, insts[i].args, insts[i].num_args, i + 1,
+            src_file, src_line, src_column);
+    }
+    return num_insts;
+}
+
+void peephole_label(Peephole* peep, uint32_t symbol) {
+    if (peep->num_labels == peep->label_cap) {
+        uint32_t old_cap = peep->label_cap;
+        peep->label_cap = old_cap ? old_cap * 2 : 64;
+        peep->labels = realloc(peep->labels, peep->label_cap * sizeof(PeepLabel));
+        if (!peep->labels) {
+            allocation_failed();
+        }
+        MEM_RESIZE(MEM_LINES, old_cap * sizeof(PeepLabel),
+            peep->label_cap * sizeof(PeepLabel));
+    }
+    peep->labels[peep->num_labels].inst = peep->num_insts;
+    peep->labels[peep->num_labels].symbol = symbol;
+    peep->num_labels++;
+}
+
+static int is_zero(const char* s) {
+    long int imm;
+    return translate_num(&imm, s, 0, 0) == 0;
+}
+
+/* R-type operations with 0 as their identity on the right, and those where
+   it is on the left as well. */
+static int is_identity_zero(const char* name) {
+    return strcmp(name, "addu") == 0 || strcmp(name, "or") == 0
+        || strcmp(name, "add") == 0 || strcmp(name, "xor") == 0
+        || strcmp(name, "subu") == 0 || strcmp(name, "sub") == 0;
+}
+
+static int is_commutative(const char* name) {
+    return name[0] != 's';
+}
+
+static int is_identity_imm(const char* name) {
+    return strcmp(name, "addiu") == 0 || strcmp(name, "ori") == 0
+        || strcmp(name, "addi") == 0 || strcmp(name, "xori") == 0;
+}
+
+/* Returns 1 if INST is valid and leaves every register as it was. */
+static int is_noop(const PeepInst* inst) {
+    const InstDesc* desc = find_inst(inst->name);
+    if (!desc || inst->num_args != 3) {
+        return 0;
+    }
+    int rd = translate_reg(inst->args[0]);
+    int a = translate_reg(inst->args[1]);
+    if (rd <= 0 || a == -1) {
+        return 0;
+    }
+
+    switch (desc->format) {
+    case FMT_R3: {
+        int b = translate_reg(inst->args[2]);
+        if (b == -1 || !is_identity_zero(inst->name)) {
+            return 0;
+        }
+        return (rd == a && b == 0)
+            || (rd == b && a == 0 && is_commutative(inst->name));
+    }
+    case FMT_SHIFT:
+        return rd == a && is_zero(inst->args[2]);
+    case FMT_SHIFTV:
+        return rd == a && translate_reg(inst->args[2]) == 0;
+    case FMT_IMM:
+        return rd == a && is_identity_imm(inst->name) && is_zero(inst->args[2]);
+    default:
+        return 0;
+    }
+}
+
+static int is_store(const char* name) {
+    return strcmp(name, "sw") == 0 || strcmp(name, "sb") == 0
+        || strcmp(name, "sh") == 0;
+}
+
+/* Returns 1 if A is a valid store that B, a store of the same width to the
+   same address, overwrites. */
+static int is_overwritten_store(const PeepInst* a, const PeepInst* b) {
+    if (!is_store(a->name) || strcmp(a->name, b->name) != 0
+        || a->num_args != 2 || b->num_args != 2
+        || translate_reg(a->args[0]) == -1) {
+        return 0;
+    }
+    long int offset_a, offset_b;
+    int base_a, base_b;
+    return translate_mem_operand(&offset_a, &base_a, a->args[1], -32769, 32768) == 0
+        && translate_mem_operand(&offset_b, &base_b, b->args[1], -32769, 32768) == 0
+        && offset_a == offset_b && base_a == base_b;
+}
+
+/* Moves "lui $at hi; ori rd $at lo", the expansion of one li or la, to RD.
+   Returns 1 if it did. */
+static int fold_lui_ori(Peephole* peep, PeepInst* lui, PeepInst* ori) {
+    if (lui->expansion != 1 || ori->expansion != 2
+        || strcmp(lui->name, "lui") != 0 || strcmp(ori->name, "ori") != 0
+        || lui->num_args != 2 || ori->num_args != 3
+        || translate_reg(lui->args[0]) != REG_AT
+        || translate_reg(ori->args[1]) != REG_AT) {
+        return 0;
+    }
+    int rd = translate_reg(ori->args[0]);
+    if (rd <= 0 || rd == REG_AT) {
+        return 0;
+    }
+    lui->args[0] = ori->args[0];
+    ori->args[1] = ori->args[0];
+    peep->folded++;
+    return 1;
+}
+
+/* The instructions are rewritten in place: those kept so far are below K,
+   and the last of them is the only one a new rule can apply to. */
+uint32_t optimize_peephole(Peephole* peep) {
+    PeepInst* insts = peep->insts;
+    uint32_t k = 0;
+    int labeled = 0;             // of an instruction removed since the last kept
+
+    for (uint32_t i = 0; i < peep->num_insts; i++) {
+        insts[k] = insts[i];
+        insts[k].labeled |= labeled;
+        labeled = 0;
+        k++;
+
+        for (;;) {
+            PeepInst* top = &insts[k - 1];
+            PeepInst* prev = k >= 2 ? &insts[k - 2] : NULL;
+            int in_slot = prev && prev->transfer;
+            if (in_slot) {
+                break;
+            }
+            if (is_noop(top)) {
+                labeled = top->labeled;
+                k--;
+                break;
+            }
+            if (!prev || top->labeled || (k >= 3 && insts[k - 3].transfer)) {
+                break;
+            }
+            if (is_overwritten_store(prev, top)) {
+                top->labeled = prev->labeled;
+                *prev = *top;
+                k--;
+                continue;
+            }
+            if (!fold_lui_ori(peep, prev, top)) {
+                break;
+            }
+        }
+    }
+
+    uint32_t removed = peep->num_insts - k;
+    peep->num_insts = k;
+    peep->removed += removed;
+    return removed;
+}
+
+void run_peephole(Peephole* peep) {
+    if (peep->passes & PEEP_OPTIMIZE) {
+        optimize_peephole(peep);
+    }
+    if (peep->passes & PEEP_DELAY_SLOTS) {
+        fill_delay_slots(peep);
+    }
+}
+
+uint32_t flush_peephole(Peephole* peep, FILE* output, SymbolTable* symtbl,
+    struct SourceMap* srcmap) {
+    uint32_t label = 0;
+    for (uint32_t i = 0; i < peep->num_insts; i++) {
+        PeepInst* inst = &peep->insts[i];
+        for (; label < peep->num_labels && peep->labels[label].inst <= inst->orig;
+            label++) {
+            symtbl->tbl[peep->labels[label].symbol].addr = peep->base + 4 * i;
+        }
+        write_inst_string(output, inst->name, inst->args, inst->num_args);
+        if (srcmap) {
+            source_map_add_in(srcmap, inst->src_file, inst->src_line,
+                inst->src_column);
+        }
+    }
+    for (; label < peep->num_labels; label++) {
+        symtbl->tbl[peep->labels[label].symbol].addr
+            = peep->base + 4 * peep->num_insts;
+    }
+    return peep->num_insts;
+}
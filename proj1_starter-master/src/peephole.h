@@ -0,0 +1,104 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "tables.h"
+
+struct Allocator;
+struct SourceMap;
+
+/* The optional peephole pass (-O). Pass one records its instructions here,
+   pseudo-instructions expanded, instead of writing them; at the end of pass
+   one they are rewritten, written to the intermediate file, and the text
+   labels recorded with them moved to their new addresses. Branch offsets
+   come from the symbol table in pass two, so they follow.
+
+   The rewrites look at one instruction or two neighbours and never reach
+   across a label, so code that jumps into the middle of them still sees
+   the same program:
+
+     lui $at hi; ori rd $at lo   becomes   lui rd hi; ori rd rd lo, and the
+                                 ori goes if lo is 0, where the pair is
+                                 the expansion of one li or la ($at is
+                                 the assembler's own there, so it is not
+                                 kept set; a pair written out by hand is
+                                 left as it is)
+     addu rd rd $zero, ori rd rd 0 and the like, which change nothing, go
+     a store followed by one of the same width to the same address goes
+
+   Only valid instructions are touched, so pass two reports the same errors.
+   Writes to $zero are kept, as they are nops on purpose. An instruction
+   after a branch or jump is left alone, as on MIPS it runs in the delay
+   slot; removing it would pull the next one in.
+
+   The delay slot filler (see delay_slots.h) works on the same recorded
+   instructions, after the rewrites.
+ */
+
+#define PEEP_ARGS 3
+
+/* Passes over the recorded instructions, run in this order. */
+#define PEEP_OPTIMIZE 1          // the rewrites above (-O)
+#define PEEP_DELAY_SLOTS 2       // fill_delay_slots() (-delayslots)
+
+typedef struct {
+    const char* name;
+    char* args[PEEP_ARGS];
+    int num_args;
+    uint32_t orig;           // index before the rewrites
+    uint32_t src_file;       // its entry in the source map
+    uint32_t src_line;
+    uint32_t src_column;
+    uint8_t labeled;         // a label is at this instruction
+    uint8_t transfer;        // a branch or jump, with a delay slot after it
+    uint8_t expansion;       // place in a pseudo-instruction expansion, from 1, or 0
+} PeepInst;
+
+typedef struct {
+    uint32_t inst;           // index of the instruction it labels, before the rewrites
+    uint32_t symbol;         // index in the symbol table
+} PeepLabel;
+
+typedef struct Peephole {
+    struct Allocator* strings;   // names and operands of the instructions
+    PeepInst* insts;
+    uint32_t num_insts;
+    uint32_t inst_cap;
+    PeepLabel* labels;
+    uint32_t num_labels;
+    uint32_t label_cap;
+    uint32_t base;           // byte offset of the first instruction
+    unsigned passes;         // PEEP_ bits
+    uint32_t removed;        // by optimize_peephole()
+    uint32_t folded;         // lui/ori pairs moved off $at
+    uint32_t filled;         // delay slots, by fill_delay_slots()
+} Peephole;
+
+/* Creates a buffer for instructions from byte offset BASE on, for PASSES. */
+Peephole* create_peephole(uint32_t base, unsigned passes);
+
+void free_peephole(Peephole* peep);
+
+/* Same as write_pass_one(), but records the instructions, at SRC_LINE and
+   SRC_COLUMN of file SRC_FILE in the source map. */
+unsigned peephole_pass_one(Peephole* peep, const char* name, char** args,
+    int num_args, uint32_t src_file, uint32_t src_line, uint32_t src_column);
+
+/* Records that entry SYMBOL of the symbol table labels the next instruction. */
+void peephole_label(Peephole* peep, uint32_t symbol);
+
+/* Rewrites the recorded instructions. Returns the number removed. */
+uint32_t optimize_peephole(Peephole* peep);
+
+/* Runs the passes of PEEP over the recorded instructions. */
+void run_peephole(Peephole* peep);
+
+/* Writes the instructions to OUTPUT, sets the addresses of their labels in
+   SYMTBL and, if SRCMAP is set, adds their source map entries. Returns the
+   number of instructions written. */
+uint32_t flush_peephole(Peephole* peep, FILE* output, SymbolTable* symtbl,
+    struct SourceMap* srcmap);
+
+#endif
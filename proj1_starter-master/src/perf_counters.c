@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && defined(__NR_perf_event_open) && __has_include(<linux/perf_event.h>)
+#include <linux/perf_event.h>
+#define HAVE_PERF_EVENTS 1
+#else
+#define HAVE_PERF_EVENTS 0
+#endif
+
+#include "utils.h"
+#include "tables.h"
+#include "perf_counters.h"
+
+/* A counter reading: the count and the times the counter was enabled and
+   actually counting, which differ when the PMU multiplexes counters. */
+typedef struct {
+    uint64_t value;
+    uint64_t enabled;
+    uint64_t running;
+} PerfReading;
+
+/* Counters are enabled from the start and read at both ends of a phase;
+   FDS is -1 for events that could not be opened. */
+struct PerfCounters {
+    int fds[PERF_NUM_EVENTS];
+    PerfReading begin[PERF_NUM_EVENTS];
+    double counts[PERF_MAX_PHASES][PERF_NUM_EVENTS];
+};
+
+static const char* EVENT_NAMES[PERF_NUM_EVENTS] = {
+    "task ms", "cycles", "instructions", "L1d misses", "LLC misses",
+    "branch misses"
+};
+
+#if HAVE_PERF_EVENTS
+
+static int open_event(PerfEvent event) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    switch (event) {
+    case PERF_TASK_CLOCK:
+        attr.type = PERF_TYPE_SOFTWARE;
+        attr.config = PERF_COUNT_SW_TASK_CLOCK;
+        break;
+    case PERF_CYCLES:
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case PERF_INSTRUCTIONS:
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case PERF_L1D_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_L1D
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+    case PERF_LLC_MISSES:
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+    default:
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+    }
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+        | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.inherit = 1;            // threads started later, e.g. the pipeline
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+#else
+
+static int open_event(PerfEvent event) {
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
+
+PerfCounters* open_perf_counters() {
+    PerfCounters* counters = calloc(1, sizeof(PerfCounters));
+    if (!counters) {
+        allocation_failed();
+    }
+
+    int opened = 0, hardware = 0, err = 0;
+    for (int i = 0; i < PERF_NUM_EVENTS; i++) {
+        counters->fds[i] = open_event(i);
+        if (counters->fds[i] >= 0) {
+            opened++;
+            hardware += i != PERF_TASK_CLOCK;
+        } else if (!err) {
+            err = errno;
+        }
+    }
+    if (opened == 0) {
+        write_to_log("Performance counters unavailable: %s\n", strerror(err));
+        free(counters);
+        return NULL;
+    }
+    if (hardware == 0) {
+        write_to_log("Hardware performance counters unavailable: %s\n",
+            strerror(err));
+    }
+    return counters;
+}
+
+void close_perf_counters(PerfCounters* counters) {
+    if (!counters) {
+        return;
+    }
+    for (int i = 0; i < PERF_NUM_EVENTS; i++) {
+        if (counters->fds[i] >= 0) {
+            close(counters->fds[i]);
+        }
+    }
+    free(counters);
+}
+
+static int read_event(const PerfCounters* counters, int event, PerfReading* r) {
+    return read(counters->fds[event], r, sizeof(*r)) == sizeof(*r) ? 0 : -1;
+}
+
+void begin_perf_phase(PerfCounters* counters, int phase) {
+    if (!counters) {
+        return;
+    }
+    for (int i = 0; i < PERF_NUM_EVENTS; i++) {
+        if (counters->fds[i] >= 0 && read_event(counters, i, &counters->begin[i]) != 0) {
+            memset(&counters->begin[i], 0, sizeof(PerfReading));
+        }
+    }
+}
+
+void end_perf_phase(PerfCounters* counters, int phase) {
+    if (!counters || phase < 0 || phase >= PERF_MAX_PHASES) {
+        return;
+    }
+    for (int i = 0; i < PERF_NUM_EVENTS; i++) {
+        PerfReading end;
+        if (counters->fds[i] < 0 || read_event(counters, i, &end) != 0) {
+            continue;
+        }
+        double value = end.value - counters->begin[i].value;
+        uint64_t enabled = end.enabled - counters->begin[i].enabled;
+        uint64_t running = end.running - counters->begin[i].running;
+        if (running > 0 && running < enabled) {
+            value = value * enabled / running;
+        }
+        counters->counts[phase][i] += value;
+    }
+}
+
+int64_t perf_phase_count(const PerfCounters* counters, int phase, PerfEvent event) {
+    if (!counters || counters->fds[event] < 0) {
+        return -1;
+    }
+    return (int64_t) counters->counts[phase][event];
+}
+
+/* Writes a row of COUNTS, divided by NUM_INSTS unless it is 0. IPC is the
+   same either way. */
+static void write_row(const PerfCounters* counters, const char* name,
+    const double* counts, uint64_t num_insts, FILE* output) {
+    fprintf(output, "%-16s", name);
+    for (int i = 0; i < PERF_NUM_EVENTS; i++) {
+        if (counters->fds[i] < 0) {
+            fprintf(output, " %14s", "n/a");
+        } else if (num_insts > 0) {
+            fprintf(output, " %14.3f", counts[i] / num_insts);
+        } else if (i == PERF_TASK_CLOCK) {
+            fprintf(output, " %14.3f", counts[i] / 1e6);
+        } else {
+            fprintf(output, " %14.0f", counts[i]);
+        }
+        if (i == PERF_INSTRUCTIONS) {
+            if (counters->fds[PERF_CYCLES] < 0 || counters->fds[i] < 0
+                || counts[PERF_CYCLES] == 0) {
+                fprintf(output, " %6s", "n/a");
+            } else {
+                fprintf(output, " %6.2f", counts[i] / counts[PERF_CYCLES]);
+            }
+        }
+    }
+    fprintf(output, "\n");
+}
+
+/* Writes the header, a row per phase, the total and, if NUM_INSTS is not 0,
+   the total per instruction (with the task clock in ns). */
+void write_perf_report(const PerfCounters* counters, const char** names,
+    int num_phases, uint64_t num_insts, FILE* output) {
+    if (!counters) {
+        return;
+    }
+    double total[PERF_NUM_EVENTS] = { 0 };
+
+    fprintf(output, "%-16s", "counters");
+    for (int i = 0; i < PERF_NUM_EVENTS; i++) {
+        fprintf(output, " %14s", EVENT_NAMES[i]);
+        if (i == PERF_INSTRUCTIONS) {
+            fprintf(output, " %6s", "IPC");
+        }
+    }
+    fprintf(output, "\n");
+
+    for (int p = 0; p < num_phases && p < PERF_MAX_PHASES; p++) {
+        write_row(counters, names[p], counters->counts[p], 0, output);
+        for (int i = 0; i < PERF_NUM_EVENTS; i++) {
+            total[i] += counters->counts[p][i];
+        }
+    }
+    write_row(counters, "total", total, 0, output);
+    if (num_insts > 0) {
+        write_row(counters, "per instruction", total, num_insts, output);
+        fprintf(output, "(%llu instructions assembled; task clock per "
+            "instruction in ns)\n", (unsigned long long) num_insts);
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Hardware performance counters of the calling thread and the threads it
+   starts, read around phases of a run with Linux perf_event_open(). Counts
+   are of user-space events only. Counters the kernel or the hardware does
+   not provide (no PMU in a VM, perf_event_paranoid too high) are left out
+   and reported as n/a; a run never fails for lack of them.
+
+   All functions accept NULL for counters that could not be set up.
+ */
+
+typedef enum {
+    PERF_TASK_CLOCK,         // ns on the CPU, a software event
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,         // L1 data cache read misses
+    PERF_LLC_MISSES,         // last level cache misses
+    PERF_BRANCH_MISSES,
+    PERF_NUM_EVENTS
+} PerfEvent;
+
+#define PERF_MAX_PHASES 8
+
+typedef struct PerfCounters PerfCounters;
+
+/* Opens the counters, which count from then on; a phase is the difference
+   of their readings at its begin and end. Returns NULL if not even one is
+   available; the reason is written to the log. */
+PerfCounters* open_perf_counters();
+
+void close_perf_counters(PerfCounters* counters);
+
+/* Starts counting for PHASE; the counts until end_perf_phase() are added to
+   those of earlier runs of the phase. Phases must not overlap. */
+void begin_perf_phase(PerfCounters* counters, int phase);
+
+void end_perf_phase(PerfCounters* counters, int phase);
+
+/* Count of EVENT in PHASE, scaled up if the counter was multiplexed, or -1
+   if the event is not available. */
+int64_t perf_phase_count(const PerfCounters* counters, int phase, PerfEvent event);
+
+/* Writes a table of the first NUM_PHASES phases, named by NAMES, with their
+   total and the total per each of NUM_INSTS assembled instructions. */
+void write_perf_report(const PerfCounters* counters, const char** names,
+    int num_phases, uint64_t num_insts, FILE* output);
+
+#endif
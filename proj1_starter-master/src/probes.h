@@ -0,0 +1,56 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/* USDT probes for tracing live runs with perf or bpftrace, for example
+
+     bpftrace -e 'usdt:./assembler:assembler:translate { @[arg1] = count(); }'
+     perf probe -x ./assembler sdt_assembler:pass_two_end
+
+   A probe is a nop in the code and a note in the binary naming it and where
+   its arguments are, so it costs nothing until a tracer attaches. Probes
+   are compiled in where <sys/sdt.h> is available (systemtap-sdt-dev) and
+   not built with -DNO_PROBES; otherwise they expand to nothing and their
+   arguments are not evaluated.
+
+   Probes of provider "assembler":
+
+     pass_one_start (line_no, addr)       run_pass_one() starts at line_no
+     pass_one_end   (line_no, addr, err)
+     pass_two_start (line_no, addr)       pass two, any encoder or output
+     pass_two_end   (line_no, addr, err)
+     translate      (name, id, addr, res) an instruction was encoded; id is
+                                          MNEMONIC_ID() of the word, -1 on
+                                          error
+     symbol_insert  (name, probes, res)   add_to_table(); probes counts the
+                                          names compared
+     symbol_lookup  (name, probes, addr)  get_addr_for_symbol()
+     diagnostic     (fmt)                 a message went to the log
+ */
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+#define PROBE1(name, a) DTRACE_PROBE1(assembler, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(assembler, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(assembler, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(assembler, name, a, b, c, d)
+#else
+#define PROBE1(name, a) do { if (0) { (void) (a); } } while (0)
+#define PROBE2(name, a, b) do { if (0) { (void) (a); (void) (b); } } while (0)
+#define PROBE3(name, a, b, c) \
+    do { if (0) { (void) (a); (void) (b); (void) (c); } } while (0)
+#define PROBE4(name, a, b, c, d) \
+    do { if (0) { (void) (a); (void) (b); (void) (c); (void) (d); } } while (0)
+#endif
+
+/* Identifies the mnemonic of an encoded instruction: its opcode, or for
+   R-type instructions 0x40 plus its funct field. */
+#define MNEMONIC_ID(word) \
+    ((word) >> 26 ? (int) ((word) >> 26) : 0x40 | (int) ((word) & 0x3f))
+
+#endif
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "translate_utils.h"
+#include "pseudo.h"
+
+/* Which operands a rule takes, beyond their number. Registers and labels
+   are otherwise left for pass two to check. */
+typedef enum {
+    OPS_ANY,
+    OPS_SHORT_IMM,           // operand 1 fits the immediate of addiu
+    OPS_LONG_IMM,            // operand 1 is a 32-bit number that does not
+    OPS_ADDRESS              // operand 1 is a 32-bit number or a label
+} OperandCheck;
+
+/* Operands of an expanded instruction are literals or, starting with '%':
+     %0 %1 %2   the pseudo-instruction's operand
+     %imm       operand 1 as a number
+     %hi %lo    upper and lower half of operand 1, a number or a label
+ */
+typedef struct {
+    const char* name;
+    const char* args[PSEUDO_ARGS];
+} InstTemplate;
+
+typedef struct {
+    const char* name;
+    int num_args;
+    OperandCheck check;
+    int size;
+    InstTemplate insts[MAX_EXPANSION];
+} PseudoRule;
+
+/* Rules of one mnemonic are adjacent; the first that matches is used. */
+static const PseudoRule RULES[] = {
+    { "li",   2, OPS_SHORT_IMM, 1, { { "addiu", { "%0", "$zero", "%imm" } } } },
+    { "li",   2, OPS_LONG_IMM,  2, { { "lui",   { "$at", "%hi" } },
+                                     { "ori",   { "%0", "$at", "%lo" } } } },
+    { "la",   2, OPS_ADDRESS,   2, { { "lui",   { "$at", "%hi" } },
+                                     { "ori",   { "%0", "$at", "%lo" } } } },
+    { "move", 2, OPS_ANY,       1, { { "addu",  { "%0", "$zero", "%1" } } } },
+    { "neg",  2, OPS_ANY,       1, { { "subu",  { "%0", "$zero", "%1" } } } },
+    { "not",  2, OPS_ANY,       1, { { "nor",   { "%0", "%1", "$zero" } } } },
+    { "nop",  0, OPS_ANY,       1, { { "sll",   { "$zero", "$zero", "0" } } } },
+    { "b",    1, OPS_ANY,       1, { { "beq",   { "$zero", "$zero", "%0" } } } },
+    { "blt",  3, OPS_ANY,       2, { { "slt",   { "$at", "%0", "%1" } },
+                                     { "bne",   { "$at", "$zero", "%2" } } } },
+    { "bgt",  3, OPS_ANY,       2, { { "slt",   { "$at", "%1", "%0" } },
+                                     { "bne",   { "$at", "$zero", "%2" } } } },
+    { "ble",  3, OPS_ANY,       2, { { "slt",   { "$at", "%1", "%0" } },
+                                     { "beq",   { "$at", "$zero", "%2" } } } },
+    { "bge",  3, OPS_ANY,       2, { { "slt",   { "$at", "%0", "%1" } },
+                                     { "beq",   { "$at", "$zero", "%2" } } } },
+};
+
+#define NUM_RULES (sizeof(RULES) / sizeof(RULES[0]))
+
+/* Operand 1 as a number, read once for all the rules that look at it. */
+typedef struct {
+    int read;
+    int number;              // it is a 32-bit number
+    long int imm;
+} Immediate;
+
+static int read_imm(Immediate* imm, char** args) {
+    if (!imm->read) {
+        imm->read = 1;
+        imm->number = translate_num(&imm->imm, args[1], -2147483647L,
+            2147483647L) == 0;
+    }
+    return imm->number;
+}
+
+/* Same bounds as before the table: MARS's, off by one at both ends. */
+static int is_short_imm(long int imm) {
+    return imm >= -32769 && imm <= 32768;
+}
+
+static int check_operands(OperandCheck check, char** args, Immediate* imm) {
+    switch (check) {
+    case OPS_SHORT_IMM:
+        return read_imm(imm, args) && is_short_imm(imm->imm);
+    case OPS_LONG_IMM:
+        return read_imm(imm, args) && !is_short_imm(imm->imm);
+    case OPS_ADDRESS:
+        return read_imm(imm, args) || is_valid_label(args[1]);
+    default:
+        return 1;
+    }
+}
+
+/* Returns the rule for NAME that ARGS match, or NULL with *KNOWN set to
+   whether NAME is a pseudo-instruction at all. */
+static const PseudoRule* find_rule(const char* name, char** args, int num_args,
+    Immediate* imm, int* known) {
+    *known = 0;
+    for (size_t i = 0; i < NUM_RULES; i++) {
+        const PseudoRule* rule = &RULES[i];
+        if (rule->name[0] != name[0] || strcmp(rule->name, name) != 0) {
+            continue;
+        }
+        *known = 1;
+        if (rule->num_args == num_args && check_operands(rule->check, args, imm)) {
+            return rule;
+        }
+    }
+    return NULL;
+}
+
+int pseudo_size(const char* name, char** args, int num_args) {
+    Immediate imm = { 0 };
+    int known;
+    const PseudoRule* rule = find_rule(name, args, num_args, &imm, &known);
+    return rule ? rule->size : known ? 0 : -1;
+}
+
+/* Builds the computed operand T of ARGS at *BUF, of *LEFT bytes, and
+   advances both. Numbers are formatted as before the table, after a
+   space. Returns the operand, or NULL if it does not fit. */
+static char* computed_operand(const char* t, char** args, Immediate* imm,
+    char** buf, size_t* left) {
+    int n;
+    if (t[1] == 'i') {
+        read_imm(imm, args);
+        n = snprintf(*buf, *left, " %ld", imm->imm);
+    } else if (read_imm(imm, args)) {
+        uint32_t half = t[1] == 'h' ? (uint32_t) imm->imm >> 16
+                                    : (uint32_t) imm->imm & 0xFFFF;
+        n = snprintf(*buf, *left, " 0x%x", half);
+    } else {
+        n = snprintf(*buf, *left, "%s(%s)", t, args[1]);
+    }
+    if (n < 0 || (size_t) n >= *left) {
+        return NULL;
+    }
+    char* operand = *buf;
+    *buf += n + 1;
+    *left -= n + 1;
+    return operand;
+}
+
+int expand_pseudo(const char* name, char** args, int num_args, InstRecord* out,
+    char* buf, size_t size) {
+    Immediate imm = { 0 };
+    int known;
+    const PseudoRule* rule = find_rule(name, args, num_args, &imm, &known);
+    if (!rule) {
+        return known ? 0 : -1;
+    }
+
+    for (int i = 0; i < rule->size; i++) {
+        const InstTemplate* inst = &rule->insts[i];
+        out[i].name = inst->name;
+        out[i].num_args = 0;
+        for (int a = 0; a < PSEUDO_ARGS && inst->args[a]; a++) {
+            const char* t = inst->args[a];
+            char* operand;
+            if (t[0] != '%') {
+                operand = (char*) t;
+            } else if (t[1] >= '0' && t[1] <= '2') {
+                operand = args[t[1] - '0'];
+            } else if (!(operand = computed_operand(t, args, &imm, &buf, &size))) {
+                return 0;
+            }
+            out[i].args[out[i].num_args++] = operand;
+        }
+    }
+    return rule->size;
+}
@@ -0,0 +1,43 @@
+#ifndef PSEUDO_H
+#define PSEUDO_H
+
+#include <stddef.h>
+
+/* Pseudo-instructions, expanded in pass one from the table of rules in
+   pseudo.c. A rule gives a mnemonic, its number of operands, a check on
+   the operands that selects between rules of the same mnemonic (li takes
+   one word or two depending on its immediate), and the instructions it
+   expands to, whose operands are literals or taken from the pseudo-
+   instruction's.
+
+   la loads the address of a label with lui/ori and the operands
+   %hi(label) and %lo(label), resolved in pass two from the symbol table.
+   Only data labels, at fixed addresses, may be loaded: text labels are
+   offsets in .text, which the linker moves, and pass two rejects them.
+ */
+
+#define MAX_EXPANSION 2          // instructions per pseudo-instruction
+#define PSEUDO_ARGS 3
+
+/* Computed operands: two halves of a label of a 1024-byte line. */
+#define PSEUDO_BUF_SIZE 2080
+
+/* One instruction of an expansion. */
+typedef struct {
+    const char* name;
+    char* args[PSEUDO_ARGS];
+    int num_args;
+} InstRecord;
+
+/* Expands NAME with the NUM_ARGS operands ARGS into OUT, which holds
+   MAX_EXPANSION records. Computed operands are built in BUF, of SIZE
+   bytes; the others point to ARGS or to constants. Returns the number of
+   records, 0 if the operands fit no rule of NAME, or -1 if NAME is not a
+   pseudo-instruction. */
+int expand_pseudo(const char* name, char** args, int num_args, InstRecord* out,
+    char* buf, size_t size);
+
+/* Same as expand_pseudo(), but only returns the number of records. */
+int pseudo_size(const char* name, char** args, int num_args);
+
+#endif
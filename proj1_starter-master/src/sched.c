@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "tables.h"
+#include "sched.h"
+
+typedef struct {
+    TaskFunc func;
+    void* arg;
+} Task;
+
+/* A worker's deque, kept as a ring buffer. The owner pushes and pops at
+   TAIL, thieves take from HEAD. */
+typedef struct {
+    Task* tasks;
+    size_t cap;
+    size_t head;
+    size_t tail;
+    pthread_mutex_t lock;
+    WorkerStats stats;
+    unsigned seed;
+} WorkerQueue;
+
+struct Scheduler {
+    WorkerQueue* queues;
+    unsigned num_workers;
+    unsigned next_queue;     // round-robin target for tasks spawned outside
+    long outstanding;        // spawned tasks that have not finished
+    uint64_t wall_ns;
+};
+
+typedef struct {
+    Scheduler* sched;
+    unsigned index;
+} WorkerArg;
+
+/* The scheduler and worker the calling thread belongs to, if any. */
+static __thread Scheduler* current_sched = NULL;
+static __thread unsigned current_worker = 0;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/*******************************
+ * Deques
+ *******************************/
+
+static void push_task(WorkerQueue* q, TaskFunc func, void* arg) {
+    pthread_mutex_lock(&q->lock);
+    if (q->tail - q->head == q->cap) {
+        size_t new_cap = q->cap * 2;
+        Task* tasks = malloc(new_cap * sizeof(Task));
+        if (!tasks) {
+            allocation_failed();
+        }
+        for (size_t i = q->head; i < q->tail; i++) {
+            tasks[i - q->head] = q->tasks[i % q->cap];
+        }
+        free(q->tasks);
+        q->tasks = tasks;
+        q->tail -= q->head;
+        q->head = 0;
+        q->cap = new_cap;
+    }
+    q->tasks[q->tail % q->cap].func = func;
+    q->tasks[q->tail % q->cap].arg = arg;
+    q->tail++;
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Takes the newest task (owner) or the oldest task (thief) from Q. Returns
+   0 on success and -1 if Q is empty. */
+static int take_task(WorkerQueue* q, int steal, Task* task) {
+    int res = -1;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->tail != q->head) {
+        if (steal) {
+            *task = q->tasks[q->head % q->cap];
+            q->head++;
+        } else {
+            q->tail--;
+            *task = q->tasks[q->tail % q->cap];
+        }
+        res = 0;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return res;
+}
+
+/*******************************
+ * Workers
+ *******************************/
+
+/* Finds a task for worker SELF: its own newest task, or else the oldest task
+   of another worker, probing victims from a random start. */
+static int find_task(Scheduler* sched, unsigned self, Task* task) {
+    WorkerQueue* own = &sched->queues[self];
+
+    if (take_task(own, 0, task) == 0) {
+        return 0;
+    }
+
+    unsigned n = sched->num_workers;
+    unsigned start = n > 1 ? rand_r(&own->seed) % n : 0;
+    for (unsigned i = 0; i < n; i++) {
+        unsigned victim = (start + i) % n;
+        if (victim == self) continue;
+
+        own->stats.steal_attempts++;
+        if (take_task(&sched->queues[victim], 1, task) == 0) {
+            own->stats.steals++;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void* worker_main(void* arg) {
+    Scheduler* sched = ((WorkerArg*) arg)->sched;
+    unsigned self = ((WorkerArg*) arg)->index;
+    WorkerStats* stats = &sched->queues[self].stats;
+    Task task;
+
+    current_sched = sched;
+    current_worker = self;
+
+    while (__atomic_load_n(&sched->outstanding, __ATOMIC_ACQUIRE) > 0) {
+        if (find_task(sched, self, &task) != 0) {
+            sched_yield();
+            continue;
+        }
+
+        uint64_t start = now_ns();
+        task.func(task.arg);
+        stats->busy_ns += now_ns() - start;
+        stats->tasks++;
+
+        __atomic_sub_fetch(&sched->outstanding, 1, __ATOMIC_RELEASE);
+    }
+
+    current_sched = NULL;
+    return NULL;
+}
+
+/*******************************
+ * Scheduler
+ *******************************/
+
+Scheduler* create_scheduler(unsigned num_workers) {
+    Scheduler* sched = malloc(sizeof(Scheduler));
+    if (!sched) {
+        allocation_failed();
+    }
+
+    sched->num_workers = num_workers ? num_workers : 1;
+    sched->queues = calloc(sched->num_workers, sizeof(WorkerQueue));
+    if (!sched->queues) {
+        allocation_failed();
+    }
+    for (unsigned i = 0; i < sched->num_workers; i++) {
+        WorkerQueue* q = &sched->queues[i];
+        q->cap = 64;
+        q->tasks = malloc(q->cap * sizeof(Task));
+        if (!q->tasks) {
+            allocation_failed();
+        }
+        q->seed = i + 1;
+        pthread_mutex_init(&q->lock, NULL);
+    }
+    sched->next_queue = 0;
+    sched->outstanding = 0;
+    sched->wall_ns = 0;
+    return sched;
+}
+
+void free_scheduler(Scheduler* sched) {
+    if (!sched) return;
+
+    for (unsigned i = 0; i < sched->num_workers; i++) {
+        free(sched->queues[i].tasks);
+        pthread_mutex_destroy(&sched->queues[i].lock);
+    }
+    free(sched->queues);
+    free(sched);
+}
+
+void sched_spawn(Scheduler* sched, TaskFunc func, void* arg) {
+    unsigned target;
+
+    if (current_sched == sched) {
+        target = current_worker;
+    } else {
+        target = __atomic_fetch_add(&sched->next_queue, 1, __ATOMIC_RELAXED)
+            % sched->num_workers;
+    }
+
+    __atomic_add_fetch(&sched->outstanding, 1, __ATOMIC_RELEASE);
+    push_task(&sched->queues[target], func, arg);
+}
+
+void sched_run(Scheduler* sched) {
+    unsigned n = sched->num_workers;
+    pthread_t* threads = malloc(n * sizeof(pthread_t));
+    WorkerArg* args = malloc(n * sizeof(WorkerArg));
+    if (!threads || !args) {
+        allocation_failed();
+    }
+
+    uint64_t start = now_ns();
+
+    /* Worker 0 is the calling thread. */
+    unsigned started = 1;
+    for (unsigned i = 0; i < n; i++) {
+        args[i].sched = sched;
+        args[i].index = i;
+    }
+    for (; started < n; started++) {
+        if (pthread_create(&threads[started], NULL, worker_main, &args[started]) != 0) {
+            break;      // fewer threads, the remaining deques get stolen from
+        }
+    }
+    worker_main(&args[0]);
+    for (unsigned i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    sched->wall_ns = now_ns() - start;
+    free(threads);
+    free(args);
+}
+
+void write_sched_stats(Scheduler* sched, FILE* output) {
+    double wall = sched->wall_ns ? (double) sched->wall_ns : 1.0;
+
+    fprintf(output, "worker\ttasks\tsteals\tprobes\tbusy_ms\tutilization\n");
+    for (unsigned i = 0; i < sched->num_workers; i++) {
+        WorkerStats* s = &sched->queues[i].stats;
+        fprintf(output, "%u\t%llu\t%llu\t%llu\t%.1f\t%.1f%%\n", i,
+            (unsigned long long) s->tasks, (unsigned long long) s->steals,
+            (unsigned long long) s->steal_attempts, s->busy_ns / 1e6,
+            100.0 * s->busy_ns / wall);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* A work-stealing task scheduler. Each worker thread owns a deque of tasks:
+   tasks spawned by a worker go to the bottom of its own deque and are run
+   newest-first, and an idle worker steals the oldest task from another
+   worker's deque.
+ */
+
+typedef void (*TaskFunc)(void* arg);
+
+typedef struct Scheduler Scheduler;
+
+/* Per-worker counters, reported by write_sched_stats(). */
+typedef struct {
+    uint64_t tasks;          // tasks run by this worker
+    uint64_t steals;         // tasks taken from other workers' deques
+    uint64_t steal_attempts; // deques probed while looking for work
+    uint64_t busy_ns;        // time spent running tasks
+} WorkerStats;
+
+/* Creates a scheduler with NUM_WORKERS worker threads (at least 1). */
+Scheduler* create_scheduler(unsigned num_workers);
+
+/* Frees the scheduler. Must not be called while sched_run() is running. */
+void free_scheduler(Scheduler* sched);
+
+/* Adds a task that calls FUNC(ARG). From inside a task the task goes to the
+   calling worker's deque; otherwise the deques are filled round-robin. */
+void sched_spawn(Scheduler* sched, TaskFunc func, void* arg);
+
+/* Runs tasks on the worker threads until every spawned task, including the
+   ones spawned while running, has finished. */
+void sched_run(Scheduler* sched);
+
+/* Writes per-worker utilization and steal counts to OUTPUT. */
+void write_sched_stats(Scheduler* sched, FILE* output);
+
+#endif
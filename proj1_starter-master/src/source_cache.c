@@ -0,0 +1,541 @@
+#define _GNU_SOURCE              // memmem()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "utils.h"
+#include "tables.h"
+#include "memstats.h"
+#include "source_cache.h"
+
+static const char* DELIMS = " \f\n\r\t\v,";
+
+#define PATH_SIZE 4096
+#define LINE_SIZE 1024           // BUF_SIZE of assembler.c
+
+/* A path as last seen, and the file it held. */
+typedef struct SourcePath {
+    char* path;
+    struct timespec mtime;
+    off_t size;
+    const SourceFile* file;
+    struct SourcePath* next;
+} SourcePath;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static SourceFile* file_list = NULL;
+static SourcePath* path_list = NULL;
+static uint32_t loads = 0;
+static size_t cache_bytes = 0;           // of the files in file_list
+static size_t cache_limit = SOURCE_CACHE_LIMIT;
+static uint64_t use_clock = 0;
+static int load_threads = 0;             // running, across all loads
+
+/* Truncates the string at the first occurrence of the '#' character that is
+   not in a string literal of .ascii. */
+static void skip_comment(char* str) {
+    char* p = str;
+    for (;;) {
+        char* comment_start = strchr(p, '#');
+        if (!comment_start) {
+            return;
+        }
+        char* quote = memchr(p, '"', comment_start - p);
+        if (!quote) {
+            *comment_start = '\0';
+            return;
+        }
+        for (p = quote + 1; *p && *p != '"'; p++) {
+            if (*p == '\\' && p[1]) {
+                p++;
+            }
+        }
+        if (!*p) {
+            return;             // unterminated, reported by the directive
+        }
+        p++;
+    }
+}
+
+int tokenize_line(char* buf, SourceLine* line) {
+    char* save;
+    skip_comment(buf);
+    char* pch = strtok_r(buf, DELIMS, &save);
+    if (!pch) {
+        return 0;
+    }
+
+    line->label = NULL;
+    size_t len = strlen(pch);
+    if (pch[len - 1] == ':') {
+        pch[len - 1] = '\0';
+        line->label = pch;
+        pch = strtok_r(NULL, DELIMS, &save);
+    }
+    line->name = pch;
+    line->column = pch ? pch - buf + 1 : 0;
+    line->num_args = 0;
+    line->extra = NULL;
+    line->operands = NULL;
+    if (!pch) {
+        return 1;
+    }
+    if (pch[0] == '.') {
+        line->operands = save;
+        return 1;
+    }
+
+    for (pch = strtok_r(NULL, DELIMS, &save); pch != NULL;
+        pch = strtok_r(NULL, DELIMS, &save)) {
+        if (line->num_args == SOURCE_MAX_ARGS) {
+            line->extra = pch;
+            break;
+        }
+        line->args[line->num_args++] = pch;
+    }
+    return 1;
+}
+
+int include_path(const char* operands, char* path, size_t size) {
+    const char* p = operands + strspn(operands, DELIMS);
+    if (*p != '"') {
+        return -1;
+    }
+    const char* end = strchr(p + 1, '"');
+    if (!end || end == p + 1 || (size_t) (end - p - 1) >= size
+        || end[1 + strspn(end + 1, DELIMS)] != '\0') {
+        return -1;
+    }
+    memcpy(path, p + 1, end - p - 1);
+    path[end - p - 1] = '\0';
+    return 0;
+}
+
+int resolve_source_path(const char* including, const char* path, char* out,
+    size_t size) {
+    const char* slash = including && path[0] != '/' ? strrchr(including, '/') : NULL;
+    size_t dir_len = slash ? (size_t) (slash - including + 1) : 0;
+    size_t len = strlen(path);
+    if (dir_len + len >= size) {
+        return -1;
+    }
+    if (dir_len > 0) {
+        memcpy(out, including, dir_len);
+    }
+    memcpy(out + dir_len, path, len + 1);
+    return 0;
+}
+
+static uint64_t hash_text(const char* text, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ (uint8_t) text[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/* Splits FILE->text into lines and tokenizes them. */
+static void tokenize_file(SourceFile* file) {
+    uint32_t cap = 0;
+    uint32_t line_no = 0;
+    char* p = file->text;
+    char* end = file->text + file->size;
+
+    while (p < end) {
+        char* newline = memchr(p, '\n', end - p);
+        if (newline) {
+            *newline = '\0';
+        }
+        line_no++;
+        if (file->num_lines == cap) {
+            uint32_t old_cap = cap;
+            cap = cap ? cap * 2 : 64;
+            file->lines = realloc(file->lines, cap * sizeof(SourceLine));
+            if (!file->lines) {
+                allocation_failed();
+            }
+            MEM_RESIZE(MEM_LINES, old_cap * sizeof(SourceLine),
+                cap * sizeof(SourceLine));
+        }
+        SourceLine* line = &file->lines[file->num_lines];
+        if (tokenize_line(p, line)) {
+            line->line_no = line_no;
+            file->num_lines++;
+        }
+        p = newline ? newline + 1 : end;
+    }
+    if (file->num_lines < cap) {    // cached for the rest of the run
+        file->lines = realloc(file->lines,
+            (file->num_lines ? file->num_lines : 1) * sizeof(SourceLine));
+        if (!file->lines) {
+            allocation_failed();
+        }
+        MEM_RESIZE(MEM_LINES, cap * sizeof(SourceLine),
+            file->num_lines * sizeof(SourceLine));
+    }
+}
+
+static size_t file_bytes(const SourceFile* file) {
+    return file->size + 1 + file->num_lines * sizeof(SourceLine);
+}
+
+static void free_file(SourceFile* file) {
+    MEM_FREE(MEM_LINES, file_bytes(file));
+    free(file->text);
+    free(file->lines);
+    free(file);
+}
+
+/* Takes a reference to FILE. Called with cache_lock held. */
+static const SourceFile* hold_file(SourceFile* file) {
+    file->refs++;
+    file->used = ++use_clock;
+    return file;
+}
+
+static void free_path(SourcePath* p) {
+    MEM_FREE(MEM_STRINGS, strlen(p->path) + 1);
+    MEM_FREE(MEM_LINES, sizeof(SourcePath));
+    free(p->path);
+    free(p);
+}
+
+/* Drops the least recently used files no one holds, and the paths that
+   lead to them, until the cache is within its limit. Called with
+   cache_lock held. */
+static void evict_files() {
+    while (cache_bytes > cache_limit) {
+        SourceFile** oldest = NULL;
+        for (SourceFile** f = &file_list; *f != NULL; f = &(*f)->next) {
+            if ((*f)->refs == 0 && (!oldest || (*f)->used < (*oldest)->used)) {
+                oldest = f;
+            }
+        }
+        if (!oldest) {
+            return;
+        }
+        SourceFile* file = *oldest;
+        *oldest = file->next;
+        for (SourcePath** p = &path_list; *p != NULL; ) {
+            if ((*p)->file == file) {
+                SourcePath* dead = *p;
+                *p = dead->next;
+                free_path(dead);
+            } else {
+                p = &(*p)->next;
+            }
+        }
+        cache_bytes -= file_bytes(file);
+        free_file(file);
+    }
+}
+
+void release_source_file(const SourceFile* file) {
+    if (!file) {
+        return;
+    }
+    pthread_mutex_lock(&cache_lock);
+    ((SourceFile*) file)->refs--;
+    evict_files();
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void set_source_cache_limit(size_t bytes) {
+    pthread_mutex_lock(&cache_lock);
+    cache_limit = bytes;
+    evict_files();
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* Reads PATH, open as FD, into a new SourceFile. */
+static SourceFile* read_file(int fd, const struct stat* st) {
+    SourceFile* file = calloc(1, sizeof(SourceFile));
+    char* text = malloc(st->st_size + 1);
+    if (!file || !text) {
+        allocation_failed();
+    }
+    size_t done = 0;
+    while (done < (size_t) st->st_size) {
+        ssize_t n = read(fd, text + done, st->st_size - done);
+        if (n <= 0) {
+            break;              // shrank meanwhile: keep what is there
+        }
+        done += n;
+    }
+    text[done] = '\0';
+    file->text = text;
+    file->size = done;
+    file->hash = hash_text(text, done);
+    MEM_ALLOC(MEM_LINES, done + 1);
+    return file;
+}
+
+static SourcePath* find_path(const char* path) {
+    for (SourcePath* p = path_list; p != NULL; p = p->next) {
+        if (strcmp(p->path, path) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static SourceFile* find_file(uint64_t hash, size_t size) {
+    for (SourceFile* f = file_list; f != NULL; f = f->next) {
+        if (f->hash == hash && f->size == size) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+static int same_stamp(const SourcePath* p, const struct stat* st) {
+    return p->size == st->st_size && p->mtime.tv_sec == st->st_mtim.tv_sec
+        && p->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* Loads the includes FILE, read from FROM, makes. */
+static void load_includes_of(const SourceFile* file, const char* from) {
+    char name[PATH_SIZE];
+    char path[PATH_SIZE];
+    char** children = NULL;
+    int num_children = 0;
+
+    for (uint32_t i = 0; i < file->num_lines; i++) {
+        const SourceLine* line = &file->lines[i];
+        if (line->name && strcmp(line->name, ".include") == 0
+            && include_path(line->operands, name, sizeof(name)) == 0
+            && resolve_source_path(from, name, path, sizeof(path)) == 0) {
+            children = realloc(children, (num_children + 1) * sizeof(char*));
+            if (!children) {
+                allocation_failed();
+            }
+            children[num_children++] = strdup(path);
+        }
+    }
+    load_source_files(children, num_children);
+    for (int i = 0; i < num_children; i++) {
+        MEM_FREE(MEM_STRINGS, strlen(children[i]) + 1);
+        free(children[i]);
+    }
+    free(children);
+}
+
+/* get_source_file(), logging errors only if LOG_ERRORS is set. */
+static const SourceFile* load_file(const char* path, int log_errors) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (log_errors) {
+            write_to_log("Error: unable to open included file: %s\n", path);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    SourcePath* seen = find_path(path);
+    if (seen && same_stamp(seen, &st)) {
+        const SourceFile* file = hold_file((SourceFile*) seen->file);
+        pthread_mutex_unlock(&cache_lock);
+        close(fd);
+        return file;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    /* Read and hash outside the lock; tokenize only if the contents are
+       new. Of two threads loading the same contents, the first to finish
+       wins and the other drops its copy. */
+    SourceFile* fresh = read_file(fd, &st);
+    close(fd);
+
+    pthread_mutex_lock(&cache_lock);
+    SourceFile* file = find_file(fresh->hash, fresh->size);
+    if (file) {
+        hold_file(file);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    int loaded = 0;
+    if (!file) {
+        tokenize_file(fresh);
+        pthread_mutex_lock(&cache_lock);
+        file = find_file(fresh->hash, fresh->size);
+        if (!file) {
+            fresh->next = file_list;
+            file_list = file = fresh;
+            cache_bytes += file_bytes(file);
+            loads++;
+            loaded = 1;
+        }
+        hold_file(file);
+        evict_files();
+        pthread_mutex_unlock(&cache_lock);
+    }
+    if (file != fresh) {
+        free_file(fresh);
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    seen = find_path(path);
+    if (!seen) {
+        seen = calloc(1, sizeof(SourcePath));
+        if (!seen) {
+            allocation_failed();
+        }
+        MEM_ALLOC(MEM_LINES, sizeof(SourcePath));
+        seen->path = strdup(path);
+        seen->next = path_list;
+        path_list = seen;
+    }
+    seen->mtime = st.st_mtim;
+    seen->size = st.st_size;
+    seen->file = file;
+    pthread_mutex_unlock(&cache_lock);
+
+    /* In the cache first, so an include cycle ends at this file. */
+    if (loaded) {
+        load_includes_of(file, path);
+    }
+    return file;
+}
+
+const SourceFile* get_source_file(const char* path) {
+    return load_file(path, 1);
+}
+
+typedef struct {
+    char** paths;
+    int num_paths;
+    int next;                // index of the next path to load
+} LoadQueue;
+
+static void* load_worker(void* arg) {
+    LoadQueue* queue = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED))
+        < queue->num_paths) {
+        release_source_file(load_file(queue->paths[i], 0));
+    }
+    return NULL;
+}
+
+/* Claims one of the LOAD_THREADS threads. Returns 1 if there was one. */
+static int claim_load_thread() {
+    if (__atomic_add_fetch(&load_threads, 1, __ATOMIC_RELAXED) <= LOAD_THREADS) {
+        return 1;
+    }
+    __atomic_sub_fetch(&load_threads, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void load_source_files(char** paths, int num_paths) {
+    LoadQueue queue = { paths, num_paths, 0 };
+    pthread_t threads[LOAD_THREADS];
+    int num_threads = 0;
+
+    /* The calling thread loads too; one path needs no other thread. Nested
+       includes come back here from the threads, so their number is capped
+       across all calls. */
+    while (num_threads < LOAD_THREADS && num_threads + 1 < num_paths
+        && claim_load_thread()) {
+        if (pthread_create(&threads[num_threads], NULL, load_worker, &queue) != 0) {
+            __atomic_sub_fetch(&load_threads, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        num_threads++;
+    }
+    load_worker(&queue);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    __atomic_sub_fetch(&load_threads, num_threads, __ATOMIC_RELAXED);
+}
+
+void prefetch_includes(const char* path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    char** children = NULL;
+    int num_children = 0;
+    const char* end = map + st.st_size;
+    const char* p = memmem(map, st.st_size, ".include", 8);
+    while (p) {
+        /* Tokenize the line it is on, which may be a comment. */
+        const char* start = p;
+        while (start > map && start[-1] != '\n') {
+            start--;
+        }
+        const char* newline = memchr(p, '\n', end - p);
+        const char* line_end = newline ? newline : end;
+
+        char buf[LINE_SIZE];
+        char name[PATH_SIZE];
+        char child[PATH_SIZE];
+        SourceLine line;
+        if (line_end - start < LINE_SIZE) {
+            memcpy(buf, start, line_end - start);
+            buf[line_end - start] = '\0';
+            if (tokenize_line(buf, &line) && line.name
+                && strcmp(line.name, ".include") == 0
+                && include_path(line.operands, name, sizeof(name)) == 0
+                && resolve_source_path(path, name, child, sizeof(child)) == 0) {
+                children = realloc(children, (num_children + 1) * sizeof(char*));
+                if (!children) {
+                    allocation_failed();
+                }
+                children[num_children++] = strdup(child);
+            }
+        }
+        p = newline ? memmem(newline, end - newline, ".include", 8) : NULL;
+    }
+    munmap(map, st.st_size);
+
+    load_source_files(children, num_children);
+    for (int i = 0; i < num_children; i++) {
+        MEM_FREE(MEM_STRINGS, strlen(children[i]) + 1);
+        free(children[i]);
+    }
+    free(children);
+}
+
+uint32_t source_cache_loads() {
+    pthread_mutex_lock(&cache_lock);
+    uint32_t n = loads;
+    pthread_mutex_unlock(&cache_lock);
+    return n;
+}
+
+void free_source_cache() {
+    pthread_mutex_lock(&cache_lock);
+    while (file_list) {
+        SourceFile* next = file_list->next;
+        free_file(file_list);
+        file_list = next;
+    }
+    while (path_list) {
+        SourcePath* next = path_list->next;
+        free_path(path_list);
+        path_list = next;
+    }
+    loads = 0;
+    cache_bytes = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,96 @@
+#ifndef SOURCE_CACHE_H
+#define SOURCE_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Tokenized source lines, and a cache of files tokenized for .include.
+
+   A file is read and tokenized once per process. Later includes of the
+   same path reuse it while the file's size and mtime are unchanged, and a
+   changed or different path whose contents hash the same shares the copy
+   already there. The cache is shared by all threads, so the jobs of a batch
+   reuse each other's includes. Includes a file makes are loaded in
+   parallel as soon as it is tokenized, by at most LOAD_THREADS threads
+   at a time across all levels and jobs.
+
+   Files in use are held by a reference. Once the files kept pass the
+   cache limit, those no longer in use are dropped, least recently used
+   first.
+
+   A relative path in an .include is taken from the directory of the file
+   that has it (see resolve_source_path()).
+ */
+
+#define SOURCE_MAX_ARGS 8        // a macro's; instructions take MAX_ARGS
+#define MAX_INCLUDE_DEPTH 16
+#define LOAD_THREADS 8           // loading includes, besides the callers
+#define SOURCE_CACHE_LIMIT (64u << 20)   // bytes of files kept, by default
+
+/* One line: comments removed, the label split off without its ':'. The
+   strings point into the tokenized text. Directives (names starting with
+   '.') are not split into arguments; OPERANDS holds the rest of the line.
+ */
+typedef struct {
+    uint32_t line_no;
+    uint32_t column;         // of NAME, from 1
+    char* label;             // NULL if none
+    char* name;              // NULL if the line holds only a label
+    char* args[SOURCE_MAX_ARGS];
+    int num_args;
+    char* extra;             // first argument past SOURCE_MAX_ARGS, or NULL
+    char* operands;          // the text after a directive, or NULL
+} SourceLine;
+
+/* A tokenized file. Never changes once in the cache. */
+typedef struct SourceFile {
+    uint64_t hash;           // FNV-1a of the contents
+    size_t size;
+    char* text;
+    SourceLine* lines;       // non-blank lines only
+    uint32_t num_lines;
+    uint32_t refs;           // get_source_file() calls not yet released
+    uint64_t used;           // when last got, to drop the oldest first
+    struct SourceFile* next;
+} SourceFile;
+
+/* Tokenizes BUF in place into LINE, leaving LINE->line_no alone. Returns 0
+   if the line is blank (or a comment), 1 otherwise. */
+int tokenize_line(char* buf, SourceLine* line);
+
+/* Copies the quoted path of an .include out of OPERANDS into PATH, of
+   SIZE bytes. Returns 0, or -1 if OPERANDS are not one quoted path. */
+int include_path(const char* operands, char* path, size_t size);
+
+/* Resolves PATH, named in the file INCLUDING, into OUT of SIZE bytes: a
+   relative path is taken from the directory of INCLUDING, or from the
+   working directory if INCLUDING is NULL. Returns 0, or -1 if it does not
+   fit. */
+int resolve_source_path(const char* including, const char* path, char* out,
+    size_t size);
+
+/* Returns the tokenized file PATH, reading it if it is not cached or has
+   changed, and holds it until release_source_file(). Returns NULL after
+   logging an error if it cannot be read. */
+const SourceFile* get_source_file(const char* path);
+
+/* Lets the cache drop FILE, if it is not NULL, once no one else holds it. */
+void release_source_file(const SourceFile* file);
+
+/* Sets the bytes of files the cache keeps before it drops unused ones. */
+void set_source_cache_limit(size_t bytes);
+
+/* Loads the NUM_PATHS files in PATHS into the cache, in parallel. Files that
+   cannot be read are left for get_source_file() to report. */
+void load_source_files(char** paths, int num_paths);
+
+/* Loads the files the source file PATH includes, if it has any. */
+void prefetch_includes(const char* path);
+
+/* Number of files read and tokenized so far. */
+uint32_t source_cache_loads();
+
+/* Empties the cache. No file returned before may be in use. */
+void free_source_cache();
+
+#endif
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tables.h"
+#include "memstats.h"
+#include "source_map.h"
+
+/* Each entry is a varint of (zigzag(line delta) << 2 | file changed << 1
+   | column changed), followed by varints of the file and the column if
+   they changed. */
+
+static void put_byte(SourceMap* map, uint8_t byte) {
+    if (map->len == map->cap) {
+        size_t old_cap = map->cap;
+        map->cap = map->cap ? map->cap * 2 : 256;
+        map->data = realloc(map->data, map->cap);
+        MEM_RESIZE(MEM_SOURCE_MAP, old_cap, map->cap);
+        if (!map->data) {
+            allocation_failed();
+        }
+    }
+    map->data[map->len++] = byte;
+}
+
+static void put_varint(SourceMap* map, uint64_t value) {
+    while (value >= 0x80) {
+        put_byte(map, (uint8_t) (value | 0x80));
+        value >>= 7;
+    }
+    put_byte(map, (uint8_t) value);
+}
+
+static uint64_t get_varint(const uint8_t* data, size_t* pos) {
+    uint64_t value = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+        byte = data[(*pos)++];
+        value |= (uint64_t) (byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return value;
+}
+
+SourceMap* create_source_map() {
+    SourceMap* map = calloc(1, sizeof(SourceMap));
+    if (!map) {
+        allocation_failed();
+    }
+    MEM_ALLOC(MEM_SOURCE_MAP, sizeof(SourceMap));
+    return map;
+}
+
+void free_source_map(SourceMap* map) {
+    if (!map) {
+        return;
+    }
+    MEM_FREE(MEM_SOURCE_MAP, sizeof(SourceMap) + map->cap
+        + map->checkpoint_cap * sizeof(SourceMapCheckpoint)
+        + map->file_cap * sizeof(char*));
+    for (uint32_t i = 0; i < map->num_files; i++) {
+        MEM_FREE(MEM_STRINGS, strlen(map->files[i]) + 1);
+        free(map->files[i]);
+    }
+    free(map->files);
+    free(map->data);
+    free(map->checkpoints);
+    free(map);
+}
+
+uint32_t source_map_file(SourceMap* map, const char* path) {
+    for (uint32_t i = 0; i < map->num_files; i++) {
+        if (strcmp(map->files[i], path) == 0) {
+            return i + 1;
+        }
+    }
+    if (map->num_files == map->file_cap) {
+        uint32_t old_cap = map->file_cap;
+        map->file_cap = map->file_cap ? map->file_cap * 2 : 8;
+        map->files = realloc(map->files, map->file_cap * sizeof(char*));
+        MEM_RESIZE(MEM_SOURCE_MAP, old_cap * sizeof(char*),
+            map->file_cap * sizeof(char*));
+        if (!map->files) {
+            allocation_failed();
+        }
+    }
+    map->files[map->num_files] = strdup(path);
+    if (!map->files[map->num_files]) {
+        allocation_failed();
+    }
+    return ++map->num_files;
+}
+
+const char* source_map_path(const SourceMap* map, uint32_t file) {
+    return map && file > 0 && file <= map->num_files ? map->files[file - 1] : NULL;
+}
+
+void source_map_add(SourceMap* map, uint32_t line, uint32_t column) {
+    source_map_add_in(map, 0, line, column);
+}
+
+void source_map_add_in(SourceMap* map, uint32_t file, uint32_t line,
+    uint32_t column) {
+    if (map->count % SRCMAP_CHECKPOINT == 0) {
+        uint32_t n = map->count / SRCMAP_CHECKPOINT;
+        if (n == map->checkpoint_cap) {
+            uint32_t old_cap = map->checkpoint_cap;
+            map->checkpoint_cap = map->checkpoint_cap ? map->checkpoint_cap * 2 : 16;
+            map->checkpoints = realloc(map->checkpoints,
+                map->checkpoint_cap * sizeof(SourceMapCheckpoint));
+            MEM_RESIZE(MEM_SOURCE_MAP, old_cap * sizeof(SourceMapCheckpoint),
+                map->checkpoint_cap * sizeof(SourceMapCheckpoint));
+            if (!map->checkpoints) {
+                allocation_failed();
+            }
+        }
+        map->checkpoints[n].pos = map->len;
+        map->checkpoints[n].line = map->last_line;
+        map->checkpoints[n].column = map->last_column;
+        map->checkpoints[n].file = map->last_file;
+    }
+
+    int64_t delta = (int64_t) line - map->last_line;
+    uint64_t zigzag = delta < 0 ? ((uint64_t) -delta << 1) - 1 : (uint64_t) delta << 1;
+    int column_changed = column != map->last_column;
+    int file_changed = file != map->last_file;
+
+    put_varint(map, zigzag << 2 | file_changed << 1 | column_changed);
+    if (file_changed) {
+        put_varint(map, file);
+    }
+    if (column_changed) {
+        put_varint(map, column);
+    }
+    map->last_line = line;
+    map->last_column = column;
+    map->last_file = file;
+    map->count++;
+}
+
+void source_map_begin(SourceMapCursor* cursor, const SourceMap* map) {
+    cursor->map = map;
+    cursor->pos = 0;
+    cursor->index = 0;
+    cursor->line = 0;
+    cursor->column = 0;
+    cursor->file = 0;
+}
+
+int source_map_next(SourceMapCursor* cursor, uint32_t* line, uint32_t* column) {
+    const SourceMap* map = cursor->map;
+    if (!map || cursor->index >= map->count) {
+        return -1;
+    }
+
+    uint64_t head = get_varint(map->data, &cursor->pos);
+    uint64_t zigzag = head >> 2;
+    int64_t delta = zigzag & 1 ? -(int64_t) ((zigzag + 1) >> 1) : (int64_t) (zigzag >> 1);
+    cursor->line += delta;
+    if (head & 2) {
+        cursor->file = get_varint(map->data, &cursor->pos);
+    }
+    if (head & 1) {
+        cursor->column = get_varint(map->data, &cursor->pos);
+    }
+    cursor->index++;
+
+    *line = cursor->line;
+    *column = cursor->column;
+    return 0;
+}
+
+int source_map_lookup(const SourceMap* map, uint32_t index, uint32_t* line,
+    uint32_t* column) {
+    if (!map || index >= map->count) {
+        return -1;
+    }
+
+    const SourceMapCheckpoint* cp = &map->checkpoints[index / SRCMAP_CHECKPOINT];
+    SourceMapCursor cursor = { map, cp->pos, index - index % SRCMAP_CHECKPOINT,
+        cp->line, cp->column, cp->file };
+    do {
+        source_map_next(&cursor, line, column);
+    } while (cursor.index <= index);
+    return 0;
+}
+
+void source_map_append(SourceMap* map, const SourceMap* other) {
+    SourceMapCursor cursor;
+    uint32_t line, column;
+
+    source_map_begin(&cursor, other);
+    while (source_map_next(&cursor, &line, &column) == 0) {
+        uint32_t file = cursor.file
+            ? source_map_file(map, source_map_path(other, cursor.file)) : 0;
+        source_map_add_in(map, file, line, column);
+    }
+}
+
+void write_source_map(const SourceMap* map, FILE* output) {
+    SourceMapCursor cursor;
+    uint32_t line, column;
+
+    source_map_begin(&cursor, map);
+    while (source_map_next(&cursor, &line, &column) == 0) {
+        const char* path = source_map_path(map, cursor.file);
+        fprintf(output, "%u\t%s%s%u:%u\n", 4 * (cursor.index - 1),
+            path ? path : "", path ? ":" : "", line, column);
+    }
+}
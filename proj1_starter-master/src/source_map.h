@@ -0,0 +1,84 @@
+#ifndef SOURCE_MAP_H
+#define SOURCE_MAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Maps the instructions of a program, in order, to the source line and
+   column they came from, and the file for those of an included file.
+   Entries are delta-encoded: an instruction on the line after the previous
+   one, or expanded from the same line, at the same column and in the same
+   file, takes one byte. A checkpoint every SRCMAP_CHECKPOINT entries keeps
+   random lookups cheap.
+ */
+
+#define SRCMAP_CHECKPOINT 64
+
+typedef struct {
+    size_t pos;              // byte offset of the entry
+    uint32_t line;           // position of the entry before it
+    uint32_t column;
+    uint32_t file;
+} SourceMapCheckpoint;
+
+typedef struct SourceMap {
+    uint8_t* data;
+    size_t len;
+    size_t cap;
+    uint32_t count;
+    uint32_t last_line;
+    uint32_t last_column;
+    uint32_t last_file;
+    SourceMapCheckpoint* checkpoints;
+    uint32_t checkpoint_cap;
+    char** files;            // paths of included files, from index 1
+    uint32_t num_files;
+    uint32_t file_cap;
+} SourceMap;
+
+/* Reads the entries of a SourceMap in order. */
+typedef struct {
+    const SourceMap* map;
+    size_t pos;
+    uint32_t index;
+    uint32_t line;
+    uint32_t column;
+    uint32_t file;           // of the entry last read
+} SourceMapCursor;
+
+SourceMap* create_source_map();
+
+void free_source_map(SourceMap* map);
+
+/* Returns the index of the included file PATH in MAP, adding it if it is
+   new. Index 0 is the input file. */
+uint32_t source_map_file(SourceMap* map, const char* path);
+
+/* Path of file FILE of MAP, or NULL for the input file. */
+const char* source_map_path(const SourceMap* map, uint32_t file);
+
+/* Appends an entry for the next instruction, in the input file. */
+void source_map_add(SourceMap* map, uint32_t line, uint32_t column);
+
+/* Same as source_map_add(), in file FILE of MAP. */
+void source_map_add_in(SourceMap* map, uint32_t file, uint32_t line,
+    uint32_t column);
+
+/* Finds entry INDEX. Returns 0, or -1 if there is no such entry. */
+int source_map_lookup(const SourceMap* map, uint32_t index, uint32_t* line,
+    uint32_t* column);
+
+/* Appends the entries of OTHER, for the instructions that follow MAP's. */
+void source_map_append(SourceMap* map, const SourceMap* other);
+
+void source_map_begin(SourceMapCursor* cursor, const SourceMap* map);
+
+/* Reads the next entry. Returns 0, or -1 past the last one. */
+int source_map_next(SourceMapCursor* cursor, uint32_t* line, uint32_t* column);
+
+/* Writes MAP as a .line section body: the byte offset of each instruction
+   and its source line and column, "offset\tline:column", with the path in
+   front for an included file, "offset\tpath:line:column". */
+void write_source_map(const SourceMap* map, FILE* output);
+
+#endif
@@ -2,8 +2,15 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "utils.h"
+#include "alloc.h"
+#include "memstats.h"
+#include "probes.h"
 #include "tables.h"
 
 const int SYMTBL_NON_UNIQUE = 0;
@@ -43,18 +50,31 @@ void write_symbol(FILE* output, uint32_t addr, const char* name) {
 SymbolTable* create_table(int mode) {
     /* YOUR CODE HERE */
      
-     SymbolTable* table = malloc(sizeof(SymbolTable));
+     return create_table_in(mode, NULL);
+}
+
+/* Subsystem the memory of TABLE is counted under. */
+static MemSubsystem table_subsystem(const SymbolTable* table) {
+     return table->mode == SYMTBL_UNIQUE_NAME ? MEM_SYMBOLS : MEM_RELOCATIONS;
+}
+
+/* Same as create_table(), with the table and the names in it allocated from
+   ALLOCATOR. The table must be freed before ALLOCATOR is reset. */
+SymbolTable* create_table_in(int mode, Allocator* allocator) {
+     SymbolTable* table = alloc_mem(allocator, sizeof(SymbolTable));
      
      if(table == NULL)  allocation_failed();
         
      // inital capacity is 2
-     Symbol* sym = malloc(sizeof(Symbol) * 2);
+     Symbol* sym = alloc_mem(allocator, sizeof(Symbol) * 2);
      if(sym == NULL) allocation_failed();
 
      table->tbl = sym;
      table->cap = 2;
      table->len = 0;
      table->mode = mode;
+     table->allocator = allocator;
+     MEM_ALLOC(table_subsystem(table), sizeof(SymbolTable) + 2 * sizeof(Symbol));
      
      return table;
 }
@@ -67,17 +87,38 @@ void free_table(SymbolTable* table) {
      
      if(table->tbl != NULL) {
 	  for(int i = 0; i < table->len; i++) {
-	       if(table->tbl[i].name != NULL)
-		    free(table->tbl[i].name);
+	       if(table->tbl[i].name != NULL) {
+		    MEM_FREE(MEM_STRINGS, strlen(table->tbl[i].name) + 1);
+		    free_mem(table->allocator, table->tbl[i].name);
+	       }
 	  }
 	  
-	  free(table->tbl);
+	  free_mem(table->allocator, table->tbl);
      }
+     MEM_FREE(table_subsystem(table), sizeof(SymbolTable) + table->cap * sizeof(Symbol));
      
-     free(table);
+     free_mem(table->allocator, table);
      
 }
 
+/* Body of get_addr_for_symbol(). Stores the number of names compared in
+   *PROBES. */
+static int64_t find_symbol(SymbolTable* table, const char* name, uint32_t* probes) {
+     // linear search
+     *probes = 0;
+     if(table == NULL || table->tbl == NULL) return -1;
+
+     for(int i = 0; i < table->len; i++) {
+	  if(strcmp(table->tbl[i].name, name) == 0) {
+	       *probes = i + 1;
+	       return table->tbl[i].addr;
+	  }
+     }
+
+     *probes = table->len;
+     return -1;
+}
+
 /* Adds a new symbol and its address to the SymbolTable pointed to by TABLE. 
    ADDR is given as the byte offset from the first instruction. The SymbolTable
    must be able to resize itself as more elements are added. 
@@ -100,9 +141,16 @@ int add_to_table(SymbolTable* table, const char* name, uint32_t addr) {
 	  return -1;
      }
      
-     if(table->mode == SYMTBL_UNIQUE_NAME &&  get_addr_for_symbol(table, name) != -1) {
-	       name_already_exists(name);
-	       return -1;
+     return add_data_symbol(table, name, addr);
+}
+
+/* Same as add_to_table() for the label of data, which may be at any byte. */
+int add_data_symbol(SymbolTable* table, const char* name, uint32_t addr) {
+     uint32_t probes = 0;
+     if(table->mode == SYMTBL_UNIQUE_NAME &&  find_symbol(table, name, &probes) != -1) {
+	  PROBE3(symbol_insert, name, probes, -1);
+	  name_already_exists(name);
+	  return -1;
      }
      
      
@@ -110,18 +158,25 @@ int add_to_table(SymbolTable* table, const char* name, uint32_t addr) {
 
 	  int new_cap = table->cap * 2;
           
-	  table->tbl = realloc(table->tbl,  new_cap * sizeof(Symbol));
+	  table->tbl = resize_mem(table->allocator, table->tbl,
+				  table->cap * sizeof(Symbol), new_cap * sizeof(Symbol));
 
 	  if(table->tbl  == NULL)
 	       allocation_failed();
+	  MEM_RESIZE(table_subsystem(table), table->cap * sizeof(Symbol),
+		     new_cap * sizeof(Symbol));
 	  
 	  table->cap =  new_cap;
      }
      
-     table->tbl[table->len].name = strdup(name);
+     table->tbl[table->len].name = alloc_strdup(table->allocator, name);
+     if(table->tbl[table->len].name == NULL)
+	  allocation_failed();
+     MEM_ALLOC(MEM_STRINGS, strlen(name) + 1);
      table->tbl[table->len].addr = addr;
 
      table->len++;
+     PROBE3(symbol_insert, name, probes, 0);
      
      return 0;
 }
@@ -131,17 +186,11 @@ int add_to_table(SymbolTable* table, const char* name, uint32_t addr) {
 */
 int64_t get_addr_for_symbol(SymbolTable* table, const char* name) {
      /* YOUR CODE HERE */
- 
-    // linear search
 
-     if(table == NULL || table->tbl == NULL) return -1;
-     
-     for(int i = 0; i < table->len; i++) {
-	  if(strcmp(table->tbl[i].name, name) == 0)
-	       return table->tbl[i].addr;
-     }
-     
-     return -1;   
+     uint32_t probes = 0;
+     int64_t addr = find_symbol(table, name, &probes);
+     PROBE3(symbol_lookup, name, probes, addr);
+     return addr;
 }
 
 /* Writes the SymbolTable TABLE to OUTPUT. You should use write_symbol() to
@@ -159,6 +208,353 @@ void write_table(SymbolTable* table, FILE* output) {
 
 
 
+/*******************************
+ * Concurrent Symbol Table
+ *******************************/
+
+static uint32_t hash_name(const char* name) {
+     uint32_t h = 2166136261u;          // FNV-1a
+     while (*name) {
+	  h ^= (unsigned char) *name++;
+	  h *= 16777619u;
+     }
+     return h;
+}
+
+/* Returns slot IDX, allocating its segment if this is the first use. Two
+   threads may race to allocate a segment; the loser frees its copy. */
+static ConcurrentSymbol* ctable_slot(ConcurrentSymbolTable* table, uint32_t idx) {
+     uint32_t m = idx / CTBL_SEGMENT_BASE + 1;
+     int k = 31 - __builtin_clz(m);
+     uint32_t offset = idx - CTBL_SEGMENT_BASE * ((1u << k) - 1);
+
+     if (k >= CTBL_SEGMENTS) allocation_failed();
+
+     ConcurrentSymbol* seg = __atomic_load_n(&table->segments[k], __ATOMIC_ACQUIRE);
+     if (seg == NULL) {
+	  size_t size = ((size_t) CTBL_SEGMENT_BASE << k) * sizeof(ConcurrentSymbol);
+	  ConcurrentSymbol* fresh = calloc(1, size);
+	  if (fresh == NULL) allocation_failed();
+
+	  if (__atomic_compare_exchange_n(&table->segments[k], &seg, fresh, 0,
+					  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	       MEM_ALLOC(MEM_SYMBOLS, size);
+	       seg = fresh;
+	  } else {
+	       free(fresh);
+	  }
+     }
+     return &seg[offset];
+}
+
+static int compare_csymbols(const void* a, const void* b) {
+     const ConcurrentSymbol* x = *(const ConcurrentSymbol* const*) a;
+     const ConcurrentSymbol* y = *(const ConcurrentSymbol* const*) b;
+     if(x->pos != y->pos) return x->pos < y->pos ? -1 : 1;
+     return x < y ? -1 : x > y;
+}
+
+/* Marks SYM as dropped if a symbol of its name in the chain from HEAD up to
+   (not including) STOP comes before it in source order, and marks those
+   that come after it. Returns 1 if SYM was dropped. */
+static int drop_duplicates(ConcurrentSymbol* sym, ConcurrentSymbol* head,
+			   ConcurrentSymbol* stop) {
+     for (ConcurrentSymbol* e = head; e != stop; e = e->next) {
+	  if (e->hash != sym->hash || strcmp(e->name, sym->name) != 0)
+	       continue;
+	  if (compare_csymbols(&e, &sym) < 0) {
+	       sym->dropped = 1;
+	       return 1;
+	  }
+	  __atomic_store_n(&e->dropped, 1, __ATOMIC_RELAXED);
+     }
+     return 0;
+}
+
+/* Creates a ConcurrentSymbolTable in MODE (see create_table()). EXPECTED is
+   the expected number of symbols and sizes the hash chains; the table holds
+   more, at the cost of longer chains.
+ */
+ConcurrentSymbolTable* create_ctable(int mode, uint32_t expected) {
+     ConcurrentSymbolTable* table = calloc(1, sizeof(ConcurrentSymbolTable));
+     if (table == NULL) allocation_failed();
+
+     uint32_t n = 64;
+     while (n < expected && n < (1u << 24)) n *= 2;
+
+     table->buckets = calloc(n, sizeof(ConcurrentSymbol*));
+     if (table->buckets == NULL) allocation_failed();
+
+     table->num_buckets = n;
+     table->mode = mode;
+     MEM_ALLOC(MEM_SYMBOLS, sizeof(ConcurrentSymbolTable) + n * sizeof(ConcurrentSymbol*));
+     return table;
+}
+
+/* Frees the table. No other thread may be using it. */
+void free_ctable(ConcurrentSymbolTable* table) {
+     if (table == NULL) return;
+
+     for (uint32_t i = 0; i < table->len; i++) {
+	  ConcurrentSymbol* sym = ctable_slot(table, i);
+	  MEM_FREE(MEM_STRINGS, strlen(sym->name) + 1);
+	  free(sym->name);
+     }
+     for (int k = 0; k < CTBL_SEGMENTS; k++) {
+	  if (table->segments[k] == NULL) continue;
+	  MEM_FREE(MEM_SYMBOLS, ((size_t) CTBL_SEGMENT_BASE << k) * sizeof(ConcurrentSymbol));
+	  free(table->segments[k]);
+     }
+     MEM_FREE(MEM_SYMBOLS, sizeof(ConcurrentSymbolTable)
+	      + table->num_buckets * sizeof(ConcurrentSymbol*));
+     free(table->buckets);
+     free(table);
+}
+
+/* Adds NAME at ADDR, like add_to_table(), and may be called from several
+   threads at once. POS is the symbol's source position and must differ
+   between symbols.
+
+   The symbol is published with a compare-and-swap on the head of its hash
+   chain; if the swap fails, only the entries prepended since are searched
+   again. In SYMTBL_UNIQUE_NAME mode, of the symbols of one name the first in
+   POS order is kept and the others are marked dropped, whatever order the
+   threads insert them in. A dropped symbol is not found by lookups or
+   written, and sort_ctable() lists it so that it can be reported once the
+   inserts have finished.
+
+   Returns 0 on success and -1 if ADDR is not word-aligned, calling
+   addr_alignment_incorrect().
+ */
+int add_to_ctable(ConcurrentSymbolTable* table, const char* name, uint32_t addr,
+		  uint64_t pos) {
+
+     if((addr % 4) != 0) {
+	  addr_alignment_incorrect();
+	  return -1;
+     }
+
+     uint32_t idx = __atomic_fetch_add(&table->len, 1, __ATOMIC_RELAXED);
+     ConcurrentSymbol* sym = ctable_slot(table, idx);
+     sym->name = strdup(name);
+     if(sym->name == NULL) allocation_failed();
+     sym->addr = addr;
+     sym->hash = hash_name(name);
+     sym->pos = pos;
+
+     ConcurrentSymbol** bucket = &table->buckets[sym->hash & (table->num_buckets - 1)];
+     ConcurrentSymbol* head = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+     ConcurrentSymbol* checked = NULL;     // chain from here on was searched
+
+     for (;;) {
+	  if(table->mode == SYMTBL_UNIQUE_NAME && drop_duplicates(sym, head, checked))
+	       return 0;                     // slot stays, not in the chain
+	  checked = head;
+
+	  sym->next = head;
+	  if(__atomic_compare_exchange_n(bucket, &head, sym, 0,
+					 __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+	       return 0;
+     }
+}
+
+/* Returns the address of NAME, or -1 if it is not in TABLE. Takes no lock
+   and may run concurrently with add_to_ctable(), in which case a symbol may
+   be found that a duplicate earlier in source order is about to drop. If
+   the table is not unique, the most recently published NAME is found.
+ */
+int64_t get_addr_for_csymbol(ConcurrentSymbolTable* table, const char* name) {
+     if(table == NULL) return -1;
+
+     uint32_t hash = hash_name(name);
+     ConcurrentSymbol* e = __atomic_load_n(&table->buckets[hash & (table->num_buckets - 1)],
+					   __ATOMIC_ACQUIRE);
+     for (; e != NULL; e = e->next) {
+	  if(e->hash == hash && !__atomic_load_n(&e->dropped, __ATOMIC_RELAXED)
+	     && strcmp(e->name, name) == 0)
+	       return e->addr;
+     }
+     return -1;
+}
+
+/* Returns the symbols of TABLE ordered by source position, dropped ones
+   included, in an array the caller frees, and stores their number in *NUM.
+   Call it once all inserts have finished.
+ */
+ConcurrentSymbol** sort_ctable(ConcurrentSymbolTable* table, uint32_t* num) {
+     ConcurrentSymbol** order = malloc((table->len ? table->len : 1) * sizeof(ConcurrentSymbol*));
+     if(order == NULL) allocation_failed();
+
+     for (uint32_t i = 0; i < table->len; i++) {
+	  order[i] = ctable_slot(table, i);
+     }
+     qsort(order, table->len, sizeof(ConcurrentSymbol*), compare_csymbols);
+     *num = table->len;
+     return order;
+}
+
+/* Writes TABLE to OUTPUT in the format of write_table(), ordered by source
+   position and without dropped symbols. Call it once all inserts have
+   finished.
+ */
+void write_ctable(ConcurrentSymbolTable* table, FILE* output) {
+     if(table == NULL || table->len == 0) return;
+
+     uint32_t n;
+     ConcurrentSymbol** order = sort_ctable(table, &n);
+     for (uint32_t i = 0; i < n; i++) {
+	  if(!order[i]->dropped)
+	       write_symbol(output, order[i]->addr, order[i]->name);
+     }
+     free(order);
+}
+
+
+
+/*******************************
+ * Symbol Table Snapshots
+ *******************************/
+
+/* Index slot for hash H and probe I. */
+static uint32_t snapshot_slot(uint32_t h, uint32_t i, uint32_t num_slots) {
+     return (h + i) & (num_slots - 1);
+}
+
+/* Writes TABLE to OUTPUT as a snapshot (see tables.h). The index has at
+   least twice as many slots as there are symbols. Returns 0 on success and
+   -1 if writing failed.
+ */
+int write_table_snapshot(SymbolTable* table, FILE* output) {
+     uint32_t len = table ? table->len : 0;
+     uint32_t num_slots = 16;
+     while (num_slots < 2 * len) num_slots *= 2;
+
+     SnapshotEntry* entries = calloc(len ? len : 1, sizeof(SnapshotEntry));
+     uint32_t* slots = calloc(num_slots, sizeof(uint32_t));
+     if (entries == NULL || slots == NULL) allocation_failed();
+
+     uint64_t names_len = 0;
+     for (uint32_t i = 0; i < len; i++) {
+	  const char* name = table->tbl[i].name;
+	  SnapshotEntry* e = &entries[i];
+	  e->hash = hash_name(name);
+	  e->addr = table->tbl[i].addr;
+	  e->name_offset = names_len;
+	  e->name_len = strlen(name);
+	  names_len += e->name_len + 1;
+
+	  // Symbols go in in table order, so a lookup finds the first of
+	  // several with the same name, as get_addr_for_symbol() does.
+	  uint32_t probe = 0;
+	  while (slots[snapshot_slot(e->hash, probe, num_slots)] != 0) probe++;
+	  slots[snapshot_slot(e->hash, probe, num_slots)] = i + 1;
+     }
+
+     SnapshotHeader header;
+     memset(&header, 0, sizeof(header));
+     memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+     header.version = SNAPSHOT_VERSION;
+     header.mode = table ? table->mode : SYMTBL_UNIQUE_NAME;
+     header.len = len;
+     header.num_slots = num_slots;
+     header.entries_offset = sizeof(header);
+     header.slots_offset = header.entries_offset + (uint64_t) len * sizeof(SnapshotEntry);
+     header.names_offset = header.slots_offset + (uint64_t) num_slots * sizeof(uint32_t);
+     header.names_len = names_len;
+
+     int err = fwrite(&header, sizeof(header), 1, output) != 1;
+     if (len > 0) err |= fwrite(entries, sizeof(SnapshotEntry), len, output) != len;
+     err |= fwrite(slots, sizeof(uint32_t), num_slots, output) != num_slots;
+     for (uint32_t i = 0; i < len; i++) {
+	  err |= fwrite(table->tbl[i].name, 1, entries[i].name_len + 1, output)
+	       != entries[i].name_len + 1;
+     }
+
+     free(entries);
+     free(slots);
+     return err ? -1 : 0;
+}
+
+/* Maps the snapshot FILENAME into SNAPSHOT. Only the header is read: its
+   sections must lie inside the file. Returns 0, or -1 if the file cannot be
+   mapped or is not a snapshot.
+ */
+int open_table_snapshot(SymbolSnapshot* snapshot, const char* filename) {
+     memset(snapshot, 0, sizeof(SymbolSnapshot));
+
+     int fd = open(filename, O_RDONLY | O_CLOEXEC);
+     if (fd < 0) {
+	  write_to_log("Error: unable to open snapshot: %s\n", filename);
+	  return -1;
+     }
+     struct stat st;
+     if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(SnapshotHeader)) {
+	  write_to_log("Error: not a symbol table snapshot: %s\n", filename);
+	  close(fd);
+	  return -1;
+     }
+
+     void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+     close(fd);
+     if (map == MAP_FAILED) {
+	  write_to_log("Error: unable to map snapshot: %s\n", filename);
+	  return -1;
+     }
+
+     const SnapshotHeader* h = map;
+     uint64_t size = st.st_size;
+     int valid = memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) == 0
+	  && h->version == SNAPSHOT_VERSION
+	  && h->num_slots > 0 && (h->num_slots & (h->num_slots - 1)) == 0
+	  && h->num_slots >= h->len
+	  && h->entries_offset == sizeof(SnapshotHeader)
+	  && h->slots_offset == h->entries_offset + (uint64_t) h->len * sizeof(SnapshotEntry)
+	  && h->names_offset == h->slots_offset + (uint64_t) h->num_slots * sizeof(uint32_t)
+	  && h->names_offset <= size && h->names_len <= size - h->names_offset;
+     if (!valid) {
+	  write_to_log("Error: not a symbol table snapshot: %s\n", filename);
+	  munmap(map, st.st_size);
+	  return -1;
+     }
+
+     snapshot->map = map;
+     snapshot->size = st.st_size;
+     snapshot->header = h;
+     snapshot->entries = (const SnapshotEntry*) (snapshot->map + h->entries_offset);
+     snapshot->slots = (const uint32_t*) (snapshot->map + h->slots_offset);
+     snapshot->names = snapshot->map + h->names_offset;
+     return 0;
+}
+
+void close_table_snapshot(SymbolSnapshot* snapshot) {
+     if (snapshot->map) munmap((void*) snapshot->map, snapshot->size);
+     memset(snapshot, 0, sizeof(SymbolSnapshot));
+}
+
+/* Returns the address of NAME in SNAPSHOT, or -1 if it is not there. The
+   entries reached while probing are checked against the file's bounds, so
+   a damaged snapshot yields -1 rather than a bad read.
+ */
+int64_t get_addr_for_snapshot(const SymbolSnapshot* snapshot, const char* name) {
+     const SnapshotHeader* h = snapshot->header;
+     if (h == NULL) return -1;
+
+     uint32_t hash = hash_name(name);
+     size_t len = strlen(name);
+
+     for (uint32_t probe = 0; probe < h->num_slots; probe++) {
+	  uint32_t slot = snapshot->slots[snapshot_slot(hash, probe, h->num_slots)];
+	  if (slot == 0 || slot > h->len) return -1;
+
+	  const SnapshotEntry* e = &snapshot->entries[slot - 1];
+	  if (e->hash != hash || e->name_len != len) continue;
+	  if ((uint64_t) e->name_offset + len >= h->names_len) return -1;
+	  if (memcmp(snapshot->names + e->name_offset, name, len) == 0)
+	       return e->addr;
+     }
+     return -1;
+}
+
 // test code
 #if 0
 int main()
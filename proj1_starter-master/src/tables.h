@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 
+struct Allocator;
+
 extern const int SYMTBL_NON_UNIQUE;      // allows duplicate names in table
 extern const int SYMTBL_UNIQUE_NAME;     // duplicate names not allowed
 
@@ -22,6 +24,7 @@ typedef struct {
     uint32_t len;
     uint32_t cap;
     int mode;
+    struct Allocator* allocator;   // of the table and its names, NULL for malloc()
 } SymbolTable;
 
 /* Helper functions: */
@@ -37,16 +40,106 @@ void write_symbol(FILE* output, uint32_t addr, const char* name);
 /* IMPLEMENT ME - see documentation in tables.c */
 SymbolTable* create_table();
 
+SymbolTable* create_table_in(int mode, struct Allocator* allocator);
+
 /* IMPLEMENT ME - see documentation in tables.c */
 void free_table(SymbolTable* table);
 
 /* IMPLEMENT ME - see documentation in tables.c */
 int add_to_table(SymbolTable* table, const char* name, uint32_t addr);
 
+/* Same as add_to_table() without the alignment check, for .data labels. */
+int add_data_symbol(SymbolTable* table, const char* name, uint32_t addr);
+
 /* IMPLEMENT ME - see documentation in tables.c */
 int64_t get_addr_for_symbol(SymbolTable* table, const char* name);
 
 /* IMPLEMENT ME - see documentation in tables.c */
 void write_table(SymbolTable* table, FILE* output);
 
+/* Concurrent symbol table for parallel front ends. Symbols are inserted with
+   compare-and-swap into fixed hash chains and stored in segments that are
+   never moved, so lookups take no lock and may run alongside inserts.
+ */
+
+#define CTBL_SEGMENTS 26     // segment k holds CTBL_SEGMENT_BASE << k symbols
+#define CTBL_SEGMENT_BASE 64
+
+typedef struct ConcurrentSymbol {
+    char *name;
+    uint32_t addr;
+    uint32_t hash;
+    uint64_t pos;            // source position, orders sort_ctable()
+    int dropped;             // a duplicate of a symbol before it
+    struct ConcurrentSymbol* next;
+} ConcurrentSymbol;
+
+typedef struct {
+    ConcurrentSymbol** buckets;
+    uint32_t num_buckets;
+    ConcurrentSymbol* segments[CTBL_SEGMENTS];
+    uint32_t len;            // slots handed out
+    int mode;
+} ConcurrentSymbolTable;
+
+ConcurrentSymbolTable* create_ctable(int mode, uint32_t expected);
+
+void free_ctable(ConcurrentSymbolTable* table);
+
+int add_to_ctable(ConcurrentSymbolTable* table, const char* name, uint32_t addr,
+    uint64_t pos);
+
+int64_t get_addr_for_csymbol(ConcurrentSymbolTable* table, const char* name);
+
+ConcurrentSymbol** sort_ctable(ConcurrentSymbolTable* table, uint32_t* num);
+
+void write_ctable(ConcurrentSymbolTable* table, FILE* output);
+
+/* A read-only snapshot of a SymbolTable in a file: its symbols in table
+   order, an open-addressing hash index over them and their names, laid out
+   to be used straight from a mapping. Opening one maps the file and checks
+   its header; lookups hash the name and probe the index, without parsing
+   the file or allocating. Snapshots use the byte order of the machine that
+   wrote them and are rejected on a machine of the other byte order.
+ */
+
+#define SNAPSHOT_MAGIC "SYMSNAP1"
+#define SNAPSHOT_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t mode;
+    uint32_t len;            // symbols
+    uint32_t num_slots;      // size of the index, a power of two
+    uint64_t entries_offset;
+    uint64_t slots_offset;
+    uint64_t names_offset;
+    uint64_t names_len;
+} SnapshotHeader;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t addr;
+    uint32_t name_offset;    // into the names, which are null-terminated
+    uint32_t name_len;
+} SnapshotEntry;
+
+typedef struct {
+    const char* map;
+    size_t size;
+    const SnapshotHeader* header;
+    const SnapshotEntry* entries;
+    const uint32_t* slots;   // entry index + 1, 0 for an empty slot
+    const char* names;
+} SymbolSnapshot;
+
+int write_table_snapshot(SymbolTable* table, FILE* output);
+
+int open_table_snapshot(SymbolSnapshot* snapshot, const char* filename);
+
+void close_table_snapshot(SymbolSnapshot* snapshot);
+
+int64_t get_addr_for_snapshot(const SymbolSnapshot* snapshot, const char* name);
+
 #endif
\ No newline at end of file
@@ -1,137 +1,75 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "tables.h"
 #include "translate_utils.h"
 #include "translate.h"
+#include "pseudo.h"
+#include "data.h"
 #include "utils.h"
+#include "probes.h"
 
 
 
-static int translate_ulong(unsigned long int* output, const char* str, unsigned long int lower_bound,
-		unsigned long int upper_bound) {
-
-	if (!str || !output) {
-		return -1;
-	}
-
-
-	char * pEnd;
-	unsigned long int res;
-	if(strstr(str, "0x") != NULL || strstr(str, "0X") != NULL) {
-		res = strtoul(str, &pEnd,  16);
-	}
-	else {
-		res = strtoul(str, &pEnd, 10);
-	}
-
-	if (*pEnd != '\0')    return -1;
-
-	*output = res;
-
-
-	if(res >= lower_bound && res <=  upper_bound)
-		return 0;
-	else
-		return -1;
-
-}
-/* Writes instructions during the assembler's first pass to OUTPUT. The case
-   for general instructions has already been completed, but you need to write
-   code to translate the li and blt pseudoinstructions. Your pseudoinstruction 
-   expansions should not have any side effects.
+/* Writes instructions during the assembler's first pass to OUTPUT.
+   Pseudoinstructions are expanded by the rules of pseudo.c; any other
+   instruction is written as it is. Your pseudoinstruction expansions
+   should not have any side effects.
 
    NAME is the name of the instruction, ARGS is an array of the arguments, and
    NUM_ARGS specifies the number of items in ARGS.
 
    Error checking for regular instructions are done in pass two. However, for
-   pseudoinstructions, you must make sure that ARGS contains the correct number
-   of arguments. You do NOT need to check whether the registers / label are 
-   valid, since that will be checked in part two.
+   pseudoinstructions, the rules check the number of arguments and, where
+   it decides the expansion, the immediate. You do NOT need to check whether
+   the registers / label are valid, since that will be checked in part two.
 
    Also for li:
-    - make sure that the number is representable by 32 bits. (Hint: the number 
+    - the number must be representable by 32 bits. (Hint: the number
         can be both signed or unsigned).
     - if the immediate can fit in the imm field of an addiu instruction, then
-        expand li into a single addiu instruction. Otherwise, expand it into 
+        li expands into a single addiu instruction. Otherwise, it expands into
         a lui-ori pair.
 
-   And for blt:
-    - your expansion should use the fewest number of instructions possible.
+   And blt, bgt, ble and bge use the fewest number of instructions possible.
 
    MARS has slightly different translation rules for li, and it allows numbers
    larger than the largest 32 bit number to be loaded with li. You should follow
    the above rules if MARS behaves differently.
 
-   Use fprintf() to write. If writing multiple instructions, make sure that 
-   each instruction is on a different line.
+   Each instruction is written on its own line.
 
    Returns the number of instructions written (so 0 if there were any errors).
  */
 unsigned write_pass_one(FILE* output, const char* name, char** args, int num_args) {
 
-     if (strcmp(name, "li") == 0) {
-        /* YOUR CODE HERE */
-	  
-	  if(num_args != 2)  return 0;
-	   
-	  long int imm;
-	  long int lowerbound = -2147483647L;  // see limits.h 
-	  long int upperbound =  2147483647L;  // see limits.h 
-	  int err = translate_num(&imm, args[1], lowerbound, upperbound);
+     InstRecord insts[MAX_EXPANSION];
+     char buf[PSEUDO_BUF_SIZE];
+     int num_insts = expand_pseudo(name, args, num_args, insts, buf, sizeof(buf));
 
- 
-	 if(err == -1)  return 0;
+     if (num_insts < 0) {
+	  write_inst_string(output, name, args, num_args);
+	  return 1;
+     }
+     for (int i = 0; i < num_insts; i++) {
+	  write_inst_string(output, insts[i].name, insts[i].args, insts[i].num_args);
+     }
+     return num_insts;
+}
 
-	 char  tmp[255];
-	 
-	 if(imm >= -32769 && imm <= 32768) { // imm fit into 16 bit
-	                                     // signed number
-	      sprintf(tmp, " %ld", imm);
-
-	      char* addiuargs[3] = {args[0], "$zero", tmp};
-	      write_inst_string(output,"addiu", addiuargs, 3);
-	      return 1;
-	 }
-	 else {
-
-		  unsigned long uimm;
-		  err = translate_ulong(&uimm, args[1], 0, 0xFFFFFFFF);
-
-	      int upper16 =  (uimm >> 16) & 0xFFFF;
-	      int lower16 =  uimm & 0xFFFF;
-	    
-	      sprintf(tmp, " 0x%x", upper16);
-	      char* luiargs[2] = {"$at", tmp};
-	      write_inst_string(output,"lui", luiargs, 2);
-
-	      sprintf(tmp, " 0x%x", lower16);
-	      char* oriargs[3] = {args[0], "$at", tmp};
-	      write_inst_string(output, "ori",  oriargs, 3);
-
-	      return 2;
-	 }
-	 
-	 
-    } else if (strcmp(name, "blt") == 0) {
-
-	  /* YOUR CODE HERE */
-
-	  if(num_args != 3)  return 0;
-	  
-	  char* sltargs[3] = {"$at", args[0], args[1]};
-	  write_inst_string(output, "slt", sltargs, 3);
-	  
-	  char* bneargs[3] = {"$at", "$zero", args[2]};
-	  write_inst_string(output, "bne", bneargs, 3);
-	  
-	  return 2;
-	  
-    } else {
-        write_inst_string(output, name, args, num_args);
-        return 1;
-    }
+/* Returns the number of instructions write_pass_one() would write for NAME,
+   without formatting or writing anything. Used by the symbols-only pass,
+   which only needs label offsets.
+
+   Only the checks that decide the size are done: those of the rule of a
+   pseudoinstruction. Returns 0 exactly when write_pass_one() would return 0.
+ */
+unsigned size_pass_one(const char* name, char** args, int num_args) {
+
+     int size = pseudo_size(name, args, num_args);
+     return size < 0 ? 1 : size;
 }
 
 /* Writes the instruction in hexadecimal format to OUTPUT during pass #2.
@@ -156,325 +94,545 @@ unsigned write_pass_one(FILE* output, const char* name, char** args, int num_arg
  */
 int translate_inst(FILE* output, const char* name, char** args, size_t num_args, uint32_t addr,
     SymbolTable* symtbl, SymbolTable* reltbl) {
-    if (strcmp(name, "addu") == 0)       return write_rtype(0x21, output, args, num_args);
-    else if (strcmp(name, "or") == 0)    return write_rtype(0x25, output, args, num_args);
-    else if (strcmp(name, "slt") == 0)   return write_rtype(0x2a, output, args, num_args);
-    else if (strcmp(name, "sltu") == 0)  return write_rtype(0x2b, output, args, num_args);
-    else if (strcmp(name, "sll") == 0)   return write_shift(0x00, output, args, num_args);
-    else if (strcmp(name, "jr") == 0)    return write_jr(0x08, output, args, num_args);
-    else if (strcmp(name, "addiu") == 0) return write_addiu(0x09, output, args, num_args);
-    else if (strcmp(name, "ori") == 0)   return write_ori(0x0d, output, args, num_args);
-    else if (strcmp(name , "lui") == 0)  return write_lui(0x0f, output, args, num_args);
-    else if (strcmp(name, "lb") == 0)    return write_mem(0x20, output, args, num_args);
-    else if (strcmp(name ,"lbu") == 0)   return write_mem(0x24, output, args, num_args);
-    else if (strcmp(name, "lw") == 0)    return write_mem(0x23, output, args, num_args);
-    else if (strcmp(name, "sb") == 0)    return write_mem(0x28, output, args, num_args);
-    else if (strcmp(name, "sw") == 0)    return write_mem(0x2B, output, args, num_args);
-    else if (strcmp(name, "beq") == 0)   return write_branch(0x04, output, args, num_args, addr, symtbl);
-    else if (strcmp(name, "bne") == 0)   return write_branch(0x05, output, args, num_args, addr, symtbl);
-    else if (strcmp(name, "j") == 0)     return write_jump(0x02, output, args, num_args, addr, reltbl);    // label always  need relocation, set addr to be 0
-    else if (strcmp(name, "jal") == 0)   return write_jump(0x03, output, args, num_args, addr, reltbl);    //label always need relocation, set addr to be 0
-    
-    /* YOUR CODE HERE */
-    else                                 return -1;
-}
-
-
-
-
-
-int write_jump(uint8_t opcode, FILE* output, char** args, size_t num_args, 
-	       uint32_t addr, SymbolTable* reltbl) {
-     
-     if(num_args != 1 || addr > 0xFFFFFFF || (addr % 4) != 0 )  return -1;
-     
-     int64_t labelAddress =  get_addr_for_symbol(reltbl, args[0]);
+    uint32_t instruction;
 
-     if(labelAddress == -1)   add_to_table(reltbl, args[0], addr);
-     
-     
-     uint32_t instruction = 0;
-    
+    if (encode_inst(&instruction, name, args, num_args, addr, symtbl, reltbl) == -1)
+        return -1;
 
-     instruction |= (opcode << 26);             // opcode
-     
-     write_inst_hex(output, instruction);
+    write_inst_hex(output, instruction);
+    return 0;
+}
 
+/* If the last of ARGS is %hi(label) or %lo(label), an operand of la, points
+   ARGS at a copy with the half of the label's address in its place, built
+   in COPY and BUF. Returns 0, or -1 if the label is not in SYMTBL or is a
+   text label: those are offsets in .text, which moves when the object is
+   linked, and the halves have no relocation entries. */
+static int resolve_half(char*** args, size_t num_args, char** copy, char* buf,
+    SymbolTable* symtbl) {
+     const char* arg = (*args)[num_args - 1];
+     int hi = strncmp(arg, "%hi(", 4) == 0;
+     if (!hi && strncmp(arg, "%lo(", 4) != 0)
+	  return 0;
+
+     size_t len = strlen(arg);
+     if (len < 6 || arg[len - 1] != ')' || len - 5 >= 1024)
+	  return -1;
+     char label[1024];
+     memcpy(label, arg + 4, len - 5);
+     label[len - 5] = '\0';
+     int64_t labelAddress = get_addr_for_symbol(symtbl, label);
+     if (labelAddress < DATA_BASE)
+	  return -1;
+
+     sprintf(buf, "%u", hi ? (uint32_t) labelAddress >> 16
+			   : (uint32_t) labelAddress & 0xFFFF);
+     memcpy(copy, *args, num_args * sizeof(char*));
+     copy[num_args - 1] = buf;
+     *args = copy;
      return 0;
-  
 }
 
+/* Encodes the instruction NAME into OUTPUT; see encode_inst(). */
+static int encode_by_name(uint32_t* output, const char* name, char** args,
+    size_t num_args, uint32_t addr, SymbolTable* symtbl, SymbolTable* reltbl) {
+    char* copy[3];
+    char half[16];
+    if (num_args > 0 && num_args <= 3 && args[num_args - 1][0] == '%'
+        && resolve_half(&args, num_args, copy, half, symtbl) != 0)
+        return -1;
+
+    const InstDesc* inst = find_inst(name);
+    if (!inst)
+        return -1;
+    return inst->encode(output, args, num_args, addr, symtbl, reltbl);
+}
 
+/* Same as translate_inst(), but stores the instruction in OUTPUT instead of
+   writing it, so encoding can be separated from formatting and I/O.
 
-int write_branch(uint8_t opcode, FILE* output, char** args, size_t num_args, 
-		 uint32_t addr, SymbolTable* symtbl) {
+   Returns 0 on success and -1 on error.
+ */
+int encode_inst(uint32_t* output, const char* name, char** args, size_t num_args,
+    uint32_t addr, SymbolTable* symtbl, SymbolTable* reltbl) {
+    int res = encode_by_name(output, name, args, num_args, addr, symtbl, reltbl);
+    PROBE4(translate, name, res == 0 ? MNEMONIC_ID(*output) : -1, addr, res);
+    return res;
+}
 
-     if(num_args != 3) return -1;
-     
-     int rs = translate_reg(args[0]);
-     int rt = translate_reg(args[1]);
-     int64_t labelAddress =  get_addr_for_symbol(symtbl, args[2]);
-     
-     if(rs == -1 || rt == -1 || labelAddress == -1 ||
-	(labelAddress % 4 != 0) || labelAddress >  32768 ||
-	labelAddress < -32769) return -1;
+/* Encoders of each format of isa.h. They take the fields of the table and
+   the operands, check the operands and pack the word. The instructions'
+   own encoders below call them with the fields as constants.
+ */
 
-     
-     int imm = (labelAddress - addr - 4) / 4; // addr = pc addr
+#define FORMAT_PARAMS uint8_t opcode, uint8_t funct, long int lo, long int hi, \
+    uint32_t* output, char** args, size_t num_args, uint32_t addr, \
+    SymbolTable* symtbl, SymbolTable* reltbl
 
-     
-     uint32_t instruction = 0;
-     
-     instruction |= (imm & 0xFFFF);   // funct, lower six bit
-     instruction |= (rt << 16);       // rt
-     instruction |= (rs << 21);       // rs
-     instruction |= (opcode << 26);   // opcode
-    
-     write_inst_hex(output, instruction);
+static inline uint32_t rtype(uint8_t opcode, int rs, int rt, int rd, int shamt,
+    uint8_t funct) {
+     return ((uint32_t) opcode << 26) | (rs << 21) | (rt << 16) | (rd << 11) | (shamt << 6)
+	  | (funct & 0x3F);
+}
 
-     return 0;
-     
+static inline uint32_t itype(uint8_t opcode, int rs, int rt, long int imm) {
+     return ((uint32_t) opcode << 26) | (rs << 21) | (rt << 16) | (imm & 0xFFFF);
 }
 
+/* Offset in words from the instruction after ADDR to LABEL, in *IMM.
+   Returns -1 if LABEL is unknown, unaligned or out of reach. */
+static inline int branch_offset(long int* imm, const char* label, uint32_t addr,
+    SymbolTable* symtbl) {
+     int64_t labelAddress = get_addr_for_symbol(symtbl, label);
+     if (labelAddress == -1 || (labelAddress % 4 != 0)) return -1;
 
-/*
- * split arg string like "-100($t1)" to two strings
- * "-100" and "$t1" , store them in pointer array and
- * return pointer to pointer array
- */
+     int64_t offset = (labelAddress - addr - 4) / 4;   // addr = pc addr
+     if (offset > 32767 || offset < -32768) return -1;  // must fit 16 bits
+     *imm = offset;
+     return 0;
+}
 
-static int splitArgs(char* arguments, char** arg0, char** arg1) {
+static inline int encode_format_R3(FORMAT_PARAMS) {
+     if (num_args != 3) return -1;
+     int rd = translate_reg(args[0]);
+     int rs = translate_reg(args[1]);
+     int rt = translate_reg(args[2]);
+     if (rd == -1 || rs == -1 || rt == -1) return -1;
+     *output = rtype(opcode, rs, rt, rd, 0, funct);
+     return 0;
+}
 
-     char args[256];
-     strcpy(args, arguments);
-     
-     char  tmp[256];
-     
-     char* leftp = strchr(args, '(');
-     char* rightp = strchr(args, ')');
-     
-     if(leftp == NULL || rightp == NULL || (rightp - args) != strlen(args) - 1 )
+static inline int encode_format_SHIFT(FORMAT_PARAMS) {
+     if (num_args != 3) return -1;
+     long int shamt;
+     int rd = translate_reg(args[0]);
+     int rt = translate_reg(args[1]);
+     if (translate_num(&shamt, args[2], lo, hi) == -1 || rd == -1 || rt == -1)
 	  return -1;
+     *output = rtype(opcode, 0, rt, rd, shamt, funct);
+     return 0;
+}
 
-     *rightp = '\0';
-     strcpy(tmp, leftp + 1);
-     *arg1 = strdup(tmp);
+static inline int encode_format_SHIFTV(FORMAT_PARAMS) {
+     if (num_args != 3) return -1;
+     int rd = translate_reg(args[0]);
+     int rt = translate_reg(args[1]);
+     int rs = translate_reg(args[2]);
+     if (rd == -1 || rs == -1 || rt == -1) return -1;
+     *output = rtype(opcode, rs, rt, rd, 0, funct);
+     return 0;
+}
 
-     *leftp = '\0';
-     strcpy(tmp, args);
-     *arg0 = strdup(tmp);
-     
+static inline int encode_format_MULDIV(FORMAT_PARAMS) {
+     if (num_args != 2) return -1;
+     int rs = translate_reg(args[0]);
+     int rt = translate_reg(args[1]);
+     if (rs == -1 || rt == -1) return -1;
+     *output = rtype(opcode, rs, rt, 0, 0, funct);
      return 0;
-     
 }
 
+/* rt must be rd as well. */
+static inline int encode_format_COUNT(FORMAT_PARAMS) {
+     if (num_args != 2) return -1;
+     int rd = translate_reg(args[0]);
+     int rs = translate_reg(args[1]);
+     if (rd == -1 || rs == -1) return -1;
+     *output = rtype(opcode, rs, rd, rd, 0, funct);
+     return 0;
+}
 
-int write_mem(uint8_t opcode, FILE* output, char** args, size_t num_args) {
+/* The code field is left 0. */
+#define encode_format_TRAP encode_format_MULDIV
 
-     if(num_args != 2) return -1;
-     
-     int rt = translate_reg(args[0]);
+static inline int encode_format_MFROM(FORMAT_PARAMS) {
+     if (num_args != 1) return -1;
+     int rd = translate_reg(args[0]);
+     if (rd == -1) return -1;
+     *output = rtype(opcode, 0, 0, rd, 0, funct);
+     return 0;
+}
 
-     char* arg0;
-     char* arg1;
-     
-     int res =  splitArgs(args[1], &arg0, &arg1);
+static inline int encode_format_MTO(FORMAT_PARAMS) {
+     if (num_args != 1) return -1;
+     int rs = translate_reg(args[0]);
+     if (rs == -1) return -1;
+     *output = rtype(opcode, rs, 0, 0, 0, funct);
+     return 0;
+}
 
-     // printf("slit res: %d\n", res);
+#define encode_format_JR encode_format_MTO
 
-     if (res == -1) return -1;
-     
-     int rs = translate_reg(arg1);
+static inline int encode_format_JALR(FORMAT_PARAMS) {
+     if (num_args != 1 && num_args != 2) return -1;
+     int rd = num_args == 2 ? translate_reg(args[0]) : 31;
+     int rs = translate_reg(args[num_args - 1]);
+     if (rd == -1 || rs == -1) return -1;
+     *output = rtype(opcode, rs, 0, rd, 0, funct);
+     return 0;
+}
+
+static inline int encode_format_NONE(FORMAT_PARAMS) {
+     if (num_args != 0) return -1;
+     *output = rtype(opcode, 0, 0, 0, 0, funct);
+     return 0;
+}
+
+static inline int encode_format_IMM(FORMAT_PARAMS) {
+     if (num_args != 3) return -1;
      long int imm;
-     
-     int err = translate_num(&imm, arg0, -32769, 32768);
+     int rt = translate_reg(args[0]);
+     int rs = translate_reg(args[1]);
+     if (translate_num(&imm, args[2], lo, hi) == -1 || rs == -1 || rt == -1)
+	  return -1;
+     *output = itype(opcode, rs, rt, imm);
+     return 0;
+}
 
-     free(arg0);
-     free(arg1);
+static inline int encode_format_LUI(FORMAT_PARAMS) {
+     if (num_args != 2) return -1;
+     long int imm;
+     int rt = translate_reg(args[0]);
+     if (translate_num(&imm, args[1], lo, hi) == -1 || rt == -1) return -1;
+     *output = itype(opcode, 0, rt, imm);
+     return 0;
+}
 
-     // printf("rs: %d, rt: %d, err: %d\n", rs, rt, err);
-     
-     if( rs == -1 || rt == -1  || err == -1)  return -1;  // invalid reg
-    
-     uint32_t instruction = 0;
-     
-     instruction |= (imm & 0xFFFF);   // funct, lower six bit
-     instruction |= (rt << 16);       // rt
-     instruction |= (rs << 21);       // rs
-     instruction |= (opcode << 26);   // opcode
-    
-     write_inst_hex(output, instruction);
+static inline int encode_format_MEM(FORMAT_PARAMS) {
+     if (num_args != 2) return -1;
+     long int imm;
+     int rs;
+     int rt = translate_reg(args[0]);
+     if (translate_mem_operand(&imm, &rs, args[1], lo, hi) == -1 || rt == -1)
+	  return -1;
+     *output = itype(opcode, rs, rt, imm);
+     return 0;
+}
 
+static inline int encode_format_BRANCH(FORMAT_PARAMS) {
+     if (num_args != 3) return -1;
+     long int imm;
+     int rs = translate_reg(args[0]);
+     int rt = translate_reg(args[1]);
+     if (rs == -1 || rt == -1 || branch_offset(&imm, args[2], addr, symtbl) == -1)
+	  return -1;
+     *output = itype(opcode, rs, rt, imm);
      return 0;
-     
-     
 }
 
+static inline int encode_format_BRANCHZ(FORMAT_PARAMS) {
+     if (num_args != 2) return -1;
+     long int imm;
+     int rs = translate_reg(args[0]);
+     if (rs == -1 || branch_offset(&imm, args[1], addr, symtbl) == -1)
+	  return -1;
+     *output = itype(opcode, rs, funct, imm);   // rt selects the REGIMM branch
+     return 0;
+}
 
+/* The label always needs relocation; its field is left 0. */
+static inline int encode_format_JUMP(FORMAT_PARAMS) {
+     if (num_args != 1 || addr > 0xFFFFFFF || (addr % 4) != 0) return -1;
+     if (get_addr_for_symbol(reltbl, args[0]) == -1)
+	  add_to_table(reltbl, args[0], addr);
+     *output = (uint32_t) opcode << 26;
+     return 0;
+}
 
+/* Trusted-input encoding. The helpers below assume well-formed operands:
+   register names are decoded from their first two characters and numbers
+   are not range checked. Only used when the input is known to be valid.
+ */
 
-int write_lui(uint8_t opcode, FILE* output, char** args, size_t num_args) {
+static int trusted_reg(const char* str) {
+     switch (str[1]) {
+     case 'z': case '0': return 0;
+     case 'a':           return str[2] == 't' ? 1 : 4 + (str[2] - '0');
+     case 'v':           return 2 + (str[2] - '0');
+     case 't':           return 8 + (str[2] - '0');
+     case 's':           return str[2] == 'p' ? 29 : 16 + (str[2] - '0');
+     case 'r':           return 31;
+     default:            return 0;
+     }
+}
 
-     if(num_args != 2) return -1;
-     
-     int rt = translate_reg(args[0]);
-    
-     long int imm;
-     
-     int err = translate_num(&imm, args[1], 0, 65535);
-     
-     if( rt == -1  || err == -1)  return -1;  // invalid reg
-    
-     uint32_t instruction = 0;
-     
-     instruction |= (imm & 0xFFFF);   // funct, lower six bit
-     instruction |= (rt << 16);       // rt
-   
-     instruction |= (opcode << 26);   // opcode
-    
-     write_inst_hex(output, instruction);
+static long int trusted_num(const char* str, char** end) {
+     int hex = strchr(str, 'x') != NULL || strchr(str, 'X') != NULL;
+     return strtol(str, end, hex ? 16 : 10);
+}
+
+/* Trusted counterparts of the format encoders: the operand count is not
+   checked either. The only error is a branch to an unknown label, which
+   cannot be encoded at all. */
 
+static inline int trusted_format_R3(FORMAT_PARAMS) {
+     *output = rtype(opcode, trusted_reg(args[1]), trusted_reg(args[2]),
+		     trusted_reg(args[0]), 0, funct);
      return 0;
+}
 
+static inline int trusted_format_SHIFT(FORMAT_PARAMS) {
+     *output = rtype(opcode, 0, trusted_reg(args[1]), trusted_reg(args[0]),
+		     trusted_num(args[2], NULL), funct);
+     return 0;
 }
 
-int write_ori(uint8_t opcode, FILE* output, char** args, size_t num_args) {
+static inline int trusted_format_SHIFTV(FORMAT_PARAMS) {
+     *output = rtype(opcode, trusted_reg(args[2]), trusted_reg(args[1]),
+		     trusted_reg(args[0]), 0, funct);
+     return 0;
+}
 
-     if(num_args != 3) return -1;
-     
-     int rt = translate_reg(args[0]);
-     int rs = translate_reg(args[1]);
-     long int imm;
-     
-     int err = translate_num(&imm, args[2], 0, 65535);
-     
-     if( rs == -1 || rt == -1  || err == -1)  return -1;  // invalid reg
-    
-     uint32_t instruction = 0;
-     
-     instruction |= (imm & 0xFFFF);   // funct, lower six bit
-     instruction |= (rt << 16);       // rt
-     instruction |= (rs << 21);       // rs
-     instruction |= (opcode << 26);   // opcode
-    
-     write_inst_hex(output, instruction);
+static inline int trusted_format_MULDIV(FORMAT_PARAMS) {
+     *output = rtype(opcode, trusted_reg(args[0]), trusted_reg(args[1]), 0, 0, funct);
+     return 0;
+}
 
+static inline int trusted_format_COUNT(FORMAT_PARAMS) {
+     int rd = trusted_reg(args[0]);
+     *output = rtype(opcode, trusted_reg(args[1]), rd, rd, 0, funct);
      return 0;
-     
 }
 
+#define trusted_format_TRAP trusted_format_MULDIV
 
+static inline int trusted_format_MFROM(FORMAT_PARAMS) {
+     *output = rtype(opcode, 0, 0, trusted_reg(args[0]), 0, funct);
+     return 0;
+}
 
-int write_addiu(uint8_t opcode, FILE* output, char** args, size_t num_args) {
+static inline int trusted_format_MTO(FORMAT_PARAMS) {
+     *output = rtype(opcode, trusted_reg(args[0]), 0, 0, 0, funct);
+     return 0;
+}
 
-     if(num_args != 3) return -1;
-     
-     int rt = translate_reg(args[0]);
-     int rs = translate_reg(args[1]);
-     long int imm;
-     
-     int err = translate_num(&imm, args[2], -32769, 32768);
-     
-     if( rs == -1 || rt == -1  || err == -1)  return -1;  // invalid reg
-    
-     uint32_t instruction = 0;
-     
-     instruction |= (imm & 0xFFFF);   // funct, lower six bit
-     instruction |= (rt << 16);       // rt
-     instruction |= (rs << 21);       // rs
-     instruction |= (opcode << 26);   // opcode
-    
-     write_inst_hex(output, instruction);
+#define trusted_format_JR trusted_format_MTO
 
+static inline int trusted_format_JALR(FORMAT_PARAMS) {
+     int rd = num_args == 2 ? trusted_reg(args[0]) : 31;
+     *output = rtype(opcode, trusted_reg(args[num_args - 1]), 0, rd, 0, funct);
      return 0;
+}
 
+#define trusted_format_NONE encode_format_NONE
+
+static inline int trusted_format_IMM(FORMAT_PARAMS) {
+     *output = itype(opcode, trusted_reg(args[1]), trusted_reg(args[0]),
+		     trusted_num(args[2], NULL));
+     return 0;
 }
 
-/*
- * helper function for jr $reg instruction
- */
+static inline int trusted_format_LUI(FORMAT_PARAMS) {
+     *output = itype(opcode, 0, trusted_reg(args[0]), trusted_num(args[1], NULL));
+     return 0;
+}
 
-int write_jr(uint8_t funct, FILE* output, char** args, size_t num_args) {
+static inline int trusted_format_MEM(FORMAT_PARAMS) {
+     char* end;
+     long int imm = trusted_num(args[1], &end);
+     *output = itype(opcode, trusted_reg(end + 1), trusted_reg(args[0]), imm);
+     return 0;
+}
 
-     if(num_args != 1) return -1;
-     
-     int rs = translate_reg(args[0]);
+static inline int trusted_format_BRANCH(FORMAT_PARAMS) {
+     int64_t labelAddress = get_addr_for_symbol(symtbl, args[2]);
+     if (labelAddress == -1) return -1;
+     *output = itype(opcode, trusted_reg(args[0]), trusted_reg(args[1]),
+		     (labelAddress - addr - 4) / 4);
+     return 0;
+}
 
-     if( rs == -1 )  return -1;  // invalid reg
-    
-     uint32_t instruction = 0;
-     
-     instruction |= (funct & 0x3F);   // funct, lower six bit
-     
-     instruction |= (rs << 21);       // rs
-    
-     write_inst_hex(output, instruction);
+static inline int trusted_format_BRANCHZ(FORMAT_PARAMS) {
+     int64_t labelAddress = get_addr_for_symbol(symtbl, args[1]);
+     if (labelAddress == -1) return -1;
+     *output = itype(opcode, trusted_reg(args[0]), funct,
+		     (labelAddress - addr - 4) / 4);
+     return 0;
+}
 
+static inline int trusted_format_JUMP(FORMAT_PARAMS) {
+     if (get_addr_for_symbol(reltbl, args[0]) == -1)
+	  add_to_table(reltbl, args[0], addr);
+     *output = (uint32_t) opcode << 26;
      return 0;
+}
 
+/* One checked and one trusted encoder per instruction of isa.h, each a
+   call of its format's encoder with the instruction's fields. */
+#define ENCODERS(name, format, opcode, funct, lo, hi) \
+static int encode_op_##name(uint32_t* output, char** args, size_t num_args, \
+    uint32_t addr, SymbolTable* symtbl, SymbolTable* reltbl) { \
+     return encode_format_##format(opcode, funct, lo, hi, output, args, \
+				   num_args, addr, symtbl, reltbl); \
+} \
+static int trusted_op_##name(uint32_t* output, char** args, size_t num_args, \
+    uint32_t addr, SymbolTable* symtbl, SymbolTable* reltbl) { \
+     return trusted_format_##format(opcode, funct, lo, hi, output, args, \
+				    num_args, addr, symtbl, reltbl); \
+}
+MIPS_INSTRUCTIONS(ENCODERS)
+#undef ENCODERS
+
+#define DESCRIBE(name, format, opcode, funct, lo, hi) \
+     { #name, FMT_##format, opcode, funct, lo, hi, encode_op_##name, \
+       trusted_op_##name },
+static const InstDesc INSTRUCTIONS[] = {
+     MIPS_INSTRUCTIONS(DESCRIBE)
+};
+#undef DESCRIBE
+
+#define NUM_INSTRUCTIONS (sizeof(INSTRUCTIONS) / sizeof(INSTRUCTIONS[0]))
+
+/* Open-addressed hash of the mnemonics: slot i holds an index into
+   INSTRUCTIONS plus one, or 0. Filled in once, on first use, along with
+   the same indices by opcode, for the opcodes of one instruction, and by
+   function, for opcode 0. */
+#define INST_SLOTS 256
+
+static uint8_t inst_slots[INST_SLOTS];
+static uint8_t opcode_insts[64];
+static uint8_t funct_insts[64];
+static pthread_once_t inst_slots_once = PTHREAD_ONCE_INIT;
+
+static inline uint32_t hash_mnemonic(const char* name) {
+     uint32_t hash = 2166136261u;
+     for (; *name; name++)
+	  hash = (hash ^ (uint8_t) *name) * 16777619u;
+     return hash;
+}
+
+static void fill_inst_slots() {
+     for (size_t i = 0; i < NUM_INSTRUCTIONS; i++) {
+	  uint32_t slot = hash_mnemonic(INSTRUCTIONS[i].name) % INST_SLOTS;
+	  while (inst_slots[slot])
+	       slot = (slot + 1) % INST_SLOTS;
+	  inst_slots[slot] = i + 1;
+
+	  uint8_t opcode = INSTRUCTIONS[i].opcode;
+	  if (opcode == 0x00)
+	       funct_insts[INSTRUCTIONS[i].funct] = i + 1;
+	  else if (opcode != 0x01 && opcode != 0x1c)
+	       opcode_insts[opcode] = i + 1;
+     }
 }
 
+/* Returns the description of the instruction NAME, or NULL if there is no
+   such instruction. Pseudoinstructions are not in the table.
+ */
+const InstDesc* find_inst(const char* name) {
+     pthread_once(&inst_slots_once, fill_inst_slots);
+     for (uint32_t slot = hash_mnemonic(name) % INST_SLOTS; inst_slots[slot];
+	  slot = (slot + 1) % INST_SLOTS) {
+	  const InstDesc* inst = &INSTRUCTIONS[inst_slots[slot] - 1];
+	  if (strcmp(inst->name, name) == 0)
+	       return inst;
+     }
+     return NULL;
+}
 
-/* A helper function for writing most R-type instructions. You should use
-   translate_reg() to parse registers and write_inst_hex() to write to 
-   OUTPUT. Both are defined in translate_utils.h.
+/* Fast path of translate_inst() for trusted input. Argument counts,
+   register names, immediate ranges and branch ranges are not checked;
+   the only error reported is a branch to an unknown label, which cannot be
+   encoded at all. Output for valid input is identical to translate_inst().
 
-   This function is INCOMPLETE. Complete the implementation below. You will
-   find bitwise operations to be the cleanest way to complete this function.
+   Returns 0 on success and -1 on error.
  */
-int write_rtype(uint8_t funct, FILE* output, char** args, size_t num_args) {
+int translate_inst_trusted(FILE* output, const char* name, char** args, size_t num_args,
+    uint32_t addr, SymbolTable* symtbl, SymbolTable* reltbl) {
 
-     if(num_args != 3) return -1;
-     
-     int rd = translate_reg(args[0]);
-     int rs = translate_reg(args[1]);
-     int rt = translate_reg(args[2]);
-     
-     if(rd == -1 || rs == -1 || rt == -1)  return -1;  // invalid reg
-    
-     uint32_t instruction = 0;
-     
-     instruction |= (funct & 0x3F);   // funct, lower six bit
-     instruction |= (rd << 11);       // rd
-     instruction |= (rt << 16);       // rt
-     instruction |= (rs << 21);       // rs
-    
-     write_inst_hex(output, instruction);
+     uint32_t instruction;
 
+     if (encode_inst_trusted(&instruction, name, args, num_args, addr, symtbl, reltbl) == -1)
+	  return -1;
+
+     write_inst_hex(output, instruction);
      return 0;
 }
 
-/* A helper function for writing shift instructions. You should use 
-   translate_num() to parse numerical arguments. translate_num() is defined
-   in translate_utils.h.
+/* Trusted counterpart of encode_inst(). */
+int encode_inst_trusted(uint32_t* output, const char* name, char** args, size_t num_args,
+    uint32_t addr, SymbolTable* symtbl, SymbolTable* reltbl) {
 
-   This function is INCOMPLETE. Complete the implementation below. You will
-   find bitwise operations to be the cleanest way to complete this function.
- */
-int write_shift(uint8_t funct, FILE* output, char** args, size_t num_args) {
+     const InstDesc* inst = find_inst(name);
+     if (!inst || (num_args > 0 && args[num_args - 1][0] == '%'))   // la halves
+	  return encode_inst(output, name, args, num_args, addr, symtbl, reltbl);
 
-     if(num_args != 3) return -1;
-     
-    long int shamt;
-    int rd = translate_reg(args[0]);
-    int rt = translate_reg(args[1]);
-    int err = translate_num(&shamt, args[2], 0, 31);
-
-    
-    if(err == -1 || rd == -1 || rt == -1)  return -1;
-
-    
-    uint32_t instruction = 0;
-
-    
-    instruction |= (funct & 0x3F);   // funct, lower six bit
-    instruction |= (shamt << 6);     // shamt
-    instruction |= (rd << 11);       // rd
-    instruction |= (rt << 16);       // rt
-   
-    write_inst_hex(output, instruction);
-     
-    return 0;
+     int res = inst->encode_trusted(output, args, num_args, addr, symtbl, reltbl);
+     PROBE4(translate, name, res == 0 ? MNEMONIC_ID(*output) : -1, addr, res);
+     return res;
+}
+
+/* The instruction with OPCODE, and FUNCT if OPCODE is 0, if it is of
+   FORMAT. The helpers below are given only those fields, and take the
+   bounds of the immediate from it. */
+static const InstDesc* find_inst_code(InstFormat format, uint8_t opcode,
+    uint8_t funct) {
+     pthread_once(&inst_slots_once, fill_inst_slots);
+     uint8_t i = opcode == 0x00 ? funct_insts[funct & 0x3f] : opcode_insts[opcode & 0x3f];
+     if (!i || INSTRUCTIONS[i - 1].format != format)
+	  return NULL;
+     return &INSTRUCTIONS[i - 1];
+}
+
+/* The helpers of translate.h, for one format each. */
+
+int encode_jump(uint8_t opcode, uint32_t* output, char** args, size_t num_args,
+	       uint32_t addr, SymbolTable* reltbl) {
+     return encode_format_JUMP(opcode, 0, 0, 0, output, args, num_args, addr,
+			       NULL, reltbl);
+}
+
+int encode_branch(uint8_t opcode, uint32_t* output, char** args, size_t num_args,
+		 uint32_t addr, SymbolTable* symtbl) {
+     return encode_format_BRANCH(opcode, 0, 0, 0, output, args, num_args, addr,
+				 symtbl, NULL);
+}
+
+int encode_mem(uint8_t opcode, uint32_t* output, char** args, size_t num_args) {
+     const InstDesc* inst = find_inst_code(FMT_MEM, opcode, 0);
+     if (!inst) return -1;
+     return encode_format_MEM(opcode, 0, inst->lo, inst->hi, output, args,
+			      num_args, 0, NULL, NULL);
+}
+
+int encode_lui(uint8_t opcode, uint32_t* output, char** args, size_t num_args) {
+     const InstDesc* inst = find_inst_code(FMT_LUI, opcode, 0);
+     if (!inst) return -1;
+     return encode_format_LUI(opcode, 0, inst->lo, inst->hi, output, args,
+			      num_args, 0, NULL, NULL);
+}
+
+int encode_ori(uint8_t opcode, uint32_t* output, char** args, size_t num_args) {
+     const InstDesc* inst = find_inst_code(FMT_IMM, opcode, 0);
+     if (!inst) return -1;
+     return encode_format_IMM(opcode, 0, inst->lo, inst->hi, output, args,
+			      num_args, 0, NULL, NULL);
+}
+
+int encode_addiu(uint8_t opcode, uint32_t* output, char** args, size_t num_args) {
+     const InstDesc* inst = find_inst_code(FMT_IMM, opcode, 0);
+     if (!inst) return -1;
+     return encode_format_IMM(opcode, 0, inst->lo, inst->hi, output, args,
+			      num_args, 0, NULL, NULL);
+}
+
+int encode_jr(uint8_t funct, uint32_t* output, char** args, size_t num_args) {
+     return encode_format_JR(0, funct, 0, 0, output, args, num_args, 0, NULL,
+			     NULL);
+}
+
+/* A helper function for encoding most R-type instructions: rd, rs, rt. */
+int encode_rtype(uint8_t funct, uint32_t* output, char** args, size_t num_args) {
+     return encode_format_R3(0, funct, 0, 0, output, args, num_args, 0, NULL,
+			     NULL);
+}
+
+/* A helper function for encoding shift instructions: rd, rt, shamt. */
+int encode_shift(uint8_t funct, uint32_t* output, char** args, size_t num_args) {
+     const InstDesc* inst = find_inst_code(FMT_SHIFT, 0, funct);
+     if (!inst) return -1;
+     return encode_format_SHIFT(0, funct, inst->lo, inst->hi, output, args,
+				num_args, 0, NULL, NULL);
 }
 
 
@@ -3,35 +3,69 @@
 
 #include <stdint.h>
 
+#include "isa.h"
+
 /* IMPLEMENT ME - see documentation in translate.c */
 unsigned write_pass_one(FILE* output, const char* name, char** args, int num_args);
 
+/* Number of instructions write_pass_one() would write - see translate.c */
+unsigned size_pass_one(const char* name, char** args, int num_args);
+
 /* IMPLEMENT ME - see documentation in translate.c */
 int translate_inst(FILE* output, const char* name, char** args, size_t num_args, 
     uint32_t addr, SymbolTable* symtbl, SymbolTable* reltbl);
 
+/* Encodes without writing - see translate.c */
+int encode_inst(uint32_t* output, const char* name, char** args, size_t num_args,
+    uint32_t addr, SymbolTable* symtbl, SymbolTable* reltbl);
+
+/* Trusted-input fast path of translate_inst() - see translate.c */
+int translate_inst_trusted(FILE* output, const char* name, char** args, size_t num_args,
+    uint32_t addr, SymbolTable* symtbl, SymbolTable* reltbl);
+
+int encode_inst_trusted(uint32_t* output, const char* name, char** args, size_t num_args,
+    uint32_t addr, SymbolTable* symtbl, SymbolTable* reltbl);
+
+typedef int (*InstEncoder)(uint32_t* output, char** args, size_t num_args,
+    uint32_t addr, SymbolTable* symtbl, SymbolTable* reltbl);
+
+/* An instruction of isa.h and its encoders. */
+typedef struct {
+    const char* name;
+    InstFormat format;
+    uint8_t opcode;
+    uint8_t funct;
+    long int lo;             // bounds of the immediate
+    long int hi;
+    InstEncoder encode;
+    InstEncoder encode_trusted;
+} InstDesc;
+
+/* Looks up an instruction of isa.h - see translate.c */
+const InstDesc* find_inst(const char* name);
+
 /* Declaring helper functions: */
 
-int write_rtype(uint8_t funct, FILE* output, char** args, size_t num_args);
+int encode_rtype(uint8_t funct, uint32_t* output, char** args, size_t num_args);
 
-int write_shift(uint8_t funct, FILE* output, char** args, size_t num_args);
+int encode_shift(uint8_t funct, uint32_t* output, char** args, size_t num_args);
 
 /* SOLUTION CODE BELOW */
 
-int write_jr(uint8_t funct, FILE* output, char** args, size_t num_args);
+int encode_jr(uint8_t funct, uint32_t* output, char** args, size_t num_args);
 
-int write_addiu(uint8_t opcode, FILE* output, char** args, size_t num_args);
+int encode_addiu(uint8_t opcode, uint32_t* output, char** args, size_t num_args);
 
-int write_ori(uint8_t opcode, FILE* output, char** args, size_t num_args);
+int encode_ori(uint8_t opcode, uint32_t* output, char** args, size_t num_args);
 
-int write_lui(uint8_t opcode, FILE* output, char** args, size_t num_args);
+int encode_lui(uint8_t opcode, uint32_t* output, char** args, size_t num_args);
 
-int write_mem(uint8_t opcode, FILE* output, char** args, size_t num_args);
+int encode_mem(uint8_t opcode, uint32_t* output, char** args, size_t num_args);
 
-int write_branch(uint8_t opcode, FILE* output, char** args, size_t num_args, 
+int encode_branch(uint8_t opcode, uint32_t* output, char** args, size_t num_args, 
     uint32_t addr, SymbolTable* symtbl);
 
-int write_jump(uint8_t opcode, FILE* output, char** args, size_t num_args, 
+int encode_jump(uint8_t opcode, uint32_t* output, char** args, size_t num_args, 
     uint32_t addr, SymbolTable* reltbl);
 
 #endif
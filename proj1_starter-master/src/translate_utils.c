@@ -15,7 +15,9 @@ void write_inst_string(FILE* output, const char* name, char** args, int num_args
 }
 
 void write_inst_hex(FILE *output, uint32_t instruction) {
-    fprintf(output, "%08x\n", instruction);
+    if (output) {
+        fprintf(output, "%08x\n", instruction);
+    }
 }
 
 int is_valid_label(const char* str) {
@@ -82,30 +84,73 @@ int translate_num(long int* output, const char* str, long int lower_bound,
 		return -1;
 }
 
+/* Parses a memory operand of the form OFFSET(REG), eg. "-100($t1)", in place.
+   STR is scanned once; nothing is copied or allocated. OFFSET follows the
+   same rules as translate_num() and may be empty (meaning 0). REG must be a
+   valid register name and the closing parenthesis must end the operand.
+
+   On success the offset is stored in *OFFSET, the register number in *REG,
+   and 0 is returned. Returns -1 if the operand is malformed, the offset is
+   not a number or is outside [LOWER_BOUND, UPPER_BOUND], or the register is
+   invalid.
+ */
+int translate_mem_operand(long int* offset, int* reg, const char* str,
+		long int lower_bound, long int upper_bound) {
+
+	if (!str || !offset || !reg) {
+		return -1;
+	}
+
+	const char* leftp = strchr(str, '(');
+	if (!leftp) return -1;
+
+	const char* regp = leftp + 1;
+	const char* rightp = strchr(regp, ')');
+	if (!rightp || rightp[1] != '\0') return -1;
+
+	int hex = memchr(str, 'x', leftp - str) || memchr(str, 'X', leftp - str);
+	char* pEnd;
+	long int res = strtol(str, &pEnd, hex ? 16 : 10);
+	if (pEnd != leftp) return -1;
+	if (res < lower_bound || res > upper_bound) return -1;
+
+	int num = translate_reg_len(regp, rightp - regp);
+	if (num == -1) return -1;
+
+	*offset = res;
+	*reg = num;
+	return 0;
+}
+
 /* Translates the register name to the corresponding register number. Please
    see the MIPS Green Sheet for information about register numbers.
 
    Returns the register number of STR or -1 if the register name is invalid.
  */
+static const struct {
+    const char* name;
+    int num;
+} REGISTERS[] = {
+    { "$zero", 0 },  { "$0", 0 },     { "$at", 1 },    { "$v0", 2 },
+    { "$a0", 4 },    { "$a1", 5 },    { "$a2", 6 },    { "$a3", 7 },
+    { "$t0", 8 },    { "$t1", 9 },    { "$t2", 10 },   { "$t3", 11 },
+    { "$s0", 16 },   { "$s1", 17 },   { "$s2", 18 },   { "$s3", 19 },
+    { "$sp", 29 },   { "$ra", 31 },
+};
+
 int translate_reg(const char* str) {
-    if (strcmp(str, "$zero") == 0)      return 0;
-    else if (strcmp(str, "$0") == 0)    return 0;
-    else if (strcmp(str, "$at") == 0)   return 1;
-    else if (strcmp(str, "$v0") == 0)   return 2;
-    else if (strcmp(str, "$a0") == 0)   return 4;
-    /* YOUR CODE HERE */
-    else if (strcmp(str, "$a1") == 0)   return 5;
-    else if (strcmp(str, "$a2") == 0)   return 6;
-    else if (strcmp(str, "$a3") == 0)   return 7;
-    else if (strcmp(str, "$t0") == 0)   return 8;
-    else if (strcmp(str, "$t1") == 0)   return 9;
-    else if (strcmp(str, "$t2") == 0)   return 10;
-    else if (strcmp(str, "$t3") == 0)   return 11;
-    else if (strcmp(str, "$s0") == 0)   return 16;
-    else if (strcmp(str, "$s1") == 0)   return 17;
-    else if (strcmp(str, "$s2") == 0)   return 18;
-    else if (strcmp(str, "$s3") == 0)   return 19;
-    else if (strcmp(str, "$sp") == 0)   return 29;
-    else if (strcmp(str, "$ra") == 0)   return 31;
-    else                                return -1;
+    return translate_reg_len(str, strlen(str));
+}
+
+/* Same as translate_reg(), for the LEN characters at STR, which need not be
+   null-terminated.
+ */
+int translate_reg_len(const char* str, size_t len) {
+    for (size_t i = 0; i < sizeof(REGISTERS) / sizeof(REGISTERS[0]); i++) {
+        if (strncmp(str, REGISTERS[i].name, len) == 0
+            && REGISTERS[i].name[len] == '\0') {
+            return REGISTERS[i].num;
+        }
+    }
+    return -1;
 }
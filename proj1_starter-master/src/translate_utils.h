@@ -1,6 +1,7 @@
 #ifndef TRANSLATE_UTILS_H
 #define TRANSLATE_UTILS_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 /* Writes the instruction as a string to OUTPUT. NAME is the name of the 
@@ -9,7 +10,9 @@
  */
 void write_inst_string(FILE* output, const char* name, char** args, int num_args);
 
-/* Writes the instruction to OUTPUT in hexadecimal format. */
+/* Writes the instruction to OUTPUT in hexadecimal format. Nothing is written
+   if OUTPUT is NULL, so encoders can be run for validation only.
+ */
 void write_inst_hex(FILE* output, uint32_t instruction);
 
 /* Returns 1 if the label is valid and 0 if it is invalid. A valid label is one
@@ -25,4 +28,11 @@ int translate_num(long int* output, const char* str, long int lower_bound,
 /* IMPLEMENT ME - see documentation in translate_utils.c */
 int translate_reg(const char* str);
 
+/* Translates the register name in the LEN characters at STR. */
+int translate_reg_len(const char* str, size_t len);
+
+/* Parses an OFFSET(REG) memory operand in place - see translate_utils.c */
+int translate_mem_operand(long int* offset, int* reg, const char* str,
+	long int lower_bound, long int upper_bound);
+
 #endif
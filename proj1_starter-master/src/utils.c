@@ -5,7 +5,14 @@
 #include <string.h>
 #include <stdlib.h>
 
-static const char* output_file = NULL;
+#include "memstats.h"
+#include "probes.h"
+
+/* Log destination of the calling thread. Each thread logs independently, so
+   concurrent assembly jobs never share (or interleave) a destination. */
+static __thread const char* output_file = NULL;
+static __thread FILE* output_stream = NULL;
+static __thread const char* output_prefix = NULL;
 
 int is_log_file_set() {
     return output_file != NULL;
@@ -20,52 +27,70 @@ void set_log_file(const char* filename) {
     }
 }
 
+void set_log_stream(FILE* stream) {
+    output_stream = stream;
+}
+
+const char* set_log_prefix(const char* prefix) {
+    const char* old = output_prefix;
+    output_prefix = prefix;
+    return old;
+}
+
+/* Returns the stream to log to, opening the log file if one is set. */
+static FILE* open_log() {
+    if (output_stream) {
+        return output_stream;
+    } else if (output_file) {
+        return fopen(output_file, "a");
+    } else {
+        return stderr;
+    }
+}
+
+static void close_log(FILE* f) {
+    if (f != output_stream && f != stderr) {
+        fclose(f);
+    }
+}
+
 void write_to_log(char* fmt, ...) {
     va_list args;
 
-    if (output_file) {
-        FILE* f = fopen(output_file, "a");
-        if (!f) {
-            return;
-        }
-        
-        va_start(args, fmt);
-        vfprintf(f, fmt, args);
-        va_end(args);
-        fclose(f);
-    } else {
-        va_start(args, fmt);
-        vfprintf(stderr, fmt, args);
-        va_end(args);
+    PROBE1(diagnostic, fmt);
+    FILE* f = open_log();
+    if (!f) {
+        return;
+    }
+
+    if (output_prefix) {
+        fprintf(f, "%s: ", output_prefix);
     }
+    va_start(args, fmt);
+    vfprintf(f, fmt, args);
+    va_end(args);
+    close_log(f);
 }
 
 void log_inst(const char* name, char** args, int num_args) {
-    if (output_file) {
-        FILE* f = fopen(output_file, "a");
-        if (!f) {
-            return;
-        }
-        
-        fprintf(f, "%s", name);
-        for (int i = 0; i < num_args; i++) {
-            fprintf(f, " %s", args[i]);
-        }
-        fprintf(f, "\n");
-        fclose(f);
-    } else {
-        fprintf(stderr, "%s", name);
-        for (int i = 0; i < num_args; i++) {
-            fprintf(stderr, " %s", args[i]);
-        }
-        fprintf(stderr, "\n");
+    FILE* f = open_log();
+    if (!f) {
+        return;
+    }
+
+    fprintf(f, "%s", name);
+    for (int i = 0; i < num_args; i++) {
+        fprintf(f, " %s", args[i]);
     }
+    fprintf(f, "\n");
+    close_log(f);
 }
 
 
 char * strdup (const char *s) {
      char *d = malloc (strlen (s) + 1);   // Space for length plus nul
      if (d == NULL) return NULL;          // No memory
+     MEM_ALLOC (MEM_STRINGS, strlen (s) + 1);
      strcpy (d,s);                        // Copy the characters
      return d;                            // Return the new string
 }
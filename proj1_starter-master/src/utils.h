@@ -3,6 +3,14 @@ int is_log_file_set();
 
 void set_log_file(const char* filename);
 
+/* Sends this thread's log messages to STREAM instead of the log file or
+   stderr. Pass NULL to stop. */
+void set_log_stream(FILE* stream);
+
+/* Starts this thread's log messages with "PREFIX: ", such as the file they
+   are about, or with nothing if PREFIX is NULL. Returns the previous one. */
+const char* set_log_prefix(const char* prefix);
+
 void write_to_log(char* fmt, ...);
 
 void log_inst(const char* name, char** args, int num_args);
@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "src/utils.h"
+#include "src/tables.h"
+#include "src/memstats.h"
+#include "src/translate_utils.h"
+#include "src/translate.h"
+#include "src/data.h"
+#include "src/macro.h"
+#include "assembler.h"
+#include "stream.h"
+
+/* Single-pass assembly from a stream to a stream, for use in a pipeline.
+
+   Each source line goes through pass one on its own and the instructions
+   it expands to are encoded right away. The only instructions that cannot
+   be are branches to labels further down and the %hi and %lo halves of an
+   la of one, such as a .data label after .text; they are kept as fixups
+   and encoded when their label is defined. Words are written in order, so
+   the output holds back from the first unresolved fixup on. Memory is bounded
+   by that window and the symbol, relocation and fixup tables, not by the
+   size of the program, except for .data, which is kept until it is written
+   after the tables.
+
+   A fixup that fails to encode is dropped and, as in pass two, takes no
+   address, so the words after it move down by one. They are all still in
+   the window: the branches among them are kept to be encoded again and
+   their relocation entries are moved. The halves of la are absolute and
+   stay as they are.
+
+   Line numbers in diagnostics are source line numbers; there is no
+   intermediate file.
+ */
+
+#define LINE_SIZE 1024           // BUF_SIZE of assembler.c
+#define LINE_ARGS 3              // MAX_ARGS of assembler.c
+
+static const char* IGNORE = " \f\n\r\t\v,";
+
+/* A branch or la half in the window: waiting for its label, or, for a
+   branch, encoded and kept in case a fixup before it is dropped. */
+typedef struct {
+    uint32_t slot;               // index of its word in the window
+    uint32_t addr;
+    uint32_t line_no;
+    char* name;
+    char* args[LINE_ARGS];
+    int num_args;
+    int encoded;
+} Fixup;
+
+/* Words not yet written. Word i of the window is instruction FIRST + i.
+   The fixups are in the order of their words; WAITING counts those not
+   encoded yet. */
+typedef struct {
+    uint32_t* words;
+    char* resolved;
+    uint32_t len;
+    uint32_t cap;
+    uint32_t first;
+    Fixup* fixups;
+    uint32_t num_fixups;
+    uint32_t fixup_cap;
+    uint32_t waiting;
+} Window;
+
+static int encode(uint32_t* word, const char* name, char** args, int num_args,
+    uint32_t addr, SymbolTable* symtbl, SymbolTable* reltbl,
+    const AsmOptions* opts) {
+    return opts->trusted
+        ? encode_inst_trusted(word, name, args, num_args, addr, symtbl, reltbl)
+        : encode_inst(word, name, args, num_args, addr, symtbl, reltbl);
+}
+
+static void raise_error(uint32_t line_no, const char* name, char** args,
+    int num_args) {
+    write_to_log("Error - invalid instruction at line %d: ", line_no);
+    log_inst(name, args, num_args);
+}
+
+/* Returns the label of a branch to one, or NULL for other instructions. */
+static const char* branch_label(const char* name, char** args, int num_args) {
+    const InstDesc* inst = find_inst(name);
+    if (!inst || !is_branch_format(inst->format)
+        || num_args != (inst->format == FMT_BRANCH ? 3 : 2)) {
+        return NULL;
+    }
+    const char* label = args[num_args - 1];
+    return is_valid_label(label) ? label : NULL;
+}
+
+/* Returns the label of a %hi(label) or %lo(label) operand, copied into BUF
+   of LINE_SIZE, or NULL if the last of ARGS is not one. */
+static const char* half_label(char** args, int num_args, char* buf) {
+    if (num_args == 0) {
+        return NULL;
+    }
+    const char* arg = args[num_args - 1];
+    size_t len = strlen(arg);
+    if ((strncmp(arg, "%hi(", 4) != 0 && strncmp(arg, "%lo(", 4) != 0)
+        || len < 6 || arg[len - 1] != ')' || len - 5 >= LINE_SIZE) {
+        return NULL;
+    }
+    memcpy(buf, arg + 4, len - 5);
+    buf[len - 5] = '\0';
+    return is_valid_label(buf) ? buf : NULL;
+}
+
+/* Returns the label an instruction may refer to before it is defined, using
+   BUF of LINE_SIZE, or NULL if it has none. */
+static const char* forward_label(const char* name, char** args, int num_args,
+    char* buf) {
+    const char* label = branch_label(name, args, num_args);
+    return label ? label : half_label(args, num_args, buf);
+}
+
+static void push_word(Window* w, uint32_t word, int resolved) {
+    if (w->len == w->cap) {
+        uint32_t old_cap = w->cap;
+        w->cap = w->cap ? w->cap * 2 : 64;
+        w->words = realloc(w->words, w->cap * sizeof(uint32_t));
+        w->resolved = realloc(w->resolved, w->cap);
+        if (!w->words || !w->resolved) {
+            allocation_failed();
+        }
+        MEM_RESIZE(MEM_OUTPUT, old_cap * (sizeof(uint32_t) + 1),
+            w->cap * (sizeof(uint32_t) + 1));
+    }
+    w->words[w->len] = word;
+    w->resolved[w->len] = resolved;
+    w->len++;
+}
+
+/* Records the instruction whose word was pushed last, ENCODED or waiting. */
+static void add_fixup(Window* w, uint32_t addr, uint32_t line_no, const char* name,
+    char** args, int num_args, int encoded) {
+    if (w->num_fixups == w->fixup_cap) {
+        uint32_t old_cap = w->fixup_cap;
+        w->fixup_cap = w->fixup_cap ? w->fixup_cap * 2 : 16;
+        w->fixups = realloc(w->fixups, w->fixup_cap * sizeof(Fixup));
+        if (!w->fixups) {
+            allocation_failed();
+        }
+        MEM_RESIZE(MEM_OUTPUT, old_cap * sizeof(Fixup), w->fixup_cap * sizeof(Fixup));
+    }
+    Fixup* f = &w->fixups[w->num_fixups++];
+    f->slot = w->first + w->len - 1;
+    f->addr = addr;
+    f->line_no = line_no;
+    f->name = strdup(name);
+    f->num_args = num_args;
+    for (int i = 0; i < num_args; i++) {
+        f->args[i] = strdup(args[i]);
+    }
+    f->encoded = encoded;
+    if (!encoded) {
+        w->waiting++;
+    }
+}
+
+static void free_fixup(Fixup* f) {
+    MEM_FREE(MEM_STRINGS, strlen(f->name) + 1);
+    free(f->name);
+    for (int i = 0; i < f->num_args; i++) {
+        MEM_FREE(MEM_STRINGS, strlen(f->args[i]) + 1);
+        free(f->args[i]);
+    }
+}
+
+/* Writes the words at the front of the window that are resolved. A word
+   whose branch failed to encode is dropped, as pass two drops it. */
+static void flush_window(Window* w, FILE* output) {
+    uint32_t i = 0;
+    while (i < w->len && w->resolved[i]) {
+        if (w->resolved[i] == 1) {
+            write_inst_hex(output, w->words[i]);
+        }
+        i++;
+    }
+    if (i == 0) return;
+
+    memmove(w->words, w->words + i, (w->len - i) * sizeof(uint32_t));
+    memmove(w->resolved, w->resolved + i, w->len - i);
+    w->len -= i;
+    w->first += i;
+
+    uint32_t written = 0;
+    while (written < w->num_fixups && w->fixups[written].slot < w->first) {
+        free_fixup(&w->fixups[written++]);
+    }
+    if (written > 0) {
+        memmove(w->fixups, w->fixups + written,
+            (w->num_fixups - written) * sizeof(Fixup));
+        w->num_fixups -= written;
+    }
+}
+
+/* Drops fixup I, which failed to encode: the words after it move down to
+   its address and those of the branches among them are encoded again. */
+static void drop_fixup(Window* w, uint32_t i, SymbolTable* reltbl, uint32_t* addr) {
+    uint32_t dropped = w->fixups[i].addr;
+    free_fixup(&w->fixups[i]);
+    w->waiting--;
+    w->num_fixups--;
+    memmove(w->fixups + i, w->fixups + i + 1, (w->num_fixups - i) * sizeof(Fixup));
+
+    for (uint32_t j = i; j < w->num_fixups; j++) {
+        Fixup* f = &w->fixups[j];
+        f->addr -= 4;
+        if (f->encoded) {
+            f->encoded = 0;
+            w->resolved[f->slot - w->first] = 0;
+            w->waiting++;
+        }
+    }
+    for (uint32_t j = 0; j < reltbl->len; j++) {
+        if (reltbl->tbl[j].addr > dropped) {
+            reltbl->tbl[j].addr -= 4;
+        }
+    }
+    *addr -= 4;
+}
+
+/* Encodes the fixups whose label is now defined, or all remaining ones
+   (reporting them as errors) if FINAL is set. *ADDR, the byte offset of the
+   next instruction, goes down a word for each that failed. Returns -1 if
+   any failed. */
+static int resolve_fixups(Window* w, SymbolTable* symtbl, SymbolTable* reltbl,
+    const AsmOptions* opts, int final, uint32_t* addr) {
+    char buf[LINE_SIZE];
+    int err = 0;
+
+    uint32_t i = 0;
+    while (i < w->num_fixups) {
+        Fixup* f = &w->fixups[i];
+        if (f->encoded
+            || (!final && get_addr_for_symbol(symtbl,
+                    forward_label(f->name, f->args, f->num_args, buf)) == -1)) {
+            i++;
+            continue;
+        }
+
+        uint32_t slot = f->slot - w->first;
+        if (encode(&w->words[slot], f->name, f->args, f->num_args, f->addr,
+                symtbl, reltbl, opts) == 0) {
+            w->resolved[slot] = 1;
+            f->encoded = 1;
+            w->waiting--;
+            i++;
+        } else {
+            raise_error(f->line_no, f->name, f->args, f->num_args);
+            w->resolved[slot] = 2;
+            err = -1;
+            drop_fixup(w, i, reltbl, addr);
+        }
+    }
+    return err;
+}
+
+/* Assembles the program read from INPUT and writes the output file format
+   of assemble() to OUTPUT, without an intermediate file and without seeking
+   either stream. Returns 0 on success and 1 if there were errors. With
+   OPTS->memstats set, the memory used is reported on stderr, as OUTPUT may
+   be stdout.
+ */
+int assemble_stream(FILE* input, FILE* output, const AsmOptions* opts) {
+    MemStats stats;
+    if (opts->memstats) {
+        start_mem_stats(&stats);
+    }
+
+    SymbolTable* symtbl = create_table_in(SYMTBL_UNIQUE_NAME, opts->allocator);
+    SymbolTable* reltbl = create_table_in(SYMTBL_NON_UNIQUE, opts->allocator);
+    PassState one = { 0, 0 };
+    one.data = create_data_section();
+    one.macros = create_macro_table();
+    uint32_t addr = 0;           // pass two's byte offset
+    Window w;
+    memset(&w, 0, sizeof(w));
+    int err = 0;
+
+    char line[LINE_SIZE];
+    char* inter_text = NULL;
+    size_t inter_len = 0;
+    FILE* inter = open_memstream(&inter_text, &inter_len);
+    if (!inter) {
+        allocation_failed();
+    }
+
+    fprintf(output, ".text\n");
+
+    while (fgets(line, LINE_SIZE, input) != NULL) {
+        FILE* src = fmemopen(line, strlen(line), "r");
+        if (!src) {
+            allocation_failed();
+        }
+
+        /* Pass one over the line: labels, pseudo-instructions and their
+           diagnostics, exactly as in a whole-file pass one. */
+        uint32_t labels = symtbl->len;
+        rewind(inter);
+        if (run_pass_one(src, inter, symtbl, &one) != 0) {
+            err = 1;
+        }
+        fclose(src);
+
+        /* The memstream keeps its old size after a rewind; the text of this
+           line ends at the current position. */
+        fflush(inter);
+        long inter_end = ftell(inter);
+        inter_text[inter_end] = '\0';
+
+        if (symtbl->len != labels && w.waiting > 0) {
+            if (resolve_fixups(&w, symtbl, reltbl, opts, 0, &addr) != 0) {
+                err = 1;
+            }
+        }
+
+        /* Pass two over the lines it expanded to. As in pass two, only an
+           instruction that encodes advances the byte offset. */
+        char* save_line;
+        char* text = inter_end > 0 ? strtok_r(inter_text, "\n", &save_line) : NULL;
+        for (; text != NULL; text = strtok_r(NULL, "\n", &save_line)) {
+            char* args[LINE_ARGS];
+            int num_args = 0;
+            char* save;
+            char* name = strtok_r(text, IGNORE, &save);
+            if (!name) continue;
+            for (char* pch = strtok_r(NULL, IGNORE, &save);
+                pch != NULL && num_args < LINE_ARGS; pch = strtok_r(NULL, IGNORE, &save)) {
+                args[num_args++] = pch;
+            }
+
+            uint32_t word;
+            char half[LINE_SIZE];
+            const char* label = branch_label(name, args, num_args);
+            const char* target = label ? label : half_label(args, num_args, half);
+            if (target && get_addr_for_symbol(symtbl, target) == -1) {
+                push_word(&w, 0, 0);
+                add_fixup(&w, addr, one.line_no, name, args, num_args, 0);
+            } else if (encode(&word, name, args, num_args, addr, symtbl, reltbl,
+                    opts) == 0) {
+                push_word(&w, word, 1);
+                if (label && w.waiting > 0) {
+                    add_fixup(&w, addr, one.line_no, name, args, num_args, 1);
+                }
+            } else {
+                raise_error(one.line_no, name, args, num_args);
+                err = 1;
+                continue;
+            }
+            addr += 4;
+        }
+        flush_window(&w, output);
+    }
+
+    if (resolve_fixups(&w, symtbl, reltbl, opts, 1, &addr) != 0) {
+        err = 1;
+    }
+    flush_window(&w, output);
+
+    fprintf(output, "\n.symbol\n");
+    write_table(symtbl, output);
+    fprintf(output, "\n.relocation\n");
+    write_table(reltbl, output);
+    if (check_macros_closed(one.macros) != 0) {
+        err = 1;
+    }
+    if (resolve_data_labels(one.data, symtbl) != 0) {
+        err = 1;
+    }
+    if (one.data->size > 0) {
+        fprintf(output, "\n.data\n");
+        write_data_section(one.data, output, 0);
+    }
+    fflush(output);
+
+    fclose(inter);
+    free(inter_text);
+    MEM_FREE(MEM_OUTPUT, w.cap * (sizeof(uint32_t) + 1) + w.fixup_cap * sizeof(Fixup));
+    free(w.words);
+    free(w.resolved);
+    free(w.fixups);
+    free_data_section(one.data);
+    free_macro_table(one.macros);
+    free_table(symtbl);
+    free_table(reltbl);
+
+    if (opts->memstats) {
+        stop_mem_stats();
+        write_mem_stats(&stats, stderr);
+    }
+    return err;
+}
@@ -0,0 +1,6 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+int assemble_stream(FILE* input, FILE* output, const AsmOptions* opts);
+
+#endif
@@ -1,13 +1,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include <CUnit/Basic.h>
 
 #include "src/utils.h"
+#include "src/alloc.h"
+#include "src/memstats.h"
+#include "src/perf_counters.h"
 #include "src/tables.h"
 #include "src/translate_utils.h"
 #include "src/translate.h"
+#include "src/sched.h"
+#include "src/io_ring.h"
+#include "src/mapped_output.h"
+#include "src/source_map.h"
+#include "src/data.h"
+#include "src/source_cache.h"
+#include "src/macro.h"
+#include "src/pseudo.h"
+#include "src/peephole.h"
+#include "src/delay_slots.h"
+#include "assembler.h"
+#include "stream.h"
 
 const char* TMP_FILE = "test_output.txt";
 const int BUF_SIZE = 1024;
@@ -85,6 +103,28 @@ void test_translate_num() {
     CU_ASSERT_EQUAL(translate_num(&output, "35x", -100, 100), -1);
 }
 
+void test_translate_mem_operand() {
+    long int offset;
+    int reg;
+
+    CU_ASSERT_EQUAL(translate_mem_operand(&offset, &reg, "-100($t1)", -32768, 32767), 0);
+    CU_ASSERT_EQUAL(offset, -100);
+    CU_ASSERT_EQUAL(reg, 9);
+    CU_ASSERT_EQUAL(translate_mem_operand(&offset, &reg, "0x10($sp)", -32768, 32767), 0);
+    CU_ASSERT_EQUAL(offset, 16);
+    CU_ASSERT_EQUAL(reg, 29);
+    CU_ASSERT_EQUAL(translate_mem_operand(&offset, &reg, "($ra)", -32768, 32767), 0);
+    CU_ASSERT_EQUAL(offset, 0);
+    CU_ASSERT_EQUAL(reg, 31);
+    CU_ASSERT_EQUAL(translate_mem_operand(&offset, &reg, "40000($t1)", -32768, 32767), -1);
+    CU_ASSERT_EQUAL(translate_mem_operand(&offset, &reg, "4($t1", -32768, 32767), -1);
+    CU_ASSERT_EQUAL(translate_mem_operand(&offset, &reg, "4($t1)x", -32768, 32767), -1);
+    CU_ASSERT_EQUAL(translate_mem_operand(&offset, &reg, "4$t1)", -32768, 32767), -1);
+    CU_ASSERT_EQUAL(translate_mem_operand(&offset, &reg, "4z($t1)", -32768, 32767), -1);
+    CU_ASSERT_EQUAL(translate_mem_operand(&offset, &reg, "4($t)", -32768, 32767), -1);
+    CU_ASSERT_EQUAL(translate_mem_operand(&offset, &reg, "4($t11)", -32768, 32767), -1);
+}
+
 /****************************************
  *  Test cases for tables.c 
  ****************************************/
@@ -152,12 +192,1457 @@ void test_table_2() {
     free_table(tbl);
 }
 
+void test_table_snapshot() {
+    const char* snap_file = "test_snapshot.bin";
+    int max = 1000;
+    char buf[16];
+    SymbolSnapshot snap;
+
+    SymbolTable* tbl = create_table(SYMTBL_UNIQUE_NAME);
+    for (int i = 0; i < max; i++) {
+        sprintf(buf, "sym%d", i);
+        CU_ASSERT_EQUAL(add_to_table(tbl, buf, 4 * i), 0);
+    }
+    FILE* f = fopen(snap_file, "w");
+    CU_ASSERT_EQUAL(write_table_snapshot(tbl, f), 0);
+    fclose(f);
+    free_table(tbl);
+
+    CU_ASSERT_EQUAL(open_table_snapshot(&snap, snap_file), 0);
+    for (int i = 0; i < max; i++) {
+        sprintf(buf, "sym%d", i);
+        CU_ASSERT_EQUAL(get_addr_for_snapshot(&snap, buf), 4 * i);
+    }
+    CU_ASSERT_EQUAL(get_addr_for_snapshot(&snap, "sym"), -1);
+    CU_ASSERT_EQUAL(get_addr_for_snapshot(&snap, "sym1000"), -1);
+    CU_ASSERT_EQUAL(get_addr_for_snapshot(&snap, ""), -1);
+    close_table_snapshot(&snap);
+
+    /* Non-unique tables keep the first entry for a repeated name. */
+    tbl = create_table(SYMTBL_NON_UNIQUE);
+    add_to_table(tbl, "abc", 8);
+    add_to_table(tbl, "abc", 12);
+    f = fopen(snap_file, "w");
+    CU_ASSERT_EQUAL(write_table_snapshot(tbl, f), 0);
+    fclose(f);
+    free_table(tbl);
+    CU_ASSERT_EQUAL(open_table_snapshot(&snap, snap_file), 0);
+    CU_ASSERT_EQUAL(get_addr_for_snapshot(&snap, "abc"), 8);
+    close_table_snapshot(&snap);
+
+    /* Empty, truncated and foreign files are rejected. */
+    tbl = create_table(SYMTBL_UNIQUE_NAME);
+    f = fopen(snap_file, "w");
+    CU_ASSERT_EQUAL(write_table_snapshot(tbl, f), 0);
+    fclose(f);
+    free_table(tbl);
+    CU_ASSERT_EQUAL(open_table_snapshot(&snap, snap_file), 0);
+    CU_ASSERT_EQUAL(get_addr_for_snapshot(&snap, "abc"), -1);
+    close_table_snapshot(&snap);
+    CU_ASSERT_EQUAL(truncate(snap_file, 12), 0);
+    CU_ASSERT_EQUAL(open_table_snapshot(&snap, snap_file), -1);
+    f = fopen(snap_file, "w");
+    fprintf(f, ".symbol\n0\tabc\n");
+    fclose(f);
+    CU_ASSERT_EQUAL(open_table_snapshot(&snap, snap_file), -1);
+    CU_ASSERT_EQUAL(open_table_snapshot(&snap, "no_such_snapshot.bin"), -1);
+    unlink(snap_file);
+}
+
+typedef struct {
+    ConcurrentSymbolTable* tbl;
+    int index;
+    int failures;
+    int lookup_errors;
+} CtableWorker;
+
+/* Every thread inserts the same 500 names, each later in source order than
+   the names of the threads before it. */
+void* ctable_insert_worker(void* arg) {
+    CtableWorker* w = arg;
+    char buf[16];
+    for (int i = 0; i < 500; i++) {
+        sprintf(buf, "L%d", i);
+        if (add_to_ctable(w->tbl, buf, 4 * (1000 * w->index + i), 500 * w->index + i) != 0) {
+            w->failures++;
+        }
+        if (get_addr_for_csymbol(w->tbl, buf) == -1) {
+            w->lookup_errors++;
+        }
+    }
+    return NULL;
+}
+
+void test_ctable() {
+    ConcurrentSymbolTable* tbl = create_ctable(SYMTBL_UNIQUE_NAME, 4);
+    CU_ASSERT_PTR_NOT_NULL(tbl);
+
+    /* Of two symbols of one name, the one first in source order is kept,
+       whichever was added first. */
+    CU_ASSERT_EQUAL(add_to_ctable(tbl, "abc", 8, 2), 0);
+    CU_ASSERT_EQUAL(add_to_ctable(tbl, "efg", 12, 1), 0);
+    CU_ASSERT_EQUAL(add_to_ctable(tbl, "abc", 16, 3), 0);
+    CU_ASSERT_EQUAL(add_to_ctable(tbl, "efg", 20, 0), 0);
+    CU_ASSERT_EQUAL(add_to_ctable(tbl, "bob", 14, 4), -1);
+    CU_ASSERT_EQUAL(get_addr_for_csymbol(tbl, "abc"), 8);
+    CU_ASSERT_EQUAL(get_addr_for_csymbol(tbl, "efg"), 20);
+    CU_ASSERT_EQUAL(get_addr_for_csymbol(tbl, "ef"), -1);
+
+    uint32_t n;
+    ConcurrentSymbol** order = sort_ctable(tbl, &n);
+    CU_ASSERT_EQUAL(n, 4);
+    CU_ASSERT_EQUAL(order[0]->addr, 20);
+    CU_ASSERT_FALSE(order[0]->dropped);
+    CU_ASSERT_EQUAL(order[1]->addr, 12);
+    CU_ASSERT_TRUE(order[1]->dropped);
+    CU_ASSERT_EQUAL(order[2]->addr, 8);
+    CU_ASSERT_FALSE(order[2]->dropped);
+    CU_ASSERT_EQUAL(order[3]->addr, 16);
+    CU_ASSERT_TRUE(order[3]->dropped);
+    free(order);
+
+    FILE* f = tmpfile();
+    char buf[BUF_SIZE];
+    write_ctable(tbl, f);
+    rewind(f);
+    CU_ASSERT_PTR_NOT_NULL(fgets(buf, BUF_SIZE, f));
+    CU_ASSERT_STRING_EQUAL(buf, "20\tefg\n");
+    CU_ASSERT_PTR_NOT_NULL(fgets(buf, BUF_SIZE, f));
+    CU_ASSERT_STRING_EQUAL(buf, "8\tabc\n");
+    CU_ASSERT_PTR_NULL(fgets(buf, BUF_SIZE, f));
+    fclose(f);
+    free_ctable(tbl);
+
+    /* Concurrent inserts of the same names across several segments, the
+       threads started last first. */
+    tbl = create_ctable(SYMTBL_UNIQUE_NAME, 0);
+    pthread_t threads[4];
+    CtableWorker workers[4];
+    for (int i = 3; i >= 0; i--) {
+        workers[i].tbl = tbl;
+        workers[i].index = i;
+        workers[i].failures = 0;
+        workers[i].lookup_errors = 0;
+        pthread_create(&threads[i], NULL, ctable_insert_worker, &workers[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        CU_ASSERT_EQUAL(workers[i].failures, 0);
+        CU_ASSERT_EQUAL(workers[i].lookup_errors, 0);
+    }
+
+    order = sort_ctable(tbl, &n);
+    CU_ASSERT_EQUAL(n, 4 * 500);
+    int kept = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        kept += !order[i]->dropped;
+        CU_ASSERT_EQUAL(order[i]->dropped, i >= 500);
+    }
+    CU_ASSERT_EQUAL(kept, 500);
+    free(order);
+
+    f = tmpfile();
+    write_ctable(tbl, f);
+    rewind(f);
+    for (int i = 0; i < 500; i++) {
+        char expected[32];
+        sprintf(expected, "%d\tL%d\n", 4 * i, i);
+        CU_ASSERT_PTR_NOT_NULL(fgets(buf, BUF_SIZE, f));
+        CU_ASSERT_STRING_EQUAL(buf, expected);
+        sprintf(buf, "L%d", i);
+        CU_ASSERT_EQUAL(get_addr_for_csymbol(tbl, buf), 4 * i);
+    }
+    CU_ASSERT_PTR_NULL(fgets(buf, BUF_SIZE, f));
+    fclose(f);
+    free_ctable(tbl);
+}
+
 /****************************************
  *  Add your test cases here
  ****************************************/
 
+void test_size_pass_one() {
+    char* li_small[] = { "$t0", "-6000" };
+    char* li_large[] = { "$t0", "80000" };
+    char* li_bad[] = { "$t0", "12z" };
+    char* blt[] = { "$t0", "$t1", "loop" };
+    char* addu[] = { "$t0", "$t1", "$t2" };
+
+    CU_ASSERT_EQUAL(size_pass_one("li", li_small, 2), 1);
+    CU_ASSERT_EQUAL(size_pass_one("li", li_large, 2), 2);
+    CU_ASSERT_EQUAL(size_pass_one("li", li_bad, 2), 0);
+    CU_ASSERT_EQUAL(size_pass_one("li", li_small, 1), 0);
+    CU_ASSERT_EQUAL(size_pass_one("blt", blt, 3), 2);
+    CU_ASSERT_EQUAL(size_pass_one("blt", blt, 2), 0);
+    CU_ASSERT_EQUAL(size_pass_one("addu", addu, 3), 1);
+}
+
+void test_translate_inst_trusted() {
+    char* insts[][4] = {
+        { "addu", "$t0", "$a0", "$s3" }, { "or", "$v0", "$at", "$ra" },
+        { "slt", "$a2", "$t1", "$t0" },  { "sltu", "$a2", "$t1", "$sp" },
+        { "sll", "$t3", "$t2", "31" },   { "jr", "$ra" },
+        { "addiu", "$a0", "$0", "-3" },  { "ori", "$t3", "$t2", "0x123" },
+        { "lui", "$t3", "532" },         { "lb", "$t2", "0($t1)" },
+        { "lbu", "$t3", "-3($s2)" },     { "lw", "$t3", "32767($t1)" },
+        { "sb", "$t2", "0x10($zero)" },  { "sw", "$t2", "-32768($t1)" },
+        { "beq", "$t0", "$a1", "back" }, { "bne", "$s1", "$a3", "back" },
+        { "j", "back" },                 { "jal", "back" },
+    };
+    int counts[] = { 3, 3, 3, 3, 3, 1, 3, 3, 2, 2, 2, 2, 2, 2, 3, 3, 1, 1 };
+    char expected[16], actual[16];
+
+    SymbolTable* symtbl = create_table(SYMTBL_UNIQUE_NAME);
+    SymbolTable* reltbl = create_table(SYMTBL_NON_UNIQUE);
+    add_to_table(symtbl, "back", 4);
+
+    for (int i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        FILE* f1 = tmpfile();
+        FILE* f2 = tmpfile();
+        CU_ASSERT_EQUAL(translate_inst(f1, insts[i][0], insts[i] + 1, counts[i],
+            64, symtbl, reltbl), 0);
+        CU_ASSERT_EQUAL(translate_inst_trusted(f2, insts[i][0], insts[i] + 1,
+            counts[i], 64, symtbl, reltbl), 0);
+        rewind(f1);
+        rewind(f2);
+        CU_ASSERT_PTR_NOT_NULL(fgets(expected, sizeof(expected), f1));
+        CU_ASSERT_PTR_NOT_NULL(fgets(actual, sizeof(actual), f2));
+        CU_ASSERT_STRING_EQUAL(expected, actual);
+        fclose(f1);
+        fclose(f2);
+    }
+
+    free_table(symtbl);
+    free_table(reltbl);
+}
+
+void test_encode_isa() {
+    char* insts[][4] = {
+        { "jalr", "$s0" },               { "jalr", "$v0", "$s0" },
+        { "mult", "$t0", "$t1" },        { "mfhi", "$v0" },
+        { "syscall" },                   { "lh", "$t0", "4($sp)" },
+        { "sh", "$t0", "-2($sp)" },      { "andi", "$t0", "$t1", "0xff" },
+        { "xor", "$t0", "$t1", "$t2" },  { "sllv", "$t0", "$t1", "$t2" },
+        { "sra", "$t0", "$t1", "2" },    { "mul", "$v0", "$t0", "$t1" },
+        { "bgez", "$t0", "back" },       { "bltz", "$t0", "back" },
+        { "blez", "$a0", "back" },       { "clz", "$v0", "$t0" },
+        { "clo", "$v0", "$t0" },         { "teq", "$t0", "$t1" },
+        { "tltu", "$a0", "$a1" },
+    };
+    int counts[] = { 1, 2, 2, 1, 0, 2, 2, 3, 3, 3, 3, 3, 2, 2, 2, 2, 2, 2, 2 };
+    uint32_t expected[] = {
+        0x0200f809, 0x02001009, 0x01090018, 0x00001010, 0x0000000c,
+        0x87a80004, 0xa7a8fffe, 0x312800ff, 0x012a4026, 0x01494004,
+        0x00094083, 0x71091002, 0x0501fff0, 0x0500fff0, 0x1880fff0,
+        0x71021020, 0x71021021, 0x01090034, 0x00850033,
+    };
+    uint32_t word, trusted;
+
+    SymbolTable* symtbl = create_table(SYMTBL_UNIQUE_NAME);
+    SymbolTable* reltbl = create_table(SYMTBL_NON_UNIQUE);
+    add_to_table(symtbl, "back", 4);
+
+    for (int i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        CU_ASSERT_PTR_NOT_NULL(find_inst(insts[i][0]));
+        CU_ASSERT_EQUAL(encode_inst(&word, insts[i][0], insts[i] + 1, counts[i],
+            64, symtbl, reltbl), 0);
+        CU_ASSERT_EQUAL(word, expected[i]);
+        CU_ASSERT_EQUAL(encode_inst_trusted(&trusted, insts[i][0], insts[i] + 1,
+            counts[i], 64, symtbl, reltbl), 0);
+        CU_ASSERT_EQUAL(trusted, expected[i]);
+    }
+    CU_ASSERT_PTR_NULL(find_inst("li"));
+    CU_ASSERT_PTR_NULL(find_inst("bogus"));
+    CU_ASSERT_EQUAL(find_inst("bgezal")->format, FMT_BRANCHZ);
+
+    char* andi[] = { "$t0", "$t1", "-1" };
+    char* sh[] = { "$t0", "32768($sp)" };
+    char* lh[] = { "$t0", "-32769($sp)" };
+    char* lw[] = { "$t0", "-32769($sp)" };
+    char* sra[] = { "$t0", "$t1", "32" };
+    char* jalr[] = { "$v0", "$s0", "$s1" };
+    char* bgez[] = { "$t0", "nowhere" };
+    CU_ASSERT_EQUAL(encode_inst(&word, "andi", andi, 3, 0, symtbl, reltbl), -1);
+    CU_ASSERT_EQUAL(encode_inst(&word, "sh", sh, 2, 0, symtbl, reltbl), -1);
+    CU_ASSERT_EQUAL(encode_inst(&word, "lh", lh, 2, 0, symtbl, reltbl), -1);
+    CU_ASSERT_EQUAL(encode_inst(&word, "lw", lw, 2, 0, symtbl, reltbl), 0);
+    CU_ASSERT_EQUAL(encode_inst(&word, "sra", sra, 3, 0, symtbl, reltbl), -1);
+    CU_ASSERT_EQUAL(encode_inst(&word, "jalr", jalr, 3, 0, symtbl, reltbl), -1);
+    CU_ASSERT_EQUAL(encode_inst(&word, "bgez", bgez, 2, 0, symtbl, reltbl), -1);
+    CU_ASSERT_EQUAL(encode_inst_trusted(&word, "bgez", bgez, 2, 0, symtbl, reltbl), -1);
+    CU_ASSERT_EQUAL(encode_inst(&word, "bogus", bgez, 2, 0, symtbl, reltbl), -1);
+
+    /* The helpers take the bounds of the instruction with their opcode. */
+    CU_ASSERT_EQUAL(encode_mem(0x21, &word, lh, 2), -1);
+    CU_ASSERT_EQUAL(encode_mem(0x23, &word, lw, 2), 0);
+    CU_ASSERT_EQUAL(encode_ori(0x0c, &word, andi, 3), -1);
+    CU_ASSERT_EQUAL(encode_shift(0x03, &word, sra, 3), -1);
+    CU_ASSERT_EQUAL(encode_mem(0x09, &word, lw, 2), -1);
+
+    free_table(symtbl);
+    free_table(reltbl);
+}
+
+/****************************************
+ *  Test cases for sched.c
+ ****************************************/
+
+typedef struct {
+    Scheduler* sched;
+    long count;
+} SchedCounter;
+
+void count_task(void* arg) {
+    __atomic_add_fetch(&((SchedCounter*) arg)->count, 1, __ATOMIC_RELAXED);
+}
+
+void fan_out_task(void* arg) {
+    SchedCounter* counter = arg;
+    for (int i = 0; i < 10; i++) {
+        sched_spawn(counter->sched, count_task, counter);
+    }
+}
+
+void test_sched() {
+    SchedCounter counter;
+    counter.sched = create_scheduler(4);
+    counter.count = 0;
+    CU_ASSERT_PTR_NOT_NULL(counter.sched);
+
+    for (int i = 0; i < 100; i++) {
+        sched_spawn(counter.sched, fan_out_task, &counter);
+    }
+    sched_run(counter.sched);
+    CU_ASSERT_EQUAL(counter.count, 1000);
+
+    /* The scheduler can be run again after it drained. */
+    sched_spawn(counter.sched, count_task, &counter);
+    sched_run(counter.sched);
+    CU_ASSERT_EQUAL(counter.count, 1001);
+
+    free_scheduler(counter.sched);
+}
+
+/* Writes a file in two requests through RING, reads it back in one and
+   checks the queue limits. */
+void check_io_ring(IoRing* ring) {
+    const char* text = "addu $t0 $t1 $t2\nori $a0 $a1 0xff\n";
+    size_t len = strlen(text), half = len / 2;
+    char buf[64];
+    void* tag;
+    long res;
+
+    FILE* f = tmpfile();
+    CU_ASSERT_PTR_NOT_NULL(f);
+    if (!f) return;
+    int fd = fileno(f);
+
+    CU_ASSERT_EQUAL(io_ring_wait(ring, &tag, &res), -1);
+    CU_ASSERT_EQUAL(io_ring_write(ring, fd, text + half, len - half, half, buf + 1), 0);
+    CU_ASSERT_EQUAL(io_ring_write(ring, fd, text, half, 0, buf), 0);
+    CU_ASSERT_EQUAL(io_ring_in_flight(ring), 2);
+
+    long written = 0;
+    for (int i = 0; i < 2; i++) {
+        CU_ASSERT_EQUAL(io_ring_wait(ring, &tag, &res), 0);
+        CU_ASSERT(tag == buf || tag == buf + 1);
+        written += res;
+    }
+    CU_ASSERT_EQUAL(written, (long) len);
+    CU_ASSERT_EQUAL(io_ring_in_flight(ring), 0);
+
+    memset(buf, 0, sizeof(buf));
+    CU_ASSERT_EQUAL(io_ring_read(ring, fd, buf, sizeof(buf) - 1, 0, buf), 0);
+    CU_ASSERT_EQUAL(io_ring_wait(ring, &tag, &res), 0);
+    CU_ASSERT(tag == buf);
+    CU_ASSERT_EQUAL(res, (long) len);
+    CU_ASSERT_STRING_EQUAL(buf, text);
+
+    /* A full ring refuses requests; reads past the end return 0 bytes. */
+    for (int i = 0; i < 4; i++) {
+        CU_ASSERT_EQUAL(io_ring_read(ring, fd, buf, 8, 1000, NULL), 0);
+    }
+    CU_ASSERT_EQUAL(io_ring_read(ring, fd, buf, 8, 1000, NULL), -1);
+    while (io_ring_wait(ring, &tag, &res) == 0) {
+        CU_ASSERT_EQUAL(res, 0);
+    }
+
+    /* Errors are returned as -errno. */
+    CU_ASSERT_EQUAL(io_ring_read(ring, -1, buf, 8, 0, NULL), 0);
+    CU_ASSERT_EQUAL(io_ring_wait(ring, &tag, &res), 0);
+    CU_ASSERT(res < 0);
+
+    fclose(f);
+}
+
+void test_io_ring() {
+    IoRing* ring = create_io_ring(4, 1);
+    CU_ASSERT_FALSE(io_ring_is_async(ring));
+    check_io_ring(ring);
+    free_io_ring(ring);
+
+    /* io_uring where the kernel allows it, blocking I/O otherwise. */
+    ring = create_io_ring(4, 0);
+    check_io_ring(ring);
+    free_io_ring(ring);
+}
+
+void test_mapped_output() {
+    SymbolTable* symtbl = create_table(SYMTBL_UNIQUE_NAME);
+    SymbolTable* reltbl = create_table(SYMTBL_NON_UNIQUE);
+    MappedOutput out;
+    char expected[256], buf[256];
+
+    add_to_table(symtbl, "start", 0);
+    add_to_table(symtbl, "loop", 12);
+
+    CU_ASSERT_EQUAL(open_mapped_output(&out, TMP_FILE, 4, symtbl), 0);
+
+    /* Words land at their index whatever order they are written in. */
+    CU_ASSERT_EQUAL(write_mapped_word(&out, 2, 0x00851021), 0);
+    CU_ASSERT_EQUAL(write_mapped_word(&out, 0, 0x0c000000), 0);
+    CU_ASSERT_EQUAL(write_mapped_word(&out, 3, 0xdeadbeef), 0);
+    CU_ASSERT_EQUAL(write_mapped_word(&out, 4, 0), -1);
+
+    /* Close the gap of word 1, as after a failed instruction. */
+    move_mapped_words(&out, 1, 2, 2);
+
+    /* A relocation makes the file grow past its initial size. */
+    add_to_table(reltbl, "printf", 0);
+    CU_ASSERT_EQUAL(close_mapped_output(&out, 3, symtbl, reltbl), 0);
+
+    sprintf(expected, ".text\n0c000000\n00851021\ndeadbeef\n"
+        "\n.symbol\n0\tstart\n12\tloop\n\n.relocation\n0\tprintf\n");
+    FILE* f = fopen(TMP_FILE, "r");
+    CU_ASSERT_PTR_NOT_NULL(f);
+    if (f) {
+        size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+        buf[len] = '\0';
+        CU_ASSERT_STRING_EQUAL(buf, expected);
+        fclose(f);
+    }
+
+    /* Without relocations and with fewer words the file shrinks. */
+    CU_ASSERT_EQUAL(open_mapped_output(&out, TMP_FILE, 100, NULL), 0);
+    CU_ASSERT_EQUAL(write_mapped_word(&out, 0, 0x1234abcd), 0);
+    CU_ASSERT_EQUAL(close_mapped_output(&out, 1, NULL, NULL), 0);
+    f = fopen(TMP_FILE, "r");
+    if (f) {
+        size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+        buf[len] = '\0';
+        CU_ASSERT_STRING_EQUAL(buf, ".text\n1234abcd\n\n.symbol\n\n.relocation\n");
+        fclose(f);
+    }
+
+    free_table(symtbl);
+    free_table(reltbl);
+}
+
+void test_source_map() {
+    SourceMap* map = create_source_map();
+    SourceMapCursor cursor;
+    uint32_t line, column;
+
+    CU_ASSERT_EQUAL(source_map_lookup(map, 0, &line, &column), -1);
+
+    /* One instruction per line at the same column: one byte each. */
+    for (uint32_t i = 1; i <= 1000; i++) {
+        source_map_add(map, i, 3);
+    }
+    CU_ASSERT(map->len <= 1000 + 2);
+
+    /* Expansions, jumps backwards and large values. */
+    source_map_add(map, 1000, 3);
+    source_map_add(map, 7, 12);
+    source_map_add(map, 4000000000u, 1);
+    source_map_add(map, 2, 200);
+
+    CU_ASSERT_EQUAL(source_map_lookup(map, 0, &line, &column), 0);
+    CU_ASSERT_EQUAL(line, 1);
+    CU_ASSERT_EQUAL(column, 3);
+    CU_ASSERT_EQUAL(source_map_lookup(map, 63, &line, &column), 0);
+    CU_ASSERT_EQUAL(line, 64);
+    CU_ASSERT_EQUAL(source_map_lookup(map, 64, &line, &column), 0);
+    CU_ASSERT_EQUAL(line, 65);
+    CU_ASSERT_EQUAL(source_map_lookup(map, 999, &line, &column), 0);
+    CU_ASSERT_EQUAL(line, 1000);
+    CU_ASSERT_EQUAL(source_map_lookup(map, 1000, &line, &column), 0);
+    CU_ASSERT_EQUAL(line, 1000);
+    CU_ASSERT_EQUAL(source_map_lookup(map, 1001, &line, &column), 0);
+    CU_ASSERT_EQUAL(line, 7);
+    CU_ASSERT_EQUAL(column, 12);
+    CU_ASSERT_EQUAL(source_map_lookup(map, 1002, &line, &column), 0);
+    CU_ASSERT_EQUAL(line, 4000000000u);
+    CU_ASSERT_EQUAL(column, 1);
+    CU_ASSERT_EQUAL(source_map_lookup(map, 1003, &line, &column), 0);
+    CU_ASSERT_EQUAL(line, 2);
+    CU_ASSERT_EQUAL(column, 200);
+    CU_ASSERT_EQUAL(source_map_lookup(map, 1004, &line, &column), -1);
+
+    /* The cursor agrees with random lookups. */
+    uint32_t n = 0, bad = 0;
+    source_map_begin(&cursor, map);
+    while (source_map_next(&cursor, &line, &column) == 0) {
+        uint32_t l, c;
+        if (source_map_lookup(map, n, &l, &c) != 0 || l != line || c != column) {
+            bad++;
+        }
+        n++;
+    }
+    CU_ASSERT_EQUAL(n, 1004);
+    CU_ASSERT_EQUAL(bad, 0);
+
+    /* Entries of included files keep their file, by path. */
+    uint32_t inc = source_map_file(map, "inc.s");
+    CU_ASSERT_EQUAL(inc, 1);
+    CU_ASSERT_EQUAL(source_map_file(map, "inc.s"), inc);
+    CU_ASSERT_STRING_EQUAL(source_map_path(map, inc), "inc.s");
+    CU_ASSERT_PTR_NULL(source_map_path(map, 0));
+    source_map_add_in(map, inc, 3, 1);
+    source_map_add(map, 9, 1);
+    source_map_begin(&cursor, map);
+    for (n = 0; source_map_next(&cursor, &line, &column) == 0 && n < 1004; n++) {
+    }
+    CU_ASSERT_EQUAL(cursor.file, inc);
+    CU_ASSERT_EQUAL(line, 3);
+    CU_ASSERT_EQUAL(source_map_next(&cursor, &line, &column), 0);
+    CU_ASSERT_EQUAL(cursor.file, 0);
+    CU_ASSERT_EQUAL(line, 9);
+
+    /* Appending maps of consecutive pieces gives the whole. */
+    SourceMap* whole = create_source_map();
+    source_map_add(whole, 5, 1);
+    source_map_file(whole, "other.s");
+    source_map_append(whole, map);
+    CU_ASSERT_EQUAL(whole->count, 1007);
+    source_map_begin(&cursor, whole);
+    for (n = 0; source_map_next(&cursor, &line, &column) == 0 && n < 1005; n++) {
+    }
+    CU_ASSERT_STRING_EQUAL(source_map_path(whole, cursor.file), "inc.s");
+    CU_ASSERT_EQUAL(line, 3);
+    CU_ASSERT_EQUAL(source_map_lookup(whole, 1003, &line, &column), 0);
+    CU_ASSERT_EQUAL(line, 4000000000u);
+    CU_ASSERT_EQUAL(column, 1);
+    CU_ASSERT_EQUAL(source_map_lookup(whole, 1004, &line, &column), 0);
+    CU_ASSERT_EQUAL(line, 2);
+    CU_ASSERT_EQUAL(column, 200);
+    free_source_map(whole);
+
+    free_source_map(map);
+}
+
+void test_arena() {
+    Allocator* arena = create_arena(4096, 0);
+    CU_ASSERT_PTR_NOT_NULL(arena);
+
+    /* Allocations are aligned and distinct. */
+    char* a = alloc_mem(arena, 3);
+    char* b = alloc_mem(arena, 5);
+    CU_ASSERT_PTR_NOT_NULL(a);
+    CU_ASSERT_EQUAL((uintptr_t) a % 16, 0);
+    CU_ASSERT_EQUAL((uintptr_t) b % 16, 0);
+    CU_ASSERT(b >= a + 3);
+
+    /* The latest allocation grows in place, others are copied. */
+    strcpy(b, "abcd");
+    CU_ASSERT_PTR_EQUAL(resize_mem(arena, b, 5, 64), b);
+    strcpy(a, "xy");
+    char* a2 = resize_mem(arena, a, 3, 64);
+    CU_ASSERT_PTR_NOT_EQUAL(a2, a);
+    CU_ASSERT_STRING_EQUAL(a2, "xy");
+    CU_ASSERT_STRING_EQUAL(b, "abcd");
+
+    /* Allocations larger than a chunk get their own. */
+    char* big = alloc_mem(arena, 10000);
+    CU_ASSERT_PTR_NOT_NULL(big);
+    memset(big, 1, 10000);
+    size_t reserved = arena_reserved(arena);
+    CU_ASSERT(reserved >= 4096 + 10000);
+
+    /* A table and its names come from the arena. */
+    SymbolTable* tbl = create_table_in(SYMTBL_UNIQUE_NAME, arena);
+    char buf[16];
+    for (int i = 0; i < 1000; i++) {
+        sprintf(buf, "L%d", i);
+        CU_ASSERT_EQUAL(add_to_table(tbl, buf, 4 * i), 0);
+    }
+    CU_ASSERT_EQUAL(get_addr_for_symbol(tbl, "L999"), 3996);
+    CU_ASSERT_STRING_EQUAL(alloc_strdup(arena, "name"), "name");
+    free_table(tbl);
+
+    /* A reset hands the same memory out again, and a repeated run needs no
+       new chunks. */
+    reset_allocator(arena);
+    CU_ASSERT_EQUAL(arena_used(arena), 0);
+    CU_ASSERT_PTR_EQUAL(alloc_mem(arena, 8), a);
+    for (int run = 0; run < 2; run++) {
+        reset_allocator(arena);
+        tbl = create_table_in(SYMTBL_NON_UNIQUE, arena);
+        for (int i = 0; i < 1000; i++) {
+            sprintf(buf, "L%d", i);
+            add_to_table(tbl, buf, 4 * i);
+        }
+        free_table(tbl);
+        if (run == 0) {
+            reserved = arena_reserved(arena);
+        }
+    }
+    CU_ASSERT_EQUAL(arena_reserved(arena), reserved);
+    free_arena(arena);
+
+    /* NULL is the system allocator. */
+    char* s = alloc_strdup(NULL, "abc");
+    s = resize_mem(NULL, s, 4, 100);
+    CU_ASSERT_STRING_EQUAL(s, "abc");
+    free_mem(NULL, s);
+}
+
+void test_memstats() {
+    MemStats stats;
+    char buf[16];
+
+    start_mem_stats(&stats);
+    SymbolTable* symtbl = create_table(SYMTBL_UNIQUE_NAME);
+    SymbolTable* reltbl = create_table(SYMTBL_NON_UNIQUE);
+    for (int i = 0; i < 100; i++) {
+        sprintf(buf, "L%d", i);            // 2 or 3 chars and a null
+        add_to_table(symtbl, buf, 4 * i);
+    }
+    add_to_table(reltbl, "abc", 0);
+
+    MemCounter* sym = &stats.subsystems[MEM_SYMBOLS];
+    MemCounter* strings = &stats.subsystems[MEM_STRINGS];
+    CU_ASSERT_EQUAL(sym->allocs, 7);      // creation, then 2 -> 128 entries
+    CU_ASSERT_EQUAL(sym->live, sizeof(SymbolTable) + 128 * sizeof(Symbol));
+    CU_ASSERT_EQUAL(strings->allocs, 101);
+    CU_ASSERT_EQUAL(strings->live, 10 * 3 + 90 * 4 + 4);
+    CU_ASSERT_EQUAL(stats.subsystems[MEM_RELOCATIONS].live,
+        sizeof(SymbolTable) + 2 * sizeof(Symbol));
+    CU_ASSERT_EQUAL(stats.live, sym->live + strings->live
+        + stats.subsystems[MEM_RELOCATIONS].live);
+
+    int64_t peak = stats.peak;
+    free_table(symtbl);
+    free_table(reltbl);
+    CU_ASSERT_EQUAL(stats.live, 0);
+    CU_ASSERT_EQUAL(sym->live, 0);
+    CU_ASSERT_EQUAL(strings->live, 0);
+    CU_ASSERT_EQUAL(stats.peak, peak);
+
+    char* s = strdup("operand");
+    CU_ASSERT_EQUAL(strings->allocs, 102);
+    stop_mem_stats();
+    free(s);
+
+    /* Nothing is counted once stopped. */
+    symtbl = create_table(SYMTBL_UNIQUE_NAME);
+    add_to_table(symtbl, "abc", 0);
+    free_table(symtbl);
+    CU_ASSERT_EQUAL(sym->allocs, 7);
+    CU_ASSERT_EQUAL(strings->allocs, 102);
+
+    FILE* f = tmpfile();
+    write_mem_stats(&stats, f);
+    rewind(f);
+    CU_ASSERT_PTR_NOT_NULL(fgets(buf, sizeof(buf), f));
+    CU_ASSERT_EQUAL(strncmp(buf, "memory ", 7), 0);
+    fclose(f);
+}
+
+void test_perf_counters() {
+    /* Without counters everything is a no-op. */
+    begin_perf_phase(NULL, 0);
+    end_perf_phase(NULL, 0);
+    CU_ASSERT_EQUAL(perf_phase_count(NULL, 0, PERF_CYCLES), -1);
+    write_perf_report(NULL, NULL, 0, 0, stdout);
+    close_perf_counters(NULL);
+
+    FILE* log = tmpfile();
+    set_log_stream(log);
+    PerfCounters* perf = open_perf_counters();
+    set_log_stream(NULL);
+    fclose(log);
+    if (!perf) {
+        return;                 // no perf_event_open() here
+    }
+
+    /* Phases accumulate; an untouched phase stays 0. */
+    volatile uint64_t x = 0;
+    for (int round = 0; round < 2; round++) {
+        begin_perf_phase(perf, 1);
+        for (int i = 0; i < 1000000; i++) {
+            x += i;
+        }
+        end_perf_phase(perf, 1);
+    }
+    for (int e = 0; e < PERF_NUM_EVENTS; e++) {
+        int64_t n = perf_phase_count(perf, 0, e);
+        CU_ASSERT(n == 0 || n == -1);
+    }
+    int64_t clock = perf_phase_count(perf, 1, PERF_TASK_CLOCK);
+    int64_t insts = perf_phase_count(perf, 1, PERF_INSTRUCTIONS);
+    CU_ASSERT(clock == -1 || clock > 0);
+    CU_ASSERT(insts == -1 || insts > 2000000);
+
+    const char* names[2] = { "idle", "loop" };
+    FILE* f = tmpfile();
+    char buf[BUF_SIZE];
+    write_perf_report(perf, names, 2, 1000, f);
+    rewind(f);
+    int rows = 0;
+    while (fgets(buf, BUF_SIZE, f)) {
+        rows++;
+    }
+    CU_ASSERT_EQUAL(rows, 6);   // header, 2 phases, total, per instruction, note
+    fclose(f);
+    close_perf_counters(perf);
+}
+
+void test_data_section() {
+    DataSection* data = create_data_section();
+    SymbolTable* symtbl = create_table(SYMTBL_UNIQUE_NAME);
+    char buf[BUF_SIZE];
+    char line[BUF_SIZE];
+
+    CU_ASSERT_EQUAL(data_address(data), DATA_BASE);
+
+    /* Values are stored least significant byte first; .word and .half
+       align themselves. */
+    strcpy(line, "\"ab\\n\", \"#\"\n");
+    CU_ASSERT_EQUAL(add_data_directive(data, 1, ".asciiz", line, NULL), 0);
+    CU_ASSERT_EQUAL(data->size, 6);
+    strcpy(line, "1, -1\n");
+    CU_ASSERT_EQUAL(add_data_directive(data, 2, ".byte", line, NULL), 0);
+    align_for_directive(data, ".word");
+    CU_ASSERT_EQUAL(data_address(data), DATA_BASE + 8);
+    strcpy(line, "0x12345678 here\n");
+    CU_ASSERT_EQUAL(add_data_directive(data, 3, ".word", line, NULL), 0);
+    CU_ASSERT_EQUAL(add_data_symbol(symtbl, "here", DATA_BASE + 1), 0);
+    strcpy(line, "3\n");
+    CU_ASSERT_EQUAL(add_data_directive(data, 4, ".byte", line, NULL), 0);
+
+    /* A label on a line of its own goes to the aligned next value. */
+    CU_ASSERT_EQUAL(add_data_symbol(symtbl, "alone", data_address(data)), 0);
+    add_pending_label(data, symtbl->len - 1);
+    place_pending_labels(data, symtbl, ".half");
+    CU_ASSERT_EQUAL(symtbl->tbl[symtbl->len - 1].addr, DATA_BASE + 18);
+    CU_ASSERT_EQUAL(data->num_pending, 0);
+    strcpy(line, "-2\n");
+    CU_ASSERT_EQUAL(add_data_directive(data, 5, ".half", line, NULL), 0);
+    CU_ASSERT_EQUAL(data->size, 20);
+
+    /* Invalid operands are errors. */
+    set_log_file(TMP_FILE);
+    strcpy(line, "256\n");
+    CU_ASSERT_EQUAL(add_data_directive(data, 6, ".byte", line, NULL), -1);
+    strcpy(line, "\"open\n");
+    CU_ASSERT_EQUAL(add_data_directive(data, 7, ".ascii", line, NULL), -1);
+    strcpy(line, "1\n");
+    CU_ASSERT_EQUAL(add_data_directive(data, 8, ".quad", line, NULL), -1);
+    CU_ASSERT_EQUAL(add_data_directive(data, 9, ".word", line, NULL), 0);
+    strcpy(line, "missing\n");
+    CU_ASSERT_EQUAL(add_data_directive(data, 10, ".word", line, NULL), 0);
+    set_log_file(NULL);
+
+    /* A large .space is a zero run, not bytes. */
+    uint32_t segments = data->num_segments;
+    CU_ASSERT_EQUAL(add_data_space(data, 1u << 24), 0);
+    CU_ASSERT_EQUAL(data->num_segments, segments + 1);
+    CU_ASSERT_PTR_NULL(data->segments[segments].bytes);
+    CU_ASSERT_EQUAL(data->size, 28 + (1u << 24));
+    strcpy(line, "3\n");
+    CU_ASSERT_EQUAL(add_data_directive(data, 11, ".align", line, NULL), 0);
+    strcpy(line, "7\n");
+    CU_ASSERT_EQUAL(add_data_directive(data, 12, ".byte", line, NULL), 0);
+
+    set_log_file(TMP_FILE);
+    CU_ASSERT_EQUAL(resolve_data_labels(data, symtbl), -1);     // missing
+    set_log_file(NULL);
+    CU_ASSERT_EQUAL(add_data_symbol(symtbl, "missing", 8), 0);
+    CU_ASSERT_EQUAL(resolve_data_labels(data, symtbl), 0);
+
+    /* Sparse output reads back to the same words. */
+    FILE* f = tmpfile();
+    CU_ASSERT_EQUAL(write_data_section(data, f, 1), 0);
+    rewind(f);
+    const char* expected[] = { "000a6261", "ff010023", "12345678", "10000001",
+        "fffe0003", "00000001", "00000008", ".space 16777216", "00000000",
+        "00000007" };
+    int lines = 0, bad = 0;
+    while (fgets(buf, BUF_SIZE, f)) {
+        buf[strcspn(buf, "\n")] = '\0';
+        if (lines >= 10 || strcmp(buf, expected[lines]) != 0) {
+            bad++;
+        }
+        lines++;
+    }
+    CU_ASSERT_EQUAL(lines, 10);
+    CU_ASSERT_EQUAL(bad, 0);
+
+    DataSection* copy = create_data_section();
+    rewind(f);
+    CU_ASSERT_EQUAL(read_data_section(copy, f), 0);
+    CU_ASSERT_EQUAL(copy->size, data->size + 3);      // padded to a word
+    fclose(f);
+
+    /* Expanded, the run is written out in full. */
+    f = tmpfile();
+    CU_ASSERT_EQUAL(write_data_section(copy, f, 0), 0);
+    CU_ASSERT_EQUAL(ftell(f), 9 * (long) (copy->size / 4));
+    fseek(f, 9 * 7, SEEK_SET);
+    CU_ASSERT_PTR_NOT_NULL(fgets(buf, BUF_SIZE, f));
+    CU_ASSERT_STRING_EQUAL(buf, "00000000\n");
+    fclose(f);
+
+    free_data_section(copy);
+    free_data_section(data);
+    free_table(symtbl);
+}
+
+void test_data_incbin() {
+    const char* blob_name = "test_incbin.bin";
+    uint8_t blob[1001];
+    for (int i = 0; i < 1001; i++) {
+        blob[i] = (uint8_t) (i * 7);
+    }
+    FILE* f = fopen(blob_name, "wb");
+    CU_ASSERT_PTR_NOT_NULL(f);
+    fwrite(blob, 1, sizeof(blob), f);
+    fclose(f);
+
+    /* Unaligned: 3 bytes are copied up to the word boundary, 996 are mapped
+       and the last 2 copied. */
+    DataSection* data = create_data_section();
+    uint8_t one = 1;
+    CU_ASSERT_EQUAL(add_data_bytes(data, &one, 1), 0);
+    CU_ASSERT_EQUAL(add_data_file(data, blob_name, 0, -1), 0);
+    CU_ASSERT_EQUAL(data->size, 1002);
+    CU_ASSERT_EQUAL(data->num_segments, 3);
+    CU_ASSERT_EQUAL(data->segments[1].kind, DATA_FILE);
+    CU_ASSERT_EQUAL(data->segments[1].offset, 4);
+    CU_ASSERT_EQUAL(data->segments[1].size, 996);
+    CU_ASSERT_EQUAL(data->segments[2].size, 2);
+
+    /* Small or out of range pieces. */
+    CU_ASSERT_EQUAL(add_data_file(data, blob_name, 1000, 1), 0);
+    CU_ASSERT_EQUAL(data->num_segments, 3);
+    set_log_file(TMP_FILE);
+    CU_ASSERT_EQUAL(add_data_file(data, blob_name, 1000, 2), -1);
+    CU_ASSERT_EQUAL(add_data_file(data, "no such file", 0, -1), -1);
+    CU_ASSERT_EQUAL(add_data_file(data, blob_name, 0x100000000ull, 1), -1);
+    set_log_file(NULL);
+    CU_ASSERT_EQUAL(data->num_files, 1);
+
+    /* The words are those of the bytes in order. */
+    char buf[BUF_SIZE];
+    f = tmpfile();
+    CU_ASSERT_EQUAL(write_data_section(data, f, 0), 0);
+    rewind(f);
+    int words = 0, bad = 0;
+    for (uint32_t i = 0; fgets(buf, BUF_SIZE, f); i += 4, words++) {
+        uint8_t b[4] = { 0 };
+        for (uint32_t j = 0; j < 4 && i + j < 1003; j++) {
+            b[j] = i + j == 0 ? 1 : i + j < 1002 ? blob[i + j - 1] : blob[1000];
+        }
+        char expected[16];
+        sprintf(expected, "%02x%02x%02x%02x\n", b[3], b[2], b[1], b[0]);
+        bad += strcmp(buf, expected) != 0;
+    }
+    CU_ASSERT_EQUAL(words, 251);
+    CU_ASSERT_EQUAL(bad, 0);
+    fclose(f);
+
+    /* The sparse form keeps the mapping. */
+    f = tmpfile();
+    CU_ASSERT_EQUAL(write_data_section(data, f, 1), 0);
+    rewind(f);
+    DataSection* copy = create_data_section();
+    CU_ASSERT_EQUAL(read_data_section(copy, f), 0);
+    CU_ASSERT_EQUAL(copy->size, 1004);
+    CU_ASSERT_EQUAL(copy->segments[1].kind, DATA_FILE);
+    CU_ASSERT_EQUAL(memcmp(copy->segments[1].bytes, blob + 3, 996), 0);
+    fclose(f);
+
+    free_data_section(copy);
+    free_data_section(data);
+
+    /* The path is taken from the directory of the source file. */
+    data = create_data_section();
+    char line[BUF_SIZE];
+    strcpy(line, "\"test_incbin.bin\", 0, 8");
+    CU_ASSERT_EQUAL(add_data_directive(data, 1, ".incbin", line, "./main.s"), 0);
+    CU_ASSERT_EQUAL(data->num_files, 1);
+    CU_ASSERT_STRING_EQUAL(data->files[0].path, "./test_incbin.bin");
+    free_data_section(data);
+    unlink(blob_name);
+}
+
+void test_tokenize_line() {
+    SourceLine line;
+    char buf[BUF_SIZE];
+
+    strcpy(buf, "  # only a comment\n");
+    CU_ASSERT_EQUAL(tokenize_line(buf, &line), 0);
+    strcpy(buf, "\t\n");
+    CU_ASSERT_EQUAL(tokenize_line(buf, &line), 0);
+
+    strcpy(buf, "loop:\taddu $t0, $t1,$t2 # sum\n");
+    CU_ASSERT_EQUAL(tokenize_line(buf, &line), 1);
+    CU_ASSERT_STRING_EQUAL(line.label, "loop");
+    CU_ASSERT_STRING_EQUAL(line.name, "addu");
+    CU_ASSERT_EQUAL(line.column, 7);
+    CU_ASSERT_EQUAL(line.num_args, 3);
+    CU_ASSERT_STRING_EQUAL(line.args[2], "$t2");
+    CU_ASSERT_PTR_NULL(line.extra);
+    CU_ASSERT_PTR_NULL(line.operands);
+
+    strcpy(buf, "end:\n");
+    CU_ASSERT_EQUAL(tokenize_line(buf, &line), 1);
+    CU_ASSERT_STRING_EQUAL(line.label, "end");
+    CU_ASSERT_PTR_NULL(line.name);
+
+    strcpy(buf, "addu $t0 $t1 $t2 $t3 $t4\n");
+    CU_ASSERT_EQUAL(tokenize_line(buf, &line), 1);
+    CU_ASSERT_PTR_NULL(line.label);
+    CU_ASSERT_EQUAL(line.num_args, 5);
+    CU_ASSERT_PTR_NULL(line.extra);
+    strcpy(buf, "m 1 2 3 4 5 6 7 8 9 10\n");
+    CU_ASSERT_EQUAL(tokenize_line(buf, &line), 1);
+    CU_ASSERT_EQUAL(line.num_args, SOURCE_MAX_ARGS);
+    CU_ASSERT_STRING_EQUAL(line.extra, "9");
+
+    /* Directives keep their operands whole, '#' in strings included. */
+    strcpy(buf, "s: .asciiz \"a, #b\" # c\n");
+    CU_ASSERT_EQUAL(tokenize_line(buf, &line), 1);
+    CU_ASSERT_STRING_EQUAL(line.name, ".asciiz");
+    CU_ASSERT_STRING_EQUAL(line.operands, "\"a, #b\" ");
+    CU_ASSERT_EQUAL(line.num_args, 0);
+
+    char path[16];
+    CU_ASSERT_EQUAL(include_path(" \"lib/a.s\"\n", path, sizeof(path)), 0);
+    CU_ASSERT_STRING_EQUAL(path, "lib/a.s");
+    CU_ASSERT_EQUAL(include_path("a.s", path, sizeof(path)), -1);
+    CU_ASSERT_EQUAL(include_path("\"\"", path, sizeof(path)), -1);
+    CU_ASSERT_EQUAL(include_path("\"a.s\" \"b.s\"", path, sizeof(path)), -1);
+    CU_ASSERT_EQUAL(include_path("\"a_rather_long_name.s\"", path,
+        sizeof(path)), -1);
+}
+
+/* Writes TEXT to the file NAME. */
+static void write_text_file(const char* name, const char* text) {
+    FILE* f = fopen(name, "w");
+    CU_ASSERT_PTR_NOT_NULL(f);
+    fputs(text, f);
+    fclose(f);
+}
+
+void test_source_cache() {
+    const char* a_name = "test_include_a.s";
+    const char* b_name = "test_include_b.s";
+    const char* c_name = "test_include_c.s";
+
+    free_source_cache();
+    write_text_file(a_name, "# a\nfn: jr $ra\n.include \"test_include_b.s\"\n");
+    write_text_file(b_name, "\n\n\taddiu $v0, $zero, 1\n");
+
+    /* Loading a file loads what it includes too. */
+    const SourceFile* a = get_source_file(a_name);
+    CU_ASSERT_PTR_NOT_NULL(a);
+    CU_ASSERT_EQUAL(source_cache_loads(), 2);
+    CU_ASSERT_EQUAL(a->num_lines, 2);
+    CU_ASSERT_EQUAL(a->lines[0].line_no, 2);
+    CU_ASSERT_STRING_EQUAL(a->lines[0].label, "fn");
+    CU_ASSERT_STRING_EQUAL(a->lines[1].name, ".include");
+
+    const SourceFile* b = get_source_file(b_name);
+    CU_ASSERT_PTR_NOT_NULL(b);
+    CU_ASSERT_EQUAL(b->num_lines, 1);
+    CU_ASSERT_EQUAL(b->lines[0].line_no, 3);
+    CU_ASSERT_PTR_EQUAL(get_source_file(a_name), a);
+    CU_ASSERT_EQUAL(source_cache_loads(), 2);
+
+    /* Another path with the same contents shares the file. */
+    write_text_file(c_name, "\n\n\taddiu $v0, $zero, 1\n");
+    CU_ASSERT_PTR_EQUAL(get_source_file(c_name), b);
+    CU_ASSERT_EQUAL(source_cache_loads(), 2);
+
+    /* A touched file is read again, but only tokenized if it changed. */
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { 1000, 0 } };
+    CU_ASSERT_EQUAL(utimensat(AT_FDCWD, b_name, times, 0), 0);
+    CU_ASSERT_PTR_EQUAL(get_source_file(b_name), b);
+    CU_ASSERT_EQUAL(source_cache_loads(), 2);
+
+    write_text_file(b_name, "\taddiu $v0, $zero, 2\n");
+    const SourceFile* changed = get_source_file(b_name);
+    CU_ASSERT_PTR_NOT_NULL(changed);
+    CU_ASSERT_PTR_NOT_EQUAL(changed, b);
+    CU_ASSERT_STRING_EQUAL(changed->lines[0].args[2], "2");
+    CU_ASSERT_EQUAL(source_cache_loads(), 3);
+
+    set_log_file(TMP_FILE);
+    CU_ASSERT_PTR_NULL(get_source_file("no such file"));
+    set_log_file(NULL);
+
+    /* Over the limit, files no one holds are dropped, and read again when
+       they are needed. */
+    set_source_cache_limit(0);
+    CU_ASSERT_PTR_EQUAL(get_source_file(a_name), a);
+    CU_ASSERT_EQUAL(source_cache_loads(), 3);
+    for (int i = 0; i < 3; i++) {
+        release_source_file(a);                 // got three times above
+    }
+    a = get_source_file(a_name);
+    CU_ASSERT_PTR_NOT_NULL(a);
+    CU_ASSERT_EQUAL(source_cache_loads(), 4);
+    release_source_file(a);
+    set_source_cache_limit(SOURCE_CACHE_LIMIT);
+
+    /* Relative paths are taken from the including file's directory. */
+    char path[64];
+    CU_ASSERT_EQUAL(resolve_source_path("src/main.s", "lib/a.s", path, sizeof(path)), 0);
+    CU_ASSERT_STRING_EQUAL(path, "src/lib/a.s");
+    CU_ASSERT_EQUAL(resolve_source_path("main.s", "a.s", path, sizeof(path)), 0);
+    CU_ASSERT_STRING_EQUAL(path, "a.s");
+    CU_ASSERT_EQUAL(resolve_source_path("src/main.s", "/abs/a.s", path, sizeof(path)), 0);
+    CU_ASSERT_STRING_EQUAL(path, "/abs/a.s");
+    CU_ASSERT_EQUAL(resolve_source_path(NULL, "a.s", path, sizeof(path)), 0);
+    CU_ASSERT_STRING_EQUAL(path, "a.s");
+    CU_ASSERT_EQUAL(resolve_source_path("src/main.s", "a.s", path, 6), -1);
+
+    free_source_cache();
+    CU_ASSERT_EQUAL(source_cache_loads(), 0);
+    unlink(a_name);
+    unlink(b_name);
+    unlink(c_name);
+}
+
+/* Tokenizes TEXT into the body of the macro being defined in TABLE. */
+static void add_macro_text(MacroTable* table, const char* text) {
+    char buf[BUF_SIZE];
+    SourceLine line;
+    strcpy(buf, text);
+    CU_ASSERT_EQUAL(tokenize_line(buf, &line), 1);
+    line.line_no = 1;
+    CU_ASSERT_EQUAL(add_macro_line(table, &line), 0);
+}
+
+void test_macro() {
+    MacroTable* table = create_macro_table();
+    CU_ASSERT_EQUAL(begin_macro(table, 1, " sum d, a, b\n"), 0);
+    add_macro_text(table, "\taddu \\d, \\a, \\b\n");
+    add_macro_text(table, "l\\@: jr $ra\n");
+    add_macro_text(table, "\t.asciiz \"\\n\\a\"\n");
+    CU_ASSERT_EQUAL(end_macro(table), 0);
+    CU_ASSERT_EQUAL(check_macros_closed(table), 0);
+
+    const Macro* macro = find_macro(table, "sum");
+    CU_ASSERT_PTR_NOT_NULL(macro);
+    CU_ASSERT_PTR_NULL(find_macro(table, "addu"));
+    CU_ASSERT_EQUAL(macro->num_params, 3);
+    CU_ASSERT_EQUAL(macro->num_lines, 3);
+    CU_ASSERT_EQUAL(macro->lines[0].subst, SUBST_ARG(0) | SUBST_ARG(1) | SUBST_ARG(2));
+    CU_ASSERT_EQUAL(macro->lines[1].subst, SUBST_LABEL);
+
+    char* args[] = { "$t0", "$s0", "$s1" };
+    char buf[64];
+    SourceLine line;
+    CU_ASSERT_EQUAL(expand_macro_line(macro, 0, args, 3, 7, 12, &line, buf,
+        sizeof(buf)), 0);
+    CU_ASSERT_EQUAL(line.line_no, 12);
+    CU_ASSERT_STRING_EQUAL(line.name, "addu");
+    CU_ASSERT_PTR_EQUAL(line.name, macro->lines[0].line.name);
+    CU_ASSERT_STRING_EQUAL(line.args[0], "$t0");
+    CU_ASSERT_STRING_EQUAL(line.args[2], "$s1");
+
+    CU_ASSERT_EQUAL(expand_macro_line(macro, 1, args, 3, 7, 12, &line, buf,
+        sizeof(buf)), 0);
+    CU_ASSERT_STRING_EQUAL(line.label, "l7");
+
+    /* Only parameter names are substituted, not string escapes. */
+    CU_ASSERT_EQUAL(expand_macro_line(macro, 2, args, 3, 7, 12, &line, buf,
+        sizeof(buf)), 0);
+    CU_ASSERT_STRING_EQUAL(line.operands, "\"\\n$s0\"\n");
+
+    CU_ASSERT_EQUAL(expand_macro_line(macro, 0, args, 3, 7, 12, &line, buf, 8),
+        -1);
+
+    /* Errors: redefinition, a bad name, an unclosed definition. */
+    set_log_file(TMP_FILE);
+    CU_ASSERT_EQUAL(begin_macro(table, 5, "sum\n"), 0);
+    CU_ASSERT_EQUAL(end_macro(table), -1);
+    CU_ASSERT_EQUAL(begin_macro(table, 6, "\n"), -1);
+    CU_ASSERT_EQUAL(end_macro(table), 0);
+    CU_ASSERT_EQUAL(begin_macro(table, 7, "m p-q\n"), -1);
+    CU_ASSERT_EQUAL(end_macro(table), 0);
+    CU_ASSERT_EQUAL(begin_macro(table, 8, "open\n"), 0);
+    CU_ASSERT_EQUAL(check_macros_closed(table), -1);
+    set_log_file(NULL);
+    CU_ASSERT_EQUAL(table->num_macros, 1);
+
+    free_macro_table(table);
+}
+
+void test_expand_pseudo() {
+    InstRecord insts[MAX_EXPANSION];
+    char buf[PSEUDO_BUF_SIZE];
+
+    char* li_large[] = { "$t0", "-299999" };
+    CU_ASSERT_EQUAL(expand_pseudo("li", li_large, 2, insts, buf, sizeof(buf)), 2);
+    CU_ASSERT_STRING_EQUAL(insts[0].name, "lui");
+    CU_ASSERT_STRING_EQUAL(insts[0].args[1], " 0xfffb");
+    CU_ASSERT_STRING_EQUAL(insts[1].name, "ori");
+    CU_ASSERT_STRING_EQUAL(insts[1].args[0], "$t0");
+    CU_ASSERT_STRING_EQUAL(insts[1].args[2], " 0x6c21");
+
+    char* la[] = { "$a0", "msg" };
+    CU_ASSERT_EQUAL(expand_pseudo("la", la, 2, insts, buf, sizeof(buf)), 2);
+    CU_ASSERT_STRING_EQUAL(insts[0].args[1], "%hi(msg)");
+    CU_ASSERT_STRING_EQUAL(insts[1].args[2], "%lo(msg)");
+    char* la_bad[] = { "$a0", "1abc" };
+    CU_ASSERT_EQUAL(expand_pseudo("la", la_bad, 2, insts, buf, sizeof(buf)), 0);
+
+    char* bge[] = { "$s0", "$s1", "loop" };
+    CU_ASSERT_EQUAL(expand_pseudo("bge", bge, 3, insts, buf, sizeof(buf)), 2);
+    CU_ASSERT_STRING_EQUAL(insts[0].name, "slt");
+    CU_ASSERT_STRING_EQUAL(insts[0].args[1], "$s0");
+    CU_ASSERT_STRING_EQUAL(insts[1].name, "beq");
+    CU_ASSERT_STRING_EQUAL(insts[1].args[2], "loop");
+    CU_ASSERT_EQUAL(expand_pseudo("bgt", bge, 3, insts, buf, sizeof(buf)), 2);
+    CU_ASSERT_STRING_EQUAL(insts[0].args[1], "$s1");
+    CU_ASSERT_STRING_EQUAL(insts[1].name, "bne");
+
+    char* move[] = { "$v0", "$a0" };
+    CU_ASSERT_EQUAL(expand_pseudo("move", move, 2, insts, buf, sizeof(buf)), 1);
+    CU_ASSERT_STRING_EQUAL(insts[0].name, "addu");
+    CU_ASSERT_EQUAL(insts[0].num_args, 3);
+    CU_ASSERT_EQUAL(expand_pseudo("nop", NULL, 0, insts, buf, sizeof(buf)), 1);
+    CU_ASSERT_STRING_EQUAL(insts[0].name, "sll");
+    CU_ASSERT_EQUAL(expand_pseudo("nop", move, 1, insts, buf, sizeof(buf)), 0);
+    CU_ASSERT_EQUAL(expand_pseudo("addu", move, 2, insts, buf, sizeof(buf)), -1);
+
+    /* Sizes agree without building anything. */
+    CU_ASSERT_EQUAL(pseudo_size("li", li_large, 2), 2);
+    CU_ASSERT_EQUAL(pseudo_size("not", move, 2), 1);
+    CU_ASSERT_EQUAL(pseudo_size("b", move, 2), 0);
+    CU_ASSERT_EQUAL(pseudo_size("beq", bge, 3), -1);
+
+    /* la halves are resolved in pass two. */
+    SymbolTable* symtbl = create_table(SYMTBL_UNIQUE_NAME);
+    SymbolTable* reltbl = create_table(SYMTBL_NON_UNIQUE);
+    add_to_table(symtbl, "msg", 0x10000024);
+    add_to_table(symtbl, "code", 0x24);
+    char* lui[] = { "$at", "%hi(msg)" };
+    char* ori[] = { "$a0", "$at", "%lo(msg)" };
+    char* ori_bad[] = { "$a0", "$at", "%lo(nothing)" };
+    char* lui_text[] = { "$at", "%hi(code)" };
+    uint32_t word;
+    CU_ASSERT_EQUAL(encode_inst(&word, "lui", lui, 2, 0, symtbl, reltbl), 0);
+    CU_ASSERT_EQUAL(word, 0x3c011000);
+    CU_ASSERT_EQUAL(encode_inst(&word, "ori", ori, 3, 4, symtbl, reltbl), 0);
+    CU_ASSERT_EQUAL(word, 0x34240024);
+    CU_ASSERT_EQUAL(encode_inst(&word, "ori", ori_bad, 3, 4, symtbl, reltbl), -1);
+    CU_ASSERT_EQUAL(encode_inst(&word, "lui", lui_text, 2, 0, symtbl, reltbl), -1);
+    CU_ASSERT_EQUAL(encode_inst_trusted(&word, "ori", ori, 3, 4, symtbl, reltbl), 0);
+    CU_ASSERT_EQUAL(word, 0x34240024);
+
+    char* neg[] = { "$s0", "$zero", "$t1" };
+    CU_ASSERT_EQUAL(encode_inst(&word, "subu", neg, 3, 0, symtbl, reltbl), 0);
+    CU_ASSERT_EQUAL(word, 0x00098023);
+    CU_ASSERT_EQUAL(encode_inst_trusted(&word, "subu", neg, 3, 0, symtbl, reltbl), 0);
+    CU_ASSERT_EQUAL(word, 0x00098023);
+    char* not[] = { "$s1", "$t2", "$zero" };
+    CU_ASSERT_EQUAL(encode_inst(&word, "nor", not, 3, 0, symtbl, reltbl), 0);
+    CU_ASSERT_EQUAL(word, 0x01408827);
+    free_table(symtbl);
+    free_table(reltbl);
+}
+
+/****************************************
+ *  Test cases for peephole.c
+ ****************************************/
+
+void add_peephole_line(Peephole* peep, const char* name, const char* a0,
+    const char* a1, const char* a2) {
+    char* args[] = { (char*) a0, (char*) a1, (char*) a2 };
+    int num_args = a2 ? 3 : a1 ? 2 : a0 ? 1 : 0;
+    peephole_pass_one(peep, name, args, num_args, 0, 1, 1);
+}
+
+void test_peephole() {
+    SymbolTable* symtbl = create_table(SYMTBL_UNIQUE_NAME);
+    Peephole* peep = create_peephole(8, PEEP_OPTIMIZE);
+
+    add_to_table(symtbl, "top", 8);
+    peephole_label(peep, symtbl->len - 1);
+    add_peephole_line(peep, "li", "$t0", "0x30000", NULL);        // lui
+    add_peephole_line(peep, "li", "$t1", "0x10002", NULL);        // lui, ori
+    add_peephole_line(peep, "move", "$s0", "$s0", NULL);          // removed
+    add_peephole_line(peep, "ori", "$s1", "$s1", "0");            // removed
+    add_peephole_line(peep, "addu", "$s1", "$zero", "$s2");
+    add_peephole_line(peep, "nop", NULL, NULL, NULL);
+    add_peephole_line(peep, "sw", "$t0", "4($sp)", NULL);         // removed
+    add_peephole_line(peep, "sw", "$t1", "0x4($sp)", NULL);
+    add_peephole_line(peep, "sw", "$t9", "8($sp)", NULL);         // invalid, kept
+    add_peephole_line(peep, "sw", "$t1", "8($sp)", NULL);
+    add_peephole_line(peep, "beq", "$t0", "$t1", "top");
+    add_peephole_line(peep, "addiu", "$a0", "$a0", "0");          // delay slot
+    add_to_table(symtbl, "mid", 88);
+    peephole_label(peep, symtbl->len - 1);
+    add_peephole_line(peep, "addiu", "$a1", "$a1", "0");          // removed
+    add_peephole_line(peep, "sb", "$t0", "0($a0)", NULL);
+    add_to_table(symtbl, "again", 96);
+    peephole_label(peep, symtbl->len - 1);
+    add_peephole_line(peep, "sb", "$t0", "0($a0)", NULL);         // after a label
+    add_peephole_line(peep, "sll", "$a2", "$a2", "0");            // removed
+    add_to_table(symtbl, "end", 104);
+    peephole_label(peep, symtbl->len - 1);
+    add_peephole_line(peep, "lui", "$at", "0x1000", NULL);        // by hand, kept
+    add_peephole_line(peep, "ori", "$t0", "$at", "4");
+    add_peephole_line(peep, "lw", "$t1", "8($at)", NULL);
+    CU_ASSERT_EQUAL(peep->num_insts, 21);
+
+    CU_ASSERT_EQUAL(optimize_peephole(peep), 6);
+    CU_ASSERT_EQUAL(peep->folded, 2);
+
+    char text[512];
+    FILE* f = fmemopen(text, sizeof(text), "w");
+    CU_ASSERT_EQUAL(flush_peephole(peep, f, symtbl, NULL), 15);
+    fclose(f);
+    CU_ASSERT_STRING_EQUAL(text,
+        "lui $t0  0x3\n"
+        "lui $t1  0x1\n"
+        "ori $t1 $t1  0x2\n"
+        "addu $s1 $zero $s2\n"
+        "sll $zero $zero 0\n"
+        "sw $t1 0x4($sp)\n"
+        "sw $t9 8($sp)\n"
+        "sw $t1 8($sp)\n"
+        "beq $t0 $t1 top\n"
+        "addiu $a0 $a0 0\n"
+        "sb $t0 0($a0)\n"
+        "sb $t0 0($a0)\n"
+        "lui $at 0x1000\n"
+        "ori $t0 $at 4\n"
+        "lw $t1 8($at)\n");
+    CU_ASSERT_EQUAL(get_addr_for_symbol(symtbl, "top"), 8);
+    CU_ASSERT_EQUAL(get_addr_for_symbol(symtbl, "mid"), 48);
+    CU_ASSERT_EQUAL(get_addr_for_symbol(symtbl, "again"), 52);
+    CU_ASSERT_EQUAL(get_addr_for_symbol(symtbl, "end"), 56);
+
+    free_peephole(peep);
+    free_table(symtbl);
+}
+
+/****************************************
+ *  Test cases for delay_slots.c
+ ****************************************/
+
+void test_inst_registers() {
+    RegisterSets regs;
+    char* addu[] = { "$t0", "$t1", "$zero" };
+    CU_ASSERT_EQUAL(inst_registers(&regs, "addu", addu, 3), 0);
+    CU_ASSERT_EQUAL(regs.defs, 1u << 8);
+    CU_ASSERT_EQUAL(regs.uses, 1u << 9);
+    char* sw[] = { "$t0", "4($sp)" };
+    CU_ASSERT_EQUAL(inst_registers(&regs, "sw", sw, 2), 0);
+    CU_ASSERT_EQUAL(regs.defs, 0);
+    CU_ASSERT_EQUAL(regs.uses, (1u << 8) | (1u << 29));
+    CU_ASSERT_EQUAL(inst_registers(&regs, "lw", sw, 2), 0);
+    CU_ASSERT_EQUAL(regs.defs, 1u << 8);
+    CU_ASSERT_EQUAL(regs.uses, 1u << 29);
+    char* jal[] = { "func" };
+    CU_ASSERT_EQUAL(inst_registers(&regs, "jal", jal, 1), 0);
+    CU_ASSERT_EQUAL(regs.defs, 1u << 31);
+    char* jalr[] = { "$s0" };
+    CU_ASSERT_EQUAL(inst_registers(&regs, "jalr", jalr, 1), 0);
+    CU_ASSERT_EQUAL(regs.defs, 1u << 31);
+    CU_ASSERT_EQUAL(regs.uses, 1u << 16);
+    char* bgezal[] = { "$a0", "func" };
+    CU_ASSERT_EQUAL(inst_registers(&regs, "bgezal", bgezal, 2), 0);
+    CU_ASSERT_EQUAL(regs.defs, 1u << 31);
+    CU_ASSERT_EQUAL(regs.uses, 1u << 4);
+    char* clz[] = { "$v0", "$t0" };
+    CU_ASSERT_EQUAL(inst_registers(&regs, "clz", clz, 2), 0);
+    CU_ASSERT_EQUAL(regs.defs, 1u << 2);
+    CU_ASSERT_EQUAL(regs.uses, 1u << 8);
+    CU_ASSERT_EQUAL(inst_registers(&regs, "teq", clz, 2), 0);
+    CU_ASSERT_EQUAL(regs.defs, 0);
+    CU_ASSERT_EQUAL(regs.uses, (1u << 2) | (1u << 8));
+    char* bad[] = { "$t9", "$t1", "$t2" };
+    CU_ASSERT_EQUAL(inst_registers(&regs, "addu", bad, 3), -1);
+    CU_ASSERT_EQUAL(inst_registers(&regs, "addu", addu, 2), -1);
+    CU_ASSERT_EQUAL(inst_registers(&regs, "li", sw, 2), -1);
+}
+
+void test_fill_delay_slots() {
+    SymbolTable* symtbl = create_table(SYMTBL_UNIQUE_NAME);
+    Peephole* peep = create_peephole(0, PEEP_DELAY_SLOTS);
+
+    add_to_table(symtbl, "main", 0);
+    peephole_label(peep, symtbl->len - 1);
+    add_peephole_line(peep, "move", "$a0", "$s0", NULL);          // moved, with main
+    add_peephole_line(peep, "jal", "func", NULL, NULL);
+    add_peephole_line(peep, "nop", NULL, NULL, NULL);
+    add_peephole_line(peep, "move", "$a0", "$ra", NULL);          // reads $ra
+    add_peephole_line(peep, "jal", "func", NULL, NULL);
+    add_peephole_line(peep, "nop", NULL, NULL, NULL);
+    add_peephole_line(peep, "addiu", "$t0", "$t0", "1");          // read by bne
+    add_peephole_line(peep, "bne", "$t0", "$zero", "main");
+    add_peephole_line(peep, "nop", NULL, NULL, NULL);
+    add_peephole_line(peep, "sw", "$t0", "0($sp)", NULL);
+    add_to_table(symtbl, "func", 40);
+    peephole_label(peep, symtbl->len - 1);
+    add_peephole_line(peep, "jr", "$ra", NULL, NULL);             // labeled
+    add_peephole_line(peep, "nop", NULL, NULL, NULL);
+    add_peephole_line(peep, "addiu", "$sp", "$sp", "8");
+    add_peephole_line(peep, "jr", "$ra", NULL, NULL);
+    add_peephole_line(peep, "addu", "$v0", "$zero", "$zero");      // filled already
+    add_to_table(symtbl, "end", 60);
+    peephole_label(peep, symtbl->len - 1);
+
+    CU_ASSERT_EQUAL(fill_delay_slots(peep), 1);
+    CU_ASSERT_EQUAL(peep->filled, 1);
+
+    char text[512];
+    FILE* f = fmemopen(text, sizeof(text), "w");
+    CU_ASSERT_EQUAL(flush_peephole(peep, f, symtbl, NULL), 14);
+    fclose(f);
+    CU_ASSERT_STRING_EQUAL(text,
+        "jal func\n"
+        "addu $a0 $zero $s0\n"
+        "addu $a0 $zero $ra\n"
+        "jal func\n"
+        "sll $zero $zero 0\n"
+        "addiu $t0 $t0 1\n"
+        "bne $t0 $zero main\n"
+        "sll $zero $zero 0\n"
+        "sw $t0 0($sp)\n"
+        "jr $ra\n"
+        "sll $zero $zero 0\n"
+        "addiu $sp $sp 8\n"
+        "jr $ra\n"
+        "addu $v0 $zero $zero\n");
+    CU_ASSERT_EQUAL(get_addr_for_symbol(symtbl, "main"), 0);
+    CU_ASSERT_EQUAL(get_addr_for_symbol(symtbl, "func"), 36);
+    CU_ASSERT_EQUAL(get_addr_for_symbol(symtbl, "end"), 56);
+
+    free_peephole(peep);
+    free_table(symtbl);
+}
+
+/* Assembles PROGRAM in both passes and with assemble_stream(). Returns 1
+   if both give the same result and output file. */
+int stream_matches_two_pass(const char* program) {
+    const char* in_name = "test_stream.s";
+    const char* tmp_name = "test_stream.int";
+    const char* out_name = "test_stream.out";
+    AsmOptions opts = DEFAULT_ASM_OPTIONS;
+    opts.quiet = 1;
+
+    FILE* f = fopen(in_name, "w");
+    fputs(program, f);
+    fclose(f);
+    set_log_file(TMP_FILE);
+    int two_pass = assemble_opts(in_name, tmp_name, out_name, &opts);
+
+    FILE* input = fmemopen((void*) program, strlen(program), "r");
+    FILE* output = tmpfile();
+    int stream = assemble_stream(input, output, &opts);
+    fclose(input);
+    set_log_file(NULL);
+
+    char expected[BUF_SIZE], actual[BUF_SIZE];
+    int same = two_pass == stream;
+    f = fopen(out_name, "r");
+    rewind(output);
+    for (;;) {
+        char* e = fgets(expected, BUF_SIZE, f);
+        char* a = fgets(actual, BUF_SIZE, output);
+        if (!e || !a) {
+            same &= !e && !a;
+            break;
+        }
+        same &= strcmp(expected, actual) == 0;
+    }
+    fclose(f);
+    fclose(output);
+    unlink(in_name);
+    unlink(tmp_name);
+    unlink(out_name);
+    return same;
+}
+
+void test_stream_fixups() {
+    /* Branches to labels further down, one after a backward branch. */
+    CU_ASSERT(stream_matches_two_pass(
+        "start: beq $t0 $t1 end\n"
+        "loop: addiu $t0 $t0 1\n"
+        "bne $t0 $t1 loop\n"
+        "bge $t0 $t1 end\n"
+        "jal start\n"
+        "end: bne $t0 $zero start\n"));
+
+    /* A branch whose label is never defined takes no address, so the
+       words after it move down, backward branches and relocations too. */
+    CU_ASSERT(stream_matches_two_pass(
+        "top: addu $t0 $t1 $t2\n"
+        "beq $t0 $t1 nowhere\n"
+        "back: addiu $t0 $t0 1\n"
+        "bne $t0 $zero back\n"
+        "jal top\n"
+        "beq $t0 $t1 fwd\n"
+        "bne $t0 $t1 nowhere\n"
+        "beq $t0 $t1 fwd\n"
+        "fwd: jal back\n"
+        "bne $t0 $zero top\n"));
+}
+
+void test_stream_far_branch() {
+    /* A branch whose label turns out to be out of range is dropped when
+       the label is defined. */
+    size_t size = 40000 * 18 + 128;
+    char* program = malloc(size);
+    char* p = program + sprintf(program, "beq $t0 $t1 far\nback: addu $t0 $t0 $t0\n");
+    for (int i = 0; i < 40000; i++) {
+        p += sprintf(p, "addu $t0 $t0 $t0\n");
+    }
+    sprintf(p, "bne $t0 $zero back\njal back\nfar: addu $t0 $t0 $t0\n");
+    CU_ASSERT(stream_matches_two_pass(program));
+    free(program);
+}
+
+void test_stream_data_labels() {
+    /* la of a .data label defined after .text, with a backward branch
+       over it. */
+    CU_ASSERT(stream_matches_two_pass(
+        ".text\n"
+        "main: la $t0 tbl\n"
+        "addu $t1 $t0 $t0\n"
+        "bne $t0 $t1 main\n"
+        ".data\n"
+        ".word 1 2\n"
+        "tbl: .word 7\n"));
+
+    /* Behind a branch that is dropped, and of labels that are never
+       defined or are in .text. */
+    CU_ASSERT(stream_matches_two_pass(
+        ".text\n"
+        "main: beq $t0 $t1 nowhere\n"
+        "la $t0 tbl\n"
+        "bne $t0 $t1 main\n"
+        "la $t1 missing\n"
+        "la $t2 later\n"
+        "later: addu $t0 $t0 $t0\n"
+        ".data\n"
+        "tbl: .word 7\n"));
+}
+
 int main(int argc, char** argv) {
-    CU_pSuite pSuite1 = NULL, pSuite2 = NULL;
+    CU_pSuite pSuite1 = NULL, pSuite2 = NULL, pSuite3 = NULL, pSuite4 = NULL;
+    CU_pSuite pSuite5 = NULL, pSuite6 = NULL, pSuite7 = NULL, pSuite8 = NULL;
+    CU_pSuite pSuite9 = NULL, pSuite10 = NULL, pSuite11 = NULL, pSuite12 = NULL;
+    CU_pSuite pSuite13 = NULL, pSuite14 = NULL, pSuite15 = NULL, pSuite16 = NULL;
+    CU_pSuite pSuite17 = NULL;
 
     if (CUE_SUCCESS != CU_initialize_registry()) {
         return CU_get_error();
@@ -174,6 +1659,9 @@ int main(int argc, char** argv) {
     if (!CU_add_test(pSuite1, "test_translate_num", test_translate_num)) {
         goto exit;
     }
+    if (!CU_add_test(pSuite1, "test_translate_mem_operand", test_translate_mem_operand)) {
+        goto exit;
+    }
 
     /* Suite 2 */
     pSuite2 = CU_add_suite("Testing tables.c", init_log_file, NULL);
@@ -186,6 +1674,168 @@ int main(int argc, char** argv) {
     if (!CU_add_test(pSuite2, "test_table_2", test_table_2)) {
         goto exit;
     }
+    if (!CU_add_test(pSuite2, "test_ctable", test_ctable)) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite2, "test_table_snapshot", test_table_snapshot)) {
+        goto exit;
+    }
+
+    /* Suite 3 */
+    pSuite3 = CU_add_suite("Testing translate.c", NULL, NULL);
+    if (!pSuite3) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite3, "test_size_pass_one", test_size_pass_one)) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite3, "test_translate_inst_trusted", test_translate_inst_trusted)) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite3, "test_encode_isa", test_encode_isa)) {
+        goto exit;
+    }
+
+    /* Suite 4 */
+    pSuite4 = CU_add_suite("Testing sched.c", NULL, NULL);
+    if (!pSuite4) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite4, "test_sched", test_sched)) {
+        goto exit;
+    }
+
+    /* Suite 5 */
+    pSuite5 = CU_add_suite("Testing io_ring.c", NULL, NULL);
+    if (!pSuite5) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite5, "test_io_ring", test_io_ring)) {
+        goto exit;
+    }
+
+    /* Suite 6 */
+    pSuite6 = CU_add_suite("Testing mapped_output.c", NULL, NULL);
+    if (!pSuite6) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite6, "test_mapped_output", test_mapped_output)) {
+        goto exit;
+    }
+
+    /* Suite 7 */
+    pSuite7 = CU_add_suite("Testing source_map.c", NULL, NULL);
+    if (!pSuite7) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite7, "test_source_map", test_source_map)) {
+        goto exit;
+    }
+
+    /* Suite 8 */
+    pSuite8 = CU_add_suite("Testing alloc.c", NULL, NULL);
+    if (!pSuite8) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite8, "test_arena", test_arena)) {
+        goto exit;
+    }
+
+    /* Suite 9 */
+    pSuite9 = CU_add_suite("Testing memstats.c", NULL, NULL);
+    if (!pSuite9) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite9, "test_memstats", test_memstats)) {
+        goto exit;
+    }
+
+    /* Suite 10 */
+    pSuite10 = CU_add_suite("Testing perf_counters.c", NULL, NULL);
+    if (!pSuite10) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite10, "test_perf_counters", test_perf_counters)) {
+        goto exit;
+    }
+
+    /* Suite 11 */
+    pSuite11 = CU_add_suite("Testing data.c", NULL, NULL);
+    if (!pSuite11) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite11, "test_data_section", test_data_section)) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite11, "test_data_incbin", test_data_incbin)) {
+        goto exit;
+    }
+
+    /* Suite 12 */
+    pSuite12 = CU_add_suite("Testing source_cache.c", NULL, NULL);
+    if (!pSuite12) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite12, "test_tokenize_line", test_tokenize_line)) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite12, "test_source_cache", test_source_cache)) {
+        goto exit;
+    }
+
+    /* Suite 13 */
+    pSuite13 = CU_add_suite("Testing macro.c", NULL, NULL);
+    if (!pSuite13) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite13, "test_macro", test_macro)) {
+        goto exit;
+    }
+
+    /* Suite 14 */
+    pSuite14 = CU_add_suite("Testing pseudo.c", NULL, NULL);
+    if (!pSuite14) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite14, "test_expand_pseudo", test_expand_pseudo)) {
+        goto exit;
+    }
+
+    /* Suite 15 */
+    pSuite15 = CU_add_suite("Testing peephole.c", NULL, NULL);
+    if (!pSuite15) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite15, "test_peephole", test_peephole)) {
+        goto exit;
+    }
+
+    /* Suite 16 */
+    pSuite16 = CU_add_suite("Testing delay_slots.c", NULL, NULL);
+    if (!pSuite16) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite16, "test_inst_registers", test_inst_registers)) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite16, "test_fill_delay_slots", test_fill_delay_slots)) {
+        goto exit;
+    }
+
+    /* Suite 17 */
+    pSuite17 = CU_add_suite("Testing stream.c", NULL, NULL);
+    if (!pSuite17) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite17, "test_stream_fixups", test_stream_fixups)) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite17, "test_stream_far_branch", test_stream_far_branch)) {
+        goto exit;
+    }
+    if (!CU_add_test(pSuite17, "test_stream_data_labels", test_stream_data_labels)) {
+        goto exit;
+    }
 
     CU_basic_set_mode(CU_BRM_VERBOSE);
     CU_basic_run_tests();